@@ -0,0 +1,68 @@
+#pragma once
+
+#include "volcano.h"
+
+// Bump allocator for results that live and die together, e.g. everything loaded from a run's
+// outputs. Allocations are 64 byte aligned and only freed all at once. Blocks are anonymous mappings,
+// so a generous upper bound costs address space, not memory: pages nobody writes are never backed.
+// Not thread safe, use one per thread.
+
+#define ARENA_BLOCK_BYTES (64ll * 1024 * 1024)
+
+typedef struct ArenaBlock {
+  struct ArenaBlock* next;
+  s64 size;   // including this header
+  s64 used;
+} ArenaBlock;
+
+typedef struct Arena {
+  ArenaBlock* blocks;   // the first one is the one we bump in
+  s64 allocated;        // bytes handed out
+} Arena;
+
+static Arena* arena_new() { return calloc(1, sizeof(Arena)); }
+
+static ArenaBlock* arena_map_block(s64 size) {
+  void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED) return nullptr;
+  ArenaBlock* block = base;
+  block->size = size;
+  block->used = 64;
+  return block;
+}
+
+// Zeroed memory, nullptr if the mapping fails
+static void* arena_alloc(Arena* arena, s64 size) {
+  size = (size + 63) & ~63ll;
+  ArenaBlock* block = arena->blocks;
+  if (!block || block->used + size > block->size) {
+    s64 page = 4096;
+    // big requests get a block of their own behind the current one, so it keeps filling up
+    bool own = size > ARENA_BLOCK_BYTES / 4;
+    s64 block_size = own ? (64 + size + page - 1) & ~(page - 1) : ARENA_BLOCK_BYTES;
+    ArenaBlock* fresh = arena_map_block(block_size);
+    if (!fresh) return nullptr;
+    if (own && block) {
+      fresh->next = block->next;
+      block->next = fresh;
+    } else {
+      fresh->next = block;
+      arena->blocks = fresh;
+    }
+    block = fresh;
+  }
+  void* ret = (u8*)block + block->used;
+  block->used += size;
+  arena->allocated += size;
+  return ret;
+}
+
+static void arena_free(Arena* arena) {
+  if (!arena) return;
+  for (ArenaBlock* block = arena->blocks; block;) {
+    ArenaBlock* next = block->next;
+    munmap(block, block->size);
+    block = next;
+  }
+  free(arena);
+}
@@ -0,0 +1,215 @@
+#pragma once
+
+#include "volcano.h"
+#include "chunk.h"
+#include "snic.h"
+#include "chord.h"
+#include "output.h"
+
+// Which fiber components each chord runs through. All the chord points of a chunk are looked up in
+// its labeled fiber mask in one pass: first every superpixel centroid is rounded to its voxel and
+// turned into an index, then the labels are gathered with one tight loop per dtype. Each chord's
+// labels then go through a small open addressing hash into a histogram, most points first, and the
+// chord is classified:
+//
+//   CHORD_NO_FIBER        no point in any fiber
+//   CHORD_SINGLE_FIBER    every point in the same fiber
+//   CHORD_EXTENDS_FIBER   the points in a fiber are all in the same one, the rest are in none, so
+//                         the fiber can be extended along the chord
+//   CHORD_BRIDGES_FIBERS  points in two or more fibers: the chord carries a fiber through a gap in
+//                         the fiber data, or two touching sheets got joined
+//
+// Fibers are the rows of the chunk's VCB_FIBER_COMPONENTS table (label - 1). Inverting the
+// histograms gives each fiber the chords touching it, so extending fibers doesn't rescan anything.
+
+typedef enum ChordFiberClass {
+  CHORD_NO_FIBER = 0,
+  CHORD_SINGLE_FIBER = 1,
+  CHORD_EXTENDS_FIBER = 2,
+  CHORD_BRIDGES_FIBERS = 3,
+} ChordFiberClass;
+
+#define CHORD_FIBER_CLASSES 4
+#define CHORD_FIBER_NONE UINT32_MAX
+
+typedef struct ChordFibers {
+  s32 num_chords;
+  u32 num_fibers;
+  u64 num_points;
+  u32* point_fibers;     // per chord point in VCB_CHORDS order, CHORD_FIBER_NONE outside the fibers
+  // per chord
+  u8* classes;           // ChordFiberClass
+  u32* in_fiber;         // points in some fiber
+  u64* offsets;          // num_chords + 1, into fibers and counts
+  u32* fibers;           // the fibers a chord touches, most points first
+  u32* counts;           // and its points in each
+  // per fiber
+  u64* fiber_offsets;    // num_fibers + 1, into fiber_chords
+  u32* fiber_chords;     // the chords touching a fiber, ascending
+  s64 class_counts[CHORD_FIBER_CLASSES];
+} ChordFibers;
+
+static void chord_fibers_free(ChordFibers* cf) {
+  free(cf->point_fibers);
+  free(cf->classes);
+  free(cf->in_fiber);
+  free(cf->offsets);
+  free(cf->fibers);
+  free(cf->counts);
+  free(cf->fiber_offsets);
+  free(cf->fiber_chords);
+  *cf = (ChordFibers){};
+}
+
+// Centroid to voxel index, rounded rather than truncated and clamped to the chunk
+static inline u32 chord_fibers_voxel(const Superpixel* sp, const s32 dims[3]) {
+  s32 p[3] = {(s32)lrintf(sp->z), (s32)lrintf(sp->y), (s32)lrintf(sp->x)};
+  for (int d = 0; d < 3; d++) p[d] = p[d] < 0 ? 0 : p[d] >= dims[d] ? dims[d] - 1 : p[d];
+  return ((u32)p[0] * (u32)dims[1] + (u32)p[1]) * (u32)dims[2] + (u32)p[2];
+}
+
+// Labels (0 for none) at every chord point, idx holds the voxel indices on entry
+static void chord_fibers_gather(const tchunk* labeled, const u32* idx, u64 n, u32* out) {
+  switch (labeled->dtype) {
+    case VS_U8:
+      for (u64 i = 0; i < n; i++) out[i] = labeled->d8[idx[i]];
+      break;
+    case VS_U16:
+      for (u64 i = 0; i < n; i++) out[i] = labeled->d16[idx[i]];
+      break;
+    default:
+      for (u64 i = 0; i < n; i++) out[i] = (u32)labeled->d32[idx[i]];
+      break;
+  }
+}
+
+// labeled is vs_tchunk_label_components of the chunk's fiber mask, with labels 1..num_fibers.
+// superpixels and chords are the chunk's, in the same chunk local coordinates
+static void chord_fibers_build(ChordFibers* cf, const Superpixel* superpixels, const Chord* chords, int num_chords,
+                               const tchunk* labeled, u32 num_fibers) {
+  *cf = (ChordFibers){.num_chords = num_chords > 0 ? num_chords : 0};
+  s32 n = cf->num_chords;
+  cf->offsets = calloc((u64)n + 1, sizeof(u64));
+  cf->classes = calloc(n ? n : 1, 1);
+  cf->in_fiber = calloc(n ? n : 1, sizeof(u32));
+
+  u64 total = 0;
+  s32 longest = 0;
+  for (s32 i = 0; i < n; i++) {
+    total += chords[i].point_count;
+    if (chords[i].point_count > longest) longest = chords[i].point_count;
+  }
+  cf->num_points = total;
+  cf->point_fibers = malloc((total ? total : 1) * sizeof(u32));
+  cf->fibers = malloc((total ? total : 1) * sizeof(u32));
+  cf->counts = malloc((total ? total : 1) * sizeof(u32));
+
+  // the whole chunk's lookups at once
+  u32* idx = malloc((total ? total : 1) * sizeof(u32));
+  u64 p = 0;
+  for (s32 i = 0; i < n; i++) {
+    for (int j = 0; j < chords[i].point_count; j++) {
+      idx[p++] = chord_fibers_voxel(&superpixels[chords[i].points[j]], labeled->dims);
+    }
+  }
+  chord_fibers_gather(labeled, idx, total, cf->point_fibers);
+  free(idx);
+
+  for (u64 i = 0; i < total; i++) {
+    if (cf->point_fibers[i] > num_fibers) num_fibers = cf->point_fibers[i];
+    cf->point_fibers[i] -= 1;   // label to row, 0 wraps to CHORD_FIBER_NONE
+  }
+  cf->num_fibers = num_fibers;
+
+  // keys are row + 1 so 0 is empty, at most half full
+  u32 cap = 16;
+  while (cap < 2 * (u32)longest) cap *= 2;
+  u32* keys = calloc(cap, sizeof(u32));
+  u32* hits = malloc(cap * sizeof(u32));
+  u32* used = malloc(cap * sizeof(u32));
+  u32 mask = cap - 1;
+
+  u64 e = 0;
+  p = 0;
+  for (s32 i = 0; i < n; i++) {
+    u32 num_used = 0, in_fiber = 0;
+    for (int j = 0; j < chords[i].point_count; j++) {
+      u32 row = cf->point_fibers[p++];
+      if (row == CHORD_FIBER_NONE) continue;
+      in_fiber++;
+      u32 key = row + 1;
+      u32 h = key * 0x9e3779b1u & mask;
+      while (keys[h] && keys[h] != key) h = (h + 1) & mask;
+      if (!keys[h]) {
+        keys[h] = key;
+        hits[h] = 0;
+        used[num_used++] = h;
+      }
+      hits[h]++;
+    }
+
+    // most points first, lower row on ties. A chord touches a handful of fibers at most
+    u64 first = e;
+    for (u32 k = 0; k < num_used; k++) {
+      u32 h = used[k], fiber = keys[h] - 1, count = hits[h];
+      u64 at = e++;
+      while (at > first && (cf->counts[at - 1] < count || (cf->counts[at - 1] == count && cf->fibers[at - 1] > fiber))) {
+        cf->fibers[at] = cf->fibers[at - 1];
+        cf->counts[at] = cf->counts[at - 1];
+        at--;
+      }
+      cf->fibers[at] = fiber;
+      cf->counts[at] = count;
+      keys[h] = 0;
+    }
+    cf->offsets[i + 1] = e;
+    cf->in_fiber[i] = in_fiber;
+
+    ChordFiberClass c = CHORD_NO_FIBER;
+    if (num_used > 1) {
+      c = CHORD_BRIDGES_FIBERS;
+    } else if (num_used == 1) {
+      c = in_fiber == (u32)chords[i].point_count ? CHORD_SINGLE_FIBER : CHORD_EXTENDS_FIBER;
+    }
+    cf->classes[i] = c;
+    cf->class_counts[c]++;
+  }
+  free(keys);
+  free(hits);
+  free(used);
+
+  // inverted, chords ascending within each fiber since they're visited in order
+  cf->fiber_offsets = calloc((u64)num_fibers + 1, sizeof(u64));
+  for (u64 k = 0; k < e; k++) cf->fiber_offsets[cf->fibers[k] + 1]++;
+  for (u32 f = 0; f < num_fibers; f++) cf->fiber_offsets[f + 1] += cf->fiber_offsets[f];
+  cf->fiber_chords = malloc((e ? e : 1) * sizeof(u32));
+  u64* fill = malloc(((u64)num_fibers + 1) * sizeof(u64));
+  memcpy(fill, cf->fiber_offsets, ((u64)num_fibers + 1) * sizeof(u64));
+  for (s32 i = 0; i < n; i++) {
+    for (u64 k = cf->offsets[i]; k < cf->offsets[i + 1]; k++) cf->fiber_chords[fill[cf->fibers[k]]++] = (u32)i;
+  }
+  free(fill);
+}
+
+// VCB_CHORD_FIBERS, one row per chord
+static void vcb_chord_fibers(VcbBuilder* b, const s32 origin[3], const s32 dims[3], VcbParams params,
+                             const ChordFibers* cf) {
+  u64 n = cf->num_chords, e = cf->offsets[n];
+  vcb_begin(b, VCB_CHORD_FIBERS, origin, dims, params, n);
+  u32* classes = vcb_add_column(b, "class", VCB_U32, 1, n);
+  for (u64 i = 0; i < n; i++) classes[i] = cf->classes[i];
+  memcpy(vcb_add_column(b, "in_fiber", VCB_U32, 1, n), cf->in_fiber, n * sizeof(u32));
+  memcpy(vcb_add_column(b, "offsets", VCB_U64, 1, n + 1), cf->offsets, (n + 1) * sizeof(u64));
+  memcpy(vcb_add_column(b, "fibers", VCB_U32, 1, e), cf->fibers, e * sizeof(u32));
+  memcpy(vcb_add_column(b, "counts", VCB_U32, 1, e), cf->counts, e * sizeof(u32));
+  memcpy(vcb_add_column(b, "point_fibers", VCB_U32, 1, cf->num_points), cf->point_fibers, cf->num_points * sizeof(u32));
+}
+
+// VCB_FIBER_CHORDS, one row per fiber
+static void vcb_fiber_chords(VcbBuilder* b, const s32 origin[3], const s32 dims[3], VcbParams params,
+                             const ChordFibers* cf) {
+  u64 n = cf->num_fibers, e = cf->fiber_offsets[n];
+  vcb_begin(b, VCB_FIBER_CHORDS, origin, dims, params, n);
+  memcpy(vcb_add_column(b, "offsets", VCB_U64, 1, n + 1), cf->fiber_offsets, (n + 1) * sizeof(u64));
+  memcpy(vcb_add_column(b, "chords", VCB_U32, 1, e), cf->fiber_chords, e * sizeof(u32));
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "volcano.h"
+#include "chunk.h"
+
+// Sparse brick representation of a cleaned 128^3 chunk. After segment_and_clean most voxels are zero,
+// so the chunk is split into 8^3 bricks and only the bricks holding any foreground are listed.
+// Downstream kernels iterate the brick list so their work scales with papyrus voxels, not chunk volume
+#define BRICK_DIM 8
+#define BRICK_CHUNK_DIM 128
+#define BRICKS_PER_AXIS (BRICK_CHUNK_DIM / BRICK_DIM)
+#define NUM_BRICKS (BRICKS_PER_AXIS * BRICKS_PER_AXIS * BRICKS_PER_AXIS)
+
+typedef struct BrickSet {
+  u64 occupancy[NUM_BRICKS / 64];  // bit b set when brick b has a nonzero voxel
+  u16 bricks[NUM_BRICKS];          // occupied brick ids in z, y, x order
+  int num_bricks;
+  s64 num_voxels;                  // nonzero voxels over all bricks
+} BrickSet;
+
+static inline int brick_id(int z, int y, int x) {
+  return ((z / BRICK_DIM) * BRICKS_PER_AXIS + (y / BRICK_DIM)) * BRICKS_PER_AXIS + (x / BRICK_DIM);
+}
+
+static inline bool brick_occupied(const BrickSet* bs, int id) {
+  return (bs->occupancy[id >> 6] >> (id & 63)) & 1;
+}
+
+// true when the voxel is in an occupied brick, used to keep region growing inside the sparse set
+static inline bool brick_voxel_occupied(const BrickSet* bs, int z, int y, int x) {
+  return brick_occupied(bs, brick_id(z, y, x));
+}
+
+static inline int brick_z0(const BrickSet* bs, int i) { return bs->bricks[i] / (BRICKS_PER_AXIS * BRICKS_PER_AXIS) * BRICK_DIM; }
+static inline int brick_y0(const BrickSet* bs, int i) { return bs->bricks[i] / BRICKS_PER_AXIS % BRICKS_PER_AXIS * BRICK_DIM; }
+static inline int brick_x0(const BrickSet* bs, int i) { return bs->bricks[i] % BRICKS_PER_AXIS * BRICK_DIM; }
+
+// Iterate the voxels of every occupied brick, or of the whole chunk when bs is NULL.
+// Within a brick the order is z, y, x with x fastest, same as a dense loop
+#define brick_foreach_voxel(bs, z, y, x) \
+  for (int bi_ = 0, nb_ = (bs) ? (bs)->num_bricks : 1; bi_ < nb_; bi_++) \
+    for (int ext_ = (bs) ? BRICK_DIM : BRICK_CHUNK_DIM, z0_ = (bs) ? brick_z0(bs, bi_) : 0, z = z0_; z < z0_ + ext_; z++) \
+      for (int y0_ = (bs) ? brick_y0(bs, bi_) : 0, y = y0_; y < y0_ + ext_; y++) \
+        for (int x0_ = (bs) ? brick_x0(bs, bi_) : 0, x = x0_; x < x0_ + ext_; x++)
+
+// Build the brick set of a cleaned chunk. One pass over the data, bricks are visited in id order
+// so the list comes out sorted
+static BrickSet* brickset_build(const tchunk* c) {
+  assert(c->dims[0] == BRICK_CHUNK_DIM && c->dims[1] == BRICK_CHUNK_DIM && c->dims[2] == BRICK_CHUNK_DIM);
+
+  BrickSet* bs = calloc(1, sizeof(BrickSet));
+  for (int id = 0; id < NUM_BRICKS; id++) {
+    int z0 = id / (BRICKS_PER_AXIS * BRICKS_PER_AXIS) * BRICK_DIM;
+    int y0 = id / BRICKS_PER_AXIS % BRICKS_PER_AXIS * BRICK_DIM;
+    int x0 = id % BRICKS_PER_AXIS * BRICK_DIM;
+
+    s64 count = 0;
+    for (int z = z0; z < z0 + BRICK_DIM; z++) {
+      for (int y = y0; y < y0 + BRICK_DIM; y++) {
+        s64 row = ((s64)z * BRICK_CHUNK_DIM + y) * BRICK_CHUNK_DIM;
+        for (int x = x0; x < x0 + BRICK_DIM; x++) {
+          count += vs_voxel(c->data, c->dtype, row + x) != 0.0f;
+        }
+      }
+    }
+
+    if (count > 0) {
+      bs->occupancy[id >> 6] |= 1ull << (id & 63);
+      bs->bricks[bs->num_bricks++] = (u16)id;
+      bs->num_voxels += count;
+    }
+  }
+  return bs;
+}
@@ -0,0 +1,300 @@
+#pragma once
+
+#include <errno.h>
+#include <pthread.h>
+
+#include "volcano.h"
+#include "chunk.h"
+#include "zarr.h"
+
+// Thread safe, memory bounded LRU cache of decoded chunks keyed by chunk grid coordinate.
+// Lets a worker assemble a chunk plus a halo from its 26 neighbors without re-reading and
+// re-decompressing them for every chunk that touches them.
+
+// Where cache misses are loaded from. Returns nullptr when the chunk doesn't exist
+typedef tchunk* (*chunk_loader_fn)(void* ctx, s32 cz, s32 cy, s32 cx);
+
+// Whether the source has a chunk. false only when the source knows the chunk isn't there, a chunk it
+// can't tell about (an I/O error, a failed request) counts as present
+typedef bool (*chunk_exists_fn)(void* ctx, s32 cz, s32 cy, s32 cx);
+
+// Optional hint that these chunks will be loaded soon, so the source can start their I/O
+typedef void (*chunk_prefetch_fn)(void* ctx, const s32 (*coords)[3], int n);
+
+typedef struct ChunkCacheEntry {
+  s32 key[3];
+  tchunk* chunk;          // nullptr for chunks that don't exist, those are cached too
+  int refcount;
+  bool loading;           // another thread is decoding it, wait on the cache's cond
+  struct ChunkCacheEntry* prev;   // towards most recently used
+  struct ChunkCacheEntry* next;   // towards least recently used
+  struct ChunkCacheEntry* hnext;  // hash chain
+} ChunkCacheEntry;
+
+typedef struct ChunkCache {
+  pthread_mutex_t lock;
+  pthread_cond_t loaded;
+  ChunkCacheEntry** buckets;
+  int num_buckets;
+  ChunkCacheEntry* head;  // most recently used
+  ChunkCacheEntry* tail;  // least recently used
+  s64 bytes;
+  s64 max_bytes;
+
+  chunk_loader_fn load;
+  void* load_ctx;
+  chunk_prefetch_fn prefetch;
+  void* prefetch_ctx;
+
+  // stats, read with the lock held or after all workers are done
+  s64 hits;
+  s64 misses;
+  s64 bytes_decoded;
+} ChunkCache;
+
+static inline u32 chunk_cache_hash(const ChunkCache* cache, s32 cz, s32 cy, s32 cx) {
+  u32 h = (u32)cz * 73856093u ^ (u32)cy * 19349663u ^ (u32)cx * 83492791u;
+  return h % (u32)cache->num_buckets;
+}
+
+// entries for missing chunks still cost their bookkeeping so they can't grow without bound
+static inline s64 chunk_cache_entry_bytes(const ChunkCacheEntry* e) {
+  return (s64)sizeof(ChunkCacheEntry) + (e->chunk ? tchunk_len(e->chunk) * vs_dtype_size(e->chunk->dtype) : 0);
+}
+
+static ChunkCache* chunk_cache_new(s64 max_bytes, chunk_loader_fn load, void* load_ctx) {
+  ChunkCache* cache = calloc(1, sizeof(ChunkCache));
+  pthread_mutex_init(&cache->lock, nullptr);
+  pthread_cond_init(&cache->loaded, nullptr);
+  cache->num_buckets = 4096;
+  cache->buckets = calloc(cache->num_buckets, sizeof(ChunkCacheEntry*));
+  cache->max_bytes = max_bytes;
+  cache->load = load;
+  cache->load_ctx = load_ctx;
+  return cache;
+}
+
+static void chunk_cache_free(ChunkCache* cache) {
+  ChunkCacheEntry* e = cache->head;
+  while (e) {
+    ChunkCacheEntry* next = e->next;
+    tchunk_free(e->chunk);
+    free(e);
+    e = next;
+  }
+  free(cache->buckets);
+  pthread_mutex_destroy(&cache->lock);
+  pthread_cond_destroy(&cache->loaded);
+  free(cache);
+}
+
+static void chunk_cache_unlink(ChunkCache* cache, ChunkCacheEntry* e) {
+  if (e->prev) e->prev->next = e->next; else cache->head = e->next;
+  if (e->next) e->next->prev = e->prev; else cache->tail = e->prev;
+  e->prev = e->next = nullptr;
+}
+
+static void chunk_cache_push_front(ChunkCache* cache, ChunkCacheEntry* e) {
+  e->prev = nullptr;
+  e->next = cache->head;
+  if (cache->head) cache->head->prev = e;
+  cache->head = e;
+  if (!cache->tail) cache->tail = e;
+}
+
+// Drop least recently used, unreferenced entries until we're under budget. Lock must be held
+static void chunk_cache_evict(ChunkCache* cache) {
+  ChunkCacheEntry* e = cache->tail;
+  while (e && cache->bytes > cache->max_bytes) {
+    ChunkCacheEntry* prev = e->prev;
+    if (e->refcount == 0 && !e->loading) {
+      chunk_cache_unlink(cache, e);
+      ChunkCacheEntry** link = &cache->buckets[chunk_cache_hash(cache, e->key[0], e->key[1], e->key[2])];
+      while (*link != e) link = &(*link)->hnext;
+      *link = e->hnext;
+      cache->bytes -= chunk_cache_entry_bytes(e);
+      tchunk_free(e->chunk);
+      free(e);
+    }
+    e = prev;
+  }
+}
+
+// Get a referenced entry for a chunk, decoding it on a miss. The chunk stays resident until
+// chunk_cache_release. entry->chunk is nullptr when the chunk doesn't exist
+static ChunkCacheEntry* chunk_cache_find(ChunkCache* cache, s32 cz, s32 cy, s32 cx) {
+  ChunkCacheEntry* e = cache->buckets[chunk_cache_hash(cache, cz, cy, cx)];
+  while (e && !(e->key[0] == cz && e->key[1] == cy && e->key[2] == cx)) e = e->hnext;
+  return e;
+}
+
+static ChunkCacheEntry* chunk_cache_acquire(ChunkCache* cache, s32 cz, s32 cy, s32 cx) {
+  pthread_mutex_lock(&cache->lock);
+
+  u32 bucket = chunk_cache_hash(cache, cz, cy, cx);
+  ChunkCacheEntry* e = chunk_cache_find(cache, cz, cy, cx);
+
+  if (e) {
+    cache->hits++;
+    e->refcount++;
+    while (e->loading) pthread_cond_wait(&cache->loaded, &cache->lock);
+    chunk_cache_unlink(cache, e);
+    chunk_cache_push_front(cache, e);
+    pthread_mutex_unlock(&cache->lock);
+    return e;
+  }
+
+  // miss: publish a loading entry so other threads wait for this decode instead of repeating it
+  cache->misses++;
+  e = calloc(1, sizeof(ChunkCacheEntry));
+  e->key[0] = cz;
+  e->key[1] = cy;
+  e->key[2] = cx;
+  e->refcount = 1;
+  e->loading = true;
+  e->hnext = cache->buckets[bucket];
+  cache->buckets[bucket] = e;
+  chunk_cache_push_front(cache, e);
+  pthread_mutex_unlock(&cache->lock);
+
+  tchunk* c = cache->load(cache->load_ctx, cz, cy, cx);
+
+  pthread_mutex_lock(&cache->lock);
+  e->chunk = c;
+  e->loading = false;
+  cache->bytes += chunk_cache_entry_bytes(e);
+  if (c) cache->bytes_decoded += tchunk_len(c) * vs_dtype_size(c->dtype);
+  chunk_cache_evict(cache);
+  pthread_cond_broadcast(&cache->loaded);
+  pthread_mutex_unlock(&cache->lock);
+  return e;
+}
+
+static void chunk_cache_set_prefetch(ChunkCache* cache, chunk_prefetch_fn prefetch, void* ctx) {
+  cache->prefetch = prefetch;
+  cache->prefetch_ctx = ctx;
+}
+
+// Pass the chunks that aren't resident yet on to the source's prefetch. At most 64 per call
+static void chunk_cache_prefetch(ChunkCache* cache, const s32 (*coords)[3], int n) {
+  if (!cache->prefetch) return;
+  s32 missing[64][3];
+  int num_missing = 0;
+  pthread_mutex_lock(&cache->lock);
+  for (int i = 0; i < n && num_missing < 64; i++) {
+    if (!chunk_cache_find(cache, coords[i][0], coords[i][1], coords[i][2])) {
+      memcpy(missing[num_missing++], coords[i], sizeof(missing[0]));
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+  if (num_missing) cache->prefetch(cache->prefetch_ctx, (const s32 (*)[3])missing, num_missing);
+}
+
+static void chunk_cache_release(ChunkCache* cache, ChunkCacheEntry* e) {
+  if (!e) return;
+  pthread_mutex_lock(&cache->lock);
+  e->refcount--;
+  chunk_cache_evict(cache);
+  pthread_mutex_unlock(&cache->lock);
+}
+
+// Assemble chunk (cz, cy, cx) grown by halo voxels on every side from the cached chunk and its
+// neighbors. Voxels outside the volume or in missing chunks are zero. chunk_dims is the zarr chunk shape
+static tchunk* chunk_cache_read_halo(ChunkCache* cache, s32 cz, s32 cy, s32 cx, s32 halo,
+                                     const s32 chunk_dims[3], vs_dtype dtype) {
+  assert(halo <= chunk_dims[0] && halo <= chunk_dims[1] && halo <= chunk_dims[2]);
+
+  s32 dims[3] = {chunk_dims[0] + 2 * halo, chunk_dims[1] + 2 * halo, chunk_dims[2] + 2 * halo};
+  tchunk* ret = tchunk_new(dtype, dims);
+  int size = vs_dtype_size(dtype);
+
+  // only the neighbors the halo actually reaches, i.e. all 26 unless halo is 0
+  s32 reach = halo > 0 ? 1 : 0;
+  for (s32 dz = -reach; dz <= reach; dz++) {
+    for (s32 dy = -reach; dy <= reach; dy++) {
+      for (s32 dx = -reach; dx <= reach; dx++) {
+        if (cz + dz < 0 || cy + dy < 0 || cx + dx < 0) continue;
+
+        ChunkCacheEntry* e = chunk_cache_acquire(cache, cz + dz, cy + dy, cx + dx);
+        const tchunk* src = e->chunk;
+        if (src) {
+          assert(src->dtype == dtype);
+          // the part of the neighbor that lands inside the haloed output, in neighbor coordinates
+          s32 d[3] = {dz, dy, dx};
+          s32 lo[3], hi[3], off[3];
+          for (int a = 0; a < 3; a++) {
+            lo[a] = d[a] < 0 ? chunk_dims[a] - halo : 0;
+            hi[a] = d[a] > 0 ? halo : chunk_dims[a];
+            off[a] = halo + d[a] * chunk_dims[a];
+          }
+          for (s32 z = lo[0]; z < hi[0]; z++) {
+            for (s32 y = lo[1]; y < hi[1]; y++) {
+              const u8* from = (const u8*)src->data + (((s64)z * src->dims[1] + y) * src->dims[2] + lo[2]) * size;
+              u8* to = (u8*)ret->data + (((s64)(z + off[0]) * dims[1] + y + off[1]) * dims[2] + lo[2] + off[2]) * size;
+              memcpy(to, from, (size_t)(hi[2] - lo[2]) * size);
+            }
+          }
+        }
+        chunk_cache_release(cache, e);
+      }
+    }
+  }
+  return ret;
+}
+
+static void chunk_cache_print_stats(ChunkCache* cache, const char* name, s64 output_chunks) {
+  pthread_mutex_lock(&cache->lock);
+  s64 lookups = cache->hits + cache->misses;
+  printf("%s cache: %lld lookups, hit rate %.1f%%, %.1f MB decoded, %.2f MB decoded per output chunk\n",
+         name, lookups, lookups ? 100.0 * (f64)cache->hits / (f64)lookups : 0.0,
+         (f64)cache->bytes_decoded / (1024.0 * 1024.0),
+         output_chunks ? (f64)cache->bytes_decoded / (1024.0 * 1024.0) / (f64)output_chunks : 0.0);
+  pthread_mutex_unlock(&cache->lock);
+}
+
+// A chunk_loader_fn over a zarr v2 array on disk. Path components follow storage_order,
+// e.g. the fiber array is stored z.x.y with '.' separators
+typedef struct ZarrChunkSource {
+  const char* root;
+  zarr_metadata metadata;
+  const char* storage_order;
+  char separator;
+} ZarrChunkSource;
+
+static void zarr_chunk_source_path(const ZarrChunkSource* src, s32 cz, s32 cy, s32 cx, char* path, size_t len) {
+  s32 coords[3];
+  for (int i = 0; i < 3; i++) {
+    char axis = src->storage_order[i];
+    coords[i] = axis == 'z' ? cz : axis == 'y' ? cy : cx;
+  }
+  snprintf(path, len, "%s/%d%c%d%c%d", src->root,
+           coords[0], src->separator, coords[1], src->separator, coords[2]);
+}
+
+static tchunk* zarr_chunk_source_load(void* ctx, s32 cz, s32 cy, s32 cx) {
+  ZarrChunkSource* src = ctx;
+  char path[1024];
+  zarr_chunk_source_path(src, cz, cy, cx, path, sizeof(path));
+  return vs_zarr_read_tchunk_as(path, src->metadata, src->storage_order);
+}
+
+static void zarr_chunk_source_prefetch(void* ctx, const s32 (*coords)[3], int n) {
+  ZarrChunkSource* src = ctx;
+  char paths[64][1024];
+  const char* ptrs[64];
+  n = n < 64 ? n : 64;
+  for (int i = 0; i < n; i++) {
+    zarr_chunk_source_path(src, coords[i][0], coords[i][1], coords[i][2], paths[i], sizeof(paths[i]));
+    ptrs[i] = paths[i];
+  }
+  io_prefetch(zarr_thread_reader()->io, ptrs, n);
+}
+
+// zarr only writes chunks that aren't all fill value, so existence doubles as an occupancy test.
+// A chunk_exists_fn, only ENOENT means absent
+static bool zarr_chunk_source_exists(void* ctx, s32 cz, s32 cy, s32 cx) {
+  ZarrChunkSource* src = ctx;
+  char path[1024];
+  zarr_chunk_source_path(src, cz, cy, cx, path, sizeof(path));
+  return access(path, F_OK) == 0 || errno != ENOENT;
+}
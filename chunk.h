@@ -0,0 +1,112 @@
+#pragma once
+
+#include <float.h>
+
+#include "volcano.h"
+#include "vesuvius-c.h"
+
+// Compute zyx strides for data laid out in storage_order, e.g. "zxy" means z is slowest and y is stride 1.
+// dims are the logical z, y, x extents
+static inline void vs_storage_strides(const char* storage_order, const s32 dims[3], s64 strides[3]) {
+  s64 stride = 1;
+  for (int i = 2; i >= 0; i--) {
+    int axis = storage_order[i] == 'z' ? 0 : storage_order[i] == 'y' ? 1 : 2;
+    strides[axis] = stride;
+    stride *= dims[axis];
+  }
+}
+
+// Voxel types we keep natively instead of widening everything to f32.
+// Scroll 1A's standardized zarr is u8, labels fit in u16
+typedef enum vs_dtype {
+  VS_U8,
+  VS_U16,
+  VS_F32,
+} vs_dtype;
+
+static inline int vs_dtype_size(vs_dtype dtype) {
+  switch (dtype) {
+    case VS_U8: return 1;
+    case VS_U16: return 2;
+    case VS_F32: return 4;
+  }
+  return 0;
+}
+
+// A chunk that keeps the voxel type it was stored with, contiguous zyx like chunk
+typedef struct tchunk {
+  vs_dtype dtype;
+  s32 dims[3];
+  union {
+    void* data;
+    u8* d8;
+    u16* d16;
+    f32* d32;
+  };
+  // set when data points into a read only file mapping rather than the heap
+  void* mapping;
+  s64 mapping_size;
+} tchunk;
+
+static inline tchunk* tchunk_new(vs_dtype dtype, const s32 dims[3]) {
+  tchunk* ret = malloc(sizeof(tchunk));
+  ret->dtype = dtype;
+  memcpy(ret->dims, dims, sizeof(ret->dims));
+  ret->data = calloc((s64)dims[0] * dims[1] * dims[2], vs_dtype_size(dtype));
+  ret->mapping = nullptr;
+  ret->mapping_size = 0;
+  return ret;
+}
+
+static inline void tchunk_free(tchunk* c) {
+  if (!c) return;
+  if (c->mapping) {
+    munmap(c->mapping, c->mapping_size);
+  } else {
+    free(c->data);
+  }
+  free(c);
+}
+
+static inline s64 tchunk_len(const tchunk* c) {
+  return (s64)c->dims[0] * c->dims[1] * c->dims[2];
+}
+
+// Read voxel i of a typed buffer as f32. The switch is on a loop invariant so it predicts perfectly;
+// used by the kernels that are shared between dtypes rather than duplicated per type
+static inline f32 vs_voxel(const void* data, vs_dtype dtype, s64 i) {
+  switch (dtype) {
+    case VS_U8: return (f32)((const u8*)data)[i];
+    case VS_U16: return (f32)((const u16*)data)[i];
+    case VS_F32: return ((const f32*)data)[i];
+  }
+  return 0.0f;
+}
+
+static inline f32 tchunk_get(const tchunk* c, s32 z, s32 y, s32 x) {
+  return vs_voxel(c->data, c->dtype, (s64)z * c->dims[1] * c->dims[2] + (s64)y * c->dims[2] + x);
+}
+
+// -FLT_MAX for an empty chunk, not -INFINITY, since -Ofast assumes finite math
+static inline f32 tchunk_max(const tchunk* c) {
+  f32 ret = -FLT_MAX;
+  for (s64 i = 0; i < tchunk_len(c); i++) {
+    f32 v = vs_voxel(c->data, c->dtype, i);
+    if (v > ret) ret = v;
+  }
+  return ret;
+}
+
+// Copy the dims sized box starting at offset out of a typed chunk, e.g. to drop a halo
+static tchunk* tchunk_crop(const tchunk* c, const s32 offset[3], const s32 dims[3]) {
+  tchunk* ret = tchunk_new(c->dtype, dims);
+  int size = vs_dtype_size(c->dtype);
+  for (s32 z = 0; z < dims[0]; z++) {
+    for (s32 y = 0; y < dims[1]; y++) {
+      const u8* from = (const u8*)c->data + (((s64)(z + offset[0]) * c->dims[1] + y + offset[1]) * c->dims[2] + offset[2]) * size;
+      u8* to = (u8*)ret->data + (((s64)z * dims[1] + y) * dims[2]) * size;
+      memcpy(to, from, (size_t)dims[2] * size);
+    }
+  }
+  return ret;
+}
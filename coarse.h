@@ -0,0 +1,213 @@
+#pragma once
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "volcano.h"
+#include "chunk.h"
+#include "cache.h"
+#include "traversal.h"
+#include "zarr.h"
+#include "preprocess.h"
+
+// Coarse to fine pruning. The scroll volumes are multiscale zarrs, level k being 2^k times coarser
+// than level 0. Before the run, every chunk of a coarse level is read once and each voxel at or
+// above the threshold marks the level 0 chunks it overlaps, grown by margin coarse voxels so papyrus
+// that averaging smeared into a neighbor, and the halo the workers read, are still covered. Level 0
+// chunks nothing marked are left out of the traversal. At /3 that's 1/512th of the voxels of /0.
+// The levels are mean pooled, so a sheet a few voxels thick is diluted by its 2^k wide footprint,
+// far below the fine iso. The coarse threshold is scaled to match: a sheet at least sheet voxels
+// thick at iso, crossing a coarse voxel's footprint, averages at least iso * sheet / 2^k there even
+// on a zero background. That keeps plenty of chunks that turn out empty and prunes mostly air. The
+// assumption about the sheets isn't guaranteed, so coarse_mask_verify checks the mask against level
+// 0 on a sample of chunks before it is used.
+
+typedef struct CoarseMask {
+  s32 grid[3];              // level 0 chunk grid
+  s32 dims[3];              // level 0 chunk dims
+  int level;
+  f32 threshold;             // on the coarse level, scaled from the fine one
+  int margin;
+  u8* occupied;             // per level 0 chunk, zyx
+
+  char root[1024];
+  ZarrChunkSource source;   // the coarse level, in root
+  s32 coarse_grid[3];
+  s64 next_chunk;
+  s64 coarse_chunks_read;
+  f64 seconds;
+
+  // also asked by coarse_mask_occupied, e.g. whether the fiber chunk exists
+  chunk_occupied_fn inner;
+  void* inner_ctx;
+  s64 asked;                // chunks inner said yes to
+  s64 kept;
+} CoarseMask;
+
+static void coarse_mask_mark_chunk(CoarseMask* m, const tchunk* c, const s32 chunk[3]) {
+  const s32* cd = m->source.metadata.chunks;
+  s32 range[2][2];   // level 0 chunks in z and y the current row's voxels overlap
+  for (s32 z = 0; z < c->dims[0]; z++) {
+    for (s32 y = 0; y < c->dims[1]; y++) {
+      s64 row = ((s64)z * c->dims[1] + y) * c->dims[2];
+      s32 last_x = -1;   // highest level 0 chunk x already marked on this row
+      s32 g[3] = {chunk[0] * cd[0] + z, chunk[1] * cd[1] + y, 0};
+      for (int d = 0; d < 2; d++) {
+        s64 a = (s64)(g[d] - m->margin) * ((s64)1 << m->level) / m->dims[d];
+        s64 b = ((s64)(g[d] + 1 + m->margin) * ((s64)1 << m->level) - 1) / m->dims[d];
+        range[d][0] = a < 0 ? 0 : (s32)a;
+        range[d][1] = b >= m->grid[d] ? m->grid[d] - 1 : (s32)b;
+      }
+      if (range[0][0] > range[0][1] || range[1][0] > range[1][1]) continue;
+      for (s32 x = 0; x < c->dims[2]; x++) {
+        if (vs_voxel(c->data, c->dtype, row + x) < m->threshold) continue;
+        g[2] = chunk[2] * cd[2] + x;
+        s64 a = (s64)(g[2] - m->margin) * ((s64)1 << m->level) / m->dims[2];
+        s64 b = ((s64)(g[2] + 1 + m->margin) * ((s64)1 << m->level) - 1) / m->dims[2];
+        s32 x0 = a < 0 ? 0 : (s32)a;
+        s32 x1 = b >= m->grid[2] ? m->grid[2] - 1 : (s32)b;
+        if (x0 <= last_x) x0 = last_x + 1;
+        if (x0 > x1) continue;
+        for (s32 cz = range[0][0]; cz <= range[0][1]; cz++) {
+          for (s32 cy = range[1][0]; cy <= range[1][1]; cy++) {
+            for (s32 cx = x0; cx <= x1; cx++) {
+              // other threads may mark the same chunk, they all store 1
+              __atomic_store_n(&m->occupied[((s64)cz * m->grid[1] + cy) * m->grid[2] + cx], 1, __ATOMIC_RELAXED);
+            }
+          }
+        }
+        last_x = x1;
+      }
+    }
+  }
+}
+
+static void* coarse_mask_thread(void* arg) {
+  CoarseMask* m = arg;
+  s64 total = (s64)m->coarse_grid[0] * m->coarse_grid[1] * m->coarse_grid[2];
+  for (;;) {
+    s64 i = __atomic_fetch_add(&m->next_chunk, 1, __ATOMIC_RELAXED);
+    if (i >= total) break;
+    const s32 chunk[3] = {(s32)(i / m->coarse_grid[2] / m->coarse_grid[1]), (s32)(i / m->coarse_grid[2] % m->coarse_grid[1]),
+                          (s32)(i % m->coarse_grid[2])};
+    // chunks that are all fill value aren't written, and hold no papyrus
+    if (!zarr_chunk_source_exists(&m->source, chunk[0], chunk[1], chunk[2])) continue;
+    tchunk* c = zarr_chunk_source_load(&m->source, chunk[0], chunk[1], chunk[2]);
+    if (!c) continue;
+    coarse_mask_mark_chunk(m, c, chunk);
+    tchunk_free(c);
+    __atomic_fetch_add(&m->coarse_chunks_read, 1, __ATOMIC_RELAXED);
+  }
+  zarr_thread_reader_release();
+  return nullptr;
+}
+
+// Scan level `level` of the multiscale zarr at root (a v2 array in root/level) for the level 0 chunks
+// of a grid of dims sized chunks that can hold papyrus, sheets at least sheet voxels thick at iso.
+// nullptr if the level isn't there
+static CoarseMask* coarse_mask_build(const char* root, int level, const s32 grid[3], const s32 dims[3], f32 iso,
+                                     f32 sheet, int margin, int num_threads) {
+  CoarseMask* m = calloc(1, sizeof(CoarseMask));
+  snprintf(m->root, sizeof(m->root), "%s/%d", root, level);
+  m->source.root = m->root;
+  char path[1100];
+  snprintf(path, sizeof(path), "%s/.zarray", m->root);
+  if (access(path, F_OK) != 0) {
+    printf("no level %d at %s, not pruning\n", level, root);
+    free(m);
+    return nullptr;
+  }
+  m->source.metadata = vs_zarr_parse_zarray(path);
+  m->source.storage_order = "zyx";
+  m->source.separator = m->source.metadata.dimension_separator ? m->source.metadata.dimension_separator : '.';
+  for (int d = 0; d < 3; d++) {
+    if (m->source.metadata.chunks[d] <= 0) {
+      printf("can't read %s, not pruning\n", path);
+      free(m);
+      return nullptr;
+    }
+    m->coarse_grid[d] = (m->source.metadata.shape[d] + m->source.metadata.chunks[d] - 1) / m->source.metadata.chunks[d];
+  }
+  memcpy(m->grid, grid, sizeof(m->grid));
+  memcpy(m->dims, dims, sizeof(m->dims));
+  m->level = level;
+  m->threshold = iso * sheet / (f32)(1 << level);
+  m->margin = margin;
+  m->occupied = calloc((s64)grid[0] * grid[1] * grid[2], 1);
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pthread_t threads[num_threads];
+  for (int i = 0; i < num_threads; i++) pthread_create(&threads[i], nullptr, coarse_mask_thread, m);
+  for (int i = 0; i < num_threads; i++) pthread_join(threads[i], nullptr);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  m->seconds = (f64)(end.tv_sec - start.tv_sec) + (f64)(end.tv_nsec - start.tv_nsec) * 1e-9;
+  return m;
+}
+
+// Checks the mask against level 0 on the cube of up to sample^3 chunks at the middle of the grid:
+// every chunk there that load returns, and that has a voxel at or above seed_threshold once denoised
+// the way the workers do (segment_and_clean grows from those), has to be marked. Returns the chunks
+// the mask would have dropped, 0 when it's safe to prune with
+static s64 coarse_mask_verify(const CoarseMask* m, chunk_loader_fn load, void* ctx, f32 seed_threshold, int sample) {
+  s32 lo[3], hi[3];
+  for (int d = 0; d < 3; d++) {
+    lo[d] = m->grid[d] / 2 - sample / 2;
+    lo[d] = lo[d] < 0 ? 0 : lo[d];
+    hi[d] = lo[d] + sample > m->grid[d] ? m->grid[d] : lo[d] + sample;
+  }
+  s64 checked = 0, papyrus = 0, missed = 0;
+  for (s32 cz = lo[0]; cz < hi[0]; cz++) {
+    for (s32 cy = lo[1]; cy < hi[1]; cy++) {
+      for (s32 cx = lo[2]; cx < hi[2]; cx++) {
+        tchunk* c = load(ctx, cz, cy, cx);
+        if (!c) continue;
+        checked++;
+        tchunk* denoised = vs_tchunk_denoise(c, 3);
+        tchunk_free(c);
+        bool seeded = tchunk_max(denoised) >= seed_threshold;
+        tchunk_free(denoised);
+        if (!seeded) continue;
+        papyrus++;
+        if (!m->occupied[((s64)cz * m->grid[1] + cy) * m->grid[2] + cx]) missed++;
+      }
+    }
+  }
+  printf("coarse pass check: %lld level 0 chunks read, %lld with papyrus, %lld of them not marked\n", checked, papyrus,
+         missed);
+  return missed;
+}
+
+// Chain another occupancy test in front of the mask, asked first
+static void coarse_mask_set_inner(CoarseMask* m, chunk_occupied_fn inner, void* inner_ctx) {
+  m->inner = inner;
+  m->inner_ctx = inner_ctx;
+}
+
+// chunk_occupied_fn for traversal_build
+static bool coarse_mask_occupied(void* ctx, s32 cz, s32 cy, s32 cx) {
+  CoarseMask* m = ctx;
+  if (m->inner && !m->inner(m->inner_ctx, cz, cy, cx)) return false;
+  m->asked++;
+  bool keep = m->occupied[((s64)cz * m->grid[1] + cy) * m->grid[2] + cx] != 0;
+  m->kept += keep;
+  return keep;
+}
+
+static void coarse_mask_print_stats(const CoarseMask* m) {
+  s64 total = (s64)m->grid[0] * m->grid[1] * m->grid[2];
+  s64 marked = 0;
+  for (s64 i = 0; i < total; i++) marked += m->occupied[i];
+  printf("coarse pass over %s at %.2f: %lld chunks read in %.1f s, %lld of %lld level 0 chunks can hold papyrus\n",
+         m->root, m->threshold, m->coarse_chunks_read, m->seconds, marked, total);
+  if (m->asked) {
+    printf("coarse pass: %lld of %lld candidate chunks kept, %.1f%% of the candidates avoided\n", m->kept, m->asked,
+           100.0 * (f64)(m->asked - m->kept) / (f64)m->asked);
+  }
+}
+
+static void coarse_mask_free(CoarseMask* m) {
+  if (!m) return;
+  free(m->occupied);
+  free(m);
+}
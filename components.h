@@ -0,0 +1,402 @@
+#pragma once
+
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "volcano.h"
+#include "output.h"
+#include "pack.h"
+#include "labels.h"
+#include "traversal.h"
+
+// Scroll-wide connected components of the fiber mask. vs_tchunk_label_components labels each chunk on
+// its own, so one fiber gets a different label in every chunk it crosses. During the run each worker
+// writes its chunk's local labels to a label volume (labels.h, (chunk index << label_bits) | (row + 1))
+// and packs a VCB_FIBER_COMPONENTS table with each component's voxel count and the components on the
+// chunk's faces. After the run, in two passes over the chunks:
+//
+//   1. every local component gets a slot, in pack order. Components touching across a face (the same
+//      6-connectivity as the local labeling) are unioned in a union-find table kept in a mapped file
+//      next to the output, four u64s per slot: parent, slots in the set, voxels, global id. The pairs
+//      are found in parallel, one chunk's faces at a time, and unioned under a lock
+//   2. roots are numbered 1.. in slot order, and the chunks are rewritten in parallel into a second
+//      label volume holding the global ids, 0 for no fiber
+//
+// Memory is one chunk per thread plus a u64 per chunk of the grid, the table is paged by the OS.
+// The global ids' voxel counts go to component_sizes.u64 in the global volume, indexed by id.
+
+typedef struct FiberComponents {
+  LabelVolume* local;
+  s32 grid[3];
+  s32 dims[3];
+  s64 chunks;
+  s64 pieces;           // local components
+} FiberComponents;
+
+// The table in the mapped file, slots are local components
+typedef struct FiberUnionFind {
+  u64* parent;
+  u64* count;           // at roots, slots in the set
+  u64* voxels;          // at roots, of the whole set once unioned
+  u64* id;
+  s64 slots;
+  u8* base;
+  s64 size;
+} FiberUnionFind;
+
+// Local labels go to local_root, a label volume of the given zyx shape chunked like the run
+static FiberComponents* fiber_components_new(const char* local_root, const s32 shape[3], const s32 dims[3], const char* cname,
+                                             int clevel) {
+  LabelVolume* local = label_volume_create(local_root, shape, dims, label_bits_for(UINT16_MAX), cname, clevel);
+  if (!local) return nullptr;
+  FiberComponents* fc = calloc(1, sizeof(FiberComponents));
+  fc->local = local;
+  memcpy(fc->grid, local->grid, sizeof(fc->grid));
+  memcpy(fc->dims, dims, sizeof(fc->dims));
+  return fc;
+}
+
+static void fiber_components_free(FiberComponents* fc) {
+  if (!fc) return;
+  label_volume_free(fc->local);
+  free(fc);
+}
+
+// A chunk's local components (vs_tchunk_label_components, 0 for no fiber): written to the local
+// volume, and their table built into out for the pack. Thread safe with one encoder per thread
+static bool fiber_components_add_chunk(FiberComponents* fc, LabelEncoder* e, s32 cz, s32 cy, s32 cx,
+                                       const tchunk* labeled, VcbBuilder* out) {
+  s64 n = (s64)fc->dims[0] * fc->dims[1] * fc->dims[2];
+  u32* rows = malloc(n * sizeof(u32));
+  u32 num_components = 0;
+  for (s64 i = 0; i < n; i++) {
+    u32 label = (u32)vs_voxel(labeled->data, labeled->dtype, i);
+    rows[i] = label ? label - 1 : UINT32_MAX;
+    if (label > num_components) num_components = label;
+  }
+  const s32 origin[3] = {cz * fc->dims[0], cy * fc->dims[1], cx * fc->dims[2]};
+  vcb_fiber_components(out, origin, fc->dims, (VcbParams){}, rows, num_components);
+  bool ok = label_volume_write_chunk(fc->local, e, cz, cy, cx, rows);
+  free(rows);
+  __atomic_fetch_add(&fc->chunks, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&fc->pieces, num_components, __ATOMIC_RELAXED);
+  return ok;
+}
+
+static bool fiber_union_find_map(FiberUnionFind* uf, const char* path, s64 slots) {
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return false;
+  s64 size = (slots ? slots : 1) * 4 * (s64)sizeof(u64);
+  if (ftruncate(fd, size) != 0) {
+    close(fd);
+    return false;
+  }
+  void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) return false;
+  *uf = (FiberUnionFind){.base = base, .size = size, .slots = slots};
+  uf->parent = (u64*)uf->base;
+  uf->count = uf->parent + slots;
+  uf->voxels = uf->count + slots;
+  uf->id = uf->voxels + slots;
+  return true;
+}
+
+static void fiber_union_find_unmap(FiberUnionFind* uf) {
+  if (uf->base) munmap(uf->base, uf->size);
+  *uf = (FiberUnionFind){};
+}
+
+static u64 fiber_find(FiberUnionFind* uf, u64 a) {
+  while (uf->parent[a] != a) {
+    uf->parent[a] = uf->parent[uf->parent[a]];
+    a = uf->parent[a];
+  }
+  return a;
+}
+
+// by size, so the trees stay shallow and find touches few pages of the table
+static void fiber_union(FiberUnionFind* uf, u64 a, u64 b) {
+  a = fiber_find(uf, a);
+  b = fiber_find(uf, b);
+  if (a == b) return;
+  if (uf->count[a] < uf->count[b]) {
+    u64 t = a;
+    a = b;
+    b = t;
+  }
+  uf->parent[b] = a;
+  uf->count[a] += uf->count[b];
+  uf->voxels[a] += uf->voxels[b];
+}
+
+typedef struct FiberResolve {
+  FiberComponents* fc;
+  const PackReader* pack;
+  LabelVolume* global;
+  FiberUnionFind uf;
+  s64* base;            // per grid chunk, its first slot, -1 without components
+  ChunkCoord* chunks;   // with components, pack order
+  s64 num_chunks;
+  s64 next;
+  pthread_mutex_t lock;
+  bool failed;
+  s64 face_pairs;
+} FiberResolve;
+
+static inline s64 fiber_chunk_index(const FiberResolve* r, s32 cz, s32 cy, s32 cx) {
+  return ((s64)cz * r->fc->grid[1] + cy) * r->fc->grid[2] + cx;
+}
+
+static int fiber_pair_cmp(const void* a, const void* b) {
+  const u64* l = a;
+  const u64* r = b;
+  if (l[0] != r[0]) return l[0] < r[0] ? -1 : 1;
+  return l[1] < r[1] ? -1 : l[1] > r[1];
+}
+
+// A fiber components table's face columns, checked by vcb_faces
+static const u32* fiber_faces(const VcbTable* t, const u64** offsets) {
+  return vcb_faces(t, "face_offsets", "face_labels", offsets);
+}
+
+// Pass 1 for one chunk: the distinct slot pairs across its +z +y +x faces
+static s64 fiber_face_pairs(FiberResolve* r, const ChunkCoord* c, u64 (**pairs)[2], s64* cap) {
+  VcbTable own = {};
+  if (!pack_find(r->pack, c->z, c->y, c->x, VCB_FIBER_COMPONENTS, &own)) return 0;
+  const u64* own_offsets;
+  const u32* own_labels = fiber_faces(&own, &own_offsets);
+  u64 own_rows = own.header->rows;
+  s64 own_base = r->base[fiber_chunk_index(r, c->z, c->y, c->x)];
+  s64 n = 0;
+  for (int axis = 0; axis < 3 && own_labels; axis++) {
+    s32 nb[3] = {c->z, c->y, c->x};
+    nb[axis]++;
+    if (nb[axis] >= r->fc->grid[axis]) continue;
+    s64 other_base = r->base[fiber_chunk_index(r, nb[0], nb[1], nb[2])];
+    if (other_base < 0) continue;
+    VcbTable other = {};
+    if (!pack_find(r->pack, nb[0], nb[1], nb[2], VCB_FIBER_COMPONENTS, &other)) continue;
+    const u64* other_offsets;
+    const u32* other_labels = fiber_faces(&other, &other_offsets);
+    u64 other_rows = other.header->rows;
+    // the faces only line up voxel for voxel between chunks of the same dims
+    if (other_labels && memcmp(own.header->dims, other.header->dims, sizeof(own.header->dims)) == 0) {
+      // our + face against their - face, voxel for voxel
+      const u32* a = own_labels + own_offsets[2 * axis + 1];
+      const u32* b = other_labels + other_offsets[2 * axis];
+      s64 area = (s64)(own_offsets[2 * axis + 2] - own_offsets[2 * axis + 1]);
+      u32 last_a = UINT32_MAX, last_b = UINT32_MAX;
+      for (s64 i = 0; i < area; i++) {
+        if (a[i] == UINT32_MAX || b[i] == UINT32_MAX || (a[i] == last_a && b[i] == last_b)) continue;
+        // a row past the table would union slots of some other chunk
+        if (a[i] >= own_rows || b[i] >= other_rows) continue;
+        last_a = a[i];
+        last_b = b[i];
+        if (n == *cap) {
+          *cap = *cap ? *cap * 2 : 1024;
+          *pairs = realloc(*pairs, *cap * sizeof(**pairs));
+        }
+        (*pairs)[n][0] = (u64)(own_base + a[i]);
+        (*pairs)[n][1] = (u64)(other_base + b[i]);
+        n++;
+      }
+    }
+    vcb_close(&other);
+  }
+  vcb_close(&own);
+  qsort(*pairs, n, sizeof(**pairs), fiber_pair_cmp);
+  s64 unique = 0;
+  for (s64 i = 0; i < n; i++) {
+    if (unique && (*pairs)[unique - 1][0] == (*pairs)[i][0] && (*pairs)[unique - 1][1] == (*pairs)[i][1]) continue;
+    (*pairs)[unique][0] = (*pairs)[i][0];
+    (*pairs)[unique][1] = (*pairs)[i][1];
+    unique++;
+  }
+  return unique;
+}
+
+static void* fiber_union_thread(void* arg) {
+  FiberResolve* r = arg;
+  u64 (*pairs)[2] = nullptr;
+  s64 cap = 0;
+  for (;;) {
+    s64 i = __atomic_fetch_add(&r->next, 1, __ATOMIC_RELAXED);
+    if (i >= r->num_chunks) break;
+    s64 n = fiber_face_pairs(r, &r->chunks[i], &pairs, &cap);
+    if (n == 0) continue;
+    pthread_mutex_lock(&r->lock);
+    for (s64 k = 0; k < n; k++) fiber_union(&r->uf, pairs[k][0], pairs[k][1]);
+    r->face_pairs += n;
+    pthread_mutex_unlock(&r->lock);
+  }
+  free(pairs);
+  return nullptr;
+}
+
+// Pass 2: local labels to global ids, chunk by chunk
+static void* fiber_relabel_thread(void* arg) {
+  FiberResolve* r = arg;
+  const LabelVolume* local = r->fc->local;
+  s64 n = (s64)local->chunks[0] * local->chunks[1] * local->chunks[2];
+  u64* labels = malloc(n * sizeof(u64));
+  u64 mask = ((u64)1 << local->label_bits) - 1;
+  LabelEncoder encoder = {};
+  for (;;) {
+    s64 i = __atomic_fetch_add(&r->next, 1, __ATOMIC_RELAXED);
+    if (i >= r->num_chunks) break;
+    const ChunkCoord* c = &r->chunks[i];
+    s64 base = r->base[fiber_chunk_index(r, c->z, c->y, c->x)];
+    bool ok = label_volume_read_chunk(local, c->z, c->y, c->x, labels);
+    for (s64 k = 0; ok && k < n; k++) {
+      if (!labels[k]) continue;
+      s64 slot = base + (s64)(labels[k] & mask) - 1;
+      ok = slot < r->uf.slots;
+      if (ok) labels[k] = r->uf.id[slot];
+    }
+    if (!ok || !label_volume_write_labels(r->global, &encoder, c->z, c->y, c->x, labels)) {
+      printf("couldn't relabel fiber chunk %d %d %d\n", c->z, c->y, c->x);
+      __atomic_store_n(&r->failed, true, __ATOMIC_RELAXED);
+    }
+  }
+  label_encoder_free(&encoder);
+  free(labels);
+  zarr_thread_reader_release();
+  return nullptr;
+}
+
+static void fiber_run_threads(FiberResolve* r, void* (*fn)(void*), int num_threads) {
+  r->next = 0;
+  pthread_t threads[num_threads];
+  for (int i = 0; i < num_threads; i++) pthread_create(&threads[i], nullptr, fn, r);
+  for (int i = 0; i < num_threads; i++) pthread_join(threads[i], nullptr);
+}
+
+static void fiber_components_print_summary(const FiberResolve* r, u64 num_ids) {
+  u64 largest[10] = {};
+  constexpr int top = sizeof(largest) / sizeof(largest[0]);
+  s64 histogram[64] = {};
+  s64 multi_chunk = 0;
+  u64 voxels = 0;
+  for (s64 i = 0; i < r->uf.slots; i++) {
+    if (r->uf.parent[i] != (u64)i) continue;
+    u64 v = r->uf.voxels[i];
+    voxels += v;
+    multi_chunk += r->uf.count[i] > 1;
+    histogram[v ? 63 - __builtin_clzll(v) : 0]++;
+    for (int k = 0; k < top; k++) {
+      if (v > largest[k]) {
+        memmove(&largest[k + 1], &largest[k], (top - 1 - k) * sizeof(u64));
+        largest[k] = v;
+        break;
+      }
+    }
+  }
+  printf("fiber components: %lld pieces in %lld chunks joined into %llu components (%lld across chunks), "
+         "%llu voxels, %lld face pairs\n",
+         r->uf.slots, r->num_chunks, num_ids, multi_chunk, voxels, r->face_pairs);
+  printf("fiber components: largest");
+  for (int k = 0; k < top && largest[k]; k++) printf(" %llu", largest[k]);
+  printf(" voxels\nfiber components: voxels");
+  for (int b = 0; b < 64; b++) {
+    if (histogram[b]) printf(" [%llu, %llu): %lld", (u64)1 << b, (u64)1 << (b + 1), histogram[b]);
+  }
+  printf("\n");
+}
+
+static bool fiber_components_write_sizes(const FiberResolve* r, u64 num_ids) {
+  char path[1100];
+  snprintf(path, sizeof(path), "%s/component_sizes.u64", r->global->root);
+  FILE* fp = fopen(path, "wb");
+  if (!fp) return false;
+  u64 zero = 0;
+  bool ok = fwrite(&zero, sizeof(zero), 1, fp) == 1;
+  for (s64 i = 0; ok && i < r->uf.slots; i++) {
+    if (r->uf.parent[i] == (u64)i) ok = fwrite(&r->uf.voxels[i], sizeof(u64), 1, fp) == 1;
+  }
+  ok &= fclose(fp) == 0;
+  snprintf(path, sizeof(path), "%s/.zattrs", r->global->root);
+  fp = ok ? fopen(path, "w") : nullptr;
+  if (!fp) return false;
+  fprintf(fp, "{\n  \"label_bits\": 0,\n  \"label_encoding\": \"global fiber component id, 0 is background\",\n"
+              "  \"num_components\": %llu,\n  \"component_sizes\": \"component_sizes.u64\"\n}\n", num_ids);
+  return fclose(fp) == 0;
+}
+
+// Join the chunks' components into global ones and write them to global_root, a label volume shaped
+// like the local one. The union-find table goes to table_path
+static bool fiber_components_resolve(FiberComponents* fc, const PackReader* pack, const char* global_root,
+                                     const char* table_path, int num_threads) {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  FiberResolve r = {.fc = fc, .pack = pack};
+  s64 cells = (s64)fc->grid[0] * fc->grid[1] * fc->grid[2];
+  r.base = malloc(cells * sizeof(s64));
+  for (s64 i = 0; i < cells; i++) r.base[i] = -1;
+  r.chunks = malloc((pack->count ? pack->count : 1) * sizeof(ChunkCoord));
+  s64 slots = 0;
+  for (s64 i = 0; i < pack->count; i++) {
+    const PackEntry* e = &pack->index[i];
+    if (e->kind != VCB_FIBER_COMPONENTS) continue;
+    if (e->chunk[0] < 0 || e->chunk[1] < 0 || e->chunk[2] < 0 ||
+        e->chunk[0] >= fc->grid[0] || e->chunk[1] >= fc->grid[1] || e->chunk[2] >= fc->grid[2]) {
+      continue;
+    }
+    const PackRecordHeader* h = pack_record_at(pack, e->offset);
+    VcbTable table = {};
+    if (!h || !pack_record_table(h, &table)) continue;
+    u64 rows = table.header->rows;
+    const u64* voxels = vcb_column_rows(&table, "voxels", VCB_U64, 1, rows);
+    if (rows && voxels) {
+      r.base[fiber_chunk_index(&r, e->chunk[0], e->chunk[1], e->chunk[2])] = slots;
+      r.chunks[r.num_chunks++] = (ChunkCoord){e->chunk[0], e->chunk[1], e->chunk[2]};
+      slots += rows;
+    }
+    vcb_close(&table);
+  }
+
+  bool ok = fiber_union_find_map(&r.uf, table_path, slots);
+  if (!ok) printf("couldn't map the union-find table %s\n", table_path);
+  // the voxel counts, second walk so the table can be sized first
+  for (s64 c = 0; ok && c < r.num_chunks; c++) {
+    VcbTable table = {};
+    if (!pack_find(pack, r.chunks[c].z, r.chunks[c].y, r.chunks[c].x, VCB_FIBER_COMPONENTS, &table)) continue;
+    const u64* voxels = vcb_column_rows(&table, "voxels", VCB_U64, 1, table.header->rows);
+    s64 base = r.base[fiber_chunk_index(&r, r.chunks[c].z, r.chunks[c].y, r.chunks[c].x)];
+    for (u64 k = 0; voxels && k < table.header->rows; k++) {
+      r.uf.parent[base + k] = base + k;
+      r.uf.count[base + k] = 1;
+      r.uf.voxels[base + k] = voxels[k];
+    }
+    vcb_close(&table);
+  }
+
+  u64 num_ids = 0;
+  if (ok) {
+    pthread_mutex_init(&r.lock, nullptr);
+    fiber_run_threads(&r, fiber_union_thread, num_threads);
+    pthread_mutex_destroy(&r.lock);
+    // roots first, so every slot below can look its root's id up
+    for (s64 i = 0; i < slots; i++) {
+      if (fiber_find(&r.uf, i) == (u64)i) r.uf.id[i] = ++num_ids;
+    }
+    for (s64 i = 0; i < slots; i++) r.uf.id[i] = r.uf.id[fiber_find(&r.uf, i)];
+
+    r.global = label_volume_create(global_root, fc->local->shape, fc->local->chunks, 0, fc->local->cname, fc->local->clevel);
+    ok = r.global != nullptr;
+  }
+  if (ok) {
+    fiber_run_threads(&r, fiber_relabel_thread, num_threads);
+    ok = !r.failed && fiber_components_write_sizes(&r, num_ids);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fiber_components_print_summary(&r, num_ids);
+    printf("fiber components: resolved in %.1f s\n",
+           (f64)(end.tv_sec - start.tv_sec) + (f64)(end.tv_nsec - start.tv_nsec) * 1e-9);
+    label_volume_print_stats(r.global);
+  }
+  label_volume_free(r.global);
+  fiber_union_find_unmap(&r.uf);
+  free(r.chunks);
+  free(r.base);
+  return ok;
+}
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <pthread.h>
+
+#include <blosc2.h>
+#ifdef VOLCANO_ZSTD
+#include <zstd.h>
+#endif
+
+#include "volcano.h"
+
+// Compression for the tables we write. One codec per run, picked in the driver:
+//   CODEC_NONE    stored as is, readers use the table in place in the mapping
+//   CODEC_ZSTD    plain zstd frames, level is the zstd level (1-19, negative for the fast levels)
+//   CODEC_BLOSC2  blosc2 with lz4 and byte shuffle over 4 byte values, which is nearly every column.
+//                 level is the blosc clevel (0-9)
+// zstd needs libzstd, build with -DVOLCANO_ZSTD. Without it CODEC_ZSTD is done by blosc2's zstd
+// codec without the shuffle and recorded as CODEC_BLOSC2, which any reader can still decode.
+// Contexts are per thread and reused, compressing into a caller buffer of codec_bound bytes.
+
+typedef enum OutputCodec {
+  CODEC_NONE = 0,
+  CODEC_ZSTD = 1,
+  CODEC_BLOSC2 = 2,
+} OutputCodec;
+
+typedef struct CodecParams {
+  OutputCodec codec;
+  int level;
+} CodecParams;
+
+static const char* codec_name(OutputCodec codec) {
+  switch (codec) {
+    case CODEC_NONE: return "none";
+    case CODEC_ZSTD: return "zstd";
+    case CODEC_BLOSC2: return "blosc2";
+  }
+  return "?";
+}
+
+typedef struct CodecContext {
+  CodecParams params;     // what we actually produce
+  int blosc_compcode;
+  int blosc_shuffle;
+  blosc2_context* bcctx;  // the rest are created on first use
+  blosc2_context* bdctx;
+#ifdef VOLCANO_ZSTD
+  ZSTD_CCtx* zcctx;
+  ZSTD_DCtx* zdctx;
+#endif
+} CodecContext;
+
+static CodecContext* codec_context_new(CodecParams params) {
+  CodecContext* ctx = calloc(1, sizeof(CodecContext));
+  ctx->params = params;
+  ctx->blosc_compcode = BLOSC_LZ4;
+  ctx->blosc_shuffle = BLOSC_SHUFFLE;
+#ifndef VOLCANO_ZSTD
+  if (params.codec == CODEC_ZSTD) {
+    ctx->params.codec = CODEC_BLOSC2;
+    ctx->params.level = params.level < 1 ? 1 : params.level > 9 ? 9 : params.level;
+    ctx->blosc_compcode = BLOSC_ZSTD;
+    ctx->blosc_shuffle = BLOSC_NOSHUFFLE;
+  }
+#endif
+  return ctx;
+}
+
+static void codec_context_free(CodecContext* ctx) {
+  if (!ctx) return;
+  if (ctx->bcctx) blosc2_free_ctx(ctx->bcctx);
+  if (ctx->bdctx) blosc2_free_ctx(ctx->bdctx);
+#ifdef VOLCANO_ZSTD
+  ZSTD_freeCCtx(ctx->zcctx);
+  ZSTD_freeDCtx(ctx->zdctx);
+#endif
+  free(ctx);
+}
+
+// Most bytes codec_compress can write for size bytes of input
+static s64 codec_bound(const CodecContext* ctx, s64 size) {
+  switch (ctx->params.codec) {
+    case CODEC_NONE: return size;
+#ifdef VOLCANO_ZSTD
+    case CODEC_ZSTD: return ZSTD_compressBound(size);
+#endif
+    default: return size + BLOSC2_MAX_OVERHEAD;
+  }
+}
+
+// Compressed size, or -1. dst holds at least codec_bound(ctx, size) bytes
+static s64 codec_compress(CodecContext* ctx, const void* src, s64 size, void* dst) {
+  switch (ctx->params.codec) {
+    case CODEC_NONE:
+      memcpy(dst, src, size);
+      return size;
+#ifdef VOLCANO_ZSTD
+    case CODEC_ZSTD: {
+      if (!ctx->zcctx) ctx->zcctx = ZSTD_createCCtx();
+      size_t n = ZSTD_compressCCtx(ctx->zcctx, dst, ZSTD_compressBound(size), src, size, ctx->params.level);
+      return ZSTD_isError(n) ? -1 : (s64)n;
+    }
+#endif
+    case CODEC_BLOSC2: {
+      if (size > INT32_MAX - BLOSC2_MAX_OVERHEAD) return -1;
+      if (!ctx->bcctx) {
+        blosc2_cparams cparams = BLOSC2_CPARAMS_DEFAULTS;
+        cparams.compcode = ctx->blosc_compcode;
+        cparams.clevel = ctx->params.level;
+        cparams.typesize = 4;
+        cparams.nthreads = 1;
+        cparams.filters[BLOSC2_MAX_FILTERS - 1] = ctx->blosc_shuffle;
+        ctx->bcctx = blosc2_create_cctx(cparams);
+      }
+      int n = blosc2_compress_ctx(ctx->bcctx, src, (s32)size, dst, (s32)(size + BLOSC2_MAX_OVERHEAD));
+      return n > 0 ? n : -1;
+    }
+    default:
+      return -1;
+  }
+}
+
+// Decode size bytes written with codec into exactly raw_size bytes at dst. Works for any codec
+// regardless of what ctx compresses with
+static bool codec_decompress(CodecContext* ctx, OutputCodec codec, const void* src, s64 size, void* dst, s64 raw_size) {
+  switch (codec) {
+    case CODEC_NONE:
+      if (size != raw_size) return false;
+      memcpy(dst, src, size);
+      return true;
+    case CODEC_ZSTD: {
+#ifdef VOLCANO_ZSTD
+      if (!ctx->zdctx) ctx->zdctx = ZSTD_createDCtx();
+      size_t n = ZSTD_decompressDCtx(ctx->zdctx, dst, raw_size, src, size);
+      return !ZSTD_isError(n) && (s64)n == raw_size;
+#else
+      printf("built without zstd, can't decode a zstd table\n");
+      return false;
+#endif
+    }
+    case CODEC_BLOSC2: {
+      if (!ctx->bdctx) {
+        blosc2_dparams dparams = BLOSC2_DPARAMS_DEFAULTS;
+        dparams.nthreads = 1;
+        ctx->bdctx = blosc2_create_dctx(dparams);
+      }
+      return blosc2_decompress_ctx(ctx->bdctx, src, (s32)size, dst, (s32)raw_size) == raw_size;
+    }
+  }
+  return false;
+}
+
+static pthread_key_t codec_context_key;
+static pthread_once_t codec_context_once = PTHREAD_ONCE_INIT;
+
+static void codec_context_key_destroy(void* ctx) { codec_context_free(ctx); }
+static void codec_context_key_init() { pthread_key_create(&codec_context_key, codec_context_key_destroy); }
+
+// The calling thread's context for decoding, created on first use and freed when the thread exits
+static CodecContext* codec_thread_context() {
+  pthread_once(&codec_context_once, codec_context_key_init);
+  CodecContext* ctx = pthread_getspecific(codec_context_key);
+  if (!ctx) {
+    ctx = codec_context_new((CodecParams){CODEC_NONE, 0});
+    pthread_setspecific(codec_context_key, ctx);
+  }
+  return ctx;
+}
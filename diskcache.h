@@ -0,0 +1,242 @@
+#pragma once
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "volcano.h"
+#include "chunk.h"
+#include "cache.h"
+
+// Persistent cache of decoded chunks on local SSD. Each chunk is a raw file with a one page header
+// so the voxels are page aligned, and is mmap'ed read only on a hit: repeat runs (and concurrent
+// processes, through the page cache) pay SSD bandwidth instead of blosc2 decode.
+// Files are written to a temp name and renamed, so readers never see a partial chunk.
+// The directory is capped at max_bytes, evicting the least recently used files (by mtime, which
+// is bumped on every hit since atime is usually disabled)
+
+#define DISK_CACHE_MAGIC "VOLCDC1"
+#define DISK_CACHE_DATA_OFFSET 4096
+
+typedef struct DiskCacheHeader {
+  char magic[8];
+  u32 dtype;
+  s32 dims[3];
+} DiskCacheHeader;
+
+typedef struct DiskCache {
+  char dir[1024];
+  s64 max_bytes;
+  pthread_mutex_t lock;
+  s64 bytes;          // our running estimate, corrected on every eviction scan
+
+  // wrapped source for misses, and whether a chunk it didn't return is really absent
+  chunk_loader_fn inner;
+  chunk_exists_fn inner_exists;
+  void* inner_ctx;
+
+  s64 hits;
+  s64 misses;
+} DiskCache;
+
+static s64 disk_cache_scan_bytes(const char* dir) {
+  DIR* d = opendir(dir);
+  if (!d) return 0;
+  s64 total = 0;
+  struct dirent* ent;
+  char path[2048];
+  while ((ent = readdir(d))) {
+    if (ent->d_name[0] == '.') continue;
+    snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) total += st.st_blocks * 512;
+  }
+  closedir(d);
+  return total;
+}
+
+// dir is created if needed. Use disk_cache_load as the chunk_loader_fn of a ChunkCache
+static DiskCache* disk_cache_new(const char* dir, s64 max_bytes, chunk_loader_fn inner, chunk_exists_fn inner_exists,
+                                 void* inner_ctx) {
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    printf("could not create decoded chunk cache %s\n", dir);
+    return nullptr;
+  }
+  DiskCache* cache = calloc(1, sizeof(DiskCache));
+  snprintf(cache->dir, sizeof(cache->dir), "%s", dir);
+  cache->max_bytes = max_bytes;
+  pthread_mutex_init(&cache->lock, nullptr);
+  cache->bytes = disk_cache_scan_bytes(dir);
+  cache->inner = inner;
+  cache->inner_exists = inner_exists;
+  cache->inner_ctx = inner_ctx;
+  return cache;
+}
+
+static void disk_cache_free(DiskCache* cache) {
+  if (!cache) return;
+  pthread_mutex_destroy(&cache->lock);
+  free(cache);
+}
+
+static void disk_cache_path(const DiskCache* cache, s32 cz, s32 cy, s32 cx, const char* ext, char* path, size_t len) {
+  snprintf(path, len, "%s/%d.%d.%d.%s", cache->dir, cz, cy, cx, ext);
+}
+
+typedef struct DiskCacheFile {
+  char name[256];
+  s64 mtime;
+  s64 bytes;
+} DiskCacheFile;
+
+static int disk_cache_file_cmp(const void* a, const void* b) {
+  s64 ta = ((const DiskCacheFile*)a)->mtime;
+  s64 tb = ((const DiskCacheFile*)b)->mtime;
+  return ta < tb ? -1 : ta > tb;
+}
+
+// Remove the oldest files until the directory is at 90% of the cap. Files another process still has
+// mapped stay valid until it unmaps them, unlink only drops the name
+static void disk_cache_evict(DiskCache* cache) {
+  DIR* d = opendir(cache->dir);
+  if (!d) return;
+
+  int cap = 1024, n = 0;
+  DiskCacheFile* files = malloc(cap * sizeof(DiskCacheFile));
+  s64 total = 0;
+  struct dirent* ent;
+  char path[2048];
+  while ((ent = readdir(d))) {
+    if (ent->d_name[0] == '.') continue;
+    snprintf(path, sizeof(path), "%s/%s", cache->dir, ent->d_name);
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+    if (n == cap) {
+      cap *= 2;
+      files = realloc(files, cap * sizeof(DiskCacheFile));
+    }
+    snprintf(files[n].name, sizeof(files[n].name), "%s", ent->d_name);
+    files[n].mtime = (s64)st.st_mtime;
+    files[n].bytes = st.st_blocks * 512;
+    total += files[n].bytes;
+    n++;
+  }
+  closedir(d);
+
+  qsort(files, n, sizeof(DiskCacheFile), disk_cache_file_cmp);
+  s64 target = cache->max_bytes / 10 * 9;
+  for (int i = 0; i < n && total > target; i++) {
+    snprintf(path, sizeof(path), "%s/%s", cache->dir, files[i].name);
+    if (unlink(path) == 0) total -= files[i].bytes;
+  }
+  free(files);
+  cache->bytes = total;
+}
+
+// Map a cached chunk, nullptr on a miss or a stale/corrupt file
+static tchunk* disk_cache_map(const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return nullptr;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < DISK_CACHE_DATA_OFFSET) {
+    close(fd);
+    return nullptr;
+  }
+
+  void* base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  // bump mtime so eviction sees this file as recently used
+  futimens(fd, nullptr);
+  close(fd);
+  if (base == MAP_FAILED) return nullptr;
+
+  const DiskCacheHeader* header = base;
+  s64 expected = 0;
+  if (memcmp(header->magic, DISK_CACHE_MAGIC, sizeof(DISK_CACHE_MAGIC)) == 0 && header->dtype <= VS_F32) {
+    expected = DISK_CACHE_DATA_OFFSET +
+               (s64)header->dims[0] * header->dims[1] * header->dims[2] * vs_dtype_size((vs_dtype)header->dtype);
+  }
+  if (expected == 0 || expected != st.st_size) {
+    munmap(base, st.st_size);
+    return nullptr;
+  }
+
+  tchunk* ret = malloc(sizeof(tchunk));
+  ret->dtype = (vs_dtype)header->dtype;
+  memcpy(ret->dims, header->dims, sizeof(ret->dims));
+  ret->data = (u8*)base + DISK_CACHE_DATA_OFFSET;
+  ret->mapping = base;
+  ret->mapping_size = st.st_size;
+  return ret;
+}
+
+// Write to a unique temp file then rename over the final name, so concurrent writers of the same
+// chunk and concurrent readers are both safe
+static bool disk_cache_store(DiskCache* cache, const char* path, const tchunk* c) {
+  char tmp[1100];
+  snprintf(tmp, sizeof(tmp), "%s/.tmp.XXXXXX", cache->dir);
+  int fd = mkstemp(tmp);
+  if (fd < 0) return false;
+  fchmod(fd, 0644);
+
+  u8 page[DISK_CACHE_DATA_OFFSET] = {0};
+  s64 data_bytes = c ? tchunk_len(c) * vs_dtype_size(c->dtype) : 0;
+  bool ok = true;
+  if (c) {
+    DiskCacheHeader header = {.magic = DISK_CACHE_MAGIC, .dtype = (u32)c->dtype, .dims = {c->dims[0], c->dims[1], c->dims[2]}};
+    memcpy(page, &header, sizeof(header));
+    ok = write(fd, page, sizeof(page)) == (ssize_t)sizeof(page) &&
+         write(fd, c->data, data_bytes) == (ssize_t)data_bytes;
+  }
+  close(fd);
+
+  if (!ok || rename(tmp, path) != 0) {
+    unlink(tmp);
+    return false;
+  }
+
+  pthread_mutex_lock(&cache->lock);
+  cache->bytes += (c ? DISK_CACHE_DATA_OFFSET : 0) + data_bytes;
+  if (cache->bytes > cache->max_bytes) disk_cache_evict(cache);
+  pthread_mutex_unlock(&cache->lock);
+  return true;
+}
+
+// chunk_loader_fn: mapped file on a hit, otherwise decode through the wrapped source and store it.
+// Chunks the source confirms it doesn't have are remembered with an empty .none file. Anything else
+// the source fails to return (a decode or I/O error, a failed download) isn't cached, the next run tries again
+static tchunk* disk_cache_load(void* ctx, s32 cz, s32 cy, s32 cx) {
+  DiskCache* cache = ctx;
+  char path[1100];
+
+  disk_cache_path(cache, cz, cy, cx, "raw", path, sizeof(path));
+  tchunk* ret = disk_cache_map(path);
+  if (ret) {
+    __atomic_fetch_add(&cache->hits, 1, __ATOMIC_RELAXED);
+    return ret;
+  }
+
+  char none_path[1100];
+  disk_cache_path(cache, cz, cy, cx, "none", none_path, sizeof(none_path));
+  if (access(none_path, F_OK) == 0) {
+    __atomic_fetch_add(&cache->hits, 1, __ATOMIC_RELAXED);
+    return nullptr;
+  }
+
+  __atomic_fetch_add(&cache->misses, 1, __ATOMIC_RELAXED);
+  ret = cache->inner(cache->inner_ctx, cz, cy, cx);
+  if (ret) {
+    disk_cache_store(cache, path, ret);
+  } else if (!cache->inner_exists(cache->inner_ctx, cz, cy, cx)) {
+    disk_cache_store(cache, none_path, nullptr);
+  }
+  return ret;
+}
+
+static void disk_cache_print_stats(DiskCache* cache, const char* name) {
+  s64 lookups = cache->hits + cache->misses;
+  printf("%s disk cache: %lld lookups, hit rate %.1f%%, %.1f GB on disk\n", name, lookups,
+         lookups ? 100.0 * (f64)cache->hits / (f64)lookups : 0.0,
+         (f64)cache->bytes / (1024.0 * 1024.0 * 1024.0));
+}
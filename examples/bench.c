@@ -0,0 +1,561 @@
+#include <pthread.h>
+#include <time.h>
+
+#include "../volcano.h"
+
+#define VESUVIUS_IMPL
+#include "vesuvius-c.h"
+
+#include "../preprocess.h"
+#include "../zarr.h"
+#include "../http.h"
+#include "../pack.h"
+#include "../labels.h"
+
+static f64 now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (f64)ts.tv_sec + (f64)ts.tv_nsec * 1e-9;
+}
+
+// Read a whole file into a malloc'd buffer, returns the size or -1
+static s64 zarr_read_file(const char* path, u8** out) {
+  FILE* fp = fopen(path, "rb");
+  if (!fp) return -1;
+
+  fseek(fp, 0, SEEK_END);
+  s64 size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+
+  u8* buf = malloc(size);
+  if (!buf || fread(buf, 1, size, fp) != (size_t)size) {
+    free(buf);
+    fclose(fp);
+    return -1;
+  }
+  fclose(fp);
+  *out = buf;
+  return size;
+}
+
+// sparse random blobs, roughly what an eroded fiber mask looks like
+static chunk* make_sparse_mask(s32 dim, f32 density) {
+  chunk* ret = vs_chunk_new((s32[3]){dim, dim, dim});
+  srand(1234);
+  for (s32 i = 0; i < dim * dim * dim; i++) {
+    ret->data[i] = ((f32)rand() / (f32)RAND_MAX) < density ? 1.0f : 0.0f;
+  }
+  return ret;
+}
+
+int benchdilate() {
+  printf("%s\n",__FUNCTION__);
+
+  chunk* mask = make_sparse_mask(128, 0.001f);
+  // vs_dilate takes a cube of width 2r+1, the edt a ball of radius r. They differ at the cube's corners
+  printf("radius,vs_dilate_s,vs_dilate_edt_s,mismatched_voxels\n");
+  for (s32 r = 1; r <= 15; r++) {
+    f64 t0 = now_seconds();
+    chunk* naive = vs_dilate(mask, 2 * r + 1);
+    f64 t1 = now_seconds();
+    chunk* edt = vs_dilate_edt(mask, (f32)r);
+    f64 t2 = now_seconds();
+
+    s32 mismatched = 0;
+    for (s32 i = 0; i < 128 * 128 * 128; i++) {
+      if ((naive->data[i] != 0.0f) != (edt->data[i] != 0.0f)) mismatched++;
+    }
+    printf("%d,%f,%f,%d\n", r, t1 - t0, t2 - t1, mismatched);
+
+    vs_chunk_free(naive);
+    vs_chunk_free(edt);
+  }
+  vs_chunk_free(mask);
+  return 0;
+}
+
+typedef struct DecodeBenchArgs {
+  const char* path;
+  zarr_metadata metadata;
+  int iters;
+  bool shared_context;
+  int failures;
+} DecodeBenchArgs;
+
+static void* decode_bench_thread(void* arg) {
+  DecodeBenchArgs* args = arg;
+  s32 dims[3] = {args->metadata.chunks[0], args->metadata.chunks[1], args->metadata.chunks[2]};
+  tchunk* dst = tchunk_new(VS_U8, dims);
+  s64 size = tchunk_len(dst);
+
+  if (args->shared_context) {
+    // what vs_zarr_read_chunk does, minus the conversion to f32
+    for (int i = 0; i < args->iters; i++) {
+      u8* compressed = nullptr;
+      s64 compressed_size = zarr_read_file((char*)args->path, &compressed);
+      if (compressed_size < 0 || blosc2_decompress(compressed, (s32)compressed_size, dst->data, (s32)size) < 0) {
+        args->failures++;
+      }
+      free(compressed);
+    }
+  } else {
+    ZarrReader* reader = zarr_reader_new();
+    for (int i = 0; i < args->iters; i++) {
+      if (!zarr_reader_read_into(reader, args->path, args->metadata, "zyx", dst)) args->failures++;
+    }
+    zarr_reader_free(reader);
+  }
+  tchunk_free(dst);
+  return nullptr;
+}
+
+// decodes/sec of a 128^3 u8 chunk as the thread count goes up, through blosc's global context vs a
+// ZarrReader per thread. Pass a real chunk path to use instead of the synthetic one
+int benchdecode(const char* chunk_path) {
+  printf("%s\n",__FUNCTION__);
+  blosc2_init();
+
+  zarr_metadata metadata = {.chunks = {128, 128, 128}, .dtype = "|u1"};
+  char path[256] = "/tmp/volcano_benchdecode.blosc";
+  if (chunk_path) {
+    snprintf(path, sizeof(path), "%s", chunk_path);
+  } else {
+    // smooth structure plus noise compresses about like the standardized scroll volume
+    s64 size = 128 * 128 * 128;
+    u8* raw = malloc(size);
+    srand(1234);
+    for (s64 i = 0; i < size; i++) {
+      s32 z = i / (128 * 128), y = (i / 128) % 128, x = i % 128;
+      raw[i] = (u8)(((z + y / 2 + x / 3) % 64) * 3 + rand() % 16);
+    }
+    blosc2_cparams cparams = BLOSC2_CPARAMS_DEFAULTS;
+    cparams.compcode = BLOSC_ZSTD;
+    cparams.clevel = 3;
+    cparams.typesize = 1;
+    cparams.nthreads = 1;
+    blosc2_context* cctx = blosc2_create_cctx(cparams);
+    u8* compressed = malloc(size + BLOSC2_MAX_OVERHEAD);
+    int compressed_size = blosc2_compress_ctx(cctx, raw, (s32)size, compressed, (s32)size + BLOSC2_MAX_OVERHEAD);
+    blosc2_free_ctx(cctx);
+    FILE* fp = fopen(path, "wb");
+    if (compressed_size <= 0 || !fp || fwrite(compressed, 1, compressed_size, fp) != (size_t)compressed_size) {
+      if (fp) fclose(fp);
+      free(raw);
+      free(compressed);
+      return 1;
+    }
+    fclose(fp);
+    free(raw);
+    free(compressed);
+  }
+
+  constexpr int iters = 200;
+  printf("threads,global_context_decodes_per_s,per_thread_context_decodes_per_s\n");
+  for (int num_threads = 1; num_threads <= 16; num_threads *= 2) {
+    f64 rates[2];
+    for (int mode = 0; mode < 2; mode++) {
+      pthread_t threads[num_threads];
+      DecodeBenchArgs args[num_threads];
+      f64 t0 = now_seconds();
+      for (int i = 0; i < num_threads; i++) {
+        args[i] = (DecodeBenchArgs){.path = path, .metadata = metadata, .iters = iters, .shared_context = mode == 0};
+        pthread_create(&threads[i], nullptr, decode_bench_thread, &args[i]);
+      }
+      int failures = 0;
+      for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], nullptr);
+        failures += args[i].failures;
+      }
+      if (failures) return 1;
+      rates[mode] = (f64)(num_threads * iters) / (now_seconds() - t0);
+    }
+    printf("%d,%f,%f\n", num_threads, rates[0], rates[1]);
+  }
+  return 0;
+}
+
+// fetches through a HttpZarrStore from a server, e.g. python3 -m http.server -d example_data 8000
+// with VOLCANO_HTTP_URL=http://localhost:8000. Skipped when that isn't set
+int benchhttp() {
+  printf("%s\n",__FUNCTION__);
+  const char* url = getenv("VOLCANO_HTTP_URL");
+  if (!url) {
+    printf("VOLCANO_HTTP_URL not set, skipping\n");
+    return 0;
+  }
+
+  char dir[] = "/tmp/volcano_http_XXXXXX";
+  if (!mkdtemp(dir)) return 1;
+  HttpZarrStore* store = http_store_new(url, dir, 2, 8);
+  int ret = 0;
+
+  f64 t0 = now_seconds();
+  if (http_store_fetch(store, "test.zarray") != HTTP_OK) ret = 1;
+  f64 t1 = now_seconds();
+  char path[HTTP_PATH_MAX];
+  http_local_path(store, "test.zarray", path, sizeof(path));
+  if (!ret && vs_zarr_parse_zarray(path).shape[0] != 14376) ret = 1;
+
+  // missing files are a result, not an error, and the second lookup is answered from disk
+  if (http_store_fetch(store, "0/0/0") != HTTP_MISSING || http_store_fetch(store, "0/0/0") != HTTP_MISSING) ret = 1;
+  if (http_store_fetch(store, "test.zarray") != HTTP_OK || store->local_hits != 2) ret = 1;
+
+  printf("first fetch %f s\n", t1 - t0);
+  http_store_print_stats(store);
+  http_store_free(store);
+  return ret;
+}
+
+// superpixel tables roughly like snic's: one seed every d_seed voxels, most of them filtered out
+static void make_superpixel_tables(VcbBuilder** tables, int* num_tables) {
+  constexpr int n = 64;
+  *tables = calloc(n, sizeof(VcbBuilder));
+  *num_tables = n;
+  Superpixel* sp = calloc(snic_superpixel_count(), sizeof(Superpixel));
+  srand(1234);
+  for (int t = 0; t < n; t++) {
+    int count = 0;
+    for (int z = 0; z < dimension; z += d_seed) {
+      for (int y = 0; y < dimension; y += d_seed) {
+        for (int x = 0; x < dimension; x += d_seed) {
+          if (rand() % 8) continue;
+          sp[count++] = (Superpixel){
+            .z = z + (f32)(rand() % 16) / 8.0f, .y = y + (f32)(rand() % 16) / 8.0f, .x = x + (f32)(rand() % 16) / 8.0f,
+            .c = 32.0f + (f32)(rand() % 160), .n = 1 + rand() % 8};
+        }
+      }
+    }
+    s32 origin[3] = {t * dimension, 0, 0};
+    s32 dims[3] = {dimension, dimension, dimension};
+    vcb_superpixels(&(*tables)[t], origin, dims, (VcbParams){32.0f, 8, d_seed, compactness}, sp, count);
+  }
+  free(sp);
+}
+
+// the superpixel tables of a pack from a real run
+static void load_superpixel_tables(PackReader* pack, VcbBuilder** tables, int* num_tables) {
+  int cap = 64;
+  *tables = calloc(cap, sizeof(VcbBuilder));
+  *num_tables = 0;
+  u64 cursor = 0;
+  VcbTable t;
+  while (pack_next(pack, &cursor, &t)) {
+    if (t.header->kind == VCB_SUPERPIXELS) {
+      if (*num_tables == cap) {
+        cap *= 2;
+        *tables = realloc(*tables, cap * sizeof(VcbBuilder));
+      }
+      VcbBuilder* b = &(*tables)[(*num_tables)++];
+      *b = (VcbBuilder){};
+      vcb_reserve(b, t.size);
+      memcpy(b->data, t.header, t.size);
+      b->size = t.size;
+    }
+    vcb_close(&t);
+  }
+}
+
+// ratio and single thread MB/s of each output codec on superpixel tables, then pack writing throughput
+// as compression threads are added. Pass a pack from a run to use its superpixels, otherwise they're
+// synthetic
+int benchcodec(const char* pack_path) {
+  printf("%s\n",__FUNCTION__);
+  blosc2_init();
+
+  VcbBuilder* tables;
+  int num_tables;
+  PackReader* pack = pack_path ? pack_open(pack_path) : nullptr;
+  if (pack) {
+    load_superpixel_tables(pack, &tables, &num_tables);
+    pack_reader_close(pack);
+  } else {
+    if (pack_path) printf("can't read %s, using synthetic superpixels\n", pack_path);
+    make_superpixel_tables(&tables, &num_tables);
+  }
+  if (num_tables == 0) return 1;
+  s64 raw_bytes = 0, max_size = 0;
+  for (int i = 0; i < num_tables; i++) {
+    raw_bytes += tables[i].size;
+    if (tables[i].size > max_size) max_size = tables[i].size;
+  }
+  f64 mb = (f64)raw_bytes / (1024.0 * 1024.0);
+
+  const CodecParams configs[] = {
+    {CODEC_NONE, 0},
+    {CODEC_ZSTD, 1}, {CODEC_ZSTD, 3}, {CODEC_ZSTD, 9}, {CODEC_ZSTD, 19},
+    {CODEC_BLOSC2, 1}, {CODEC_BLOSC2, 5}, {CODEC_BLOSC2, 9},
+  };
+  constexpr int reps = 5;
+  printf("codec,level,ratio,compress_MBps,decompress_MBps\n");
+  for (u64 c = 0; c < sizeof(configs) / sizeof(configs[0]); c++) {
+    CodecContext* ctx = codec_context_new(configs[c]);
+    s64 bound = codec_bound(ctx, max_size);
+    u8** compressed = calloc(num_tables, sizeof(u8*));
+    s64* sizes = calloc(num_tables, sizeof(s64));
+    u8* raw = malloc(max_size);
+    s64 stored = 0;
+    bool ok = true;
+
+    f64 t0 = now_seconds();
+    for (int r = 0; r < reps && ok; r++) {
+      stored = 0;
+      for (int i = 0; i < num_tables && ok; i++) {
+        if (!compressed[i]) compressed[i] = malloc(bound);
+        sizes[i] = codec_compress(ctx, tables[i].data, tables[i].size, compressed[i]);
+        ok = sizes[i] >= 0;
+        stored += sizes[i];
+      }
+    }
+    f64 t1 = now_seconds();
+    for (int r = 0; r < reps && ok; r++) {
+      for (int i = 0; i < num_tables && ok; i++) {
+        ok = codec_decompress(ctx, ctx->params.codec, compressed[i], sizes[i], raw, tables[i].size) &&
+             memcmp(raw, tables[i].data, tables[i].size) == 0;
+      }
+    }
+    f64 t2 = now_seconds();
+
+    if (ok) {
+      // the codec actually used, CODEC_ZSTD shows up as blosc2 without libzstd
+      printf("%s,%d,%f,%f,%f\n", codec_name(ctx->params.codec), ctx->params.level, (f64)raw_bytes / (f64)stored,
+             mb * reps / (t1 - t0), mb * reps / (t2 - t1));
+    } else {
+      printf("%s,%d,failed\n", codec_name(configs[c].codec), configs[c].level);
+    }
+    for (int i = 0; i < num_tables; i++) free(compressed[i]);
+    free(compressed);
+    free(sizes);
+    free(raw);
+    codec_context_free(ctx);
+    if (!ok) return 1;
+  }
+
+  // the whole path the driver takes, one appending thread and a pool of compressors
+  char path[] = "/tmp/volcano_benchcodec.pack";
+  printf("compress_threads,pack_MBps\n");
+  for (int threads = 1; threads <= 8; threads *= 2) {
+    PackWriter* w = pack_writer_new(path, (CodecParams){CODEC_ZSTD, 3}, threads);
+    if (!w) return 1;
+    PackBuffer buf = {.writer = w};
+    f64 t0 = now_seconds();
+    for (int r = 0; r < reps; r++) {
+      for (int i = 0; i < num_tables; i++) pack_append(&buf, r, i, 0, &tables[i]);
+    }
+    pack_buffer_free(&buf);
+    if (!pack_close(w)) return 1;
+    printf("%d,%f\n", threads, mb * reps / (now_seconds() - t0));
+  }
+  unlink(path);
+
+  for (int i = 0; i < num_tables; i++) vcb_builder_free(&tables[i]);
+  free(tables);
+  return 0;
+}
+
+// snic labels of a synthetic chunk: a few wavy sheets a handful of voxels thick, the way a cleaned
+// chunk of papyrus looks. Row + 1 per voxel, 0 for background, like the low bits of the label volume
+static void make_label_chunk(int seed, u32* out) {
+  s32 dims[3] = {dimension, dimension, dimension};
+  tchunk* c = tchunk_new(VS_U8, dims);
+  for (int z = 0; z < dimension; z++) {
+    for (int y = 0; y < dimension; y++) {
+      for (int x = 0; x < dimension; x++) {
+        f32 sheet = (f32)z + 6.0f * sinf((f32)(x + seed * 17) * 0.05f) + 4.0f * cosf((f32)y * 0.07f);
+        bool inside = fmodf(sheet + 64.0f, 16.0f) < 5.0f;
+        c->d8[((s64)z * dimension + y) * dimension + x] = inside ? (u8)(64 + (x * 7 + y * 3 + z) % 128) : 0;
+      }
+    }
+  }
+  BrickSet* bricks = brickset_build(c);
+  Superpixel* superpixels = calloc(snic_superpixel_count(), sizeof(Superpixel));
+  snic_bricks(c->data, c->dtype, bricks, out, superpixels);
+  filter_superpixels_bricks(out, superpixels, bricks, 1, 32.0f);
+  for (s64 i = 0; i < (s64)dimension * dimension * dimension; i++) out[i] = out[i] == UINT32_MAX ? 0 : out[i] + 1;
+  free(superpixels);
+  free(bricks);
+  tchunk_free(c);
+}
+
+// Size and decode speed of the label volume's compressed_segmentation + blosc against blosc alone on
+// u32 labels. Pass a label volume from a run to use its chunks, otherwise they're synthetic
+int benchlabels(const char* labels_path) {
+  printf("%s\n",__FUNCTION__);
+  blosc2_init();
+  constexpr s64 voxels = (s64)dimension * dimension * dimension;
+  constexpr int max_chunks = 32;
+  u32* local[max_chunks];
+  int num_chunks = 0;
+
+  LabelVolume* volume = labels_path ? label_volume_open(labels_path) : nullptr;
+  if (volume) {
+    u64* global = malloc(voxels * sizeof(u64));
+    u64 mask = ((u64)1 << volume->label_bits) - 1;
+    char path[1200];
+    for (s32 cz = 0; cz < volume->grid[0] && num_chunks < max_chunks; cz++) {
+      for (s32 cy = 0; cy < volume->grid[1] && num_chunks < max_chunks; cy++) {
+        for (s32 cx = 0; cx < volume->grid[2] && num_chunks < max_chunks; cx++) {
+          label_chunk_path(volume, cz, cy, cx, path, sizeof(path));
+          if (access(path, F_OK) != 0 || !label_volume_read_chunk(volume, cz, cy, cx, global)) continue;
+          local[num_chunks] = malloc(voxels * sizeof(u32));
+          for (s64 i = 0; i < voxels; i++) local[num_chunks][i] = (u32)(global[i] & mask);
+          num_chunks++;
+        }
+      }
+    }
+    free(global);
+    label_volume_free(volume);
+  }
+  if (num_chunks == 0) {
+    if (labels_path) printf("no label chunks in %s, using synthetic labels\n", labels_path);
+    for (; num_chunks < 8; num_chunks++) {
+      local[num_chunks] = malloc(voxels * sizeof(u32));
+      make_label_chunk(num_chunks, local[num_chunks]);
+    }
+  }
+
+  u64* labels = malloc(voxels * sizeof(u64));
+  u8* compressed = malloc(voxels * sizeof(u64) + BLOSC2_MAX_OVERHEAD);
+  u8* raw = malloc(voxels * sizeof(u64));
+  CsegBuffer cseg = {};
+  blosc2_dparams dparams = BLOSC2_DPARAMS_DEFAULTS;
+  dparams.nthreads = 1;
+  blosc2_context* dctx = blosc2_create_dctx(dparams);
+  constexpr int reps = 5;
+
+  printf("codec,clevel,bits_per_voxel,encode_Mvoxps,decode_Mvoxps\n");
+  const char* cnames[] = {"lz4", "zstd"};
+  for (int segmentation = 0; segmentation < 2; segmentation++) {
+    for (int cn = 0; cn < 2; cn++) {
+      blosc2_cparams cparams = BLOSC2_CPARAMS_DEFAULTS;
+      cparams.compcode = label_blosc_compcode(cnames[cn]);
+      cparams.clevel = 5;
+      cparams.typesize = 4;
+      cparams.nthreads = 1;
+      cparams.filters[BLOSC2_MAX_FILTERS - 1] = BLOSC_SHUFFLE;
+      blosc2_context* cctx = blosc2_create_cctx(cparams);
+      s64 stored = 0, bad = 0;
+      f64 encode_s = 0.0, decode_s = 0.0;
+      for (int c = 0; c < num_chunks; c++) {
+        const void* src = local[c];
+        s64 size = voxels * sizeof(u32);
+        int n = 0;
+        f64 t0 = now_seconds();
+        for (int r = 0; r < reps; r++) {
+          if (segmentation) {
+            for (s64 i = 0; i < voxels; i++) labels[i] = local[c][i];
+            cseg_encode(&cseg, labels, (s32[3]){dimension, dimension, dimension});
+            src = cseg.words;
+            size = cseg.count * (s64)sizeof(u32);
+          }
+          n = blosc2_compress_ctx(cctx, src, (s32)size, compressed, (s32)(voxels * sizeof(u64) + BLOSC2_MAX_OVERHEAD));
+        }
+        f64 t1 = now_seconds();
+        for (int r = 0; r < reps; r++) {
+          blosc2_decompress_ctx(dctx, compressed, n, raw, (s32)size);
+          if (segmentation) cseg_decode((const u32*)raw, size / 4, (s32[3]){dimension, dimension, dimension}, labels);
+        }
+        f64 t2 = now_seconds();
+        for (s64 i = 0; i < voxels; i++) {
+          bad += segmentation ? labels[i] != local[c][i] : ((const u32*)raw)[i] != local[c][i];
+        }
+        stored += n;
+        encode_s += t1 - t0;
+        decode_s += t2 - t1;
+      }
+      f64 mvox = (f64)voxels * num_chunks * reps * 1e-6;
+      printf("%s%s,5,%f,%f,%f%s\n", segmentation ? "cseg+" : "", cnames[cn], (f64)stored * 8.0 / ((f64)voxels * num_chunks),
+             mvox / encode_s, mvox / decode_s, bad ? ",MISMATCH" : "");
+      blosc2_free_ctx(cctx);
+    }
+  }
+
+  blosc2_free_ctx(dctx);
+  cseg_buffer_free(&cseg);
+  free(raw);
+  free(compressed);
+  free(labels);
+  for (int c = 0; c < num_chunks; c++) free(local[c]);
+  return 0;
+}
+
+// how many of the chunk's foreground voxels have a superpixel after filtering
+static s64 snic_coverage(const tchunk* c, const u32* labels, s64* foreground) {
+  s64 covered = 0;
+  *foreground = 0;
+  for (s64 i = 0; i < tchunk_len(c); i++) {
+    if (vs_voxel(c->data, c->dtype, i) == 0.0f) continue;
+    (*foreground)++;
+    covered += labels[i] != UINT32_MAX;
+  }
+  return covered;
+}
+
+// dense snic against snic_bricks on a cleaned chunk: superpixels kept, foreground voxels labeled and
+// time. Pass a real 128^3 u8 chunk (blosc, as stored in the zarr) to use instead of synthetic sheets
+int benchsnic(const char* chunk_path) {
+  printf("%s\n",__FUNCTION__);
+  constexpr f32 iso = 32.0f;
+  s32 dims[3] = {dimension, dimension, dimension};
+  tchunk* raw = tchunk_new(VS_U8, dims);
+  zarr_metadata metadata = {.chunks = {dimension, dimension, dimension}, .dtype = "|u1"};
+  ZarrReader* reader = chunk_path ? zarr_reader_new() : nullptr;
+  if (reader && !zarr_reader_read_into(reader, chunk_path, metadata, "zyx", raw)) {
+    printf("could not read %s, using synthetic sheets\n", chunk_path);
+    zarr_reader_free(reader);
+    reader = nullptr;
+  }
+  if (!reader) {
+    srand(1234);
+    for (int z = 0; z < dimension; z++) {
+      for (int y = 0; y < dimension; y++) {
+        for (int x = 0; x < dimension; x++) {
+          f32 sheet = (f32)z + 6.0f * sinf((f32)x * 0.05f) + 4.0f * cosf((f32)y * 0.07f);
+          bool inside = fmodf(sheet + 64.0f, 16.0f) < 3.0f;
+          raw->d8[((s64)z * dimension + y) * dimension + x] = (u8)((inside ? 140 : 10) + rand() % 40);
+        }
+      }
+    }
+  }
+  zarr_reader_free(reader);
+
+  tchunk* c = vs_tchunk_denoise(raw, 3);
+  segment_and_clean_tchunk(c, iso, iso + 96.0f);
+  u32* labels = malloc(tchunk_len(c) * sizeof(u32));
+  Superpixel* superpixels = calloc(snic_superpixel_count(), sizeof(Superpixel));
+
+  printf("kernel,superpixels,foreground_voxels,labeled_voxels,seconds\n");
+  f64 t0 = now_seconds();
+  snic_typed(c->data, c->dtype, labels, superpixels);
+  int dense = filter_superpixels(labels, superpixels, 1, iso);
+  f64 t1 = now_seconds();
+  s64 foreground = 0;
+  s64 covered = snic_coverage(c, labels, &foreground);
+  printf("snic,%d,%lld,%lld,%f\n", dense, foreground, covered, t1 - t0);
+
+  memset(superpixels, 0, snic_superpixel_count() * sizeof(Superpixel));
+  t0 = now_seconds();
+  BrickSet* bricks = brickset_build(c);
+  int unlabeled = snic_bricks(c->data, c->dtype, bricks, labels, superpixels);
+  int sparse = filter_superpixels_bricks(labels, superpixels, bricks, 1, iso);
+  t1 = now_seconds();
+  covered = snic_coverage(c, labels, &foreground);
+  printf("snic_bricks,%d,%lld,%lld,%f\n", sparse, foreground, covered, t1 - t0);
+
+  free(bricks);
+  free(superpixels);
+  free(labels);
+  tchunk_free(c);
+  tchunk_free(raw);
+  // snic_bricks labels every foreground voxel, snic_typed() may lose some to filtering
+  return unlabeled != 0 || covered != foreground;
+}
+
+int main(int argc, char** argv) {
+  if(benchdilate()) printf("benchdilate failed\n");
+  if(benchdecode(argc > 1 ? argv[1] : nullptr)) printf("benchdecode failed\n");
+  if(benchhttp()) printf("benchhttp failed\n");
+  if(benchcodec(argc > 2 ? argv[2] : nullptr)) printf("benchcodec failed\n");
+  if(benchlabels(argc > 3 ? argv[3] : nullptr)) printf("benchlabels failed\n");
+  if(benchsnic(argc > 1 ? argv[1] : nullptr)) printf("benchsnic failed\n");
+  return 0;
+}
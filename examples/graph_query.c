@@ -0,0 +1,63 @@
+#include "../volcano.h"
+
+#define VESUVIUS_IMPL
+#include "vesuvius-c.h"
+
+#include "../graph.h"
+
+// Build the superpixel graph for a run's pack file, or list a superpixel's neighbors. grid and
+// label_bits have to be the run's for the node ids to match its label volume
+//   graph_query build run.pack graph_dir grid_z grid_y grid_x label_bits
+//   graph_query neighbors graph_dir chunk_z chunk_y chunk_x row
+
+static void print_usage(const char* program_name) {
+  fprintf(stderr, "Usage: %s build input.pack graph_dir grid_z grid_y grid_x label_bits\n", program_name);
+  fprintf(stderr, "       %s neighbors graph_dir chunk_z chunk_y chunk_x row\n", program_name);
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) print_usage(argv[0]);
+
+  if (strcmp(argv[1], "build") == 0) {
+    if (argc != 8) print_usage(argv[0]);
+    PackReader* pack = pack_open(argv[2]);
+    if (!pack) {
+      fprintf(stderr, "can't open %s\n", argv[2]);
+      return 1;
+    }
+    const s32 grid[3] = {atoi(argv[4]), atoi(argv[5]), atoi(argv[6])};
+    bool ok = graph_build(pack, argv[3], grid, (u32)atoi(argv[7]), 8);
+    pack_reader_close(pack);
+    return ok ? 0 : 1;
+  }
+
+  if (strcmp(argv[1], "neighbors") != 0 || argc != 7) print_usage(argv[0]);
+  GraphReader* graph = graph_open(argv[2], 16);
+  if (!graph) {
+    fprintf(stderr, "can't open %s\n", argv[2]);
+    return 1;
+  }
+  const GraphManifest* m = &graph->manifest;
+  u64 node = graph_node_id(m->grid, m->label_bits, atoi(argv[3]), atoi(argv[4]), atoi(argv[5]), (u32)atoi(argv[6]));
+  GraphIter it;
+  if (!graph_neighbors(graph, node, &it)) {
+    fprintf(stderr, "node %llu isn't in the graph\n", node);
+    graph_close(graph);
+    return 1;
+  }
+  printf("node,chunk_z,chunk_y,chunk_x,row,weight,face\n");
+  const GraphEdge* e;
+  while ((e = graph_next(&it))) {
+    s32 chunk[3];
+    u32 row;
+    // background (node 0) has no chunk or row, those fields are left empty
+    if (graph_node_source(m->grid, m->label_bits, e->node, chunk, &row)) {
+      printf("%llu,%d,%d,%d,%u,%f,%u\n", e->node, chunk[0], chunk[1], chunk[2], row, e->weight, e->face);
+    } else {
+      printf("%llu,,,,,%f,%u\n", e->node, e->weight, e->face);
+    }
+  }
+  graph_close(graph);
+  return 0;
+}
@@ -0,0 +1,71 @@
+#include "../volcano.h"
+
+#define VESUVIUS_IMPL
+#include "vesuvius-c.h"
+
+#include "../spatial.h"
+
+// Build a spatial index for a run's pack file, or query one. Query coordinates are global zyx voxels
+//   spatial_query build run.pack run.spx
+//   spatial_query box run.spx z0 y0 x0 z1 y1 x1
+//   spatial_query radius run.spx z y x r
+
+static void print_usage(const char* program_name) {
+  fprintf(stderr, "Usage: %s build input.pack output.spx\n", program_name);
+  fprintf(stderr, "       %s box index.spx z0 y0 x0 z1 y1 x1\n", program_name);
+  fprintf(stderr, "       %s radius index.spx z y x r\n", program_name);
+  exit(1);
+}
+
+static void print_hits(const SpatialHits* hits) {
+  printf("superpixels: chunk_z,chunk_y,chunk_x,id,z,y,x,c,n\n");
+  for (s64 i = 0; i < hits->num_superpixels; i++) {
+    const SpatialSuperpixelHit* h = &hits->superpixels[i];
+    printf("%d,%d,%d,%u,%f,%f,%f,%f,%u\n", h->chunk[0], h->chunk[1], h->chunk[2], h->id,
+           h->origin[0] + h->sp.z, h->origin[1] + h->sp.y, h->origin[2] + h->sp.x, h->sp.c, h->sp.n);
+  }
+  printf("chords: chunk_z,chunk_y,chunk_x,id,points,z0,z1,y0,y1,x0,x1\n");
+  for (s64 i = 0; i < hits->num_chords; i++) {
+    const SpatialChordHit* h = &hits->chords[i];
+    printf("%d,%d,%d,%u,%u", h->chunk[0], h->chunk[1], h->chunk[2], h->id, h->num_points);
+    for (int d = 0; d < 3; d++) printf(",%f,%f", h->origin[d] + h->bbox[d][0], h->origin[d] + h->bbox[d][1]);
+    printf("\n");
+  }
+  fprintf(stderr, "%lld superpixels, %lld chords\n", hits->num_superpixels, hits->num_chords);
+}
+
+int main(int argc, char** argv) {
+  if (argc < 4) print_usage(argv[0]);
+
+  if (strcmp(argv[1], "build") == 0) {
+    PackReader* pack = pack_open(argv[2]);
+    if (!pack) {
+      fprintf(stderr, "can't open %s\n", argv[2]);
+      return 1;
+    }
+    bool ok = spatial_index_build(pack, argv[3]);
+    pack_reader_close(pack);
+    return ok ? 0 : 1;
+  }
+
+  bool box = strcmp(argv[1], "box") == 0;
+  if (!(box && argc == 9) && !(strcmp(argv[1], "radius") == 0 && argc == 7)) print_usage(argv[0]);
+  SpatialIndex* index = spatial_index_open(argv[2]);
+  if (!index) {
+    fprintf(stderr, "can't open %s\n", argv[2]);
+    return 1;
+  }
+  SpatialHits hits = {};
+  if (box) {
+    const f32 lo[3] = {strtof(argv[3], nullptr), strtof(argv[4], nullptr), strtof(argv[5], nullptr)};
+    const f32 hi[3] = {strtof(argv[6], nullptr), strtof(argv[7], nullptr), strtof(argv[8], nullptr)};
+    spatial_query_box(index, lo, hi, true, true, &hits);
+  } else {
+    const f32 center[3] = {strtof(argv[3], nullptr), strtof(argv[4], nullptr), strtof(argv[5], nullptr)};
+    spatial_query_radius(index, center, strtof(argv[6], nullptr), true, true, &hits);
+  }
+  print_hits(&hits);
+  spatial_hits_free(&hits);
+  spatial_index_close(index);
+  return 0;
+}
@@ -0,0 +1,144 @@
+#include <dirent.h>
+
+#include "../volcano.h"
+
+#define VESUVIUS_IMPL
+#include "vesuvius-c.h"
+
+#include "../util.h"
+#include "../output.h"
+#include "../pack.h"
+
+// Write the csv files volcano used to produce from its binary output, for tools that still want them.
+// The input is a run's pack file, or a directory of superpixels/chords/chords.stats.z.y.x.vcb tables.
+// Every chunk gets superpixels, chords, chords.stats and chords.only csvs in output_dir with the same
+// names the driver used
+
+static void print_usage(const char* program_name) {
+  fprintf(stderr, "Usage: %s input output_dir\n", program_name);
+  fprintf(stderr, "  input  a .pack file or a directory of .vcb tables\n");
+  exit(1);
+}
+
+static bool export_tables(const char* out_dir, int cz, int cy, int cx,
+                          const VcbTable* sp_table, const VcbTable* chord_table, const VcbTable* stats_table) {
+  char path[1024];
+  VcbSuperpixelView sp;
+  VcbChordView cv;
+  if (!vcb_superpixel_view(sp_table, &sp) || !vcb_chord_view(chord_table, &cv)) {
+    fprintf(stderr, "chunk %d %d %d has malformed tables\n", cz, cy, cx);
+    return false;
+  }
+
+  Superpixel* superpixels = calloc(sp.count ? sp.count : 1, sizeof(Superpixel));
+  for (u64 i = 0; i < sp.count; i++) {
+    superpixels[i] = (Superpixel){.z = sp.z[i], .y = sp.y[i], .x = sp.x[i], .c = sp.c[i], .n = sp.n[i]};
+  }
+  // the csv writers index superpixels with the chord points as they are
+  for (u64 i = 0; i < cv.num_points; i++) {
+    if (cv.points[i] >= sp.count) {
+      fprintf(stderr, "chunk %d %d %d has a chord point past its %llu superpixels\n", cz, cy, cx,
+              (unsigned long long)sp.count);
+      free(superpixels);
+      return false;
+    }
+  }
+  // the chords point straight into the mapped table, the csv writers only read them
+  Chord* chords = calloc(cv.count ? cv.count : 1, sizeof(Chord));
+  for (u64 i = 0; i < cv.count; i++) {
+    chords[i].points = (u32*)cv.points + cv.offsets[i];
+    chords[i].point_count = (int)(cv.offsets[i + 1] - cv.offsets[i]);
+  }
+  ChordStats* stats = vcb_to_chord_stats(stats_table);
+
+  bool ok = stats != nullptr;
+  snprintf(path, sizeof(path), "%s/superpixels.%d.%d.%d.csv", out_dir, cz, cy, cx);
+  ok = ok && superpixels_to_csv(path, superpixels, (int)sp.count) == 0;
+  snprintf(path, sizeof(path), "%s/chords.%d.%d.%d.csv", out_dir, cz, cy, cx);
+  ok = ok && chords_to_csv(path, chords, (int)cv.count) == 0;
+  snprintf(path, sizeof(path), "%s/chords.stats.%d.%d.%d.csv", out_dir, cz, cy, cx);
+  if (ok) write_chord_stats_csv(path, stats, (int)stats_table->header->rows);
+  snprintf(path, sizeof(path), "%s/chords.only.%d.%d.%d.csv", out_dir, cz, cy, cx);
+  ok = ok && chords_with_data_to_csv(path, chords, (int)cv.count, superpixels) == 0;
+  if (!ok) fprintf(stderr, "failed to export chunk %d %d %d\n", cz, cy, cx);
+
+  free(stats);
+  free(chords);
+  free(superpixels);
+  return ok;
+}
+
+static bool export_dir_chunk(const char* in_dir, const char* out_dir, int cz, int cy, int cx) {
+  char path[1024];
+  VcbTable tables[3] = {};
+  const char* names[3] = {"superpixels", "chords", "chords.stats"};
+  bool ok = true;
+  for (int i = 0; i < 3 && ok; i++) {
+    snprintf(path, sizeof(path), "%s/%s.%d.%d.%d.vcb", in_dir, names[i], cz, cy, cx);
+    ok = vcb_open(path, &tables[i]);
+    if (!ok) fprintf(stderr, "can't read %s\n", path);
+  }
+  ok = ok && export_tables(out_dir, cz, cy, cx, &tables[0], &tables[1], &tables[2]);
+  for (int i = 0; i < 3; i++) vcb_close(&tables[i]);
+  return ok;
+}
+
+static int export_dir(const char* in_dir, const char* out_dir) {
+  DIR* dir = opendir(in_dir);
+  if (!dir) {
+    fprintf(stderr, "can't open %s\n", in_dir);
+    return 1;
+  }
+  int exported = 0, failed = 0;
+  struct dirent* ent;
+  while ((ent = readdir(dir))) {
+    int cz, cy, cx, end = 0;
+    if (sscanf(ent->d_name, "superpixels.%d.%d.%d.vcb%n", &cz, &cy, &cx, &end) != 3 || ent->d_name[end] != '\0') {
+      continue;
+    }
+    if (export_dir_chunk(in_dir, out_dir, cz, cy, cx)) exported++;
+    else failed++;
+  }
+  closedir(dir);
+  printf("exported %d chunks, %d failed\n", exported, failed);
+  return failed ? 1 : 0;
+}
+
+static int export_pack(const char* pack_path, const char* out_dir) {
+  PackReader* pack = pack_open(pack_path);
+  if (!pack) {
+    fprintf(stderr, "can't open %s\n", pack_path);
+    return 1;
+  }
+  int exported = 0, failed = 0;
+  // one superpixels record per chunk
+  for (s64 i = 0; i < pack->count; i++) {
+    const PackEntry* e = &pack->index[i];
+    if (e->kind != VCB_SUPERPIXELS) continue;
+    VcbTable tables[3] = {};
+    bool found = true;
+    for (int k = 0; k < 3; k++) {
+      found &= pack_find(pack, e->chunk[0], e->chunk[1], e->chunk[2], (VcbKind)(VCB_SUPERPIXELS + k), &tables[k]);
+    }
+    if (found && export_tables(out_dir, e->chunk[0], e->chunk[1], e->chunk[2], &tables[0], &tables[1], &tables[2])) {
+      exported++;
+    } else {
+      if (!found) fprintf(stderr, "chunk %d %d %d is incomplete\n", e->chunk[0], e->chunk[1], e->chunk[2]);
+      failed++;
+    }
+    for (int k = 0; k < 3; k++) vcb_close(&tables[k]);
+  }
+  pack_reader_close(pack);
+  printf("exported %d chunks, %d failed\n", exported, failed);
+  return failed ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+  if (argc != 3) print_usage(argv[0]);
+  struct stat st;
+  if (stat(argv[1], &st) != 0) {
+    fprintf(stderr, "can't open %s\n", argv[1]);
+    return 1;
+  }
+  return S_ISDIR(st.st_mode) ? export_dir(argv[1], argv[2]) : export_pack(argv[1], argv[2]);
+}
@@ -0,0 +1,283 @@
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "../volcano.h"
+
+#define VESUVIUS_IMPL
+#include "vesuvius-c.h"
+
+#include "../cache.h"
+#include "../zarr3.h"
+
+// Convert a zarr v2 array of 3d chunks into a sharded zarr v3 array that zarr3_open can read.
+// The output is always zyx, so a chunk stored in another axis order (the z.x.y fiber chunks) is
+// transposed once here instead of on every read. Inner chunks keep the v2 chunk shape and compressor,
+// chunks that are all zero aren't written, same as zarr does for fill value chunks. They are blosc2
+// chunks, so the inner codec is named ZARR3_BLOSC2_CODEC, not the blosc1 format's "blosc"
+
+static void print_usage(const char* program_name) {
+  fprintf(stderr, "Usage: %s v2_array storage_order separator v3_array [chunks_per_shard] [threads]\n", program_name);
+  fprintf(stderr, "  storage_order     axis order of the v2 chunks, e.g. zyx or zxy\n");
+  fprintf(stderr, "  separator         v2 dimension separator, / or .\n");
+  fprintf(stderr, "  chunks_per_shard  inner chunks along each axis of a shard, default 8\n");
+  fprintf(stderr, "  threads           default 8\n");
+  exit(1);
+}
+
+typedef struct ConvertArgs {
+  ZarrChunkSource* src;
+  vs_dtype dtype;          // of src, checked by main
+  const char* out_root;
+  s32 chunk_shape[3];
+  s32 chunk_grid[3];
+  s32 shard_grid[3];
+  s32 chunks_per_shard;
+  int worker_num;
+  int num_workers;
+  s64 chunks_written;
+  s64 bytes_written;
+  bool failed;
+} ConvertArgs;
+
+static int blosc_compcode(const char* cname) {
+  if (strcmp(cname, "zstd") == 0) return BLOSC_ZSTD;
+  if (strcmp(cname, "lz4") == 0) return BLOSC_LZ4;
+  return BLOSC_BLOSCLZ;
+}
+
+static bool all_zero(const tchunk* c) {
+  const u8* p = c->data;
+  s64 size = tchunk_len(c) * vs_dtype_size(c->dtype);
+  for (s64 i = 0; i < size; i++) {
+    if (p[i]) return false;
+  }
+  return true;
+}
+
+static bool write_all(int fd, const void* buf, s64 size) {
+  const u8* p = buf;
+  while (size > 0) {
+    ssize_t n = write(fd, p, size);
+    if (n <= 0) return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+static bool convert_shard(ConvertArgs* args, blosc2_context* cctx, u8* compressed, s64 compressed_cap,
+                          s32 sz, s32 sy, s32 sx) {
+  s32 n = args->chunks_per_shard;
+  s64 num_inner = (s64)n * n * n;
+  u64* index = malloc(num_inner * 2 * sizeof(u64));
+  for (s64 i = 0; i < num_inner * 2; i++) index[i] = ZARR3_EMPTY_CHUNK;
+
+  char path[1200];
+  snprintf(path, sizeof(path), "%s/c/%d/%d/%d", args->out_root, sz, sy, sx);
+  int fd = -1;
+  u64 offset = 0;
+  bool ok = true;
+
+  for (s32 iz = 0, inner = 0; iz < n; iz++) {
+    for (s32 iy = 0; iy < n; iy++) {
+      for (s32 ix = 0; ix < n; ix++, inner++) {
+        s32 cz = sz * n + iz, cy = sy * n + iy, cx = sx * n + ix;
+        if (!ok || cz >= args->chunk_grid[0] || cy >= args->chunk_grid[1] || cx >= args->chunk_grid[2]) continue;
+        tchunk* c = zarr_chunk_source_load(args->src, cz, cy, cx);
+        if (!c || all_zero(c)) {
+          tchunk_free(c);
+          continue;
+        }
+
+        s64 raw_size = tchunk_len(c) * vs_dtype_size(c->dtype);
+        int size = blosc2_compress_ctx(cctx, c->data, (s32)raw_size, compressed, (s32)compressed_cap);
+        tchunk_free(c);
+        if (size <= 0) {
+          printf("compressing chunk %d %d %d failed: %d\n", cz, cy, cx, size);
+          ok = false;
+          continue;
+        }
+
+        // only create the shard once it has something in it
+        if (fd < 0) {
+          char dir[1200];
+          snprintf(dir, sizeof(dir), "%s/c/%d", args->out_root, sz);
+          mkdir(dir, 0755);
+          snprintf(dir, sizeof(dir), "%s/c/%d/%d", args->out_root, sz, sy);
+          mkdir(dir, 0755);
+          fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+          if (fd < 0) {
+            printf("could not create %s\n", path);
+            ok = false;
+            continue;
+          }
+        }
+        ok = write_all(fd, compressed, size);
+        index[inner * 2] = offset;
+        index[inner * 2 + 1] = (u64)size;
+        offset += size;
+        args->chunks_written++;
+        args->bytes_written += size;
+      }
+    }
+  }
+
+  if (fd >= 0) {
+    ok = ok && write_all(fd, index, num_inner * 2 * sizeof(u64));
+    close(fd);
+  }
+  free(index);
+  return ok;
+}
+
+static void* convert_thread(void* arg) {
+  ConvertArgs* args = arg;
+  zarr_compressor_settings comp = args->src->metadata.compressor;
+  vs_dtype dtype = args->dtype;
+
+  blosc2_cparams cparams = BLOSC2_CPARAMS_DEFAULTS;
+  cparams.compcode = blosc_compcode(comp.cname);
+  cparams.clevel = comp.clevel;
+  cparams.typesize = vs_dtype_size(dtype);
+  cparams.nthreads = 1;
+  cparams.blocksize = comp.blocksize;
+  cparams.filters[BLOSC2_MAX_FILTERS - 1] = comp.shuffle;
+  blosc2_context* cctx = blosc2_create_cctx(cparams);
+
+  s64 compressed_cap = (s64)args->chunk_shape[0] * args->chunk_shape[1] * args->chunk_shape[2] * vs_dtype_size(dtype) + BLOSC2_MAX_OVERHEAD;
+  u8* compressed = malloc(compressed_cap);
+
+  s64 num_shards = (s64)args->shard_grid[0] * args->shard_grid[1] * args->shard_grid[2];
+  for (s64 i = args->worker_num; i < num_shards && !args->failed; i += args->num_workers) {
+    s32 sz = i / ((s64)args->shard_grid[1] * args->shard_grid[2]);
+    s32 sy = (i / args->shard_grid[2]) % args->shard_grid[1];
+    s32 sx = i % args->shard_grid[2];
+    if (!convert_shard(args, cctx, compressed, compressed_cap, sz, sy, sx)) args->failed = true;
+  }
+
+  free(compressed);
+  blosc2_free_ctx(cctx);
+  return nullptr;
+}
+
+// v3 data_type of a voxel type
+static const char* zarr3_dtype_name(vs_dtype dtype) {
+  switch (dtype) {
+    case VS_U8: return "uint8";
+    case VS_U16: return "uint16";
+    case VS_F32: return "float32";
+  }
+  return nullptr;
+}
+
+static bool write_zarr_json(const char* out_root, const zarr_metadata* md, vs_dtype dtype,
+                            const s32 shape[3], const s32 chunk_shape[3], s32 chunks_per_shard) {
+  char path[1100];
+  snprintf(path, sizeof(path), "%s/zarr.json", out_root);
+  FILE* fp = fopen(path, "w");
+  if (!fp) return false;
+
+  const char* shuffle = md->compressor.shuffle == BLOSC_BITSHUFFLE ? "bitshuffle"
+                      : md->compressor.shuffle == BLOSC_SHUFFLE ? "shuffle" : "noshuffle";
+  fprintf(fp,
+          "{\n"
+          "  \"zarr_format\": 3,\n"
+          "  \"node_type\": \"array\",\n"
+          "  \"shape\": [%d, %d, %d],\n"
+          "  \"data_type\": \"%s\",\n"
+          "  \"chunk_grid\": {\"name\": \"regular\", \"configuration\": {\"chunk_shape\": [%d, %d, %d]}},\n"
+          "  \"chunk_key_encoding\": {\"name\": \"default\", \"configuration\": {\"separator\": \"/\"}},\n"
+          "  \"fill_value\": 0,\n"
+          "  \"codecs\": [{\n"
+          "    \"name\": \"sharding_indexed\",\n"
+          "    \"configuration\": {\n"
+          "      \"chunk_shape\": [%d, %d, %d],\n"
+          "      \"codecs\": [\n"
+          "        {\"name\": \"bytes\", \"configuration\": {\"endian\": \"little\"}},\n"
+          "        {\"name\": \"" ZARR3_BLOSC2_CODEC "\", \"configuration\": {\"cname\": \"%s\", \"clevel\": %d, \"shuffle\": \"%s\", \"typesize\": %d, \"blocksize\": %d}}\n"
+          "      ],\n"
+          "      \"index_codecs\": [{\"name\": \"bytes\", \"configuration\": {\"endian\": \"little\"}}],\n"
+          "      \"index_location\": \"end\"\n"
+          "    }\n"
+          "  }],\n"
+          "  \"dimension_names\": [\"z\", \"y\", \"x\"]\n"
+          "}\n",
+          shape[0], shape[1], shape[2], zarr3_dtype_name(dtype),
+          chunk_shape[0] * chunks_per_shard, chunk_shape[1] * chunks_per_shard, chunk_shape[2] * chunks_per_shard,
+          chunk_shape[0], chunk_shape[1], chunk_shape[2],
+          md->compressor.cname, md->compressor.clevel, shuffle, vs_dtype_size(dtype), md->compressor.blocksize);
+  fclose(fp);
+  return true;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 5) print_usage(argv[0]);
+  const char* in_root = argv[1];
+  const char* storage_order = argv[2];
+  const char* out_root = argv[4];
+  s32 chunks_per_shard = argc > 5 ? atoi(argv[5]) : 8;
+  int num_threads = argc > 6 ? atoi(argv[6]) : 8;
+  if (strlen(storage_order) != 3 || chunks_per_shard <= 0 || num_threads <= 0) print_usage(argv[0]);
+
+  char path[1100];
+  snprintf(path, sizeof(path), "%s/.zarray", in_root);
+  ZarrChunkSource src = {.root = in_root, .storage_order = storage_order, .separator = argv[3][0]};
+  src.metadata = vs_zarr_parse_zarray(path);
+
+  vs_dtype dtype;
+  if (!vs_dtype_from_zarr(src.metadata.dtype, &dtype)) {
+    printf("unsupported dtype %s\n", src.metadata.dtype);
+    return 1;
+  }
+
+  // .zarray shapes are in storage order
+  s32 shape[3], chunk_shape[3], chunk_grid[3], shard_grid[3];
+  for (int i = 0; i < 3; i++) {
+    int axis = storage_order[i] == 'z' ? 0 : storage_order[i] == 'y' ? 1 : 2;
+    shape[axis] = src.metadata.shape[i];
+    chunk_shape[axis] = src.metadata.chunks[i];
+  }
+  for (int i = 0; i < 3; i++) {
+    chunk_grid[i] = (shape[i] + chunk_shape[i] - 1) / chunk_shape[i];
+    shard_grid[i] = (chunk_grid[i] + chunks_per_shard - 1) / chunks_per_shard;
+  }
+
+  snprintf(path, sizeof(path), "%s/c", out_root);
+  if ((mkdir(out_root, 0755) != 0 && errno != EEXIST) || (mkdir(path, 0755) != 0 && errno != EEXIST) ||
+      !write_zarr_json(out_root, &src.metadata, dtype, shape, chunk_shape, chunks_per_shard)) {
+    printf("could not create %s\n", out_root);
+    return 1;
+  }
+
+  blosc2_init();
+  pthread_t threads[num_threads];
+  ConvertArgs args[num_threads];
+  for (int i = 0; i < num_threads; i++) {
+    args[i] = (ConvertArgs){
+      .src = &src,
+      .dtype = dtype,
+      .out_root = out_root,
+      .chunk_shape = {chunk_shape[0], chunk_shape[1], chunk_shape[2]},
+      .chunk_grid = {chunk_grid[0], chunk_grid[1], chunk_grid[2]},
+      .shard_grid = {shard_grid[0], shard_grid[1], shard_grid[2]},
+      .chunks_per_shard = chunks_per_shard,
+      .worker_num = i,
+      .num_workers = num_threads,
+    };
+    pthread_create(&threads[i], nullptr, convert_thread, &args[i]);
+  }
+
+  s64 chunks_written = 0, bytes_written = 0;
+  bool failed = false;
+  for (int i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], nullptr);
+    chunks_written += args[i].chunks_written;
+    bytes_written += args[i].bytes_written;
+    failed |= args[i].failed;
+  }
+  printf("wrote %lld chunks, %.2f GB into %d shards of %d^3 chunks\n", chunks_written,
+         (f64)bytes_written / (1024.0 * 1024.0 * 1024.0), shard_grid[0] * shard_grid[1] * shard_grid[2], chunks_per_shard);
+  blosc2_destroy();
+  return failed ? 1 : 0;
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "vesuvius-c.h"
+#include "chunk.h"
 
 typedef struct queue_node {
     int z, y, x;
@@ -127,4 +128,86 @@ static inline chunk* vs_chunk_label_components(chunk* input) {
 
     free_queue(q);
     return output;
-}
\ No newline at end of file
+}
+
+// Typed version of vs_chunk_label_components. Labels are returned as a u16 chunk rather than f32,
+// a 128^3 chunk of fiber mask has nowhere near 65535 sections. One that does anyway returns NULL
+// rather than wrapping labels into sections they don't belong to
+static inline tchunk* vs_tchunk_label_components(const tchunk* input) {
+    if (!input) return NULL;
+
+    tchunk* output = tchunk_new(VS_U16, input->dims);
+    if (!output) return NULL;
+
+    const s32 depth = input->dims[0];
+    const s32 height = input->dims[1];
+    const s32 width = input->dims[2];
+    const s64 len = tchunk_len(input);
+
+    // nonzero voxels, with one loop per dtype, so the fill only reads bytes
+    u8* fg = malloc(len);
+    if (!fg) {
+        tchunk_free(output);
+        return NULL;
+    }
+    switch (input->dtype) {
+        case VS_U8: for (s64 i = 0; i < len; i++) fg[i] = input->d8[i] != 0; break;
+        case VS_U16: for (s64 i = 0; i < len; i++) fg[i] = input->d16[i] != 0; break;
+        case VS_F32: for (s64 i = 0; i < len; i++) fg[i] = input->d32[i] != 0.0f; break;
+    }
+
+    queue* q = create_queue();
+    int current_label = 1;
+
+    for (int z = 0; z < depth; z++) {
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                s64 i = ((s64)z * height + y) * width + x;
+                if (output->d16[i] != 0 || !fg[i]) {
+                    continue;
+                }
+
+                if (current_label > UINT16_MAX) {
+                    printf("more than %d fiber sections in one chunk, not labeling it\n", UINT16_MAX);
+                    free_queue(q);
+                    free(fg);
+                    tchunk_free(output);
+                    return NULL;
+                }
+                output->d16[i] = (u16)current_label;
+                enqueue(q, z, y, x);
+
+                int curr_z, curr_y, curr_x;
+                while (dequeue(q, &curr_z, &curr_y, &curr_x)) {
+                    const int offsets[6][3] = {
+                        {-1, 0, 0}, {1, 0, 0},
+                        {0, -1, 0}, {0, 1, 0},
+                        {0, 0, -1}, {0, 0, 1}
+                    };
+
+                    for (int n = 0; n < 6; n++) {
+                        int nz = curr_z + offsets[n][0];
+                        int ny = curr_y + offsets[n][1];
+                        int nx = curr_x + offsets[n][2];
+
+                        if (nz < 0 || nz >= depth || ny < 0 || ny >= height || nx < 0 || nx >= width) {
+                            continue;
+                        }
+
+                        s64 ni = ((s64)nz * height + ny) * width + nx;
+                        if (fg[ni] && output->d16[ni] == 0) {
+                            output->d16[ni] = (u16)current_label;
+                            enqueue(q, nz, ny, nx);
+                        }
+                    }
+                }
+
+                current_label++;
+            }
+        }
+    }
+
+    free_queue(q);
+    free(fg);
+    return output;
+}
@@ -0,0 +1,229 @@
+#pragma once
+
+#include <pthread.h>
+
+#include "volcano.h"
+#include "chunk.h"
+#include "chord.h"
+#include "traversal.h"
+
+// Frontier driven traversal: instead of sweeping every candidate chunk, start from seed chunks and
+// only go on to a face neighbor when the chunk just processed has foreground or chords on that face,
+// so a partial run touches the chunks connected to the sheets it started on and nothing else.
+// Workers pop chunks from a shared queue, ordered along the hilbert curve so concurrent workers stay
+// close together in the caches, and report each chunk's faces when they're done with it. A chunk is
+// queued at most once, and the run is over when the queue is empty and no worker holds a chunk.
+
+#define FRONTIER_CANDIDATE 1
+#define FRONTIER_QUEUED 2
+
+// face bits: -z, +z, -y, +y, -x, +x
+#define FRONTIER_ALL_FACES 0x3f
+
+typedef struct FrontierItem {
+  u64 key;
+  ChunkCoord coord;
+} FrontierItem;
+
+typedef struct Frontier {
+  s32 grid[3];
+  int bits;              // for hilbert3
+  u8* state;             // FRONTIER_* per chunk, zyx
+
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  FrontierItem* heap;    // queued chunks, smallest key on top
+  s64 count;
+  s64 cap;
+  s64 in_flight;         // popped and not finished yet
+
+  s64 candidates;
+  s64 seeded;
+  s64 queued;
+  s64 max_queued;
+} Frontier;
+
+// Over a grid of chunks, going only where candidates has chunks, or anywhere for nullptr
+static Frontier* frontier_new(const s32 grid[3], const Traversal* candidates) {
+  Frontier* f = calloc(1, sizeof(Frontier));
+  memcpy(f->grid, grid, sizeof(f->grid));
+  s32 maxdim = grid[0] > grid[1] ? grid[0] : grid[1];
+  maxdim = maxdim > grid[2] ? maxdim : grid[2];
+  f->bits = 1;
+  while ((1 << f->bits) < maxdim) f->bits++;
+
+  s64 total = (s64)grid[0] * grid[1] * grid[2];
+  f->state = calloc(total, 1);
+  if (candidates) {
+    for (s64 i = 0; i < candidates->count; i++) {
+      const ChunkCoord* c = &candidates->chunks[i];
+      f->state[((s64)c->z * grid[1] + c->y) * grid[2] + c->x] = FRONTIER_CANDIDATE;
+    }
+    f->candidates = candidates->count;
+  } else {
+    memset(f->state, FRONTIER_CANDIDATE, total);
+    f->candidates = total;
+  }
+  f->cap = 1024;
+  f->heap = malloc(f->cap * sizeof(FrontierItem));
+  pthread_mutex_init(&f->lock, nullptr);
+  pthread_cond_init(&f->ready, nullptr);
+  return f;
+}
+
+static void frontier_free(Frontier* f) {
+  if (!f) return;
+  pthread_mutex_destroy(&f->lock);
+  pthread_cond_destroy(&f->ready);
+  free(f->heap);
+  free(f->state);
+  free(f);
+}
+
+static inline u8* frontier_state(Frontier* f, s32 cz, s32 cy, s32 cx) {
+  return &f->state[((s64)cz * f->grid[1] + cy) * f->grid[2] + cx];
+}
+
+// Queue a candidate chunk that hasn't been queued before. Call with the lock held
+static bool frontier_push_locked(Frontier* f, s32 cz, s32 cy, s32 cx) {
+  if (cz < 0 || cy < 0 || cx < 0 || cz >= f->grid[0] || cy >= f->grid[1] || cx >= f->grid[2]) return false;
+  u8* state = frontier_state(f, cz, cy, cx);
+  if (*state != FRONTIER_CANDIDATE) return false;
+  *state |= FRONTIER_QUEUED;
+
+  if (f->count == f->cap) {
+    f->cap *= 2;
+    f->heap = realloc(f->heap, f->cap * sizeof(FrontierItem));
+  }
+  FrontierItem item = {.key = hilbert3(cz, cy, cx, f->bits), .coord = {cz, cy, cx}};
+  s64 i = f->count++;
+  while (i > 0 && f->heap[(i - 1) / 2].key > item.key) {
+    f->heap[i] = f->heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  f->heap[i] = item;
+  f->queued++;
+  if (f->count > f->max_queued) f->max_queued = f->count;
+  return true;
+}
+
+static bool frontier_seed(Frontier* f, s32 cz, s32 cy, s32 cx) {
+  pthread_mutex_lock(&f->lock);
+  bool queued = frontier_push_locked(f, cz, cy, cx);
+  f->seeded += queued;
+  pthread_mutex_unlock(&f->lock);
+  if (queued) pthread_cond_signal(&f->ready);
+  return queued;
+}
+
+// Seeds from a text file of "cz cy cx" lines, -1 if it can't be opened
+static s64 frontier_seed_file(Frontier* f, const char* path) {
+  FILE* fp = fopen(path, "r");
+  if (!fp) return -1;
+  s64 n = 0;
+  s32 c[3];
+  while (fscanf(fp, "%d %d %d", &c[0], &c[1], &c[2]) == 3) n += frontier_seed(f, c[0], c[1], c[2]);
+  fclose(fp);
+  return n;
+}
+
+// Next chunk to process, waiting while other workers may still queue more. false once the frontier
+// is exhausted
+static bool frontier_pop(Frontier* f, ChunkCoord* out) {
+  pthread_mutex_lock(&f->lock);
+  while (f->count == 0 && f->in_flight > 0) pthread_cond_wait(&f->ready, &f->lock);
+  if (f->count == 0) {
+    pthread_mutex_unlock(&f->lock);
+    return false;
+  }
+  *out = f->heap[0].coord;
+  FrontierItem last = f->heap[--f->count];
+  s64 i = 0;
+  for (;;) {
+    s64 child = 2 * i + 1;
+    if (child >= f->count) break;
+    if (child + 1 < f->count && f->heap[child + 1].key < f->heap[child].key) child++;
+    if (f->heap[child].key >= last.key) break;
+    f->heap[i] = f->heap[child];
+    i = child;
+  }
+  f->heap[i] = last;
+  f->in_flight++;
+  pthread_mutex_unlock(&f->lock);
+  return true;
+}
+
+// Done with a popped chunk: queue the neighbors across the faces set in faces. The newly queued
+// chunks go to queued (room for 6), e.g. to prefetch them. Returns how many there are
+static int frontier_finish(Frontier* f, ChunkCoord c, u8 faces, s32 queued[6][3]) {
+  static const s32 offsets[6][3] = {{-1, 0, 0}, {1, 0, 0}, {0, -1, 0}, {0, 1, 0}, {0, 0, -1}, {0, 0, 1}};
+  int n = 0;
+  pthread_mutex_lock(&f->lock);
+  for (int face = 0; face < 6; face++) {
+    if (!(faces & (1 << face))) continue;
+    s32 z = c.z + offsets[face][0], y = c.y + offsets[face][1], x = c.x + offsets[face][2];
+    if (frontier_push_locked(f, z, y, x)) {
+      queued[n][0] = z;
+      queued[n][1] = y;
+      queued[n][2] = x;
+      n++;
+    }
+  }
+  f->in_flight--;
+  bool exhausted = f->count == 0 && f->in_flight == 0;
+  pthread_mutex_unlock(&f->lock);
+  // waiters have to see the end too, not just new work
+  if (exhausted || n > 1) {
+    pthread_cond_broadcast(&f->ready);
+  } else if (n == 1) {
+    pthread_cond_signal(&f->ready);
+  }
+  return n;
+}
+
+// Whether a chunk was ever queued. Only meaningful once the workers are done
+static bool frontier_visited(const Frontier* f, s32 cz, s32 cy, s32 cx) {
+  return f->state[((s64)cz * f->grid[1] + cy) * f->grid[2] + cx] & FRONTIER_QUEUED;
+}
+
+// Faces of a cleaned chunk with any foreground on them
+static u8 frontier_faces_from_chunk(const tchunk* c) {
+  const s32* d = c->dims;
+  u8 faces = 0;
+  for (int axis = 0; axis < 3; axis++) {
+    int a = (axis + 1) % 3, b = (axis + 2) % 3;
+    for (int side = 0; side < 2; side++) {
+      s32 p[3];
+      p[axis] = side ? d[axis] - 1 : 0;
+      bool hit = false;
+      for (p[a] = 0; p[a] < d[a] && !hit; p[a]++) {
+        for (p[b] = 0; p[b] < d[b]; p[b]++) {
+          if (vs_voxel(c->data, c->dtype, ((s64)p[0] * d[1] + p[1]) * d[2] + p[2]) != 0.0f) {
+            hit = true;
+            break;
+          }
+        }
+      }
+      if (hit) faces |= 1 << (2 * axis + side);
+    }
+  }
+  return faces;
+}
+
+// Faces that some chord's bounding box comes within reach of, in chunk local coordinates
+static u8 frontier_faces_from_chords(const ChordStats* stats, int num_chords, const s32 dims[3], f32 reach) {
+  u8 faces = 0;
+  for (int i = 0; i < num_chords && faces != FRONTIER_ALL_FACES; i++) {
+    for (int d = 0; d < 3; d++) {
+      if (stats[i].bbox[d][0] < reach) faces |= 1 << (2 * d);
+      if (stats[i].bbox[d][1] > (f32)dims[d] - 1.0f - reach) faces |= 1 << (2 * d + 1);
+    }
+  }
+  return faces;
+}
+
+static void frontier_print_stats(const Frontier* f) {
+  printf("frontier: %lld seeds, %lld of %lld candidate chunks visited, %.1f%% avoided, at most %lld queued\n",
+         f->seeded, f->queued, f->candidates,
+         f->candidates ? 100.0 * (f64)(f->candidates - f->queued) / (f64)f->candidates : 0.0, f->max_queued);
+}
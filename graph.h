@@ -0,0 +1,662 @@
+#pragma once
+
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "volcano.h"
+#include "output.h"
+#include "pack.h"
+#include "traversal.h"
+
+// Scroll-wide superpixel graph, built from a run's pack. calculate_superpixel_connections only sees
+// one chunk, so its graph stops at the chunk faces. The workers also pack the labels on each chunk's
+// faces (VCB_FACE_LABELS), and here two chunks sharing a face are joined by the superpixels touching
+// across it: each pair of face voxels in each other's 3x3 neighborhood adds 1 to the pair's edge, the
+// same 26-neighborhood calculate_superpixel_connections counts in (there the count is weighted by
+// intensity similarity, which the faces don't have).
+//
+// Nodes have global ids, the same ones the label volume (labels.h) stores: the chunk's index in the
+// grid shifted by label_bits, or'ed with the superpixel's row + 1. The graph is CSR, sharded by blocks
+// of GRAPH_SHARD_CHUNKS^3 chunks, one file per shard plus a small header file:
+//
+//   dir/graph      GraphManifest
+//   dir/z.y.x.gsh  GraphShardHeader | u32 directory[] | per chunk: u64 offsets[] GraphEdge[] | GraphShardChunk[]
+//
+// Every file is mapped. A GraphReader keeps at most max_open shards mapped and maps the one a query
+// lands in on demand, so walking the graph touches the shards under the walk, not the scroll.
+
+#define GRAPH_MAGIC "VOLCGRF"
+#define GRAPH_SHARD_MAGIC "VOLCGRS"
+#define GRAPH_VERSION 1
+#define GRAPH_SHARD_CHUNKS 8
+#define GRAPH_SHARD_CELLS (GRAPH_SHARD_CHUNKS * GRAPH_SHARD_CHUNKS * GRAPH_SHARD_CHUNKS)
+#define GRAPH_NO_CHUNK UINT32_MAX
+#define GRAPH_DATA_OFFSET VCB_ALIGN
+
+typedef struct GraphManifest {
+  char magic[8];
+  u32 version;
+  u32 label_bits;
+  s32 grid[3];
+  s32 shard_chunks;
+  u64 num_shards;
+  u64 num_chunks;
+  u64 num_nodes;
+  u64 num_edges;
+  u64 num_face_edges;
+} GraphManifest;
+
+typedef struct GraphShardHeader {
+  char magic[8];
+  u32 version;
+  u32 num_chunks;
+  s32 shard[3];
+  s32 shard_chunks;
+  u64 num_nodes;
+  u64 num_edges;
+  u64 chunks_offset;
+  u64 total_bytes;
+} GraphShardHeader;
+
+typedef struct GraphShardChunk {
+  s32 chunk[3];
+  u32 num_nodes;
+  u64 offsets_offset;   // num_nodes + 1 u64s, node row's edges are [offsets[row], offsets[row + 1])
+  u64 edges_offset;
+  u64 num_edges;
+} GraphShardChunk;
+
+typedef struct GraphEdge {
+  u64 node;
+  f32 weight;
+  u32 face;             // 0 inside the chunk, 1 + the face crossed (-z +z -y +y -x +x)
+} GraphEdge;
+
+static_assert(sizeof(GraphManifest) <= GRAPH_DATA_OFFSET, "the manifest fits in one block");
+static_assert(sizeof(GraphShardHeader) <= GRAPH_DATA_OFFSET, "the header fits in front of the directory");
+static_assert(sizeof(GraphShardChunk) == 40, "GraphShardChunk is part of the file format");
+static_assert(sizeof(GraphEdge) == 16, "GraphEdge is part of the file format");
+
+static inline u64 graph_node_id(const s32 grid[3], u32 label_bits, s32 cz, s32 cy, s32 cx, u32 row) {
+  return (((u64)cz * grid[1] + cy) * grid[2] + cx) << label_bits | ((u64)row + 1);
+}
+
+// The chunk and row of a node, false for 0 (background in the label volume)
+static inline bool graph_node_source(const s32 grid[3], u32 label_bits, u64 node, s32 chunk[3], u32* row) {
+  if (node == 0) return false;
+  u64 index = node >> label_bits;
+  *row = (u32)(node & (((u64)1 << label_bits) - 1)) - 1;
+  chunk[2] = (s32)(index % grid[2]);
+  chunk[1] = (s32)(index / grid[2] % grid[1]);
+  chunk[0] = (s32)(index / grid[2] / grid[1]);
+  return true;
+}
+
+static void graph_shard_path(const char* dir, const s32 shard[3], char* path, s64 size) {
+  snprintf(path, size, "%s/%d.%d.%d.gsh", dir, shard[0], shard[1], shard[2]);
+}
+
+static bool graph_write_at(FILE* fp, const void* data, s64 size, s64* offset) {
+  static const u8 zeros[VCB_ALIGN] = {};
+  s64 pad = vcb_align(*offset) - *offset;
+  if (pad && fwrite(zeros, 1, pad, fp) != (size_t)pad) return false;
+  *offset += pad;
+  if (size && fwrite(data, 1, size, fp) != (size_t)size) return false;
+  *offset += size;
+  return true;
+}
+
+// Face contacts of one chunk, (own row, neighbor row) -> weight, open addressing
+typedef struct GraphContacts {
+  u64* keys;            // own row << 32 | neighbor row, UINT64_MAX for empty
+  f32* weights;
+  s64 count;
+  s64 cap;              // power of two
+} GraphContacts;
+
+static void graph_contacts_clear(GraphContacts* c) {
+  if (!c->cap) {
+    c->cap = 1024;
+    c->keys = malloc(c->cap * sizeof(u64));
+    c->weights = malloc(c->cap * sizeof(f32));
+  }
+  memset(c->keys, 0xff, c->cap * sizeof(u64));
+  c->count = 0;
+}
+
+static void graph_contacts_add(GraphContacts* c, u64 key, f32 weight) {
+  if (2 * (c->count + 1) > c->cap) {
+    u64* keys = c->keys;
+    f32* weights = c->weights;
+    s64 cap = c->cap;
+    c->cap *= 2;
+    c->keys = malloc(c->cap * sizeof(u64));
+    c->weights = malloc(c->cap * sizeof(f32));
+    memset(c->keys, 0xff, c->cap * sizeof(u64));
+    c->count = 0;
+    for (s64 i = 0; i < cap; i++) {
+      if (keys[i] != UINT64_MAX) graph_contacts_add(c, keys[i], weights[i]);
+    }
+    free(keys);
+    free(weights);
+  }
+  s64 mask = c->cap - 1;
+  for (s64 i = (s64)((key * 0x9e3779b97f4a7c15ull) >> 20) & mask;; i = (i + 1) & mask) {
+    if (c->keys[i] == key) {
+      c->weights[i] += weight;
+      return;
+    }
+    if (c->keys[i] == UINT64_MAX) {
+      c->keys[i] = key;
+      c->weights[i] = weight;
+      c->count++;
+      return;
+    }
+  }
+}
+
+static void graph_contacts_free(GraphContacts* c) {
+  free(c->keys);
+  free(c->weights);
+  *c = (GraphContacts){};
+}
+
+typedef struct GraphContact {
+  u64 key;
+  f32 weight;
+  u32 face;
+} GraphContact;
+
+static int graph_contact_cmp(const void* a, const void* b) {
+  const GraphContact* l = a;
+  const GraphContact* r = b;
+  return l->key < r->key ? -1 : l->key > r->key;
+}
+
+typedef struct GraphBuild {
+  const PackReader* pack;
+  const char* dir;
+  s32 grid[3];
+  u32 label_bits;
+  ChunkCoord* chunks;   // chunks with an edges table, grouped by shard
+  s64 num_chunks;
+  s64* shard_starts;    // shard i is chunks[shard_starts[i], shard_starts[i + 1])
+  s64 num_shards;
+  s64 next_shard;
+  bool failed;
+
+  u64 num_nodes;
+  u64 num_edges;
+  u64 num_face_edges;
+  s64 missing_faces;    // neighbors with edges but no face labels
+} GraphBuild;
+
+static inline u64 graph_shard_key(const ChunkCoord* c) {
+  return (u64)(c->z / GRAPH_SHARD_CHUNKS) << 42 | (u64)(c->y / GRAPH_SHARD_CHUNKS) << 21 | (u64)(c->x / GRAPH_SHARD_CHUNKS);
+}
+
+static int graph_chunk_cmp(const void* a, const void* b) {
+  const ChunkCoord* l = a;
+  const ChunkCoord* r = b;
+  u64 kl = graph_shard_key(l), kr = graph_shard_key(r);
+  if (kl != kr) return kl < kr ? -1 : 1;
+  if (l->z != r->z) return l->z < r->z ? -1 : 1;
+  if (l->y != r->y) return l->y < r->y ? -1 : 1;
+  return l->x < r->x ? -1 : l->x > r->x;
+}
+
+// Contacts across face of the chunk at c, whose face labels are own, with the neighbor across it
+static void graph_face_contacts(GraphBuild* b, const ChunkCoord* c, const s32 dims[3], int face, const u32* own,
+                                GraphContacts* contacts) {
+  int axis = face / 2, side = face % 2;
+  s32 n[3] = {c->z, c->y, c->x};
+  n[axis] += side ? 1 : -1;
+  if (n[axis] < 0 || n[axis] >= b->grid[axis]) return;
+  VcbTable table = {};
+  if (!pack_find(b->pack, n[0], n[1], n[2], VCB_FACE_LABELS, &table)) return;
+  const u64* offsets;
+  const u32* labels = vcb_faces(&table, "offsets", "labels", &offsets);
+  const VcbHeader* h = table.header;
+  if (!labels || memcmp(h->dims, dims, sizeof(h->dims)) != 0) {
+    __atomic_fetch_add(&b->missing_faces, 1, __ATOMIC_RELAXED);
+    vcb_close(&table);
+    return;
+  }
+  // the neighbor's face on our side
+  const u32* other = labels + offsets[face ^ 1];
+  s32 nu = dims[axis == 0 ? 1 : 0], nv = dims[axis == 2 ? 1 : 2];
+  for (s32 u = 0; u < nu; u++) {
+    for (s32 v = 0; v < nv; v++) {
+      u32 a = own[(s64)u * nv + v];
+      if (a == UINT32_MAX) continue;
+      for (s32 uu = u - 1; uu <= u + 1; uu++) {
+        if (uu < 0 || uu >= nu) continue;
+        for (s32 vv = v - 1; vv <= v + 1; vv++) {
+          if (vv < 0 || vv >= nv) continue;
+          u32 o = other[(s64)uu * nv + vv];
+          if (o != UINT32_MAX) graph_contacts_add(contacts, (u64)a << 32 | o, 1.0f);
+        }
+      }
+    }
+  }
+  vcb_close(&table);
+}
+
+// One chunk's CSR: the edges table's edges, then the face contacts sorted by row
+static bool graph_build_chunk(GraphBuild* b, const ChunkCoord* c, FILE* fp, s64* offset, GraphShardChunk* out,
+                              GraphContacts* contacts) {
+  VcbTable edges_table = {}, faces_table = {};
+  if (!pack_find(b->pack, c->z, c->y, c->x, VCB_SUPERPIXEL_EDGES, &edges_table)) return false;
+  const VcbHeader* h = edges_table.header;
+  u64 num_neighbor, num_strength;
+  const u32* neighbor = vcb_column(&edges_table, "neighbor", VCB_U32, &num_neighbor);
+  const f32* strength = vcb_column(&edges_table, "strength", VCB_F32, &num_strength);
+  // every row's edges have to be inside both columns, the pack may be a crashed run's
+  const u64* offsets = neighbor && strength && num_neighbor == num_strength && h->rows < UINT32_MAX
+                       ? vcb_offsets(&edges_table, "offsets", h->rows, num_neighbor) : nullptr;
+  if (!offsets) {
+    vcb_close(&edges_table);
+    return false;
+  }
+  u32 num_nodes = (u32)h->rows;
+
+  // contacts per face, tagged with the face so the edges can say which one they cross
+  GraphContact* cross = nullptr;
+  s64 num_cross = 0;
+  if (pack_find(b->pack, c->z, c->y, c->x, VCB_FACE_LABELS, &faces_table)) {
+    const u64* face_offsets;
+    const u32* labels = vcb_faces(&faces_table, "offsets", "labels", &face_offsets);
+    // the faces are indexed with the edges table's dims
+    if (labels && memcmp(faces_table.header->dims, h->dims, sizeof(h->dims)) != 0) labels = nullptr;
+    if (!labels) __atomic_fetch_add(&b->missing_faces, 1, __ATOMIC_RELAXED);
+    s64 cap = 0;
+    for (int face = 0; face < 6 && labels; face++) {
+      graph_contacts_clear(contacts);
+      graph_face_contacts(b, c, h->dims, face, labels + face_offsets[face], contacts);
+      if (num_cross + contacts->count > cap) {
+        cap = (num_cross + contacts->count) * 2;
+        cross = realloc(cross, cap * sizeof(GraphContact));
+      }
+      for (s64 i = 0; i < contacts->cap; i++) {
+        if (contacts->keys[i] == UINT64_MAX) continue;
+        cross[num_cross++] = (GraphContact){contacts->keys[i], contacts->weights[i], (u32)face + 1};
+      }
+    }
+    vcb_close(&faces_table);
+    if (num_cross) qsort(cross, num_cross, sizeof(GraphContact), graph_contact_cmp);
+  } else {
+    __atomic_fetch_add(&b->missing_faces, 1, __ATOMIC_RELAXED);
+  }
+
+  u64 num_edges = offsets[num_nodes] + num_cross;
+  u64* csr = malloc((num_nodes + 1) * sizeof(u64));
+  GraphEdge* edges = malloc((num_edges ? num_edges : 1) * sizeof(GraphEdge));
+  u64 k = 0;
+  s64 j = 0;
+  for (u32 row = 0; row < num_nodes; row++) {
+    csr[row] = k;
+    for (u64 e = offsets[row]; e < offsets[row + 1]; e++) {
+      edges[k++] = (GraphEdge){graph_node_id(b->grid, b->label_bits, c->z, c->y, c->x, neighbor[e]), strength[e], 0};
+    }
+    for (; j < num_cross && cross[j].key >> 32 == row; j++) {
+      s32 n[3] = {c->z, c->y, c->x};
+      int face = (int)cross[j].face - 1;
+      n[face / 2] += face % 2 ? 1 : -1;
+      edges[k++] = (GraphEdge){graph_node_id(b->grid, b->label_bits, n[0], n[1], n[2], (u32)cross[j].key),
+                               cross[j].weight, cross[j].face};
+    }
+  }
+  csr[num_nodes] = k;
+  vcb_close(&edges_table);
+
+  *out = (GraphShardChunk){.chunk = {c->z, c->y, c->x}, .num_nodes = num_nodes, .num_edges = k};
+  bool ok = graph_write_at(fp, nullptr, 0, offset);
+  out->offsets_offset = *offset;
+  ok = ok && graph_write_at(fp, csr, (num_nodes + 1) * sizeof(u64), offset);
+  ok = ok && graph_write_at(fp, nullptr, 0, offset);
+  out->edges_offset = *offset;
+  ok = ok && graph_write_at(fp, edges, k * sizeof(GraphEdge), offset);
+  free(csr);
+  free(edges);
+  free(cross);
+
+  __atomic_fetch_add(&b->num_nodes, num_nodes, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&b->num_edges, k, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&b->num_face_edges, num_cross, __ATOMIC_RELAXED);
+  return ok;
+}
+
+static bool graph_build_shard(GraphBuild* b, s64 shard_index, GraphContacts* contacts) {
+  const ChunkCoord* first = &b->chunks[b->shard_starts[shard_index]];
+  s64 count = b->shard_starts[shard_index + 1] - b->shard_starts[shard_index];
+  GraphShardHeader header = {
+    .magic = GRAPH_SHARD_MAGIC, .version = GRAPH_VERSION, .shard_chunks = GRAPH_SHARD_CHUNKS,
+    .shard = {first->z / GRAPH_SHARD_CHUNKS, first->y / GRAPH_SHARD_CHUNKS, first->x / GRAPH_SHARD_CHUNKS}};
+  char path[1100], tmp[1110];
+  graph_shard_path(b->dir, header.shard, path, sizeof(path));
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  FILE* fp = fopen(tmp, "wb");
+  if (!fp) return false;
+
+  u32 directory[GRAPH_SHARD_CELLS];
+  for (s64 i = 0; i < GRAPH_SHARD_CELLS; i++) directory[i] = GRAPH_NO_CHUNK;
+  // the directory is rewritten with the header at the end
+  s64 offset = 0;
+  static const u8 zeros[GRAPH_DATA_OFFSET + sizeof(directory)] = {};
+  bool ok = graph_write_at(fp, zeros, sizeof(zeros), &offset);
+
+  GraphShardChunk* chunks = malloc(count * sizeof(GraphShardChunk));
+  for (s64 i = 0; ok && i < count; i++) {
+    const ChunkCoord* c = &first[i];
+    GraphShardChunk* out = &chunks[header.num_chunks];
+    if (!graph_build_chunk(b, c, fp, &offset, out, contacts)) {
+      // an edges table that doesn't read is skipped like spatial_index_build skips incomplete chunks,
+      // a write that fails isn't
+      if (ferror(fp)) ok = false;
+      continue;
+    }
+    s32 local[3] = {c->z % GRAPH_SHARD_CHUNKS, c->y % GRAPH_SHARD_CHUNKS, c->x % GRAPH_SHARD_CHUNKS};
+    directory[(local[0] * GRAPH_SHARD_CHUNKS + local[1]) * GRAPH_SHARD_CHUNKS + local[2]] = header.num_chunks++;
+    header.num_nodes += out->num_nodes;
+    header.num_edges += out->num_edges;
+  }
+  ok = ok && graph_write_at(fp, nullptr, 0, &offset);
+  header.chunks_offset = offset;
+  ok = ok && graph_write_at(fp, chunks, header.num_chunks * sizeof(GraphShardChunk), &offset);
+  header.total_bytes = offset;
+  ok = ok && fseek(fp, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, fp) == 1;
+  ok = ok && fseek(fp, GRAPH_DATA_OFFSET, SEEK_SET) == 0 && fwrite(directory, sizeof(directory), 1, fp) == 1;
+  ok &= fclose(fp) == 0;
+  free(chunks);
+  if (!ok || rename(tmp, path) != 0) {
+    unlink(tmp);
+    return false;
+  }
+  return true;
+}
+
+static void* graph_build_thread(void* arg) {
+  GraphBuild* b = arg;
+  GraphContacts contacts = {};
+  for (;;) {
+    s64 i = __atomic_fetch_add(&b->next_shard, 1, __ATOMIC_RELAXED);
+    if (i >= b->num_shards) break;
+    if (!graph_build_shard(b, i, &contacts)) {
+      printf("couldn't write graph shard %lld\n", i);
+      __atomic_store_n(&b->failed, true, __ATOMIC_RELAXED);
+    }
+  }
+  graph_contacts_free(&contacts);
+  return nullptr;
+}
+
+// Build the graph of every chunk in the pack with an edges table into dir. grid and label_bits are the
+// label volume's, so node ids match its labels. Shards are built in parallel, each one holds a shard's
+// worth of chunks in memory at a time, one chunk per thread
+static bool graph_build(const PackReader* pack, const char* dir, const s32 grid[3], u32 label_bits, int num_threads) {
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    printf("can't create %s\n", dir);
+    return false;
+  }
+  GraphBuild b = {.pack = pack, .dir = dir, .label_bits = label_bits};
+  memcpy(b.grid, grid, sizeof(b.grid));
+  b.chunks = malloc((pack->count ? pack->count : 1) * sizeof(ChunkCoord));
+  for (s64 i = 0; i < pack->count; i++) {
+    const PackEntry* e = &pack->index[i];
+    if (e->kind != VCB_SUPERPIXEL_EDGES) continue;
+    if (e->chunk[0] < 0 || e->chunk[1] < 0 || e->chunk[2] < 0 ||
+        e->chunk[0] >= grid[0] || e->chunk[1] >= grid[1] || e->chunk[2] >= grid[2]) {
+      continue;
+    }
+    b.chunks[b.num_chunks++] = (ChunkCoord){e->chunk[0], e->chunk[1], e->chunk[2]};
+  }
+  qsort(b.chunks, b.num_chunks, sizeof(ChunkCoord), graph_chunk_cmp);
+  b.shard_starts = malloc((b.num_chunks + 1) * sizeof(s64));
+  for (s64 i = 0; i < b.num_chunks; i++) {
+    if (i == 0 || graph_shard_key(&b.chunks[i]) != graph_shard_key(&b.chunks[i - 1])) b.shard_starts[b.num_shards++] = i;
+  }
+  b.shard_starts[b.num_shards] = b.num_chunks;
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pthread_t threads[num_threads];
+  for (int i = 0; i < num_threads; i++) pthread_create(&threads[i], nullptr, graph_build_thread, &b);
+  for (int i = 0; i < num_threads; i++) pthread_join(threads[i], nullptr);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  // the manifest goes last, a graph without one is incomplete
+  GraphManifest manifest = {
+    .magic = GRAPH_MAGIC, .version = GRAPH_VERSION, .label_bits = label_bits, .shard_chunks = GRAPH_SHARD_CHUNKS,
+    .grid = {grid[0], grid[1], grid[2]}, .num_shards = b.num_shards, .num_chunks = b.num_chunks,
+    .num_nodes = b.num_nodes, .num_edges = b.num_edges, .num_face_edges = b.num_face_edges};
+  char path[1100], tmp[1110];
+  snprintf(path, sizeof(path), "%s/graph", dir);
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  bool ok = !b.failed;
+  FILE* fp = ok ? fopen(tmp, "wb") : nullptr;
+  if (fp) {
+    ok = fwrite(&manifest, sizeof(manifest), 1, fp) == 1;
+    ok &= fclose(fp) == 0;
+    if (!ok || rename(tmp, path) != 0) {
+      unlink(tmp);
+      ok = false;
+    }
+  } else {
+    ok = false;
+  }
+  if (ok) {
+    printf("graph: %llu nodes, %llu edges (%llu across chunk faces) in %lld shards of %lld chunks, %.1f s\n",
+           manifest.num_nodes, manifest.num_edges, manifest.num_face_edges, b.num_shards, b.num_chunks,
+           (f64)(end.tv_sec - start.tv_sec) + (f64)(end.tv_nsec - start.tv_nsec) * 1e-9);
+    if (b.missing_faces) printf("graph: %lld chunk faces had no face labels\n", b.missing_faces);
+  }
+  free(b.shard_starts);
+  free(b.chunks);
+  return ok;
+}
+
+typedef struct GraphShard {
+  s32 shard[3];
+  u8* base;             // nullptr for an unused slot
+  s64 size;
+  const GraphShardHeader* header;
+  const u32* directory;
+  const GraphShardChunk* chunks;
+  s32 pins;             // iterators into it
+  u64 last_used;
+} GraphShard;
+
+typedef struct GraphReader {
+  char dir[1024];
+  GraphManifest manifest;
+  GraphShard** shards;  // apart, iterators point at them
+  int num_shards;
+  int max_open;         // more only while that many are pinned
+  u64 clock;
+  pthread_mutex_t lock;
+
+  s64 queries;
+  s64 shard_loads;
+  s64 evictions;
+} GraphReader;
+
+// Neighbors of one node, graph_next until it returns nullptr or graph_iter_release to stop early
+typedef struct GraphIter {
+  GraphReader* graph;
+  GraphShard* shard;
+  const GraphEdge* edges;
+  u64 count;
+  u64 i;
+} GraphIter;
+
+static GraphReader* graph_open(const char* dir, int max_open) {
+  char path[1100];
+  snprintf(path, sizeof(path), "%s/graph", dir);
+  FILE* fp = fopen(path, "rb");
+  if (!fp) return nullptr;
+  GraphManifest manifest;
+  bool ok = fread(&manifest, sizeof(manifest), 1, fp) == 1;
+  fclose(fp);
+  if (!ok || memcmp(manifest.magic, GRAPH_MAGIC, sizeof(manifest.magic)) != 0 || manifest.version != GRAPH_VERSION) {
+    printf("%s is not a version %d graph\n", path, GRAPH_VERSION);
+    return nullptr;
+  }
+  GraphReader* g = calloc(1, sizeof(GraphReader));
+  snprintf(g->dir, sizeof(g->dir), "%s", dir);
+  g->manifest = manifest;
+  g->max_open = max_open > 0 ? max_open : 1;
+  g->shards = malloc(g->max_open * sizeof(GraphShard*));
+  for (int i = 0; i < g->max_open; i++) g->shards[i] = calloc(1, sizeof(GraphShard));
+  g->num_shards = g->max_open;
+  pthread_mutex_init(&g->lock, nullptr);
+  return g;
+}
+
+static void graph_shard_unmap(GraphShard* s) {
+  if (s->base) munmap(s->base, s->size);
+  *s = (GraphShard){};
+}
+
+static void graph_close(GraphReader* g) {
+  if (!g) return;
+  for (int i = 0; i < g->num_shards; i++) {
+    graph_shard_unmap(g->shards[i]);
+    free(g->shards[i]);
+  }
+  free(g->shards);
+  pthread_mutex_destroy(&g->lock);
+  free(g);
+}
+
+// count items of size bytes at offset lie inside total bytes, without the sum wrapping around
+static inline bool graph_range_fits(u64 offset, u64 count, u64 size, u64 total) {
+  return offset <= total && count <= (total - offset) / size;
+}
+
+// The header, and every chunk's offsets and edges, lie inside the file. Each row's offsets are
+// checked when it is read, see graph_neighbors
+static bool graph_shard_valid(const GraphShardHeader* h, u64 size) {
+  if (memcmp(h->magic, GRAPH_SHARD_MAGIC, sizeof(h->magic)) != 0 || h->version != GRAPH_VERSION ||
+      h->shard_chunks != GRAPH_SHARD_CHUNKS || h->total_bytes != size ||
+      !graph_range_fits(GRAPH_DATA_OFFSET, GRAPH_SHARD_CELLS, sizeof(u32), size) ||
+      h->chunks_offset % sizeof(u64) != 0 ||
+      !graph_range_fits(h->chunks_offset, h->num_chunks, sizeof(GraphShardChunk), size)) {
+    return false;
+  }
+  const GraphShardChunk* chunks = (const GraphShardChunk*)((const u8*)h + h->chunks_offset);
+  for (u32 i = 0; i < h->num_chunks; i++) {
+    const GraphShardChunk* c = &chunks[i];
+    if (c->offsets_offset % sizeof(u64) != 0 || c->edges_offset % sizeof(u64) != 0 ||
+        !graph_range_fits(c->offsets_offset, (u64)c->num_nodes + 1, sizeof(u64), size) ||
+        !graph_range_fits(c->edges_offset, c->num_edges, sizeof(GraphEdge), size)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool graph_shard_map(GraphShard* s, const char* dir, const s32 shard[3]) {
+  char path[1100];
+  graph_shard_path(dir, shard, path, sizeof(path));
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < GRAPH_DATA_OFFSET) {
+    close(fd);
+    return false;
+  }
+  void* base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) return false;
+  const GraphShardHeader* h = base;
+  if (!graph_shard_valid(h, (u64)st.st_size)) {
+    printf("%s is not a version %d graph shard\n", path, GRAPH_VERSION);
+    munmap(base, st.st_size);
+    return false;
+  }
+  *s = (GraphShard){.shard = {shard[0], shard[1], shard[2]}, .base = base, .size = st.st_size, .header = h};
+  s->directory = (const u32*)(s->base + GRAPH_DATA_OFFSET);
+  s->chunks = (const GraphShardChunk*)(s->base + h->chunks_offset);
+  return true;
+}
+
+// The mapped shard, mapping it if it isn't and unmapping the least recently used unpinned one to make
+// room. Pinned. Call with the lock held
+static GraphShard* graph_shard_pin(GraphReader* g, const s32 shard[3]) {
+  GraphShard* victim = nullptr;
+  for (int i = 0; i < g->num_shards; i++) {
+    GraphShard* s = g->shards[i];
+    if (s->base && memcmp(s->shard, shard, sizeof(s->shard)) == 0) {
+      s->pins++;
+      s->last_used = ++g->clock;
+      return s;
+    }
+    if (s->pins == 0 && (!victim || (victim->base && (!s->base || s->last_used < victim->last_used)))) victim = s;
+  }
+  if (!victim) {
+    // every slot is pinned by an iterator
+    g->shards = realloc(g->shards, (g->num_shards + 1) * sizeof(GraphShard*));
+    victim = g->shards[g->num_shards++] = calloc(1, sizeof(GraphShard));
+  }
+  if (victim->base) g->evictions++;
+  graph_shard_unmap(victim);
+  if (!graph_shard_map(victim, g->dir, shard)) return nullptr;
+  g->shard_loads++;
+  victim->pins = 1;
+  victim->last_used = ++g->clock;
+  return victim;
+}
+
+static void graph_iter_release(GraphIter* it) {
+  if (!it->shard) return;
+  pthread_mutex_lock(&it->graph->lock);
+  it->shard->pins--;
+  pthread_mutex_unlock(&it->graph->lock);
+  it->shard = nullptr;
+}
+
+// Start iterating node's neighbors. false, with nothing to release, for a node the graph doesn't have
+static bool graph_neighbors(GraphReader* g, u64 node, GraphIter* it) {
+  *it = (GraphIter){.graph = g};
+  s32 chunk[3];
+  u32 row;
+  const GraphManifest* m = &g->manifest;
+  if (!graph_node_source(m->grid, m->label_bits, node, chunk, &row)) return false;
+  if (chunk[0] >= m->grid[0]) return false;
+  const s32 shard[3] = {chunk[0] / m->shard_chunks, chunk[1] / m->shard_chunks, chunk[2] / m->shard_chunks};
+  pthread_mutex_lock(&g->lock);
+  g->queries++;
+  GraphShard* s = graph_shard_pin(g, shard);
+  pthread_mutex_unlock(&g->lock);
+  if (!s) return false;
+  it->shard = s;
+  s32 local[3] = {chunk[0] % m->shard_chunks, chunk[1] % m->shard_chunks, chunk[2] % m->shard_chunks};
+  u32 i = s->directory[(local[0] * m->shard_chunks + local[1]) * m->shard_chunks + local[2]];
+  if (i == GRAPH_NO_CHUNK || i >= s->header->num_chunks || row >= s->chunks[i].num_nodes) {
+    graph_iter_release(it);
+    return false;
+  }
+  const GraphShardChunk* c = &s->chunks[i];
+  const u64* offsets = (const u64*)(s->base + c->offsets_offset);
+  if (offsets[row] > offsets[row + 1] || offsets[row + 1] > c->num_edges) {
+    printf("node %u of chunk %d %d %d has edges outside its shard\n", row, chunk[0], chunk[1], chunk[2]);
+    graph_iter_release(it);
+    return false;
+  }
+  it->edges = (const GraphEdge*)(s->base + c->edges_offset) + offsets[row];
+  it->count = offsets[row + 1] - offsets[row];
+  return true;
+}
+
+// The next edge, nullptr (and released) at the end
+static const GraphEdge* graph_next(GraphIter* it) {
+  if (it->i < it->count) return &it->edges[it->i++];
+  graph_iter_release(it);
+  return nullptr;
+}
+
+static void graph_print_stats(const GraphReader* g) {
+  printf("graph: %lld neighbor queries, %lld shards mapped, %lld unmapped to make room\n", g->queries,
+         g->shard_loads, g->evictions);
+}
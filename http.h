@@ -0,0 +1,558 @@
+#pragma once
+
+#include <curl/curl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "volcano.h"
+#include "cache.h"
+
+// Read-through mirror of a remote zarr store. Files are fetched over HTTP by a few fetcher threads, each
+// driving a curl multi handle with up to max_parallel transfers on keep-alive connections, and written
+// into cache_dir under the same relative path before anyone reads them. cache_dir ends up a partial
+// local mirror that the plain ZarrChunkSource can read later, so processing can start before the
+// download script has finished.
+// 404s are remembered with an empty <file>.absent marker, since zarr leaves out empty chunks. Existence
+// checks only send a HEAD and remember a 200 with an empty <file>.present marker, so walking the grid
+// doesn't download chunks that won't be processed.
+// Connection errors, 5xx and 429 are retried with exponential backoff.
+//
+// To try it against example_data:
+//   python3 -m http.server -d example_data 8000
+//   VOLCANO_HTTP_URL=http://localhost:8000 ./bench
+
+typedef enum HttpStatus {
+  HTTP_OK,        // the file is in cache_dir
+  HTTP_MISSING,   // the server doesn't have it
+  HTTP_FAILED,    // gave up after retries
+} HttpStatus;
+
+// cache_dir, '/' and rel always fit in a local path, and a local path plus a marker or mkstemp suffix
+// in HTTP_MARKER_MAX, so two files can never map to the same cached one
+#define HTTP_DIR_MAX 1024
+#define HTTP_REL_MAX 512
+#define HTTP_PATH_MAX (HTTP_DIR_MAX + HTTP_REL_MAX)
+#define HTTP_MARKER_MAX (HTTP_PATH_MAX + 16)
+
+typedef struct HttpRequest {
+  char rel[HTTP_REL_MAX];
+  bool head;        // only whether it exists
+  bool done;
+  HttpStatus status;
+  int attempts;
+  s64 retry_at_ns;
+  u32 seed;         // rand_r state for the backoff jitter, the fetchers share requests
+  int refs;         // the fetchers' plus one per waiting thread
+  bool queued;
+  struct HttpRequest* next;   // queue
+  struct HttpRequest* hnext;  // outstanding bucket
+  u32 bucket;       // of rel and head when it was made, head can change after
+  // while a transfer is running
+  FILE* fp;
+  char tmp[HTTP_MARKER_MAX];
+} HttpRequest;
+
+// buckets of the outstanding requests. There are at most a few prefetch windows of them
+#define HTTP_BUCKETS 1024
+
+typedef struct HttpZarrStore {
+  char base_url[1024];
+  char cache_dir[HTTP_DIR_MAX];
+  int max_parallel;
+  int max_retries;
+
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  HttpRequest* queue;         // waiting to start, in order
+  HttpRequest* outstanding[HTTP_BUCKETS];   // every request not done yet by path, for deduplication
+  int waiters;                // threads blocked in http_store_fetch
+  bool stop;
+
+  int num_threads;
+  pthread_t* threads;
+  CURLM** multis;
+
+  // stats
+  s64 local_hits;
+  s64 downloads;
+  s64 probes;
+  s64 missing;
+  s64 retries;
+  s64 failures;
+  s64 bytes;
+} HttpZarrStore;
+
+static s64 http_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (s64)ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+static void http_local_path(const HttpZarrStore* store, const char* rel, char* path, size_t len) {
+  snprintf(path, len, "%s/%s", store->cache_dir, rel);
+}
+
+// mkdir -p of everything before the last '/'
+static void http_make_parents(const char* path) {
+  char dir[HTTP_PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s", path);
+  for (char* p = dir + 1; *p; p++) {
+    if (*p != '/') continue;
+    *p = '\0';
+    mkdir(dir, 0755);
+    *p = '/';
+  }
+}
+
+static void http_release(HttpRequest* req) {
+  if (--req->refs == 0) free(req);
+}
+
+// FNV-1a of the path, a probe and a download of the same file are different requests
+static u32 http_bucket(const char* rel, bool head) {
+  u32 h = 2166136261u ^ head;
+  for (const char* c = rel; *c; c++) h = (h ^ (u8)*c) * 16777619u;
+  return h % HTTP_BUCKETS;
+}
+
+// Lock held. Remove from the outstanding requests, wake waiters, drop the fetcher's reference
+static void http_complete(HttpZarrStore* store, HttpRequest* req, HttpStatus status) {
+  for (HttpRequest** p = &store->outstanding[req->bucket]; *p; p = &(*p)->hnext) {
+    if (*p == req) {
+      *p = req->hnext;
+      break;
+    }
+  }
+  req->done = true;
+  req->status = status;
+  pthread_cond_broadcast(&store->done);
+  http_release(req);
+}
+
+// Lock held
+static HttpRequest* http_pop_ready(HttpZarrStore* store, s64 now) {
+  for (HttpRequest** p = &store->queue; *p; p = &(*p)->next) {
+    if ((*p)->retry_at_ns <= now) {
+      HttpRequest* req = *p;
+      *p = req->next;
+      req->next = nullptr;
+      req->queued = false;
+      return req;
+    }
+  }
+  return nullptr;
+}
+
+// Lock held
+static void http_enqueue(HttpZarrStore* store, HttpRequest* req) {
+  HttpRequest** p = &store->queue;
+  while (*p) p = &(*p)->next;
+  req->next = nullptr;
+  req->queued = true;
+  *p = req;
+  pthread_cond_broadcast(&store->work);
+  for (int i = 0; i < store->num_threads; i++) {
+    if (store->multis[i]) curl_multi_wakeup(store->multis[i]);
+  }
+}
+
+static bool http_start(HttpZarrStore* store, CURLM* multi, CURL* easy, HttpRequest* req) {
+  char path[HTTP_PATH_MAX];
+  http_local_path(store, req->rel, path, sizeof(path));
+  http_make_parents(path);
+  if (!req->head) {
+    snprintf(req->tmp, sizeof(req->tmp), "%s.XXXXXX", path);
+    int fd = mkstemp(req->tmp);
+    if (fd < 0 || !(req->fp = fdopen(fd, "wb"))) {
+      if (fd >= 0) close(fd);
+      return false;
+    }
+    fchmod(fd, 0644);
+  }
+
+  char url[1600];
+  snprintf(url, sizeof(url), "%s/%s", store->base_url, req->rel);
+  curl_easy_setopt(easy, CURLOPT_URL, url);
+  // the easy handles are reused, so both are set every time
+  curl_easy_setopt(easy, CURLOPT_NOBODY, req->head ? 1L : 0L);
+  curl_easy_setopt(easy, CURLOPT_WRITEDATA, req->fp);
+  curl_easy_setopt(easy, CURLOPT_PRIVATE, req);
+  curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(easy, CURLOPT_TCP_KEEPALIVE, 1L);
+  curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT, 15L);
+  // a stalled transfer gets retried instead of holding a slot forever
+  curl_easy_setopt(easy, CURLOPT_LOW_SPEED_LIMIT, 1024L);
+  curl_easy_setopt(easy, CURLOPT_LOW_SPEED_TIME, 30L);
+  curl_multi_add_handle(multi, easy);
+  return true;
+}
+
+static void http_finish(HttpZarrStore* store, CURL* easy, CURLcode result) {
+  HttpRequest* req;
+  long code = 0;
+  curl_easy_getinfo(easy, CURLINFO_PRIVATE, (char**)&req);
+  curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &code);
+  char path[HTTP_PATH_MAX];
+  http_local_path(store, req->rel, path, sizeof(path));
+
+  bool ok;
+  s64 size = 0;
+  if (req->head) {
+    char present[HTTP_MARKER_MAX];
+    snprintf(present, sizeof(present), "%s.present", path);
+    int fd = result == CURLE_OK && code == 200 ? open(present, O_WRONLY | O_CREAT, 0644) : -1;
+    ok = fd >= 0;
+    if (ok) close(fd);
+  } else {
+    bool wrote = fclose(req->fp) == 0;
+    req->fp = nullptr;
+    struct stat st;
+    if (stat(req->tmp, &st) == 0) size = st.st_size;
+    ok = result == CURLE_OK && code == 200 && wrote && rename(req->tmp, path) == 0;
+    if (!ok) unlink(req->tmp);
+  }
+
+  pthread_mutex_lock(&store->lock);
+  if (ok) {
+    if (req->head) {
+      store->probes++;
+    } else {
+      store->downloads++;
+      store->bytes += size;
+    }
+    http_complete(store, req, HTTP_OK);
+  } else if (req->head && result == CURLE_OK && (code == 403 || code == 405 || code == 501)) {
+    // a server that won't answer HEAD gets asked for the whole file instead. Still deduplicated
+    // as a probe, waiters find the file local once it's done
+    req->head = false;
+    http_enqueue(store, req);
+  } else if (result == CURLE_OK && code == 404) {
+    char absent[HTTP_MARKER_MAX];
+    snprintf(absent, sizeof(absent), "%s.absent", path);
+    int fd = open(absent, O_WRONLY | O_CREAT, 0644);
+    if (fd >= 0) close(fd);
+    store->missing++;
+    http_complete(store, req, HTTP_MISSING);
+  } else if ((result != CURLE_OK || code >= 500 || code == 429) && ++req->attempts <= store->max_retries) {
+    // 0.2s, 0.4s, ... capped at 30s, jittered so retries from many transfers don't line up
+    s64 backoff = 200000000ll << (req->attempts - 1 < 8 ? req->attempts - 1 : 8);
+    backoff = backoff < 30000000000ll ? backoff : 30000000000ll;
+    req->retry_at_ns = http_now_ns() + backoff / 2 + (s64)(rand_r(&req->seed) % 1000) * (backoff / 2000);
+    store->retries++;
+    http_enqueue(store, req);
+  } else {
+    printf("fetching %s/%s failed: %s, http %ld\n", store->base_url, req->rel, curl_easy_strerror(result), code);
+    store->failures++;
+    http_complete(store, req, HTTP_FAILED);
+  }
+  pthread_mutex_unlock(&store->lock);
+}
+
+typedef struct HttpFetcherArgs {
+  HttpZarrStore* store;
+  int index;
+} HttpFetcherArgs;
+
+static void* http_fetch_thread(void* arg) {
+  HttpFetcherArgs* args = arg;
+  HttpZarrStore* store = args->store;
+  CURLM* multi = store->multis[args->index];
+  free(args);
+
+  // easy handles are reused so their connections stay alive between chunks
+  CURL** idle = malloc(store->max_parallel * sizeof(CURL*));
+  int num_idle = store->max_parallel;
+  for (int i = 0; i < num_idle; i++) idle[i] = curl_easy_init();
+
+  while (true) {
+    pthread_mutex_lock(&store->lock);
+    HttpRequest* req;
+    while (!store->stop && num_idle > 0 && (req = http_pop_ready(store, http_now_ns()))) {
+      CURL* easy = idle[--num_idle];
+      if (!http_start(store, multi, easy, req)) {
+        idle[num_idle++] = easy;
+        store->failures++;
+        http_complete(store, req, HTTP_FAILED);
+      }
+    }
+    bool active = num_idle < store->max_parallel;
+    if (!active) {
+      if (store->stop) {
+        pthread_mutex_unlock(&store->lock);
+        break;
+      }
+      // nothing running, sleep until there's work or a retry comes due
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_nsec += 50000000;
+      if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&store->work, &store->lock, &ts);
+      pthread_mutex_unlock(&store->lock);
+      continue;
+    }
+    pthread_mutex_unlock(&store->lock);
+
+    int running;
+    curl_multi_perform(multi, &running);
+    CURLMsg* msg;
+    int left;
+    while ((msg = curl_multi_info_read(multi, &left))) {
+      if (msg->msg != CURLMSG_DONE) continue;
+      CURL* easy = msg->easy_handle;
+      CURLcode result = msg->data.result;
+      curl_multi_remove_handle(multi, easy);
+      http_finish(store, easy, result);
+      idle[num_idle++] = easy;
+    }
+    curl_multi_poll(multi, nullptr, 0, 100, nullptr);
+  }
+
+  for (int i = 0; i < num_idle; i++) curl_easy_cleanup(idle[i]);
+  free(idle);
+  return nullptr;
+}
+
+static HttpZarrStore* http_store_new(const char* base_url, const char* cache_dir, int num_threads, int max_parallel) {
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+  HttpZarrStore* store = calloc(1, sizeof(HttpZarrStore));
+  snprintf(store->base_url, sizeof(store->base_url), "%s", base_url);
+  snprintf(store->cache_dir, sizeof(store->cache_dir), "%s", cache_dir);
+  // tolerate a trailing slash on the url
+  size_t len = strlen(store->base_url);
+  if (len && store->base_url[len - 1] == '/') store->base_url[len - 1] = '\0';
+  store->max_parallel = max_parallel;
+  store->max_retries = 6;
+  pthread_mutex_init(&store->lock, nullptr);
+  pthread_cond_init(&store->work, nullptr);
+  pthread_cond_init(&store->done, nullptr);
+
+  store->num_threads = num_threads;
+  store->threads = calloc(num_threads, sizeof(pthread_t));
+  store->multis = calloc(num_threads, sizeof(CURLM*));
+  for (int i = 0; i < num_threads; i++) {
+    store->multis[i] = curl_multi_init();
+    curl_multi_setopt(store->multis[i], CURLMOPT_MAX_HOST_CONNECTIONS, (long)max_parallel);
+    curl_multi_setopt(store->multis[i], CURLMOPT_MAXCONNECTS, (long)max_parallel);
+  }
+  for (int i = 0; i < num_threads; i++) {
+    HttpFetcherArgs* args = malloc(sizeof(HttpFetcherArgs));
+    *args = (HttpFetcherArgs){.store = store, .index = i};
+    pthread_create(&store->threads[i], nullptr, http_fetch_thread, args);
+  }
+  return store;
+}
+
+// Lets running transfers finish and fails whatever is still queued. Threads still waiting in
+// http_store_fetch get HTTP_FAILED, and the store is only freed once they've all returned
+static void http_store_free(HttpZarrStore* store) {
+  if (!store) return;
+  pthread_mutex_lock(&store->lock);
+  store->stop = true;
+  pthread_cond_broadcast(&store->work);
+  pthread_mutex_unlock(&store->lock);
+  for (int i = 0; i < store->num_threads; i++) {
+    curl_multi_wakeup(store->multis[i]);
+    pthread_join(store->threads[i], nullptr);
+    curl_multi_cleanup(store->multis[i]);
+  }
+  // the fetchers only stop with no transfer running, so what's left is queued
+  pthread_mutex_lock(&store->lock);
+  while (store->queue) {
+    HttpRequest* req = store->queue;
+    store->queue = req->next;
+    req->queued = false;
+    http_complete(store, req, HTTP_FAILED);
+  }
+  while (store->waiters > 0) pthread_cond_wait(&store->done, &store->lock);
+  pthread_mutex_unlock(&store->lock);
+  free(store->threads);
+  free(store->multis);
+  pthread_mutex_destroy(&store->lock);
+  pthread_cond_destroy(&store->work);
+  pthread_cond_destroy(&store->done);
+  free(store);
+}
+
+// Whether rel is known locally. For a probe (head) the cached body or a .present marker will do
+static bool http_is_local(const HttpZarrStore* store, const char* rel, bool head, HttpStatus* status) {
+  char path[HTTP_PATH_MAX], absent[HTTP_MARKER_MAX], present[HTTP_MARKER_MAX];
+  http_local_path(store, rel, path, sizeof(path));
+  snprintf(present, sizeof(present), "%s.present", path);
+  if (access(path, F_OK) == 0 || (head && access(present, F_OK) == 0)) {
+    *status = HTTP_OK;
+    return true;
+  }
+  snprintf(absent, sizeof(absent), "%s.absent", path);
+  if (access(absent, F_OK) == 0) {
+    *status = HTTP_MISSING;
+    return true;
+  }
+  return false;
+}
+
+// Lock held. The request fetching (or probing) rel, queued if it's new. nullptr if a fetch finished
+// since the caller last looked and the file is local now, or HTTP_FAILED once the store is stopping
+static HttpRequest* http_request_locked(HttpZarrStore* store, const char* rel, bool head, HttpStatus* local) {
+  u32 bucket = http_bucket(rel, head);
+  for (HttpRequest* r = store->outstanding[bucket]; r; r = r->hnext) {
+    if (strcmp(r->rel, rel) == 0) return r;
+  }
+  if (http_is_local(store, rel, head, local)) return nullptr;
+  if (store->stop) {
+    *local = HTTP_FAILED;
+    return nullptr;
+  }
+
+  HttpRequest* req = calloc(1, sizeof(HttpRequest));
+  snprintf(req->rel, sizeof(req->rel), "%s", rel);
+  req->head = head;
+  req->bucket = bucket;
+  req->seed = (u32)http_now_ns() ^ (u32)(uintptr_t)req;
+  req->refs = 1;
+  req->hnext = store->outstanding[bucket];
+  store->outstanding[bucket] = req;
+  http_enqueue(store, req);
+  return req;
+}
+
+// Make sure rel (relative to the store root) is in cache_dir, blocking until it's there or known
+// missing. With head only whether the server has it, without downloading it
+static HttpStatus http_store_request(HttpZarrStore* store, const char* rel, bool head) {
+  HttpStatus status;
+  // cut down to fit it would be confused with another file
+  if (strlen(rel) >= HTTP_REL_MAX) {
+    printf("fetching %s/%s failed: path too long\n", store->base_url, rel);
+    return HTTP_FAILED;
+  }
+  if (http_is_local(store, rel, head, &status)) {
+    __atomic_fetch_add(&store->local_hits, 1, __ATOMIC_RELAXED);
+    return status;
+  }
+
+  pthread_mutex_lock(&store->lock);
+  HttpRequest* req = http_request_locked(store, rel, head, &status);
+  if (req) {
+    // someone is waiting on it now, jump ahead of the prefetches
+    if (req->queued && store->queue != req) {
+      for (HttpRequest** p = &store->queue; *p; p = &(*p)->next) {
+        if (*p == req) {
+          *p = req->next;
+          break;
+        }
+      }
+      req->next = store->queue;
+      store->queue = req;
+    }
+    req->refs++;
+    store->waiters++;
+    while (!req->done) pthread_cond_wait(&store->done, &store->lock);
+    status = req->status;
+    http_release(req);
+    // http_store_free waits for the last one out
+    if (--store->waiters == 0 && store->stop) pthread_cond_broadcast(&store->done);
+  }
+  pthread_mutex_unlock(&store->lock);
+  return status;
+}
+
+static HttpStatus http_store_fetch(HttpZarrStore* store, const char* rel) {
+  return http_store_request(store, rel, false);
+}
+
+// Queue files that will be wanted soon, or probes of them with head, without waiting for them
+static void http_store_prefetch(HttpZarrStore* store, const char* const* rels, int n, bool head) {
+  HttpStatus status;
+  for (int i = 0; i < n; i++) {
+    if (strlen(rels[i]) >= HTTP_REL_MAX || http_is_local(store, rels[i], head, &status)) continue;
+    pthread_mutex_lock(&store->lock);
+    http_request_locked(store, rels[i], head, &status);
+    pthread_mutex_unlock(&store->lock);
+  }
+}
+
+static void http_store_print_stats(HttpZarrStore* store) {
+  printf("http %s: %lld downloads, %.2f GB, %lld probed, %lld missing, %lld already local, %lld retries, "
+         "%lld failures\n", store->base_url, store->downloads, (f64)store->bytes / (1024.0 * 1024.0 * 1024.0),
+         store->probes, store->missing, store->local_hits, store->retries, store->failures);
+}
+
+// A zarr v2 array behind a HttpZarrStore, read from the store's cache_dir once fetched
+typedef struct HttpZarrSource {
+  HttpZarrStore* store;
+  ZarrChunkSource local;
+  s32 grid[3];    // zyx chunk grid
+} HttpZarrSource;
+
+// Fetch and parse the .zarray. storage_order and separator are as for ZarrChunkSource
+static bool http_zarr_source_open(HttpZarrSource* src, HttpZarrStore* store, const char* storage_order, char separator) {
+  if (http_store_fetch(store, ".zarray") != HTTP_OK) {
+    printf("could not fetch %s/.zarray\n", store->base_url);
+    return false;
+  }
+  char path[HTTP_PATH_MAX];
+  http_local_path(store, ".zarray", path, sizeof(path));
+  src->store = store;
+  src->local = (ZarrChunkSource){.root = store->cache_dir, .storage_order = storage_order, .separator = separator};
+  src->local.metadata = vs_zarr_parse_zarray(path);
+  for (int i = 0; i < 3; i++) {
+    int axis = storage_order[i] == 'z' ? 0 : storage_order[i] == 'y' ? 1 : 2;
+    src->grid[axis] = (src->local.metadata.shape[i] + src->local.metadata.chunks[i] - 1) / src->local.metadata.chunks[i];
+  }
+  return true;
+}
+
+// chunk key relative to the store root, e.g. "12/3/40"
+static const char* http_zarr_source_key(const HttpZarrSource* src, s32 cz, s32 cy, s32 cx, char* path, size_t len) {
+  zarr_chunk_source_path(&src->local, cz, cy, cx, path, len);
+  return path + strlen(src->store->cache_dir) + 1;
+}
+
+static tchunk* http_zarr_source_load(void* ctx, s32 cz, s32 cy, s32 cx) {
+  HttpZarrSource* src = ctx;
+  char path[HTTP_PATH_MAX];
+  if (http_store_fetch(src->store, http_zarr_source_key(src, cz, cy, cx, path, sizeof(path))) != HTTP_OK) return nullptr;
+  return vs_zarr_read_tchunk_as(path, src->local.metadata, src->local.storage_order);
+}
+
+static void http_zarr_source_queue(HttpZarrSource* src, const s32 (*coords)[3], int n, bool head) {
+  char paths[64][HTTP_PATH_MAX];
+  const char* keys[64];
+  n = n < 64 ? n : 64;
+  for (int i = 0; i < n; i++) {
+    keys[i] = http_zarr_source_key(src, coords[i][0], coords[i][1], coords[i][2], paths[i], sizeof(paths[i]));
+  }
+  http_store_prefetch(src->store, keys, n, head);
+}
+
+static void http_zarr_source_prefetch(void* ctx, const s32 (*coords)[3], int n) {
+  http_zarr_source_queue(ctx, coords, n, false);
+}
+
+// Existence costs a HEAD per chunk (nothing once a chunk is cached), so when called in raster order
+// (as traversal_build does) it keeps the next few hundred probes queued to overlap the round trips.
+// A chunk_exists_fn, only a chunk the server says it doesn't have is absent
+static bool http_zarr_source_exists(void* ctx, s32 cz, s32 cy, s32 cx) {
+  HttpZarrSource* src = ctx;
+  constexpr int window = 256;
+  s64 linear = ((s64)cz * src->grid[1] + cy) * src->grid[2] + cx;
+  s64 total = (s64)src->grid[0] * src->grid[1] * src->grid[2];
+  if (linear % (window / 2) == 0) {
+    for (s64 start = linear; start < linear + window && start < total; start += 64) {
+      s32 coords[64][3];
+      int n = 0;
+      for (s64 l = start; l < start + 64 && l < total; l++, n++) {
+        coords[n][0] = (s32)(l / ((s64)src->grid[1] * src->grid[2]));
+        coords[n][1] = (s32)((l / src->grid[2]) % src->grid[1]);
+        coords[n][2] = (s32)(l % src->grid[2]);
+      }
+      http_zarr_source_queue(src, (const s32 (*)[3])coords, n, true);
+    }
+  }
+  char path[HTTP_PATH_MAX];
+  return http_store_request(src->store, http_zarr_source_key(src, cz, cy, cx, path, sizeof(path)), true) != HTTP_MISSING;
+}
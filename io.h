@@ -0,0 +1,366 @@
+#pragma once
+
+#include <pthread.h>
+#include <sys/stat.h>
+
+#ifdef VOLCANO_IO_URING
+#include <liburing.h>
+#endif
+
+#include "volcano.h"
+
+// How compressed chunk files get from disk into memory. Every backend returns the whole file as a
+// read only buffer owned by the thread's IoContext, valid until its next read:
+//   IO_PREAD   open + pread into a reused buffer, hinted sequential
+//   IO_MMAP    map the file, no copy, the decompressor reads straight from the page cache
+//   IO_URING   batches the worker's upcoming files into one submission so the SSD sees a deep queue
+//              while we're busy decoding. Needs liburing, build with -DVOLCANO_IO_URING
+// io_prefetch is the readahead hook, the worker calls it with the next files in traversal order.
+// Without io_uring it's a POSIX_FADV_WILLNEED per file, which starts the kernel's readahead, or
+// F_RDADVISE where there's no posix_fadvise (macOS).
+
+typedef enum IoBackendKind {
+  IO_PREAD,
+  IO_MMAP,
+  IO_URING,
+} IoBackendKind;
+
+static const char* io_backend_name(IoBackendKind kind) {
+  switch (kind) {
+    case IO_PREAD: return "pread";
+    case IO_MMAP: return "mmap";
+    case IO_URING: return "io_uring";
+  }
+  return "?";
+}
+
+// Shared by every thread's context, the counters are updated atomically
+typedef struct IoBackend {
+  IoBackendKind kind;
+  int queue_depth;  // max files in flight per thread for io_uring
+
+  s64 files;
+  s64 bytes;
+  s64 read_ns;          // time threads spent blocked in io_read_file
+  s64 prefetch_issued;
+  s64 prefetch_hits;    // io_uring reads that were already submitted when they were asked for
+} IoBackend;
+
+static IoBackend* io_backend_new(IoBackendKind kind, int queue_depth) {
+#ifndef VOLCANO_IO_URING
+  if (kind == IO_URING) {
+    printf("built without io_uring, using pread\n");
+    kind = IO_PREAD;
+  }
+#endif
+  IoBackend* ret = calloc(1, sizeof(IoBackend));
+  ret->kind = kind;
+  ret->queue_depth = queue_depth;
+  return ret;
+}
+
+static void io_backend_free(IoBackend* backend) { free(backend); }
+
+static s64 io_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (s64)ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+static void io_count(IoBackend* backend, s64 bytes, s64 t0) {
+  __atomic_fetch_add(&backend->files, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&backend->bytes, bytes, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&backend->read_ns, io_now_ns() - t0, __ATOMIC_RELAXED);
+}
+
+static void io_print_stats(IoBackend* backend, f64 wall_seconds) {
+  f64 gb = (f64)backend->bytes / (1024.0 * 1024.0 * 1024.0);
+  f64 blocked = (f64)backend->read_ns * 1e-9;
+  printf("io %s: %lld files, %.2f GB, %.0f MB/s over the run, %.0f MB/s while blocked, %lld prefetched, %lld prefetch hits\n",
+         io_backend_name(backend->kind), backend->files, gb,
+         wall_seconds > 0 ? gb * 1024.0 / wall_seconds : 0.0,
+         blocked > 0 ? gb * 1024.0 / blocked : 0.0,
+         backend->prefetch_issued, backend->prefetch_hits);
+}
+
+#ifdef VOLCANO_IO_URING
+typedef struct IoInflight {
+  bool used;
+  char path[1024];
+  int fd;
+  u8* buf;
+  s64 size;
+  s64 result;   // bytes read, negative errno, or 0 while in flight
+  bool done;
+  s64 wanted;   // ctx->reads when it was last prefetched
+} IoInflight;
+#endif
+
+// Per thread state, one per ZarrReader
+typedef struct IoContext {
+  IoBackend* backend;
+  u8* buf;
+  s64 cap;
+  void* mapping;
+  s64 mapping_size;
+#ifdef VOLCANO_IO_URING
+  struct io_uring ring;
+  bool ring_ok;
+  IoInflight* inflight;   // queue_depth slots, the slot number is the sqe's user data
+  int num_inflight;
+  s64 reads;              // io_read_file calls, to age the prefetches
+#endif
+} IoContext;
+
+static IoContext* io_context_new(IoBackend* backend) {
+  IoContext* ctx = calloc(1, sizeof(IoContext));
+  ctx->backend = backend;
+#ifdef VOLCANO_IO_URING
+  if (backend->kind == IO_URING) {
+    ctx->ring_ok = io_uring_queue_init(backend->queue_depth, &ctx->ring, 0) == 0;
+    if (!ctx->ring_ok) printf("io_uring_queue_init failed, falling back to pread\n");
+    ctx->inflight = calloc(backend->queue_depth, sizeof(IoInflight));
+  }
+#endif
+  return ctx;
+}
+
+static void io_release_mapping(IoContext* ctx) {
+  if (ctx->mapping) munmap(ctx->mapping, ctx->mapping_size);
+  ctx->mapping = nullptr;
+  ctx->mapping_size = 0;
+}
+
+#ifdef VOLCANO_IO_URING
+static void io_uring_reap(IoContext* ctx, bool wait) {
+  struct io_uring_cqe* cqe;
+  while ((wait ? io_uring_wait_cqe(&ctx->ring, &cqe) : io_uring_peek_cqe(&ctx->ring, &cqe)) == 0) {
+    IoInflight* f = &ctx->inflight[io_uring_cqe_get_data64(cqe)];
+    f->result = cqe->res;
+    f->done = true;
+    io_uring_cqe_seen(&ctx->ring, cqe);
+    wait = false;
+  }
+}
+
+static void io_uring_retire(IoContext* ctx, IoInflight* f) {
+  close(f->fd);
+  free(f->buf);
+  f->buf = nullptr;
+  f->used = false;
+  ctx->num_inflight--;
+}
+
+// Reads nobody claimed (the chunk turned up in the cache after all) would hold their slot and buffer
+// forever. A finished read that 2 * queue_depth reads have gone by since it was last prefetched won't
+// be asked for any more, the prefetch window is never that far ahead
+static void io_uring_reap_orphans(IoContext* ctx) {
+  io_uring_reap(ctx, false);
+  for (int i = 0; i < ctx->backend->queue_depth; i++) {
+    IoInflight* f = &ctx->inflight[i];
+    if (f->used && f->done && ctx->reads - f->wanted > 2 * ctx->backend->queue_depth) io_uring_retire(ctx, f);
+  }
+}
+#endif
+
+static void io_context_free(IoContext* ctx) {
+  if (!ctx) return;
+  io_release_mapping(ctx);
+#ifdef VOLCANO_IO_URING
+  if (ctx->ring_ok) {
+    // the kernel may still be writing into these buffers
+    while (ctx->num_inflight) {
+      for (int i = 0; i < ctx->backend->queue_depth; i++) {
+        if (ctx->inflight[i].used && ctx->inflight[i].done) io_uring_retire(ctx, &ctx->inflight[i]);
+      }
+      if (ctx->num_inflight) io_uring_reap(ctx, true);
+    }
+    io_uring_queue_exit(&ctx->ring);
+  }
+  free(ctx->inflight);
+#endif
+  free(ctx->buf);
+  free(ctx);
+}
+
+static u8* io_reserve(IoContext* ctx, s64 size) {
+  if (ctx->cap < size) {
+    free(ctx->buf);
+    ctx->buf = malloc(size);
+    ctx->cap = size;
+  }
+  return ctx->buf;
+}
+
+static bool io_pread_all(int fd, u8* buf, s64 size, s64 offset) {
+  while (size > 0) {
+    ssize_t n = pread(fd, buf, size, offset);
+    if (n <= 0) return false;
+    buf += n;
+    offset += n;
+    size -= n;
+  }
+  return true;
+}
+
+// Start the kernel's readahead of size bytes at offset, 0 for the rest of the file. POSIX_FADV_WILLNEED,
+// or F_RDADVISE where there's no posix_fadvise (macOS)
+static void io_advise_willneed(int fd, s64 offset, s64 size) {
+#if defined(POSIX_FADV_WILLNEED)
+  posix_fadvise(fd, (off_t)offset, (off_t)size, POSIX_FADV_WILLNEED);
+#elif defined(F_RDADVISE)
+  if (size == 0) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= offset) return;
+    size = st.st_size - offset;
+  }
+  struct radvisory advice = {.ra_offset = (off_t)offset, .ra_count = size > INT32_MAX ? INT32_MAX : (int)size};
+  fcntl(fd, F_RDADVISE, &advice);
+#else
+  (void)fd;
+  (void)offset;
+  (void)size;
+#endif
+}
+
+// Start reading files this thread will ask for soon
+static void io_prefetch(IoContext* ctx, const char* const* paths, int n) {
+  IoBackend* backend = ctx->backend;
+#ifdef VOLCANO_IO_URING
+  if (ctx->ring_ok) {
+    io_uring_reap_orphans(ctx);
+    // still full of finished reads, the oldest make room for the newer window
+    if (ctx->num_inflight == backend->queue_depth) {
+      for (int i = 0; i < backend->queue_depth; i++) {
+        if (ctx->inflight[i].used && ctx->inflight[i].done) io_uring_retire(ctx, &ctx->inflight[i]);
+      }
+    }
+    int queued = 0;
+    for (int p = 0; p < n && ctx->num_inflight < backend->queue_depth; p++) {
+      int slot = -1;
+      IoInflight* already = nullptr;
+      for (int i = 0; i < backend->queue_depth && !already; i++) {
+        if (!ctx->inflight[i].used) slot = slot < 0 ? i : slot;
+        else if (strcmp(ctx->inflight[i].path, paths[p]) == 0) already = &ctx->inflight[i];
+      }
+      if (already) {
+        already->wanted = ctx->reads;
+        continue;
+      }
+
+      int fd = open(paths[p], O_RDONLY);
+      struct stat st;
+      if (fd < 0) continue;
+      if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        continue;
+      }
+      struct io_uring_sqe* sqe = io_uring_get_sqe(&ctx->ring);
+      if (!sqe) {
+        close(fd);
+        break;
+      }
+      ctx->num_inflight++;
+      IoInflight* f = &ctx->inflight[slot];
+      f->used = true;
+      snprintf(f->path, sizeof(f->path), "%s", paths[p]);
+      f->fd = fd;
+      f->size = st.st_size;
+      f->buf = malloc(st.st_size);
+      f->result = 0;
+      f->done = false;
+      f->wanted = ctx->reads;
+      io_uring_prep_read(sqe, fd, f->buf, st.st_size, 0);
+      io_uring_sqe_set_data64(sqe, slot);
+      queued++;
+    }
+    // one syscall for the whole batch
+    if (queued) io_uring_submit(&ctx->ring);
+    __atomic_fetch_add(&backend->prefetch_issued, queued, __ATOMIC_RELAXED);
+    return;
+  }
+#endif
+  for (int p = 0; p < n; p++) {
+    int fd = open(paths[p], O_RDONLY);
+    if (fd < 0) continue;
+    io_advise_willneed(fd, 0, 0);
+    close(fd);
+  }
+  __atomic_fetch_add(&backend->prefetch_issued, n, __ATOMIC_RELAXED);
+}
+
+// Whole file contents, nullptr if it can't be read. The buffer belongs to ctx
+static const u8* io_read_file(IoContext* ctx, const char* path, s64* size) {
+  IoBackend* backend = ctx->backend;
+  s64 t0 = io_now_ns();
+  io_release_mapping(ctx);
+
+#ifdef VOLCANO_IO_URING
+  if (ctx->ring_ok) {
+    ctx->reads++;
+    io_uring_reap_orphans(ctx);
+    for (int i = 0; i < backend->queue_depth; i++) {
+      IoInflight* f = &ctx->inflight[i];
+      if (!f->used || strcmp(f->path, path) != 0) continue;
+      // the ring completes out of order, reap until ours is in
+      while (!f->done) io_uring_reap(ctx, true);
+      bool ok = f->result == f->size ||
+                (f->result >= 0 && io_pread_all(f->fd, f->buf + f->result, f->size - f->result, f->result));
+      if (!ok) {
+        io_uring_retire(ctx, f);
+        return nullptr;
+      }
+      // hand the buffer over instead of copying it
+      free(ctx->buf);
+      ctx->buf = f->buf;
+      ctx->cap = f->size;
+      *size = f->size;
+      f->buf = nullptr;
+      io_uring_retire(ctx, f);
+      __atomic_fetch_add(&backend->prefetch_hits, 1, __ATOMIC_RELAXED);
+      io_count(backend, *size, t0);
+      return ctx->buf;
+    }
+  }
+#endif
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return nullptr;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return nullptr;
+  }
+  const u8* ret = nullptr;
+  if (backend->kind == IO_MMAP) {
+    void* base = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base != MAP_FAILED) {
+      madvise(base, st.st_size, MADV_SEQUENTIAL);
+      madvise(base, st.st_size, MADV_WILLNEED);
+      ctx->mapping = base;
+      ctx->mapping_size = st.st_size;
+      ret = base;
+    }
+  } else {
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    u8* buf = io_reserve(ctx, st.st_size);
+    if (io_pread_all(fd, buf, st.st_size, 0)) ret = buf;
+  }
+  close(fd);
+
+  if (ret) {
+    *size = st.st_size;
+    io_count(backend, *size, t0);
+  }
+  return ret;
+}
+
+// pread of part of a file that's already open, e.g. an inner chunk of a shard, counted in the stats
+static bool io_pread(IoContext* ctx, int fd, u8* buf, s64 size, s64 offset) {
+  s64 t0 = io_now_ns();
+  bool ok = io_pread_all(fd, buf, size, offset);
+  if (ok) io_count(ctx->backend, size, t0);
+  return ok;
+}
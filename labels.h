@@ -0,0 +1,502 @@
+#pragma once
+
+#include <blosc2.h>
+#include <json-c/json.h>
+#include <sys/stat.h>
+
+#include "volcano.h"
+#include "zarr.h"
+#include "zarr3.h"
+
+// The superpixel label volume as a zarr v2 array of u64, one chunk file per processed chunk. Labels are
+// made unique across the scroll by giving each chunk its own range:
+//
+//   label = (linear chunk index << label_bits) | (superpixel row + 1),   0 is background
+//
+// so a label names its chunk and its row in the chunk's superpixel table without any lookup, and
+// chunks can be written in any order by any thread.
+// Chunks are encoded with the compressed_segmentation filter (the neuroglancer format): each 8^3 block
+// stores a sorted palette of the labels in it and a bit-packed index per voxel, 0, 1, 2, 4, 8, 16 or
+// 32 bits wide. A block of background is two header words and a shared one entry palette, a block with
+// a handful of superpixels costs 2 or 4 bits per voxel instead of 64. The words then go through blosc.
+// zarr-python needs a numcodecs codec registered under the filter's id to read the array.
+
+#define CSEG_BLOCK 8
+#define CSEG_FILTER_ID "compressed_segmentation"
+#define CSEG_MAX_OFFSET (1u << 24)
+
+// Bits a chunk's labels need, for label_bits
+static int label_bits_for(u32 max_labels_per_chunk) {
+  int bits = 0;
+  while (((u64)1 << bits) <= max_labels_per_chunk) bits++;
+  return bits;
+}
+
+typedef struct CsegTable {
+  u64 hash;
+  u32 offset;     // in words from the channel start, 0 for an empty slot
+  u32 count;
+} CsegTable;
+
+// Output and scratch of the encoder, reused from chunk to chunk
+typedef struct CsegBuffer {
+  u32* words;
+  s64 count;
+  s64 cap;
+  CsegTable* tables;    // palettes written so far, identical ones are shared between blocks
+  s64 tables_cap;
+} CsegBuffer;
+
+static void cseg_reserve(CsegBuffer* b, s64 count) {
+  if (count <= b->cap) return;
+  s64 cap = b->cap ? b->cap : 4096;
+  while (cap < count) cap *= 2;
+  b->words = realloc(b->words, cap * sizeof(u32));
+  b->cap = cap;
+}
+
+static void cseg_buffer_free(CsegBuffer* b) {
+  free(b->words);
+  free(b->tables);
+  *b = (CsegBuffer){};
+}
+
+static int cseg_bits(s64 unique) {
+  if (unique <= 1) return 0;
+  if (unique <= 2) return 1;
+  if (unique <= 4) return 2;
+  if (unique <= 16) return 4;
+  if (unique <= 256) return 8;
+  if (unique <= 65536) return 16;
+  return 32;
+}
+
+// Offset of palette in b, appending it unless the same palette is already there
+static u32 cseg_palette(CsegBuffer* b, const u64* palette, s64 n) {
+  u64 hash = 1469598103934665603ull;
+  for (s64 i = 0; i < n; i++) hash = (hash ^ palette[i]) * 1099511628211ull;
+  s64 mask = b->tables_cap - 1;
+  for (s64 slot = (s64)(hash & mask);; slot = (slot + 1) & mask) {
+    CsegTable* t = &b->tables[slot];
+    if (t->offset == 0) {
+      // channel start is word 1
+      *t = (CsegTable){hash, (u32)(b->count - 1), (u32)n};
+      cseg_reserve(b, b->count + 2 * n);
+      memcpy(b->words + b->count, palette, n * sizeof(u64));
+      b->count += 2 * n;
+      return t->offset;
+    }
+    if (t->hash == hash && t->count == n && memcmp(b->words + 1 + t->offset, palette, n * sizeof(u64)) == 0) {
+      return t->offset;
+    }
+  }
+}
+
+// Encode a zyx volume of u64 labels into b->words[0, b->count), one channel. false if the chunk
+// is too big for the format's 24 bit palette offsets
+static bool cseg_encode(CsegBuffer* b, const u64* data, const s32 dims[3]) {
+  s32 grid[3];
+  for (int d = 0; d < 3; d++) grid[d] = (dims[d] + CSEG_BLOCK - 1) / CSEG_BLOCK;
+  s64 num_blocks = (s64)grid[0] * grid[1] * grid[2];
+
+  s64 tables_cap = 64;
+  while (tables_cap < 2 * num_blocks) tables_cap *= 2;
+  if (tables_cap > b->tables_cap) {
+    free(b->tables);
+    b->tables = malloc(tables_cap * sizeof(CsegTable));
+    b->tables_cap = tables_cap;
+  }
+  memset(b->tables, 0, b->tables_cap * sizeof(CsegTable));
+
+  b->count = 0;
+  cseg_reserve(b, 1 + 2 * num_blocks);
+  b->words[0] = 1;
+  b->count = 1 + 2 * num_blocks;
+
+  constexpr int block_voxels = CSEG_BLOCK * CSEG_BLOCK * CSEG_BLOCK;
+  u64 values[block_voxels];
+  u64 palette[block_voxels];
+  s64 block = 0;
+  for (s32 bz = 0; bz < grid[0]; bz++) {
+    for (s32 by = 0; by < grid[1]; by++) {
+      for (s32 bx = 0; bx < grid[2]; bx++, block++) {
+        // voxels past the edge of the volume repeat the block's first one
+        s32 z0 = bz * CSEG_BLOCK, y0 = by * CSEG_BLOCK, x0 = bx * CSEG_BLOCK;
+        u64 first = data[((s64)z0 * dims[1] + y0) * dims[2] + x0];
+        bool uniform = true;
+        for (int z = 0, i = 0; z < CSEG_BLOCK; z++) {
+          for (int y = 0; y < CSEG_BLOCK; y++) {
+            for (int x = 0; x < CSEG_BLOCK; x++, i++) {
+              bool inside = z0 + z < dims[0] && y0 + y < dims[1] && x0 + x < dims[2];
+              values[i] = inside ? data[((s64)(z0 + z) * dims[1] + y0 + y) * dims[2] + x0 + x] : first;
+              uniform &= values[i] == first;
+            }
+          }
+        }
+
+        s64 unique = 1;
+        palette[0] = first;
+        if (!uniform) {
+          // a voxel with the label of its neighbor at -x, -y or -z is already in the sorted palette,
+          // only the others are looked up and inserted
+          for (int i = 1; i < block_voxels; i++) {
+            if (values[i] == values[i - 1] || (i >= CSEG_BLOCK && values[i] == values[i - CSEG_BLOCK]) ||
+                (i >= CSEG_BLOCK * CSEG_BLOCK && values[i] == values[i - CSEG_BLOCK * CSEG_BLOCK])) {
+              continue;
+            }
+            s64 lo = 0, hi = unique;
+            while (lo < hi) {
+              s64 mid = (lo + hi) / 2;
+              if (palette[mid] < values[i]) lo = mid + 1;
+              else hi = mid;
+            }
+            if (lo < unique && palette[lo] == values[i]) continue;
+            memmove(palette + lo + 1, palette + lo, (unique - lo) * sizeof(u64));
+            palette[lo] = values[i];
+            unique++;
+          }
+        }
+
+        int bits = cseg_bits(unique);
+        u32 values_offset = (u32)(b->count - 1);
+        if (bits) {
+          s64 n = block_voxels * bits / 32;
+          cseg_reserve(b, b->count + n);
+          u32* packed = b->words + b->count;
+          memset(packed, 0, n * sizeof(u32));
+          u32 index[block_voxels];
+          for (int i = 0; i < block_voxels; i++) {
+            // same neighbors as above, most voxels copy their index
+            if (i >= 1 && values[i] == values[i - 1]) {
+              index[i] = index[i - 1];
+            } else if (i >= CSEG_BLOCK && values[i] == values[i - CSEG_BLOCK]) {
+              index[i] = index[i - CSEG_BLOCK];
+            } else if (i >= CSEG_BLOCK * CSEG_BLOCK && values[i] == values[i - CSEG_BLOCK * CSEG_BLOCK]) {
+              index[i] = index[i - CSEG_BLOCK * CSEG_BLOCK];
+            } else {
+              s64 lo = 0, hi = unique - 1;
+              while (lo < hi) {
+                s64 mid = (lo + hi) / 2;
+                if (palette[mid] < values[i]) lo = mid + 1;
+                else hi = mid;
+              }
+              index[i] = (u32)lo;
+            }
+            packed[i * bits / 32] |= index[i] << (i * bits % 32);
+          }
+          b->count += n;
+        }
+        u32 table_offset = cseg_palette(b, palette, unique);
+        if (table_offset >= CSEG_MAX_OFFSET) return false;
+        b->words[1 + 2 * block] = table_offset | (u32)bits << 24;
+        b->words[2 + 2 * block] = values_offset;
+      }
+    }
+  }
+  return true;
+}
+
+// Decode count words from cseg_encode into the zyx volume out. false if they're malformed
+static bool cseg_decode(const u32* words, s64 count, const s32 dims[3], u64* out) {
+  s32 grid[3];
+  for (int d = 0; d < 3; d++) grid[d] = (dims[d] + CSEG_BLOCK - 1) / CSEG_BLOCK;
+  s64 num_blocks = (s64)grid[0] * grid[1] * grid[2];
+  if (count < 1 || words[0] != 1 || count < 1 + 2 * num_blocks) return false;
+  const u32* channel = words + 1;
+  s64 channel_count = count - 1;
+
+  s64 block = 0;
+  for (s32 bz = 0; bz < grid[0]; bz++) {
+    for (s32 by = 0; by < grid[1]; by++) {
+      for (s32 bx = 0; bx < grid[2]; bx++, block++) {
+        u32 table_offset = channel[2 * block] & 0xffffff;
+        int bits = channel[2 * block] >> 24;
+        u32 values_offset = channel[2 * block + 1];
+        if (bits != 0 && bits != 1 && bits != 2 && bits != 4 && bits != 8 && bits != 16 && bits != 32) return false;
+        if (bits && values_offset + CSEG_BLOCK * CSEG_BLOCK * CSEG_BLOCK * bits / 32 > channel_count) return false;
+        // indices are checked against the palette as they're read
+        s64 table_words = channel_count - table_offset;
+        const u32* table = channel + table_offset;
+        const u32* packed = channel + values_offset;
+        u32 mask = bits == 32 ? UINT32_MAX : ((u32)1 << bits) - 1;
+
+        s32 z0 = bz * CSEG_BLOCK, y0 = by * CSEG_BLOCK, x0 = bx * CSEG_BLOCK;
+        for (int z = 0; z < CSEG_BLOCK && z0 + z < dims[0]; z++) {
+          for (int y = 0; y < CSEG_BLOCK && y0 + y < dims[1]; y++) {
+            u64* row = out + ((s64)(z0 + z) * dims[1] + y0 + y) * dims[2] + x0;
+            int i = (z * CSEG_BLOCK + y) * CSEG_BLOCK;
+            for (int x = 0; x < CSEG_BLOCK && x0 + x < dims[2]; x++, i++) {
+              u32 index = bits ? (packed[i * bits / 32] >> (i * bits % 32)) & mask : 0;
+              if (2 * (s64)index + 1 >= table_words) return false;
+              row[x] = (u64)table[2 * index] | (u64)table[2 * index + 1] << 32;
+            }
+          }
+        }
+      }
+    }
+  }
+  return true;
+}
+
+typedef struct LabelVolume {
+  char root[1024];
+  s32 shape[3];
+  s32 chunks[3];
+  s32 grid[3];
+  int label_bits;
+  char cname[16];     // blosc codec behind the filter
+  int clevel;
+
+  s64 chunks_written;
+  s64 voxels;
+  s64 filtered_bytes; // after compressed_segmentation
+  s64 stored_bytes;
+  s64 encode_ns;
+} LabelVolume;
+
+// Per worker encode state, reused for every chunk
+typedef struct LabelEncoder {
+  u64* labels;
+  s64 labels_cap;
+  CsegBuffer cseg;
+  u8* compressed;
+  s64 compressed_cap;
+  blosc2_context* cctx;
+} LabelEncoder;
+
+static int label_blosc_compcode(const char* cname) {
+  if (strcmp(cname, "zstd") == 0) return BLOSC_ZSTD;
+  if (strcmp(cname, "lz4") == 0) return BLOSC_LZ4;
+  return BLOSC_BLOSCLZ;
+}
+
+static void label_encoder_free(LabelEncoder* e) {
+  free(e->labels);
+  cseg_buffer_free(&e->cseg);
+  free(e->compressed);
+  if (e->cctx) blosc2_free_ctx(e->cctx);
+  *e = (LabelEncoder){};
+}
+
+// Create root as an empty label array of the given zyx shape. Existing chunk files are left alone,
+// chunks written again are replaced
+static LabelVolume* label_volume_create(const char* root, const s32 shape[3], const s32 chunks[3], int label_bits,
+                                        const char* cname, int clevel) {
+  mkdir(root, 0755);
+  char path[1100];
+  snprintf(path, sizeof(path), "%s/.zarray", root);
+  FILE* fp = fopen(path, "w");
+  if (!fp) {
+    printf("could not create %s\n", path);
+    return nullptr;
+  }
+  fprintf(fp,
+          "{\n"
+          "  \"zarr_format\": 2,\n"
+          "  \"shape\": [%d, %d, %d],\n"
+          "  \"chunks\": [%d, %d, %d],\n"
+          "  \"dtype\": \"<u8\",\n"
+          "  \"fill_value\": 0,\n"
+          "  \"order\": \"C\",\n"
+          "  \"dimension_separator\": \"/\",\n"
+          "  \"filters\": [{\"id\": \"%s\", \"block_size\": [%d, %d, %d], \"data_type\": \"uint64\"}],\n"
+          "  \"compressor\": {\"id\": \"blosc\", \"cname\": \"%s\", \"clevel\": %d, \"shuffle\": 1, \"blocksize\": 0}\n"
+          "}\n",
+          shape[0], shape[1], shape[2], chunks[0], chunks[1], chunks[2],
+          CSEG_FILTER_ID, CSEG_BLOCK, CSEG_BLOCK, CSEG_BLOCK, cname, clevel);
+  bool ok = fclose(fp) == 0;
+
+  snprintf(path, sizeof(path), "%s/.zattrs", root);
+  fp = fopen(path, "w");
+  ok = ok && fp;
+  if (fp) {
+    fprintf(fp, "{\n  \"label_bits\": %d,\n  \"label_encoding\": \"(chunk index << label_bits) | (superpixel row + 1)\"\n}\n",
+            label_bits);
+    ok &= fclose(fp) == 0;
+  }
+  if (!ok) {
+    printf("could not write the metadata of %s\n", root);
+    return nullptr;
+  }
+
+  LabelVolume* v = calloc(1, sizeof(LabelVolume));
+  snprintf(v->root, sizeof(v->root), "%s", root);
+  memcpy(v->shape, shape, sizeof(v->shape));
+  memcpy(v->chunks, chunks, sizeof(v->chunks));
+  for (int d = 0; d < 3; d++) v->grid[d] = (shape[d] + chunks[d] - 1) / chunks[d];
+  v->label_bits = label_bits;
+  snprintf(v->cname, sizeof(v->cname), "%s", cname);
+  v->clevel = clevel;
+  return v;
+}
+
+// Open an array made by label_volume_create for reading
+static LabelVolume* label_volume_open(const char* root) {
+  char path[1100];
+  snprintf(path, sizeof(path), "%s/.zarray", root);
+  json_object* meta = json_object_from_file(path);
+  snprintf(path, sizeof(path), "%s/.zattrs", root);
+  json_object* attrs = json_object_from_file(path);
+
+  LabelVolume* v = calloc(1, sizeof(LabelVolume));
+  snprintf(v->root, sizeof(v->root), "%s", root);
+  json_object *filters, *compressor, *bits;
+  bool ok = meta && attrs && zarr3_get_shape(meta, "shape", v->shape) && zarr3_get_shape(meta, "chunks", v->chunks);
+  const char* dtype = ok ? zarr3_get_string(meta, "dtype") : nullptr;
+  ok = ok && dtype && strcmp(dtype, "<u8") == 0;
+  ok = ok && json_object_object_get_ex(meta, "filters", &filters) && json_object_array_length(filters) == 1;
+  const char* filter = ok ? zarr3_get_string(json_object_array_get_idx(filters, 0), "id") : nullptr;
+  ok = ok && filter && strcmp(filter, CSEG_FILTER_ID) == 0;
+  ok = ok && json_object_object_get_ex(attrs, "label_bits", &bits);
+  if (ok) {
+    v->label_bits = json_object_get_int(bits);
+    if (json_object_object_get_ex(meta, "compressor", &compressor)) {
+      const char* cname = zarr3_get_string(compressor, "cname");
+      snprintf(v->cname, sizeof(v->cname), "%s", cname ? cname : "");
+    }
+    for (int d = 0; d < 3; d++) {
+      ok &= v->chunks[d] > 0;
+      if (ok) v->grid[d] = (v->shape[d] + v->chunks[d] - 1) / v->chunks[d];
+    }
+  }
+  if (meta) json_object_put(meta);
+  if (attrs) json_object_put(attrs);
+  if (!ok) {
+    printf("%s is not a label volume\n", root);
+    free(v);
+    return nullptr;
+  }
+  return v;
+}
+
+static void label_volume_free(LabelVolume* v) { free(v); }
+
+// What a chunk's local labels are offset by
+static inline u64 label_chunk_base(const LabelVolume* v, s32 cz, s32 cy, s32 cx) {
+  return (((u64)cz * v->grid[1] + cy) * v->grid[2] + cx) << v->label_bits;
+}
+
+// Where a label came from, false for background
+static inline bool label_source(const LabelVolume* v, u64 label, s32 chunk[3], u32* row) {
+  if (label == 0) return false;
+  u64 index = label >> v->label_bits;
+  *row = (u32)(label & (((u64)1 << v->label_bits) - 1)) - 1;
+  chunk[2] = (s32)(index % v->grid[2]);
+  chunk[1] = (s32)(index / v->grid[2] % v->grid[1]);
+  chunk[0] = (s32)(index / v->grid[2] / v->grid[1]);
+  return true;
+}
+
+static void label_chunk_path(const LabelVolume* v, s32 cz, s32 cy, s32 cx, char* path, size_t len) {
+  snprintf(path, len, "%s/%d/%d/%d", v->root, cz, cy, cx);
+}
+
+// snic's labels for a chunk (superpixel rows, UINT32_MAX for background) as volume labels
+static void label_chunk_globalize(const LabelVolume* v, s32 cz, s32 cy, s32 cx, const u32* labels, u64* out) {
+  s64 n = (s64)v->chunks[0] * v->chunks[1] * v->chunks[2];
+  u64 base = label_chunk_base(v, cz, cy, cx);
+  for (s64 i = 0; i < n; i++) out[i] = labels[i] == UINT32_MAX ? 0 : base | ((u64)labels[i] + 1);
+}
+
+// Write a chunk of volume labels as they are. Thread safe as long as each thread has its own encoder
+static bool label_volume_write_labels(LabelVolume* v, LabelEncoder* e, s32 cz, s32 cy, s32 cx, const u64* labels) {
+  s64 t0 = io_now_ns();
+  s64 n = (s64)v->chunks[0] * v->chunks[1] * v->chunks[2];
+  if (!cseg_encode(&e->cseg, labels, v->chunks)) {
+    printf("label chunk %d %d %d doesn't fit the segmentation format\n", cz, cy, cx);
+    return false;
+  }
+  s64 filtered = e->cseg.count * (s64)sizeof(u32);
+  if (filtered > INT32_MAX - BLOSC2_MAX_OVERHEAD) return false;
+  if (e->compressed_cap < filtered + BLOSC2_MAX_OVERHEAD) {
+    free(e->compressed);
+    e->compressed_cap = filtered + BLOSC2_MAX_OVERHEAD;
+    e->compressed = malloc(e->compressed_cap);
+  }
+  if (!e->cctx) {
+    blosc2_cparams cparams = BLOSC2_CPARAMS_DEFAULTS;
+    cparams.compcode = label_blosc_compcode(v->cname);
+    cparams.clevel = v->clevel;
+    cparams.typesize = 4;
+    cparams.nthreads = 1;
+    cparams.filters[BLOSC2_MAX_FILTERS - 1] = BLOSC_SHUFFLE;
+    e->cctx = blosc2_create_cctx(cparams);
+  }
+  int size = blosc2_compress_ctx(e->cctx, e->cseg.words, (s32)filtered, e->compressed, (s32)e->compressed_cap);
+  if (size <= 0) {
+    printf("compressing label chunk %d %d %d failed: %d\n", cz, cy, cx, size);
+    return false;
+  }
+
+  char path[1200];
+  snprintf(path, sizeof(path), "%s/%d", v->root, cz);
+  mkdir(path, 0755);
+  snprintf(path, sizeof(path), "%s/%d/%d", v->root, cz, cy);
+  mkdir(path, 0755);
+  label_chunk_path(v, cz, cy, cx, path, sizeof(path));
+  FILE* fp = fopen(path, "wb");
+  bool ok = fp && fwrite(e->compressed, 1, size, fp) == (size_t)size;
+  if (fp) ok &= fclose(fp) == 0;
+  if (!ok) {
+    printf("could not write %s\n", path);
+    return false;
+  }
+
+  __atomic_fetch_add(&v->chunks_written, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&v->voxels, n, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&v->filtered_bytes, filtered, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&v->stored_bytes, size, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&v->encode_ns, io_now_ns() - t0, __ATOMIC_RELAXED);
+  return true;
+}
+
+// Write a chunk from snic's labels: superpixel rows, UINT32_MAX for background
+static bool label_volume_write_chunk(LabelVolume* v, LabelEncoder* e, s32 cz, s32 cy, s32 cx, const u32* labels) {
+  s64 n = (s64)v->chunks[0] * v->chunks[1] * v->chunks[2];
+  if (e->labels_cap < n) {
+    free(e->labels);
+    e->labels = malloc(n * sizeof(u64));
+    e->labels_cap = n;
+  }
+  label_chunk_globalize(v, cz, cy, cx, labels, e->labels);
+  return label_volume_write_labels(v, e, cz, cy, cx, e->labels);
+}
+
+// Decode a chunk into out, chunks[0] * chunks[1] * chunks[2] labels. Chunks that were never written
+// are background. Goes through the calling thread's zarr reader
+static bool label_volume_read_chunk(const LabelVolume* v, s32 cz, s32 cy, s32 cx, u64* out) {
+  s64 n = (s64)v->chunks[0] * v->chunks[1] * v->chunks[2];
+  char path[1200];
+  label_chunk_path(v, cz, cy, cx, path, sizeof(path));
+  if (access(path, F_OK) != 0) {
+    memset(out, 0, n * sizeof(u64));
+    return true;
+  }
+  ZarrReader* reader = zarr_thread_reader();
+  s64 compressed_size;
+  const u8* compressed = io_read_file(reader->io, path, &compressed_size);
+  if (!compressed) return false;
+
+  s32 nbytes = 0;
+  if (blosc2_cbuffer_sizes(compressed, &nbytes, nullptr, nullptr) < 0 || nbytes <= 0 || nbytes % 4) {
+    printf("%s is not a blosc chunk\n", path);
+    return false;
+  }
+  u8* words = zarr_reader_reserve(&reader->scratch, &reader->scratch_cap, nbytes);
+  if (blosc2_decompress_ctx(reader->dctx, compressed, (s32)compressed_size, words, nbytes) != nbytes ||
+      !cseg_decode((const u32*)words, nbytes / 4, v->chunks, out)) {
+    printf("could not decode %s\n", path);
+    return false;
+  }
+  return true;
+}
+
+static void label_volume_print_stats(const LabelVolume* v) {
+  f64 mb = 1.0 / (1024.0 * 1024.0);
+  f64 raw = (f64)v->voxels * sizeof(u64);
+  printf("labels %s: %lld chunks, %.1f MB of u64 labels -> %.1f MB segmentation (%.1fx) -> %.1f MB stored (%.1fx), "
+         "%.1f ms encode per chunk\n",
+         v->root, v->chunks_written, raw * mb, (f64)v->filtered_bytes * mb, raw / (f64)(v->filtered_bytes ? v->filtered_bytes : 1),
+         (f64)v->stored_bytes * mb, raw / (f64)(v->stored_bytes ? v->stored_bytes : 1),
+         v->chunks_written ? (f64)v->encode_ns * 1e-6 / (f64)v->chunks_written : 0.0);
+}
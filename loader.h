@@ -0,0 +1,588 @@
+#pragma once
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "volcano.h"
+#include "snic.h"
+#include "arena.h"
+
+// Fast loaders for the csv files the pipeline writes (see util.h for the writers). Files are mmap'ed
+// and parsed once, front to back, by a hand written scanner instead of fgets + sscanf, optionally
+// split into line ranges parsed in parallel. Results go into an Arena, so loading a whole run is a
+// handful of large allocations freed together.
+//
+// Each range parses straight into the final array at an upper bound of its row count (every row has
+// a minimum length), then the ranges are moved down to close the gaps, so nothing is parsed twice.
+// Malformed rows are skipped.
+
+#define LOADER_MIN_RANGE_BYTES (1ll << 20)
+#define LOADER_SUPERPIXEL_MIN_ROW 10  // 0,0,0,0,0\n
+#define LOADER_CHORD_DATA_MIN_ROW 14  // 0,0,0,0,0,0,0\n
+
+typedef struct MappedFile {
+  const char* data;
+  s64 size;
+} MappedFile;
+
+static bool map_file(const char* path, MappedFile* out) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return false;
+  }
+  *out = (MappedFile){.data = "", .size = st.st_size};
+  if (st.st_size > 0) {
+    void* base = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+      close(fd);
+      return false;
+    }
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+    out->data = base;
+  }
+  close(fd);
+  return true;
+}
+
+static void unmap_file(MappedFile* f) {
+  if (f->size > 0) munmap((void*)f->data, f->size);
+  *f = (MappedFile){};
+}
+
+// Number scanning. Each scanner takes the position to start at and returns the position after the
+// number, or nullptr if there isn't one there, and passes nullptr through so a row parses as a chain
+// of calls with one check at the end. The numbers we write are a few characters long, so a simple
+// digit loop beats anything wider.
+
+static inline bool scan_is_digit(char c) { return (u8)(c - '0') < 10; }
+
+static inline const char* scan_char(const char* p, const char* end, char c) {
+  return p && p < end && *p == c ? p + 1 : nullptr;
+}
+
+static inline const char* scan_u64(const char* p, const char* end, u64* out) {
+  if (!p) return nullptr;
+  const char* start = p;
+  u64 v = 0;
+  while (p < end && scan_is_digit(*p)) v = v * 10 + (u64)(*p++ - '0');
+  if (p == start || p - start > 19) return nullptr;
+  *out = v;
+  return p;
+}
+
+static inline const char* scan_u32(const char* p, const char* end, u32* out) {
+  u64 v;
+  p = scan_u64(p, end, &v);
+  if (!p || v > UINT32_MAX) return nullptr;
+  *out = (u32)v;
+  return p;
+}
+
+static inline const char* scan_s32(const char* p, const char* end, s32* out) {
+  if (!p) return nullptr;
+  bool neg = p < end && *p == '-';
+  u64 v;
+  p = scan_u64(neg ? p + 1 : p, end, &v);
+  if (!p || v > (u64)INT32_MAX + neg) return nullptr;
+  *out = neg ? (s32)-(s64)v : (s32)v;
+  return p;
+}
+
+static const char* scan_f32_slow(const char* p, const char* end, f32* out) {
+  char buf[64];
+  s64 n = end - p < (s64)sizeof(buf) - 1 ? end - p : (s64)sizeof(buf) - 1;
+  memcpy(buf, p, n);
+  buf[n] = '\0';
+  char* stop;
+  f32 v = strtof(buf, &stop);
+  if (stop == buf) return nullptr;
+  *out = v;
+  return p + (stop - buf);
+}
+
+static inline const char* scan_f32(const char* p, const char* end, f32* out) {
+  static const f32 pow10[] = {1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f};
+  if (!p) return nullptr;
+  const char* start = p;
+  bool neg = p < end && *p == '-';
+  if (neg || (p < end && *p == '+')) p++;
+  u64 mant = 0;
+  int digits = 0, frac = 0;
+  while (p < end && scan_is_digit(*p)) {
+    mant = mant * 10 + (u64)(*p++ - '0');
+    digits++;
+  }
+  if (p < end && *p == '.') {
+    p++;
+    while (p < end && scan_is_digit(*p)) {
+      mant = mant * 10 + (u64)(*p++ - '0');
+      digits++;
+      frac++;
+    }
+  }
+  // both operands exact in a float, so the division is correctly rounded, same as strtof.
+  // Anything else (exponents, long mantissas, inf, nan) goes to strtof
+  if (digits == 0 || digits > 18 || mant >= (1u << 24) || frac > 10 || (p < end && (*p == 'e' || *p == 'E'))) {
+    return scan_f32_slow(start, end, out);
+  }
+  f32 v = (f32)mant / pow10[frac];
+  *out = neg ? -v : v;
+  return p;
+}
+
+static inline bool scan_row_end(const char* p, const char* end) {
+  return p && (p == end || *p == '\n' || *p == '\r');
+}
+
+static inline const char* next_line(const char* p, const char* end) {
+  const char* nl = memchr(p, '\n', end - p);
+  return nl ? nl + 1 : end;
+}
+
+// Split [begin, end) into n ranges of whole lines, bounds gets n + 1 entries
+static void loader_split(const char* begin, const char* end, int n, const char** bounds) {
+  bounds[0] = begin;
+  for (int i = 1; i < n; i++) {
+    const char* b = begin + (end - begin) * i / n;
+    if (b < bounds[i - 1]) b = bounds[i - 1];
+    bounds[i] = b == begin ? b : next_line(b - 1, end);
+  }
+  bounds[n] = end;
+}
+
+static int loader_ranges(s64 bytes, int threads) {
+  s64 n = bytes / LOADER_MIN_RANGE_BYTES;
+  if (n > threads) n = threads;
+  return n < 1 ? 1 : (int)n;
+}
+
+static void loader_run(int n, void* (*fn)(void*), void* args, size_t arg_size) {
+  if (n == 1) {
+    fn(args);
+    return;
+  }
+  pthread_t threads[n];
+  for (int i = 0; i < n; i++) pthread_create(&threads[i], nullptr, fn, (u8*)args + i * arg_size);
+  for (int i = 0; i < n; i++) pthread_join(threads[i], nullptr);
+}
+
+// superpixels
+
+static s64 parse_superpixel_rows(const char* p, const char* end, Superpixel* out) {
+  s64 n = 0;
+  while (p < end) {
+    Superpixel sp;
+    const char* q = scan_f32(p, end, &sp.z);
+    q = scan_f32(scan_char(q, end, ','), end, &sp.y);
+    q = scan_f32(scan_char(q, end, ','), end, &sp.x);
+    q = scan_f32(scan_char(q, end, ','), end, &sp.c);
+    q = scan_u32(scan_char(q, end, ','), end, &sp.n);
+    if (scan_row_end(q, end)) out[n++] = sp;
+    p = next_line(q ? q : p, end);
+  }
+  return n;
+}
+
+typedef struct SuperpixelRange {
+  const char* begin;
+  const char* end;
+  Superpixel* out;
+  s64 count;
+} SuperpixelRange;
+
+static void* superpixel_range_thread(void* arg) {
+  SuperpixelRange* r = arg;
+  r->count = parse_superpixel_rows(r->begin, r->end, r->out);
+  return nullptr;
+}
+
+// Rows of a superpixels csv, -1 if the file can't be read
+static s64 load_superpixels_csv(const char* path, Arena* arena, int threads, Superpixel** out) {
+  MappedFile f;
+  if (!map_file(path, &f)) return -1;
+  const char* end = f.data + f.size;
+  const char* body = next_line(f.data, end);  // header
+
+  int n = loader_ranges(end - body, threads);
+  const char* bounds[n + 1];
+  loader_split(body, end, n, bounds);
+  SuperpixelRange ranges[n];
+  s64 bound = 0;
+  for (int i = 0; i < n; i++) {
+    ranges[i] = (SuperpixelRange){.begin = bounds[i], .end = bounds[i + 1]};
+    bound += (bounds[i + 1] - bounds[i]) / LOADER_SUPERPIXEL_MIN_ROW + 1;
+  }
+  Superpixel* all = arena_alloc(arena, bound * sizeof(Superpixel));
+  if (!all) {
+    unmap_file(&f);
+    return -1;
+  }
+  for (s64 i = 0, at = 0; i < n; i++) {
+    ranges[i].out = all + at;
+    at += (bounds[i + 1] - bounds[i]) / LOADER_SUPERPIXEL_MIN_ROW + 1;
+  }
+  loader_run(n, superpixel_range_thread, ranges, sizeof(SuperpixelRange));
+
+  s64 count = 0;
+  for (int i = 0; i < n; i++) {
+    memmove(all + count, ranges[i].out, ranges[i].count * sizeof(Superpixel));
+    count += ranges[i].count;
+  }
+  unmap_file(&f);
+  *out = all;
+  return count;
+}
+
+// A gzip'ed superpixels csv (superpixels_to_compressed_csv), inflated a window at a time and parsed
+// as it goes, so the whole text is never in memory
+static s64 load_compressed_superpixels_csv(const char* path, Arena* arena, Superpixel** out) {
+  constexpr s64 window = 1 << 20;
+  MappedFile f;
+  if (!map_file(path, &f)) return -1;
+  if (f.size < 18) {
+    unmap_file(&f);
+    return -1;
+  }
+  // the gzip trailer has the text size mod 4 GB, a bound that's only wrong for huge files
+  u32 isize;
+  memcpy(&isize, f.data + f.size - 4, sizeof(isize));
+  s64 cap = isize / LOADER_SUPERPIXEL_MIN_ROW + 1;
+  Superpixel* all = arena_alloc(arena, cap * sizeof(Superpixel));
+  char* text = malloc(window);
+
+  z_stream strm = {};
+  if (!all || !text || inflateInit2(&strm, 31) != Z_OK) {
+    free(text);
+    unmap_file(&f);
+    return -1;
+  }
+  strm.next_in = (u8*)f.data;
+  strm.avail_in = f.size;
+
+  s64 count = 0, have = 0;
+  bool header = true, ok = true, done = false;
+  while (ok && !done) {
+    strm.next_out = (u8*)text + have;
+    strm.avail_out = window - have;
+    int ret = inflate(&strm, Z_NO_FLUSH);
+    // concatenated gzip members are one stream
+    if (ret == Z_STREAM_END && strm.avail_in > 0) ret = inflateReset(&strm);
+    ok = ret == Z_OK || ret == Z_STREAM_END;
+    done = ret == Z_STREAM_END;
+    // all the input is in and inflate still wants more: the file was cut short, not finished
+    if (ret == Z_OK && strm.avail_in == 0 && strm.avail_out > 0) {
+      printf("%s is truncated\n", path);
+      ok = false;
+    }
+    have = window - strm.avail_out;
+
+    // parse up to the last full line, keep the rest for the next window
+    const char* stop = text + have;
+    if (!done) {
+      while (stop > text && stop[-1] != '\n') stop--;
+      if (stop == text && have == window) ok = false;  // a line longer than the window
+    }
+    const char* p = text;
+    if (header && stop > text) {
+      p = next_line(text, stop);
+      header = false;
+    }
+    s64 need = count + (stop - p) / LOADER_SUPERPIXEL_MIN_ROW + 1;
+    if (ok && need > cap) {
+      cap = need * 2;
+      Superpixel* bigger = arena_alloc(arena, cap * sizeof(Superpixel));
+      if (bigger) memcpy(bigger, all, count * sizeof(Superpixel));
+      all = bigger;
+      ok = all != nullptr;
+    }
+    if (ok) count += parse_superpixel_rows(p, stop, all + count);
+    have = text + have - stop;
+    memmove(text, stop, have);
+  }
+  inflateEnd(&strm);
+  free(text);
+  unmap_file(&f);
+  if (!ok) return -1;
+  *out = all;
+  return count;
+}
+
+// chords
+
+// chord i is points[offsets[i], offsets[i + 1]). point_data has each point's superpixel, only when
+// loaded from a chords.only file
+typedef struct LoadedChords {
+  s64 count;
+  u64* offsets;
+  u32* points;
+  Superpixel* point_data;
+} LoadedChords;
+
+typedef struct ChordRange {
+  const char* begin;
+  const char* end;
+  u64* ends;      // end of each chord, relative to points
+  u32* points;
+  s64 count;
+  s64 num_points;
+} ChordRange;
+
+static void* chord_range_thread(void* arg) {
+  ChordRange* r = arg;
+  const char* p = r->begin;
+  const char* end = r->end;
+  s64 n = 0, k = 0;
+  while (p < end) {
+    // a row is a comma separated list of superpixel ids, possibly empty
+    const char* q = p;
+    while (q < end && *q != '\n' && *q != '\r') {
+      q = scan_u32(q, end, &r->points[k]);
+      if (!q) break;
+      k++;
+      if (q < end && *q == ',') q++;
+    }
+    r->ends[n++] = k;
+    p = next_line(q ? q : p, end);
+  }
+  r->count = n;
+  r->num_points = k;
+  return nullptr;
+}
+
+// Chords csv (chords_to_csv) into out, false if the file can't be read
+static bool load_chords_csv(const char* path, Arena* arena, int threads, LoadedChords* out) {
+  MappedFile f;
+  if (!map_file(path, &f)) return false;
+  const char* end = f.data + f.size;
+  const char* body = next_line(f.data, end);
+
+  int n = loader_ranges(end - body, threads);
+  const char* bounds[n + 1];
+  loader_split(body, end, n, bounds);
+  ChordRange ranges[n];
+  // every row takes at least a newline, every point at least 2 bytes
+  s64 row_bound = 0, point_bound = 0;
+  for (int i = 0; i < n; i++) {
+    row_bound += bounds[i + 1] - bounds[i] + 1;
+    point_bound += (bounds[i + 1] - bounds[i]) / 2 + 1;
+  }
+  u64* offsets = arena_alloc(arena, (row_bound + 1) * sizeof(u64));
+  u32* points = arena_alloc(arena, point_bound * sizeof(u32));
+  if (!offsets || !points) {
+    unmap_file(&f);
+    return false;
+  }
+  for (s64 i = 0, rows = 0, pts = 0; i < n; i++) {
+    ranges[i] = (ChordRange){.begin = bounds[i], .end = bounds[i + 1], .ends = offsets + 1 + rows, .points = points + pts};
+    rows += bounds[i + 1] - bounds[i] + 1;
+    pts += (bounds[i + 1] - bounds[i]) / 2 + 1;
+  }
+  loader_run(n, chord_range_thread, ranges, sizeof(ChordRange));
+
+  // close the gaps, the destination is never past the source so left to right is safe
+  s64 count = 0, num_points = 0;
+  offsets[0] = 0;
+  for (int i = 0; i < n; i++) {
+    for (s64 j = 0; j < ranges[i].count; j++) offsets[1 + count + j] = num_points + ranges[i].ends[j];
+    memmove(points + num_points, ranges[i].points, ranges[i].num_points * sizeof(u32));
+    count += ranges[i].count;
+    num_points += ranges[i].num_points;
+  }
+  unmap_file(&f);
+  *out = (LoadedChords){.count = count, .offsets = offsets, .points = points};
+  return true;
+}
+
+typedef struct ChordDataRange {
+  const char* begin;
+  const char* end;
+  s32* chord_ids;
+  u32* points;
+  Superpixel* data;
+  s64 count;
+  s32 max_id;
+} ChordDataRange;
+
+static void* chord_data_range_thread(void* arg) {
+  ChordDataRange* r = arg;
+  const char* p = r->begin;
+  const char* end = r->end;
+  s64 n = 0;
+  r->max_id = -1;
+  while (p < end) {
+    s32 id;
+    Superpixel sp;
+    const char* q = scan_s32(p, end, &id);
+    q = scan_u32(scan_char(q, end, ','), end, &r->points[n]);
+    q = scan_f32(scan_char(q, end, ','), end, &sp.z);
+    q = scan_f32(scan_char(q, end, ','), end, &sp.y);
+    q = scan_f32(scan_char(q, end, ','), end, &sp.x);
+    q = scan_f32(scan_char(q, end, ','), end, &sp.c);
+    q = scan_u32(scan_char(q, end, ','), end, &sp.n);
+    if (scan_row_end(q, end) && id >= 0) {
+      r->chord_ids[n] = id;
+      r->data[n++] = sp;
+      if (id > r->max_id) r->max_id = id;
+    }
+    p = next_line(q ? q : p, end);
+  }
+  r->count = n;
+  return nullptr;
+}
+
+// chords.only csv (chords_with_data_to_csv), one row per point, into out with point_data filled in.
+// Chords come out in id order with their points in file order, ids nobody used are empty chords
+static bool load_chords_with_data_csv(const char* path, Arena* arena, int threads, LoadedChords* out) {
+  MappedFile f;
+  if (!map_file(path, &f)) return false;
+  const char* end = f.data + f.size;
+  const char* body = next_line(f.data, end);
+
+  int n = loader_ranges(end - body, threads);
+  const char* bounds[n + 1];
+  loader_split(body, end, n, bounds);
+  ChordDataRange ranges[n];
+  s64 bound = 0;
+  for (int i = 0; i < n; i++) bound += (bounds[i + 1] - bounds[i]) / LOADER_CHORD_DATA_MIN_ROW + 1;
+  // rows in file order, grouped by chord below
+  s32* ids = malloc(bound * sizeof(s32));
+  u32* row_points = malloc(bound * sizeof(u32));
+  Superpixel* row_data = malloc(bound * sizeof(Superpixel));
+  bool ok = ids && row_points && row_data;
+  for (s64 i = 0, at = 0; ok && i < n; i++) {
+    ranges[i] = (ChordDataRange){.begin = bounds[i], .end = bounds[i + 1],
+                                 .chord_ids = ids + at, .points = row_points + at, .data = row_data + at};
+    at += (bounds[i + 1] - bounds[i]) / LOADER_CHORD_DATA_MIN_ROW + 1;
+  }
+  if (ok) loader_run(n, chord_data_range_thread, ranges, sizeof(ChordDataRange));
+
+  s64 rows = 0;
+  s32 max_id = -1;
+  for (int i = 0; ok && i < n; i++) {
+    rows += ranges[i].count;
+    if (ranges[i].max_id > max_id) max_id = ranges[i].max_id;
+  }
+  s64 count = max_id + 1;
+  u64* offsets = ok ? arena_alloc(arena, (count + 1) * sizeof(u64)) : nullptr;
+  u32* points = ok ? arena_alloc(arena, (rows ? rows : 1) * sizeof(u32)) : nullptr;
+  Superpixel* data = ok ? arena_alloc(arena, (rows ? rows : 1) * sizeof(Superpixel)) : nullptr;
+  ok = offsets && points && data;
+  if (ok) {
+    // counting sort by chord id
+    for (int i = 0; i < n; i++) {
+      for (s64 j = 0; j < ranges[i].count; j++) offsets[ranges[i].chord_ids[j] + 1]++;
+    }
+    for (s64 c = 0; c < count; c++) offsets[c + 1] += offsets[c];
+    u64* fill = malloc((count ? count : 1) * sizeof(u64));
+    ok = fill != nullptr;
+    if (ok) {
+      memcpy(fill, offsets, count * sizeof(u64));
+      for (int i = 0; i < n; i++) {
+        for (s64 j = 0; j < ranges[i].count; j++) {
+          u64 at = fill[ranges[i].chord_ids[j]]++;
+          points[at] = ranges[i].points[j];
+          data[at] = ranges[i].data[j];
+        }
+      }
+      *out = (LoadedChords){.count = count, .offsets = offsets, .points = points, .point_data = data};
+    }
+    free(fill);
+  }
+  free(ids);
+  free(row_points);
+  free(row_data);
+  unmap_file(&f);
+  return ok;
+}
+
+// A whole output directory
+
+typedef struct LoadedChunk {
+  s32 chunk[3];
+  s64 num_superpixels;
+  Superpixel* superpixels;
+  LoadedChords chords;    // empty if the chunk has no chords file
+} LoadedChunk;
+
+typedef struct LoadedOutputs {
+  s64 count;
+  LoadedChunk* chunks;
+  int num_arenas;
+  Arena** arenas;
+  s64 failed;
+} LoadedOutputs;
+
+typedef struct OutputDirArgs {
+  const char* dir;
+  LoadedChunk* chunks;
+  s64 count;
+  s64* next;
+  Arena* arena;
+  s64 failed;
+} OutputDirArgs;
+
+static void* output_dir_thread(void* arg) {
+  OutputDirArgs* a = arg;
+  char path[2048];
+  for (s64 i; (i = __atomic_fetch_add(a->next, 1, __ATOMIC_RELAXED)) < a->count;) {
+    LoadedChunk* c = &a->chunks[i];
+    snprintf(path, sizeof(path), "%s/superpixels.%d.%d.%d.csv", a->dir, c->chunk[0], c->chunk[1], c->chunk[2]);
+    c->num_superpixels = load_superpixels_csv(path, a->arena, 1, &c->superpixels);
+    if (c->num_superpixels < 0) {
+      c->num_superpixels = 0;
+      a->failed++;
+    }
+    snprintf(path, sizeof(path), "%s/chords.%d.%d.%d.csv", a->dir, c->chunk[0], c->chunk[1], c->chunk[2]);
+    load_chords_csv(path, a->arena, 1, &c->chords);
+  }
+  return nullptr;
+}
+
+// superpixels and chords csvs of every chunk in dir, a file per thread at a time. Free with
+// loaded_outputs_free
+static bool load_output_dir(const char* dir, int threads, LoadedOutputs* out) {
+  DIR* d = opendir(dir);
+  if (!d) return false;
+  *out = (LoadedOutputs){};
+  s64 cap = 1024;
+  out->chunks = malloc(cap * sizeof(LoadedChunk));
+  struct dirent* ent;
+  while ((ent = readdir(d))) {
+    s32 cz, cy, cx;
+    int end = 0;
+    if (sscanf(ent->d_name, "superpixels.%d.%d.%d.csv%n", &cz, &cy, &cx, &end) != 3 || ent->d_name[end] != '\0') {
+      continue;
+    }
+    if (out->count == cap) {
+      cap *= 2;
+      out->chunks = realloc(out->chunks, cap * sizeof(LoadedChunk));
+    }
+    out->chunks[out->count++] = (LoadedChunk){.chunk = {cz, cy, cx}};
+  }
+  closedir(d);
+
+  int n = threads < 1 ? 1 : threads;
+  out->num_arenas = n;
+  out->arenas = calloc(n, sizeof(Arena*));
+  OutputDirArgs args[n];
+  s64 next = 0;
+  for (int i = 0; i < n; i++) {
+    out->arenas[i] = arena_new();
+    args[i] = (OutputDirArgs){.dir = dir, .chunks = out->chunks, .count = out->count, .next = &next, .arena = out->arenas[i]};
+  }
+  loader_run(n, output_dir_thread, args, sizeof(OutputDirArgs));
+  for (int i = 0; i < n; i++) out->failed += args[i].failed;
+  return true;
+}
+
+static void loaded_outputs_free(LoadedOutputs* out) {
+  for (int i = 0; i < out->num_arenas; i++) arena_free(out->arenas[i]);
+  free(out->arenas);
+  free(out->chunks);
+  *out = (LoadedOutputs){};
+}
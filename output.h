@@ -0,0 +1,474 @@
+#pragma once
+
+#include <sys/stat.h>
+
+#include "volcano.h"
+#include "snic.h"
+#include "chord.h"
+
+// Binary per chunk results. A table is a fixed header, a column directory and the columns themselves,
+// each one a little-endian array aligned to 64 bytes, so a reader can mmap a table and use the columns
+// in place with no parsing. Tables are built in memory and written whole (or packed, see pack.h).
+// Unlike the CSV files the floats are exact.
+//
+// Version 1 tables:
+//   VCB_SUPERPIXELS  z y x c (f32), n (u32), one row per superpixel
+//   VCB_CHORDS       offsets (u64, rows + 1 entries), points (u32 superpixel indices, offsets[rows] entries)
+//   VCB_CHORD_STATS  one column per ChordStats field, bbox is 6 wide (min/max per axis), center_of_mass 3 wide
+//   VCB_STITCHED_CHORDS  chords stitched across chunks (stitch.h), one row per stitched chord: offsets
+//                    (u64, rows + 1) into points (f32, 3 wide, global zyx), piece_offsets (u64, rows + 1)
+//                    into pieces (s32, 5 wide: chunk zyx, row in its VCB_CHORDS table, 1 if walked
+//                    backwards). Filed under the chunk whose completion finished them, the ones still
+//                    open at the end of the run under chunk -1 -1 -1
+//   VCB_SUPERPIXEL_EDGES  the superpixel graph inside the chunk, one row per superpixel: offsets (u64,
+//                    rows + 1) into neighbor (u32 superpixel rows) and strength (f32)
+//   VCB_FACE_LABELS  the superpixel labels on the chunk's six faces (graph.h joins them across chunks),
+//                    one row per face in -z +z -y +y -x +x order: offsets (u64, 7) into labels (u32
+//                    superpixel rows, UINT32_MAX for none). Face 2 * axis + side is the layer at 0 or
+//                    dims[axis] - 1, laid out in zyx order over the other two axes
+//   VCB_FIBER_COMPONENTS  the fiber mask's connected components in the chunk (components.h joins them
+//                    across chunks), one row per component: voxels (u64), and face_offsets (u64, 7) into
+//                    face_labels (u32 component rows, UINT32_MAX for none) laid out like VCB_FACE_LABELS
+//   VCB_CHORD_FIBERS the fiber components the chunk's chords run through (association.h), one row per
+//                    chord: class (u32 ChordFiberClass), in_fiber (u32 points in some fiber), offsets
+//                    (u64, rows + 1) into fibers (u32 component rows, most points first) and counts (u32),
+//                    point_fibers (u32 component row per point of VCB_CHORDS, UINT32_MAX for none)
+//   VCB_FIBER_CHORDS the other way around, one row per fiber component: offsets (u64, rows + 1) into
+//                    chords (u32 VCB_CHORDS rows, ascending)
+// Readers look columns up by name and must ignore columns they don't know, so adding a column doesn't
+// need a version bump. Changing the meaning of an existing one does.
+
+#define VCB_MAGIC "VOLCVCB"
+#define VCB_VERSION 1
+#define VCB_ALIGN 64
+#define VCB_MAX_COLUMNS 24
+
+typedef enum VcbKind {
+  VCB_SUPERPIXELS = 1,
+  VCB_CHORDS = 2,
+  VCB_CHORD_STATS = 3,
+  VCB_STITCHED_CHORDS = 4,
+  VCB_SUPERPIXEL_EDGES = 5,
+  VCB_FACE_LABELS = 6,
+  VCB_FIBER_COMPONENTS = 7,
+  VCB_CHORD_FIBERS = 8,
+  VCB_FIBER_CHORDS = 9,
+} VcbKind;
+
+typedef enum VcbType {
+  VCB_U32 = 1,
+  VCB_S32 = 2,
+  VCB_U64 = 3,
+  VCB_F32 = 4,
+} VcbType;
+
+static int vcb_type_size(VcbType type) {
+  switch (type) {
+    case VCB_U32: case VCB_S32: case VCB_F32: return 4;
+    case VCB_U64: return 8;
+  }
+  return 0;
+}
+
+typedef struct VcbColumn {
+  char name[24];
+  u32 type;
+  u32 width;      // values per row
+  u64 offset;     // from the start of the table
+  u64 count;      // values, not rows
+} VcbColumn;
+
+// Parameters of the run that produced a table, enough to tell tables from different runs apart
+typedef struct VcbParams {
+  f32 iso;
+  s32 halo;
+  s32 d_seed;
+  f32 compactness;
+} VcbParams;
+
+typedef struct VcbHeader {
+  char magic[8];
+  u32 version;
+  u32 kind;
+  s32 origin[3];    // zyx voxel coordinate of the chunk's first voxel
+  s32 dims[3];
+  VcbParams params;
+  u64 rows;
+  u64 total_bytes;
+  u32 num_columns;
+  u32 reserved;
+  VcbColumn columns[];
+} VcbHeader;
+
+static_assert(sizeof(VcbColumn) == 48, "VcbColumn is part of the file format");
+
+// Building a table: vcb_begin, vcb_add_column per column, then the finished buffer is
+// builder.data[0, builder.size)
+typedef struct VcbBuilder {
+  u8* data;
+  s64 size;
+  s64 cap;
+} VcbBuilder;
+
+static void vcb_reserve(VcbBuilder* b, s64 size) {
+  if (size <= b->cap) return;
+  s64 cap = b->cap ? b->cap : 4096;
+  while (cap < size) cap *= 2;
+  b->data = realloc(b->data, cap);
+  b->cap = cap;
+}
+
+static inline VcbHeader* vcb_builder_header(VcbBuilder* b) { return (VcbHeader*)b->data; }
+
+static s64 vcb_align(s64 n) { return (n + VCB_ALIGN - 1) & ~(s64)(VCB_ALIGN - 1); }
+
+// Starts a new table in b, reusing its buffer
+static void vcb_begin(VcbBuilder* b, VcbKind kind, const s32 origin[3], const s32 dims[3], VcbParams params, u64 rows) {
+  s64 header_size = vcb_align(sizeof(VcbHeader) + VCB_MAX_COLUMNS * sizeof(VcbColumn));
+  vcb_reserve(b, header_size);
+  memset(b->data, 0, header_size);
+  VcbHeader* h = vcb_builder_header(b);
+  memcpy(h->magic, VCB_MAGIC, sizeof(h->magic));
+  h->version = VCB_VERSION;
+  h->kind = kind;
+  memcpy(h->origin, origin, sizeof(h->origin));
+  memcpy(h->dims, dims, sizeof(h->dims));
+  h->params = params;
+  h->rows = rows;
+  b->size = header_size;
+  h->total_bytes = b->size;
+}
+
+// Appends a column and returns where to write its count values, valid until the next add
+static void* vcb_add_column(VcbBuilder* b, const char* name, VcbType type, u32 width, u64 count) {
+  VcbHeader* h = vcb_builder_header(b);
+  assert(h->num_columns < VCB_MAX_COLUMNS);
+  s64 offset = vcb_align(b->size);
+  s64 end = offset + (s64)count * vcb_type_size(type);
+  vcb_reserve(b, end);
+  h = vcb_builder_header(b);
+  memset(b->data + b->size, 0, end - b->size);
+
+  VcbColumn* col = &h->columns[h->num_columns++];
+  snprintf(col->name, sizeof(col->name), "%s", name);
+  col->type = type;
+  col->width = width;
+  col->offset = offset;
+  col->count = count;
+  b->size = end;
+  h->total_bytes = end;
+  return b->data + offset;
+}
+
+static void vcb_builder_free(VcbBuilder* b) {
+  free(b->data);
+  *b = (VcbBuilder){};
+}
+
+static void vcb_superpixels(VcbBuilder* b, const s32 origin[3], const s32 dims[3], VcbParams params,
+                            const Superpixel* superpixels, int num_superpixels) {
+  vcb_begin(b, VCB_SUPERPIXELS, origin, dims, params, num_superpixels);
+  f32* z = vcb_add_column(b, "z", VCB_F32, 1, num_superpixels);
+  for (int i = 0; i < num_superpixels; i++) z[i] = superpixels[i].z;
+  f32* y = vcb_add_column(b, "y", VCB_F32, 1, num_superpixels);
+  for (int i = 0; i < num_superpixels; i++) y[i] = superpixels[i].y;
+  f32* x = vcb_add_column(b, "x", VCB_F32, 1, num_superpixels);
+  for (int i = 0; i < num_superpixels; i++) x[i] = superpixels[i].x;
+  f32* c = vcb_add_column(b, "c", VCB_F32, 1, num_superpixels);
+  for (int i = 0; i < num_superpixels; i++) c[i] = superpixels[i].c;
+  u32* n = vcb_add_column(b, "n", VCB_U32, 1, num_superpixels);
+  for (int i = 0; i < num_superpixels; i++) n[i] = superpixels[i].n;
+}
+
+static void vcb_chords(VcbBuilder* b, const s32 origin[3], const s32 dims[3], VcbParams params,
+                       const Chord* chords, int num_chords) {
+  vcb_begin(b, VCB_CHORDS, origin, dims, params, num_chords);
+  u64* offsets = vcb_add_column(b, "offsets", VCB_U64, 1, num_chords + 1);
+  offsets[0] = 0;
+  for (int i = 0; i < num_chords; i++) offsets[i + 1] = offsets[i] + chords[i].point_count;
+  u64 total = offsets[num_chords];
+  u32* points = vcb_add_column(b, "points", VCB_U32, 1, total);
+  for (int i = 0, k = 0; i < num_chords; i++) {
+    memcpy(points + k, chords[i].points, chords[i].point_count * sizeof(u32));
+    k += chords[i].point_count;
+  }
+}
+
+static void vcb_chord_stats(VcbBuilder* b, const s32 origin[3], const s32 dims[3], VcbParams params,
+                            const ChordStats* stats, int num_chords) {
+  vcb_begin(b, VCB_CHORD_STATS, origin, dims, params, num_chords);
+  #define stats_column(field, T, type) do { \
+      T* col = vcb_add_column(b, #field, type, 1, num_chords); \
+      for (int i = 0; i < num_chords; i++) col[i] = stats[i].field; \
+    } while (0)
+  stats_column(num_superpixels, s32, VCB_S32);
+  stats_column(total_path_length, f32, VCB_F32);
+  stats_column(avg_step_distance, f32, VCB_F32);
+  stats_column(straightness, f32, VCB_F32);
+  stats_column(avg_intensity, f32, VCB_F32);
+  stats_column(min_intensity, f32, VCB_F32);
+  stats_column(max_intensity, f32, VCB_F32);
+  stats_column(intensity_stddev, f32, VCB_F32);
+  stats_column(avg_axis_deviation, f32, VCB_F32);
+  stats_column(avg_connection_strength, f32, VCB_F32);
+  stats_column(min_connections, s32, VCB_S32);
+  stats_column(max_connections, s32, VCB_S32);
+  #undef stats_column
+  f32* bbox = vcb_add_column(b, "bbox", VCB_F32, 6, (u64)num_chords * 6);
+  for (int i = 0; i < num_chords; i++) memcpy(bbox + i * 6, stats[i].bbox, 6 * sizeof(f32));
+  f32* com = vcb_add_column(b, "center_of_mass", VCB_F32, 3, (u64)num_chords * 3);
+  for (int i = 0; i < num_chords; i++) memcpy(com + i * 3, stats[i].center_of_mass, 3 * sizeof(f32));
+}
+
+static void vcb_superpixel_edges(VcbBuilder* b, const s32 origin[3], const s32 dims[3], VcbParams params,
+                                 const SuperpixelConnections* connections, int num_superpixels) {
+  vcb_begin(b, VCB_SUPERPIXEL_EDGES, origin, dims, params, num_superpixels);
+  u64* offsets = vcb_add_column(b, "offsets", VCB_U64, 1, num_superpixels + 1);
+  offsets[0] = 0;
+  for (int i = 0; i < num_superpixels; i++) offsets[i + 1] = offsets[i] + connections[i].num_connections;
+  u64 total = offsets[num_superpixels];
+  u32* neighbor = vcb_add_column(b, "neighbor", VCB_U32, 1, total);
+  for (int i = 0, k = 0; i < num_superpixels; i++) {
+    for (int j = 0; j < connections[i].num_connections; j++) neighbor[k++] = connections[i].connections[j].neighbor_label;
+  }
+  f32* strength = vcb_add_column(b, "strength", VCB_F32, 1, total);
+  for (int i = 0, k = 0; i < num_superpixels; i++) {
+    for (int j = 0; j < connections[i].num_connections; j++) strength[k++] = connections[i].connections[j].connection_strength;
+  }
+}
+
+static void vcb_face_offsets(const s32 dims[3], u64 offsets[7]) {
+  offsets[0] = 0;
+  for (int face = 0; face < 6; face++) {
+    int axis = face / 2;
+    offsets[face + 1] = offsets[face] + (u64)dims[(axis + 1) % 3] * dims[(axis + 2) % 3];
+  }
+}
+
+// The six faces of a zyx volume of labels, -z +z -y +y -x +x one after the other
+static void vcb_copy_faces(const s32 dims[3], const u32* labels, u32* out) {
+  for (int face = 0; face < 6; face++) {
+    int axis = face / 2;
+    s32 p[3], lo[3] = {}, hi[3] = {dims[0], dims[1], dims[2]};
+    lo[axis] = face % 2 ? dims[axis] - 1 : 0;
+    hi[axis] = lo[axis] + 1;
+    for (p[0] = lo[0]; p[0] < hi[0]; p[0]++) {
+      for (p[1] = lo[1]; p[1] < hi[1]; p[1]++) {
+        for (p[2] = lo[2]; p[2] < hi[2]; p[2]++) *out++ = labels[((s64)p[0] * dims[1] + p[1]) * dims[2] + p[2]];
+      }
+    }
+  }
+}
+
+// labels is the chunk's dims[0] * dims[1] * dims[2] superpixel labels, zyx
+static void vcb_face_labels(VcbBuilder* b, const s32 origin[3], const s32 dims[3], VcbParams params, const u32* labels) {
+  vcb_begin(b, VCB_FACE_LABELS, origin, dims, params, 6);
+  u64* offsets = vcb_add_column(b, "offsets", VCB_U64, 1, 7);
+  vcb_face_offsets(dims, offsets);
+  vcb_copy_faces(dims, labels, vcb_add_column(b, "labels", VCB_U32, 1, offsets[6]));
+}
+
+// components is the chunk's fiber components as rows, UINT32_MAX for no fiber, zyx
+static void vcb_fiber_components(VcbBuilder* b, const s32 origin[3], const s32 dims[3], VcbParams params,
+                                 const u32* components, u32 num_components) {
+  vcb_begin(b, VCB_FIBER_COMPONENTS, origin, dims, params, num_components);
+  u64* voxels = vcb_add_column(b, "voxels", VCB_U64, 1, num_components);
+  s64 n = (s64)dims[0] * dims[1] * dims[2];
+  for (s64 i = 0; i < n; i++) {
+    if (components[i] < num_components) voxels[components[i]]++;
+  }
+  u64 offsets[7];
+  vcb_face_offsets(dims, offsets);
+  memcpy(vcb_add_column(b, "face_offsets", VCB_U64, 1, 7), offsets, sizeof(offsets));
+  vcb_copy_faces(dims, components, vcb_add_column(b, "face_labels", VCB_U32, 1, offsets[6]));
+}
+
+// Write a finished table to its own file, via a temp name so readers never map a partial table
+static bool vcb_write(const VcbBuilder* b, const char* path) {
+  char tmp[1100];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  FILE* fp = fopen(tmp, "wb");
+  if (!fp) return false;
+  bool ok = fwrite(b->data, 1, b->size, fp) == (size_t)b->size;
+  ok &= fclose(fp) == 0;
+  if (!ok || rename(tmp, path) != 0) {
+    unlink(tmp);
+    return false;
+  }
+  return true;
+}
+
+// A table in memory, mapped or not. Column pointers point into it
+typedef struct VcbTable {
+  const VcbHeader* header;
+  s64 size;
+  void* mapping;
+  void* owned;    // decoded copy, see pack.h
+} VcbTable;
+
+// Validate a table at data. Returns false for anything malformed or a newer version
+static bool vcb_table_from_memory(const void* data, s64 size, VcbTable* out) {
+  const VcbHeader* h = data;
+  if (size < (s64)sizeof(VcbHeader) || memcmp(h->magic, VCB_MAGIC, sizeof(h->magic)) != 0) return false;
+  if (h->version > VCB_VERSION || h->num_columns > VCB_MAX_COLUMNS || (s64)h->total_bytes > size) return false;
+  if ((s64)(sizeof(VcbHeader) + h->num_columns * sizeof(VcbColumn)) > size) return false;
+  for (u32 i = 0; i < h->num_columns; i++) {
+    // written as divisions so a huge offset or count can't wrap around into range
+    const VcbColumn* c = &h->columns[i];
+    int type_size = vcb_type_size(c->type);
+    if (type_size == 0 || c->offset % VCB_ALIGN != 0 || c->offset > h->total_bytes ||
+        c->count > (h->total_bytes - c->offset) / (u64)type_size) {
+      return false;
+    }
+  }
+  *out = (VcbTable){.header = h, .size = (s64)h->total_bytes};
+  return true;
+}
+
+static bool vcb_open(const char* path, VcbTable* out) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+  void* base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) return false;
+  if (!vcb_table_from_memory(base, st.st_size, out)) {
+    munmap(base, st.st_size);
+    return false;
+  }
+  out->mapping = base;
+  out->size = st.st_size;
+  return true;
+}
+
+static void vcb_close(VcbTable* t) {
+  if (t->mapping) munmap(t->mapping, t->size);
+  free(t->owned);
+  *t = (VcbTable){};
+}
+
+// Column data by name and type, nullptr if the table doesn't have it
+static const void* vcb_column(const VcbTable* t, const char* name, VcbType type, u64* count) {
+  const VcbHeader* h = t->header;
+  for (u32 i = 0; i < h->num_columns; i++) {
+    if (h->columns[i].type == type && strncmp(h->columns[i].name, name, sizeof(h->columns[i].name)) == 0) {
+      if (count) *count = h->columns[i].count;
+      return (const u8*)h + h->columns[i].offset;
+    }
+  }
+  return nullptr;
+}
+
+// vcb_column for a column of exactly rows rows of width values, nullptr if it's missing or any other
+// length. The header's rows is only as trustworthy as the file, so the views check every column with it
+static const void* vcb_column_rows(const VcbTable* t, const char* name, VcbType type, u64 width, u64 rows) {
+  u64 count;
+  const void* col = vcb_column(t, name, type, &count);
+  if (!col || width == 0 || count % width != 0 || count / width != rows) return nullptr;
+  return col;
+}
+
+// A CSR offsets column for rows rows, nullptr unless it has rows + 1 entries that start at 0, never
+// decrease and end at or before total, so row i's range [offsets[i], offsets[i + 1]) can be read as is
+static const u64* vcb_offsets(const VcbTable* t, const char* name, u64 rows, u64 total) {
+  const u64* offsets = vcb_column_rows(t, name, VCB_U64, 1, rows + 1);
+  if (!offsets || offsets[0] != 0 || offsets[rows] > total) return nullptr;
+  for (u64 i = 0; i < rows; i++) {
+    if (offsets[i + 1] < offsets[i]) return nullptr;
+  }
+  return offsets;
+}
+
+// The six face label columns of a table (vcb_face_labels, vcb_fiber_components), nullptr unless the
+// offsets are the ones its dims give and the labels are as long as they say, so the faces can be
+// indexed without further checks
+static const u32* vcb_faces(const VcbTable* t, const char* offsets_name, const char* labels_name, const u64** offsets) {
+  u64 expected[7], num_offsets, num_labels;
+  vcb_face_offsets(t->header->dims, expected);
+  *offsets = vcb_column(t, offsets_name, VCB_U64, &num_offsets);
+  const u32* labels = vcb_column(t, labels_name, VCB_U32, &num_labels);
+  if (!*offsets || !labels || num_offsets != 7 || memcmp(*offsets, expected, sizeof(expected)) != 0 ||
+      num_labels != expected[6]) {
+    return nullptr;
+  }
+  return labels;
+}
+
+typedef struct VcbSuperpixelView {
+  u64 count;
+  const f32 *z, *y, *x, *c;
+  const u32* n;
+} VcbSuperpixelView;
+
+static bool vcb_superpixel_view(const VcbTable* t, VcbSuperpixelView* v) {
+  if (t->header->kind != VCB_SUPERPIXELS) return false;
+  u64 rows = v->count = t->header->rows;
+  v->z = vcb_column_rows(t, "z", VCB_F32, 1, rows);
+  v->y = vcb_column_rows(t, "y", VCB_F32, 1, rows);
+  v->x = vcb_column_rows(t, "x", VCB_F32, 1, rows);
+  v->c = vcb_column_rows(t, "c", VCB_F32, 1, rows);
+  v->n = vcb_column_rows(t, "n", VCB_U32, 1, rows);
+  return v->z && v->y && v->x && v->c && v->n;
+}
+
+// Chord i is points[offsets[i], offsets[i + 1]). The offsets are checked to start at 0, never
+// decrease and end inside points, so every chord can be read without further checks
+typedef struct VcbChordView {
+  u64 count;
+  u64 num_points;
+  const u64* offsets;
+  const u32* points;
+} VcbChordView;
+
+static bool vcb_chord_view(const VcbTable* t, VcbChordView* v) {
+  if (t->header->kind != VCB_CHORDS) return false;
+  v->count = t->header->rows;
+  v->points = vcb_column(t, "points", VCB_U32, &v->num_points);
+  v->offsets = v->points ? vcb_offsets(t, "offsets", v->count, v->num_points) : nullptr;
+  return v->offsets != nullptr;
+}
+
+// Copy a chord stats table back into ChordStats, e.g. for the CSV export. Unknown or missing
+// columns are left zero, a column that isn't rows long makes it nullptr
+static ChordStats* vcb_to_chord_stats(const VcbTable* t) {
+  if (t->header->kind != VCB_CHORD_STATS) return nullptr;
+  u64 rows = t->header->rows;
+  // every column holds at least 4 bytes a row, more rows than bytes is a corrupt header
+  if (rows > t->header->total_bytes) return nullptr;
+  ChordStats* stats = calloc(rows ? rows : 1, sizeof(ChordStats));
+  if (!stats) return nullptr;
+  bool ok = true;
+  #define stats_field(field, T, type) do { \
+      const T* col = vcb_column_rows(t, #field, type, 1, rows); \
+      ok &= col || !vcb_column(t, #field, type, nullptr); \
+      for (u64 i = 0; col && i < rows; i++) stats[i].field = col[i]; \
+    } while (0)
+  stats_field(num_superpixels, s32, VCB_S32);
+  stats_field(total_path_length, f32, VCB_F32);
+  stats_field(avg_step_distance, f32, VCB_F32);
+  stats_field(straightness, f32, VCB_F32);
+  stats_field(avg_intensity, f32, VCB_F32);
+  stats_field(min_intensity, f32, VCB_F32);
+  stats_field(max_intensity, f32, VCB_F32);
+  stats_field(intensity_stddev, f32, VCB_F32);
+  stats_field(avg_axis_deviation, f32, VCB_F32);
+  stats_field(avg_connection_strength, f32, VCB_F32);
+  stats_field(min_connections, s32, VCB_S32);
+  stats_field(max_connections, s32, VCB_S32);
+  #undef stats_field
+  const f32* bbox = vcb_column_rows(t, "bbox", VCB_F32, 6, rows);
+  ok &= bbox || !vcb_column(t, "bbox", VCB_F32, nullptr);
+  for (u64 i = 0; bbox && i < rows; i++) memcpy(stats[i].bbox, bbox + i * 6, 6 * sizeof(f32));
+  const f32* com = vcb_column_rows(t, "center_of_mass", VCB_F32, 3, rows);
+  ok &= com || !vcb_column(t, "center_of_mass", VCB_F32, nullptr);
+  for (u64 i = 0; com && i < rows; i++) memcpy(stats[i].center_of_mass, com + i * 3, 3 * sizeof(f32));
+  if (!ok) {
+    free(stats);
+    return nullptr;
+  }
+  return stats;
+}
@@ -0,0 +1,509 @@
+#pragma once
+
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "volcano.h"
+#include "output.h"
+#include "compress.h"
+
+// One append-only file for a whole run instead of a few files per chunk. Each record is one output.h
+// table behind a 64 byte PackRecordHeader, stored as is or compressed (compress.h). Uncompressed tables
+// stay 64 byte aligned in the file, so a mapped pack hands them out in place.
+//
+// Records go into PackBuffers. When a buffer fills up its thread reserves that many bytes at the end
+// of the file with one atomic add and pwrites the whole buffer there, so writers never wait on each
+// other for the data, only briefly for the index. Without compression every worker appends into its
+// own buffer. With compression pack_append only queues a copy of the table, and a pool of compression
+// threads, each with its own codec context and buffer, compresses straight into the buffer. A full
+// queue blocks pack_append so a slow codec can't pile up memory.
+//
+// pack_close writes the index (sorted by chunk and record kind) and a footer after the last record:
+//
+//   PackFileHeader | records ... | PackEntry[count] | PackFooter
+//
+// A pack without a footer (the run died) is still readable, pack_open rebuilds the index by walking
+// the record headers. The pack is written as path.tmp and only renamed over path once pack_close has
+// written the footer, so a failed or aborted run never replaces the previous run's pack. A run that
+// died leaves its records in path.tmp.
+
+#define PACK_MAGIC "VOLCPAK"
+#define PACK_RECORD_MAGIC "VOLCREC"
+#define PACK_FOOTER_MAGIC "VOLCPKI"
+#define PACK_VERSION 2
+#define PACK_DATA_OFFSET VCB_ALIGN
+#define PACK_FLUSH_BYTES (8ll * 1024 * 1024)
+#define PACK_MAX_QUEUED_BYTES (256ll * 1024 * 1024)
+
+typedef struct PackFileHeader {
+  char magic[8];
+  u32 version;
+  u32 reserved;
+} PackFileHeader;
+
+typedef struct PackRecordHeader {
+  char magic[8];
+  s32 chunk[3];
+  u32 kind;
+  u32 codec;
+  u32 reserved;
+  u64 raw_size;     // the table's size
+  u64 stored_size;  // bytes following this header
+  u8 pad[16];
+} PackRecordHeader;
+
+// Index entry, the key is chunk + kind. offset is the record header's
+typedef struct PackEntry {
+  s32 chunk[3];
+  u32 kind;
+  u64 offset;
+  u64 size;
+} PackEntry;
+
+typedef struct PackFooter {
+  u64 index_offset;
+  u64 count;
+  char magic[8];
+} PackFooter;
+
+static_assert(sizeof(PackRecordHeader) == VCB_ALIGN, "tables must stay aligned after the record header");
+static_assert(sizeof(PackEntry) == 32, "PackEntry is part of the file format");
+static_assert(sizeof(PackFooter) == 24, "PackFooter is part of the file format");
+
+typedef struct PackWriter PackWriter;
+
+// Pending records, flushed to the file as one write
+typedef struct PackBuffer {
+  PackWriter* writer;
+  u8* data;
+  s64 size;
+  s64 cap;
+  PackEntry* entries;   // offsets relative to data until the flush
+  s64 count;
+  s64 entries_cap;
+} PackBuffer;
+
+// A table waiting for a compression thread, data is an exact size copy
+typedef struct PackJob {
+  struct PackJob* next;
+  s32 chunk[3];
+  u32 kind;
+  u8* data;
+  s64 size;
+} PackJob;
+
+struct PackWriter {
+  int fd;
+  char path[1024];
+  char tmp_path[1040];  // written here, renamed to path by pack_close
+  s64 end;              // next free byte, reserved with an atomic add
+  bool failed;          // set by any flushing thread, only through __atomic
+  CodecParams codec;
+
+  pthread_mutex_t lock; // guards the index and the job queue
+  PackEntry* index;
+  s64 count;
+  s64 cap;
+
+  pthread_cond_t work;
+  pthread_cond_t room;
+  PackJob* head;
+  PackJob* tail;
+  s64 queued_bytes;
+  bool stop;
+  int num_threads;
+  pthread_t* threads;
+
+  s64 records;
+  s64 raw_bytes;
+  s64 stored_bytes;
+  s64 compress_ns;
+  s64 stall_ns;         // time pack_append waited for room in the queue
+};
+
+static bool pack_pwrite_all(int fd, const u8* buf, s64 size, s64 offset) {
+  while (size > 0) {
+    ssize_t n = pwrite(fd, buf, size, offset);
+    if (n <= 0) return false;
+    buf += n;
+    offset += n;
+    size -= n;
+  }
+  return true;
+}
+
+static s64 pack_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (s64)ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+static void pack_flush(PackBuffer* buf) {
+  if (buf->size == 0) return;
+  PackWriter* w = buf->writer;
+  s64 offset = __atomic_fetch_add(&w->end, buf->size, __ATOMIC_RELAXED);
+  if (!pack_pwrite_all(w->fd, buf->data, buf->size, offset)) {
+    printf("failed writing %lld bytes to %s\n", buf->size, w->tmp_path);
+    __atomic_store_n(&w->failed, true, __ATOMIC_RELAXED);
+  }
+
+  pthread_mutex_lock(&w->lock);
+  if (w->count + buf->count > w->cap) {
+    w->cap = w->cap * 2 > w->count + buf->count ? w->cap * 2 : w->count + buf->count + 1024;
+    w->index = realloc(w->index, w->cap * sizeof(PackEntry));
+  }
+  for (s64 i = 0; i < buf->count; i++) {
+    PackEntry e = buf->entries[i];
+    e.offset += offset;
+    w->index[w->count++] = e;
+  }
+  pthread_mutex_unlock(&w->lock);
+
+  buf->size = 0;
+  buf->count = 0;
+}
+
+// Room for a record of up to max_stored bytes, returns where its payload goes
+static u8* pack_buffer_begin(PackBuffer* buf, s64 max_stored) {
+  s64 need = buf->size + sizeof(PackRecordHeader) + vcb_align(max_stored);
+  if (need > buf->cap) {
+    buf->cap = buf->cap * 2 > PACK_FLUSH_BYTES ? buf->cap * 2 : PACK_FLUSH_BYTES;
+    if (buf->cap < need) buf->cap = need;
+    buf->data = realloc(buf->data, buf->cap);
+  }
+  if (buf->count == buf->entries_cap) {
+    buf->entries_cap = buf->entries_cap ? buf->entries_cap * 2 : 256;
+    buf->entries = realloc(buf->entries, buf->entries_cap * sizeof(PackEntry));
+  }
+  return buf->data + buf->size + sizeof(PackRecordHeader);
+}
+
+// Finish the record started by pack_buffer_begin, whose payload is now stored bytes
+static void pack_buffer_end(PackBuffer* buf, const s32 chunk[3], u32 kind, OutputCodec codec, s64 raw, s64 stored) {
+  PackRecordHeader* h = (PackRecordHeader*)(buf->data + buf->size);
+  *h = (PackRecordHeader){
+    .magic = PACK_RECORD_MAGIC, .chunk = {chunk[0], chunk[1], chunk[2]},
+    .kind = kind, .codec = codec, .raw_size = raw, .stored_size = stored,
+  };
+  s64 end = buf->size + sizeof(PackRecordHeader) + stored;
+  s64 aligned = vcb_align(end);
+  memset(buf->data + end, 0, aligned - end);
+  buf->entries[buf->count++] = (PackEntry){{chunk[0], chunk[1], chunk[2]}, kind, buf->size, stored};
+
+  PackWriter* w = buf->writer;
+  __atomic_fetch_add(&w->records, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&w->raw_bytes, raw, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&w->stored_bytes, stored, __ATOMIC_RELAXED);
+  buf->size = aligned;
+  if (buf->size >= PACK_FLUSH_BYTES) pack_flush(buf);
+}
+
+static void pack_buffer_free(PackBuffer* buf) {
+  pack_flush(buf);
+  free(buf->data);
+  free(buf->entries);
+  *buf = (PackBuffer){};
+}
+
+static void* pack_compress_thread(void* arg) {
+  PackWriter* w = arg;
+  CodecContext* ctx = codec_context_new(w->codec);
+  PackBuffer buf = {.writer = w};
+  for (;;) {
+    pthread_mutex_lock(&w->lock);
+    while (!w->head && !w->stop) pthread_cond_wait(&w->work, &w->lock);
+    PackJob* job = w->head;
+    if (job) {
+      w->head = job->next;
+      if (!w->head) w->tail = nullptr;
+    }
+    pthread_mutex_unlock(&w->lock);
+    if (!job) break;
+
+    s64 t0 = pack_now_ns();
+    u8* dst = pack_buffer_begin(&buf, codec_bound(ctx, job->size));
+    s64 stored = codec_compress(ctx, job->data, job->size, dst);
+    OutputCodec codec = ctx->params.codec;
+    // incompressible, or the codec failed: keep the table as is
+    if (stored < 0 || stored >= job->size) {
+      memcpy(dst, job->data, job->size);
+      stored = job->size;
+      codec = CODEC_NONE;
+    }
+    __atomic_fetch_add(&w->compress_ns, pack_now_ns() - t0, __ATOMIC_RELAXED);
+    pack_buffer_end(&buf, job->chunk, job->kind, codec, job->size, stored);
+
+    pthread_mutex_lock(&w->lock);
+    w->queued_bytes -= job->size;
+    pthread_cond_broadcast(&w->room);
+    pthread_mutex_unlock(&w->lock);
+    free(job->data);
+    free(job);
+  }
+  pack_buffer_free(&buf);
+  codec_context_free(ctx);
+  return nullptr;
+}
+
+// threads compression threads, unused with CODEC_NONE
+static PackWriter* pack_writer_new(const char* path, CodecParams codec, int threads) {
+  char tmp_path[1040];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    printf("could not create pack %s\n", tmp_path);
+    return nullptr;
+  }
+  PackFileHeader header = {.magic = PACK_MAGIC, .version = PACK_VERSION};
+  u8 first[PACK_DATA_OFFSET] = {};
+  memcpy(first, &header, sizeof(header));
+  if (pwrite(fd, first, sizeof(first), 0) != sizeof(first)) {
+    printf("could not write pack %s\n", tmp_path);
+    close(fd);
+    unlink(tmp_path);
+    return nullptr;
+  }
+  PackWriter* w = calloc(1, sizeof(PackWriter));
+  w->fd = fd;
+  snprintf(w->path, sizeof(w->path), "%s", path);
+  snprintf(w->tmp_path, sizeof(w->tmp_path), "%s", tmp_path);
+  w->end = PACK_DATA_OFFSET;
+  w->codec = codec;
+  pthread_mutex_init(&w->lock, nullptr);
+  pthread_cond_init(&w->work, nullptr);
+  pthread_cond_init(&w->room, nullptr);
+  if (codec.codec != CODEC_NONE) {
+    w->num_threads = threads > 0 ? threads : 1;
+    w->threads = calloc(w->num_threads, sizeof(pthread_t));
+    for (int i = 0; i < w->num_threads; i++) pthread_create(&w->threads[i], nullptr, pack_compress_thread, w);
+  }
+  return w;
+}
+
+// Add a finished table as the chunk's record of its kind. buf is the calling thread's
+static void pack_append(PackBuffer* buf, s32 cz, s32 cy, s32 cx, const VcbBuilder* table) {
+  PackWriter* w = buf->writer;
+  const s32 chunk[3] = {cz, cy, cx};
+  u32 kind = ((const VcbHeader*)table->data)->kind;
+  if (w->codec.codec == CODEC_NONE) {
+    u8* dst = pack_buffer_begin(buf, table->size);
+    memcpy(dst, table->data, table->size);
+    pack_buffer_end(buf, chunk, kind, CODEC_NONE, table->size, table->size);
+    return;
+  }
+
+  PackJob* job = malloc(sizeof(PackJob));
+  *job = (PackJob){.chunk = {cz, cy, cx}, .kind = kind, .data = malloc(table->size), .size = table->size};
+  memcpy(job->data, table->data, table->size);
+
+  pthread_mutex_lock(&w->lock);
+  if (w->queued_bytes > 0 && w->queued_bytes + job->size > PACK_MAX_QUEUED_BYTES) {
+    s64 t0 = pack_now_ns();
+    while (w->queued_bytes > 0 && w->queued_bytes + job->size > PACK_MAX_QUEUED_BYTES) {
+      pthread_cond_wait(&w->room, &w->lock);
+    }
+    w->stall_ns += pack_now_ns() - t0;
+  }
+  w->queued_bytes += job->size;
+  if (w->tail) w->tail->next = job;
+  else w->head = job;
+  w->tail = job;
+  pthread_cond_signal(&w->work);
+  pthread_mutex_unlock(&w->lock);
+}
+
+static int pack_entry_cmp(const void* a, const void* b) {
+  const PackEntry* ea = a;
+  const PackEntry* eb = b;
+  for (int i = 0; i < 3; i++) {
+    if (ea->chunk[i] != eb->chunk[i]) return ea->chunk[i] < eb->chunk[i] ? -1 : 1;
+  }
+  return ea->kind < eb->kind ? -1 : ea->kind > eb->kind;
+}
+
+static void pack_print_stats(const PackWriter* w) {
+  f64 mb = 1024.0 * 1024.0;
+  f64 compress_s = (f64)w->compress_ns * 1e-9;
+  printf("pack %s: %lld records, %s level %d, %.1f MB -> %.1f MB (%.2fx), %.0f MB/s per compression thread, %.1f s stalled\n",
+         w->path, w->records, codec_name(w->codec.codec), w->codec.level,
+         (f64)w->raw_bytes / mb, (f64)w->stored_bytes / mb,
+         w->stored_bytes ? (f64)w->raw_bytes / (f64)w->stored_bytes : 0.0,
+         compress_s > 0 ? (f64)w->raw_bytes / mb / compress_s : 0.0,
+         (f64)w->stall_ns * 1e-9);
+}
+
+static void pack_writer_free(PackWriter* w) {
+  pthread_cond_destroy(&w->work);
+  pthread_cond_destroy(&w->room);
+  pthread_mutex_destroy(&w->lock);
+  free(w->threads);
+  free(w->index);
+  free(w);
+}
+
+static void pack_stop_threads(PackWriter* w) {
+  pthread_mutex_lock(&w->lock);
+  w->stop = true;
+  pthread_cond_broadcast(&w->work);
+  pthread_mutex_unlock(&w->lock);
+  for (int i = 0; i < w->num_threads; i++) pthread_join(w->threads[i], nullptr);
+}
+
+// Call after every worker's PackBuffer has been freed. Drains the compression threads, writes the
+// index and footer, renames the pack over path, prints the stats and frees w. On failure path is
+// left as it was and the partial pack stays in path.tmp
+static bool pack_close(PackWriter* w) {
+  if (!w) return false;
+  pack_stop_threads(w);
+  pack_print_stats(w);
+
+  qsort(w->index, w->count, sizeof(PackEntry), pack_entry_cmp);
+  PackFooter footer = {.index_offset = w->end, .count = w->count, .magic = PACK_FOOTER_MAGIC};
+  bool ok = !__atomic_load_n(&w->failed, __ATOMIC_RELAXED) &&
+            pack_pwrite_all(w->fd, (const u8*)w->index, w->count * sizeof(PackEntry), w->end) &&
+            pack_pwrite_all(w->fd, (const u8*)&footer, sizeof(footer), w->end + w->count * sizeof(PackEntry));
+  ok &= close(w->fd) == 0;
+  ok = ok && rename(w->tmp_path, w->path) == 0;
+  if (!ok) printf("failed to finish pack %s, partial pack left in %s\n", w->path, w->tmp_path);
+  pack_writer_free(w);
+  return ok;
+}
+
+// Drop a pack that won't be finished: nothing replaces path and path.tmp is removed. Every worker's
+// PackBuffer must have been freed, as for pack_close
+static void pack_abort(PackWriter* w) {
+  if (!w) return;
+  pack_stop_threads(w);
+  close(w->fd);
+  unlink(w->tmp_path);
+  pack_writer_free(w);
+}
+
+typedef struct PackReader {
+  u8* base;
+  s64 size;
+  s64 data_end;       // where the records stop
+  PackEntry* index;   // sorted by chunk and kind
+  s64 count;
+  bool owns_index;
+} PackReader;
+
+static const PackRecordHeader* pack_record_at(const PackReader* r, u64 offset) {
+  if (offset + sizeof(PackRecordHeader) > (u64)r->data_end) return nullptr;
+  const PackRecordHeader* h = (const PackRecordHeader*)(r->base + offset);
+  if (memcmp(h->magic, PACK_RECORD_MAGIC, sizeof(h->magic)) != 0) return nullptr;
+  if (h->stored_size > (u64)r->data_end - offset - sizeof(PackRecordHeader)) return nullptr;
+  return h;
+}
+
+// Walk the records from offset, skipping anything that isn't one a 64 byte step at a time (holes
+// a crashed run reserved but never wrote). Returns nullptr at the end
+static const PackRecordHeader* pack_scan_at(const PackReader* r, u64* offset) {
+  for (u64 at = *offset; at + sizeof(PackRecordHeader) <= (u64)r->data_end; at += VCB_ALIGN) {
+    const PackRecordHeader* h = pack_record_at(r, at);
+    if (h) {
+      *offset = vcb_align(at + sizeof(PackRecordHeader) + h->stored_size);
+      return h;
+    }
+  }
+  *offset = r->data_end;
+  return nullptr;
+}
+
+static void pack_rebuild_index(PackReader* r) {
+  s64 cap = 1024;
+  r->index = malloc(cap * sizeof(PackEntry));
+  r->owns_index = true;
+  r->count = 0;
+  u64 offset = PACK_DATA_OFFSET;
+  const PackRecordHeader* h;
+  while ((h = pack_scan_at(r, &offset))) {
+    if (r->count == cap) {
+      cap *= 2;
+      r->index = realloc(r->index, cap * sizeof(PackEntry));
+    }
+    r->index[r->count++] = (PackEntry){
+      {h->chunk[0], h->chunk[1], h->chunk[2]}, h->kind, (u64)((const u8*)h - r->base), h->stored_size};
+  }
+  qsort(r->index, r->count, sizeof(PackEntry), pack_entry_cmp);
+}
+
+static PackReader* pack_open(const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return nullptr;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < PACK_DATA_OFFSET) {
+    close(fd);
+    return nullptr;
+  }
+  void* base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) return nullptr;
+  const PackFileHeader* header = base;
+  if (memcmp(header->magic, PACK_MAGIC, sizeof(header->magic)) != 0 || header->version != PACK_VERSION) {
+    printf("%s is not a version %d pack\n", path, PACK_VERSION);
+    munmap(base, st.st_size);
+    return nullptr;
+  }
+
+  PackReader* r = calloc(1, sizeof(PackReader));
+  r->base = base;
+  r->size = st.st_size;
+  r->data_end = st.st_size;
+  const PackFooter* footer = (const PackFooter*)(r->base + st.st_size - sizeof(PackFooter));
+  if (st.st_size >= PACK_DATA_OFFSET + (s64)sizeof(PackFooter) &&
+      memcmp(footer->magic, PACK_FOOTER_MAGIC, sizeof(footer->magic)) == 0 &&
+      footer->index_offset + footer->count * sizeof(PackEntry) + sizeof(PackFooter) == (u64)st.st_size) {
+    // the index sits right after the records, so it's aligned in the mapping
+    r->index = (PackEntry*)(r->base + footer->index_offset);
+    r->count = footer->count;
+    r->data_end = footer->index_offset;
+  } else {
+    printf("pack %s has no index, rebuilding it\n", path);
+    pack_rebuild_index(r);
+  }
+  return r;
+}
+
+static void pack_reader_close(PackReader* r) {
+  if (!r) return;
+  if (r->owns_index) free(r->index);
+  munmap(r->base, r->size);
+  free(r);
+}
+
+// The record's table. Uncompressed tables are used in place, compressed ones are decoded into a
+// buffer the table owns. Either way vcb_close the table when done
+static bool pack_record_table(const PackRecordHeader* h, VcbTable* table) {
+  const u8* payload = (const u8*)(h + 1);
+  if (h->codec == CODEC_NONE) return vcb_table_from_memory(payload, h->stored_size, table);
+  u8* raw = malloc(h->raw_size ? h->raw_size : 1);
+  if (!codec_decompress(codec_thread_context(), h->codec, payload, h->stored_size, raw, h->raw_size) ||
+      !vcb_table_from_memory(raw, h->raw_size, table)) {
+    free(raw);
+    return false;
+  }
+  table->owned = raw;
+  return true;
+}
+
+// The chunk's record of the given kind
+static bool pack_find(const PackReader* r, s32 cz, s32 cy, s32 cx, VcbKind kind, VcbTable* table) {
+  PackEntry key = {.chunk = {cz, cy, cx}, .kind = kind};
+  const PackEntry* e = bsearch(&key, r->index, r->count, sizeof(PackEntry), pack_entry_cmp);
+  if (!e) return false;
+  const PackRecordHeader* h = pack_record_at(r, e->offset);
+  return h && pack_record_table(h, table);
+}
+
+// Sequential scan in file order, which is the order the records were written in:
+//   u64 cursor = 0;
+//   while (pack_next(reader, &cursor, &table)) { ...; vcb_close(&table); }
+static bool pack_next(const PackReader* r, u64* cursor, VcbTable* table) {
+  if (*cursor < PACK_DATA_OFFSET) *cursor = PACK_DATA_OFFSET;
+  const PackRecordHeader* h;
+  while ((h = pack_scan_at(r, cursor))) {
+    if (pack_record_table(h, table)) return true;
+  }
+  return false;
+}
@@ -1,6 +1,12 @@
 #pragma once
 
+#include <float.h>
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "volcano.h"
+#include "chunk.h"
 
 // Get neighbors for a 3D point, returns number of valid neighbors
 int get_neighbors_3d(int z, int y, int x, int depth, int height, int width,
@@ -29,8 +35,26 @@ int get_neighbors_3d(int z, int y, int x, int depth, int height, int width,
     return count;
 }
 
-// Flood fill implementation for float32 data
-void flood_fill_f32(const float* volume, uint8_t* mask, uint8_t* visited,
+// 0 below iso, 1 at or above iso, 2 at or above start, one tight loop per dtype so the fill
+// itself never looks at the voxel type
+#define flood_levels_loop(T) \
+    for (s64 i = 0; i < n; i++) {                                                               \
+        f32 v = (f32)((const T*)volume)[i];                                                     \
+        levels[i] = v >= start_threshold ? 2 : v >= iso_threshold ? 1 : 0;                     \
+    }
+
+static void flood_levels(const void* volume, vs_dtype dtype, s64 n, float iso_threshold, float start_threshold,
+                         u8* levels) {
+    switch (dtype) {
+        case VS_U8: flood_levels_loop(u8) break;
+        case VS_U16: flood_levels_loop(u16) break;
+        case VS_F32: flood_levels_loop(f32) break;
+    }
+}
+#undef flood_levels_loop
+
+// Flood fill implementation for any voxel type
+void flood_fill_typed(const void* volume, vs_dtype dtype, uint8_t* mask, uint8_t* visited,
                    int depth, int height, int width,
                    float iso_threshold, float start_threshold) {
     int max_size = depth * height * width;
@@ -41,13 +65,15 @@ void flood_fill_f32(const float* volume, uint8_t* mask, uint8_t* visited,
     int* queue_x = (int*)malloc(max_size * sizeof(int));
     int queue_start = 0;
     int queue_end = 0;
+    u8* levels = malloc(max_size);
+    flood_levels(volume, dtype, max_size, iso_threshold, start_threshold, levels);
 
     // Find starting points
     for (int z = 0; z < depth; z++) {
         for (int y = 0; y < height; y++) {
             for (int x = 0; x < width; x++) {
                 int idx = z * (height * width) + y * width + x;
-                if (volume[idx] >= start_threshold) {
+                if (levels[idx] == 2) {
                     queue_z[queue_end] = z;
                     queue_y[queue_end] = y;
                     queue_x[queue_end] = x;
@@ -79,7 +105,7 @@ void flood_fill_f32(const float* volume, uint8_t* mask, uint8_t* visited,
             int x = neighbor_coords[i * 3 + 2];
             int idx = z * (height * width) + y * width + x;
 
-            if (visited[idx] || volume[idx] < iso_threshold) {
+            if (visited[idx] || levels[idx] == 0) {
                 continue;
             }
 
@@ -95,6 +121,14 @@ void flood_fill_f32(const float* volume, uint8_t* mask, uint8_t* visited,
     free(queue_z);
     free(queue_y);
     free(queue_x);
+    free(levels);
+}
+
+// Flood fill implementation for float32 data
+void flood_fill_f32(const float* volume, uint8_t* mask, uint8_t* visited,
+                   int depth, int height, int width,
+                   float iso_threshold, float start_threshold) {
+    flood_fill_typed(volume, VS_F32, mask, visited, depth, height, width, iso_threshold, start_threshold);
 }
 
 float* segment_and_clean_f32(const float* volume, int depth, int height, int width,
@@ -122,6 +156,25 @@ float* segment_and_clean_f32(const float* volume, int depth, int height, int wid
     return result;
 }
 
+// segment_and_clean for typed chunks, in place. Works on the chunk's own dtype
+void segment_and_clean_tchunk(tchunk* c, float iso_threshold, float start_threshold) {
+    s64 total_size = tchunk_len(c);
+    uint8_t* mask = (uint8_t*)calloc(total_size, sizeof(uint8_t));
+    uint8_t* visited = (uint8_t*)calloc(total_size, sizeof(uint8_t));
+
+    flood_fill_typed(c->data, c->dtype, mask, visited, c->dims[0], c->dims[1], c->dims[2],
+                     iso_threshold, start_threshold);
+
+    switch (c->dtype) {
+        case VS_U8: for (s64 i = 0; i < total_size; i++) if (!mask[i]) c->d8[i] = 0; break;
+        case VS_U16: for (s64 i = 0; i < total_size; i++) if (!mask[i]) c->d16[i] = 0; break;
+        case VS_F32: for (s64 i = 0; i < total_size; i++) if (!mask[i]) c->d32[i] = 0.0f; break;
+    }
+
+    free(mask);
+    free(visited);
+}
+
 chunk *vs_avgpool_denoise(chunk *inchunk, s32 kernel) {
     // Create output chunk with same dimensions as input
     chunk *ret = vs_chunk_new(inchunk->dims);
@@ -169,4 +222,552 @@ chunk *vs_avgpool_denoise(chunk *inchunk, s32 kernel) {
 
     free(data);
     return ret;
-}
\ No newline at end of file
+}
+
+// Integer version of vs_avgpool_denoise for u8 and u16 chunks. The kernel^3 box is summed as three
+// separable 1D passes with u32 accumulators, so the sums are exact and cost 3*kernel reads per voxel.
+// Like vs_avgpool_denoise only in-bounds neighbors are averaged. The result keeps the input dtype
+tchunk* vs_avgpool_denoise_int(const tchunk* inchunk, s32 kernel) {
+    assert(inchunk->dtype == VS_U8 || inchunk->dtype == VS_U16);
+
+    s32 depth = inchunk->dims[0];
+    s32 height = inchunk->dims[1];
+    s32 width = inchunk->dims[2];
+    s64 total_size = tchunk_len(inchunk);
+    s32 half = kernel / 2;
+
+    u32* a = malloc(total_size * sizeof(u32));
+    u32* b = malloc(total_size * sizeof(u32));
+
+    // x pass straight from the input, one loop per dtype
+#define avgpool_x_pass(src) \
+    for (s32 z = 0; z < depth; z++) {                                                             \
+        for (s32 y = 0; y < height; y++) {                                                        \
+            s64 row = ((s64)z * height + y) * width;                                              \
+            for (s32 x = 0; x < width; x++) {                                                     \
+                u32 sum = 0;                                                                      \
+                s32 lo = x - half < 0 ? 0 : x - half;                                             \
+                s32 hi = x + half >= width ? width - 1 : x + half;                                \
+                for (s32 xi = lo; xi <= hi; xi++) sum += (src)[row + xi];                         \
+                a[row + x] = sum;                                                                 \
+            }                                                                                     \
+        }                                                                                         \
+    }
+    if (inchunk->dtype == VS_U8) {
+        avgpool_x_pass(inchunk->d8)
+    } else {
+        avgpool_x_pass(inchunk->d16)
+    }
+#undef avgpool_x_pass
+
+    // y pass
+    for (s32 z = 0; z < depth; z++) {
+        for (s32 y = 0; y < height; y++) {
+            s32 lo = y - half < 0 ? 0 : y - half;
+            s32 hi = y + half >= height ? height - 1 : y + half;
+            for (s32 x = 0; x < width; x++) {
+                u32 sum = 0;
+                for (s32 yi = lo; yi <= hi; yi++) sum += a[((s64)z * height + yi) * width + x];
+                b[((s64)z * height + y) * width + x] = sum;
+            }
+        }
+    }
+
+    // z pass, then divide by the number of in-bounds voxels. Truncated rather than rounded so that
+    // avg >= t exactly when vs_avgpool_denoise's mean >= t for any whole t, which iso and the seed
+    // threshold are, and the integer and f32 paths keep the same voxels
+    tchunk* ret = tchunk_new(inchunk->dtype, inchunk->dims);
+    for (s32 z = 0; z < depth; z++) {
+        s32 zlo = z - half < 0 ? 0 : z - half;
+        s32 zhi = z + half >= depth ? depth - 1 : z + half;
+        for (s32 y = 0; y < height; y++) {
+            s32 ylo = y - half < 0 ? 0 : y - half;
+            s32 yhi = y + half >= height ? height - 1 : y + half;
+            for (s32 x = 0; x < width; x++) {
+                s32 xlo = x - half < 0 ? 0 : x - half;
+                s32 xhi = x + half >= width ? width - 1 : x + half;
+                u32 count = (u32)((zhi - zlo + 1) * (yhi - ylo + 1) * (xhi - xlo + 1));
+
+                u32 sum = 0;
+                for (s32 zi = zlo; zi <= zhi; zi++) sum += b[((s64)zi * height + y) * width + x];
+
+                s64 i = ((s64)z * height + y) * width + x;
+                u32 avg = sum / count;
+                if (inchunk->dtype == VS_U8) {
+                    ret->d8[i] = (u8)avg;
+                } else {
+                    ret->d16[i] = (u16)avg;
+                }
+            }
+        }
+    }
+
+    free(a);
+    free(b);
+    return ret;
+}
+
+// Denoise a typed chunk with the kernel matching its dtype
+tchunk* vs_tchunk_denoise(const tchunk* inchunk, s32 kernel) {
+    if (inchunk->dtype != VS_F32) {
+        return vs_avgpool_denoise_int(inchunk, kernel);
+    }
+
+    chunk* tmp = vs_chunk_new((s32*)inchunk->dims);
+    memcpy(tmp->data, inchunk->d32, tchunk_len(inchunk) * sizeof(f32));
+    chunk* denoised = vs_avgpool_denoise(tmp, kernel);
+
+    tchunk* ret = tchunk_new(VS_F32, inchunk->dims);
+    memcpy(ret->d32, denoised->data, tchunk_len(inchunk) * sizeof(f32));
+    vs_chunk_free(tmp);
+    vs_chunk_free(denoised);
+    return ret;
+}
+
+// 1D squared distance transform of a sampled function (Felzenszwalb & Huttenlocher)
+// f and d are read/written with the given stride so the same routine serves every axis
+// v and zz are scratch buffers of at least n and n+1 elements
+static void edt_1d(const f32* f, f32* d, s32 n, s64 stride, s32* v, f32* zz, f32* tmp) {
+    // Gather the strided line so the lower envelope pass works on contiguous memory
+    for (s32 q = 0; q < n; q++) {
+        tmp[q] = f[q * stride];
+    }
+
+    s32 k = 0;
+    v[0] = 0;
+    // FLT_MAX rather than INFINITY as sentinels, -Ofast assumes finite math
+    zz[0] = -FLT_MAX;
+    zz[1] = FLT_MAX;
+
+    // Build the lower envelope of the parabolas rooted at each sample
+    for (s32 q = 1; q < n; q++) {
+        s32 p = v[k];
+        f32 s = ((tmp[q] + (f32)(q * q)) - (tmp[p] + (f32)(p * p))) / (f32)(2 * q - 2 * p);
+        while (s <= zz[k]) {
+            k--;
+            p = v[k];
+            s = ((tmp[q] + (f32)(q * q)) - (tmp[p] + (f32)(p * p))) / (f32)(2 * q - 2 * p);
+        }
+        k++;
+        v[k] = q;
+        zz[k] = s;
+        zz[k + 1] = FLT_MAX;
+    }
+
+    // Sample the envelope
+    k = 0;
+    for (s32 q = 0; q < n; q++) {
+        while (zz[k + 1] < (f32)q) k++;
+        s32 p = v[k];
+        d[q * stride] = (f32)((q - p) * (q - p)) + tmp[p];
+    }
+}
+
+// Squared euclidean distance from every voxel to the nearest voxel where mask is nonzero.
+// Three separable passes (x, y, z), each linear in the number of voxels regardless of distance.
+// Voxels with no feature anywhere in the volume get a value >= EDT_FAR.
+#define EDT_FAR 1e20f
+static void vs_edt_sq(const u8* mask, f32* dist, s32 depth, s32 height, s32 width) {
+    s32 maxdim = depth > height ? depth : height;
+    maxdim = maxdim > width ? maxdim : width;
+
+    s32* v = malloc(maxdim * sizeof(s32));
+    f32* zz = malloc((maxdim + 1) * sizeof(f32));
+    f32* tmp = malloc(maxdim * sizeof(f32));
+
+    s64 total_size = (s64)depth * height * width;
+    for (s64 i = 0; i < total_size; i++) {
+        dist[i] = mask[i] ? 0.0f : EDT_FAR;
+    }
+
+    // x pass, stride 1
+    for (s32 z = 0; z < depth; z++) {
+        for (s32 y = 0; y < height; y++) {
+            f32* line = &dist[(s64)z * height * width + (s64)y * width];
+            edt_1d(line, line, width, 1, v, zz, tmp);
+        }
+    }
+
+    // y pass, stride width
+    for (s32 z = 0; z < depth; z++) {
+        for (s32 x = 0; x < width; x++) {
+            f32* line = &dist[(s64)z * height * width + x];
+            edt_1d(line, line, height, width, v, zz, tmp);
+        }
+    }
+
+    // z pass, stride height*width
+    for (s32 y = 0; y < height; y++) {
+        for (s32 x = 0; x < width; x++) {
+            f32* line = &dist[(s64)y * width + x];
+            edt_1d(line, line, depth, (s64)height * width, v, zz, tmp);
+        }
+    }
+
+    free(v);
+    free(zz);
+    free(tmp);
+}
+
+// Dilate mask into out: every voxel within radius of a foreground voxel
+static void edt_dilate(const u8* mask, u8* out, const s32 dims[3], f32 radius) {
+    s64 total_size = (s64)dims[0] * dims[1] * dims[2];
+    f32* dist = malloc(total_size * sizeof(f32));
+
+    vs_edt_sq(mask, dist, dims[0], dims[1], dims[2]);
+
+    f32 r2 = radius * radius;
+    for (s64 i = 0; i < total_size; i++) {
+        out[i] = dist[i] <= r2;
+    }
+
+    free(dist);
+}
+
+// Binary dilation by a euclidean ball of the given radius. Cost does not depend on radius.
+chunk* vs_dilate_edt(chunk* inchunk, f32 radius) {
+    s64 total_size = (s64)inchunk->dims[0] * inchunk->dims[1] * inchunk->dims[2];
+    u8* mask = malloc(total_size * sizeof(u8));
+    for (s64 i = 0; i < total_size; i++) {
+        mask[i] = inchunk->data[i] != 0.0f;
+    }
+
+    edt_dilate(mask, mask, inchunk->dims, radius);
+
+    chunk* ret = vs_chunk_new(inchunk->dims);
+    for (s64 i = 0; i < total_size; i++) {
+        ret->data[i] = mask[i] ? 1.0f : 0.0f;
+    }
+    free(mask);
+    return ret;
+}
+
+// vs_dilate_edt for typed chunks, returns a u8 0/1 mask
+tchunk* vs_dilate_edt_tchunk(const tchunk* inchunk, f32 radius) {
+    tchunk* ret = tchunk_new(VS_U8, inchunk->dims);
+    s64 n = tchunk_len(inchunk);
+    switch (inchunk->dtype) {
+        case VS_U8: for (s64 i = 0; i < n; i++) ret->d8[i] = inchunk->d8[i] != 0; break;
+        case VS_U16: for (s64 i = 0; i < n; i++) ret->d8[i] = inchunk->d16[i] != 0; break;
+        case VS_F32: for (s64 i = 0; i < n; i++) ret->d8[i] = inchunk->d32[i] != 0.0f; break;
+    }
+    edt_dilate(ret->d8, ret->d8, inchunk->dims, radius);
+    return ret;
+}
+
+
+// Native port of global_local_contrast_3d from scripts/dl_chunks_to_zarr.py (GLCAE, github.com/pengyan510/glcae)
+// so contrast enhancement can run inline on each chunk instead of writing an enhanced copy of the scroll.
+// The per slice 2D CLAHE of the python is replaced by a 3D CLAHE over overlapping tiles.
+typedef struct ContrastParams {
+    s32 tile;          // CLAHE tile edge in voxels
+    s32 overlap;       // voxels on each side of a tile that also go into its histogram
+    f32 clip_limit;    // CLAHE clip limit relative to a flat histogram, cv2 default of 2.0 in the python
+} ContrastParams;
+
+constexpr ContrastParams default_contrast_params = {.tile = 16, .overlap = 4, .clip_limit = 2.0f};
+
+// out[i] = lut[in[i]]. A 256 entry table is four 64 byte tbl registers on neon
+static void lut_apply_u8(const u8* lut, const u8* in, u8* out, s64 n) {
+    s64 i = 0;
+#if defined(__ARM_NEON)
+    uint8x16x4_t t0 = vld1q_u8_x4(lut);
+    uint8x16x4_t t1 = vld1q_u8_x4(lut + 64);
+    uint8x16x4_t t2 = vld1q_u8_x4(lut + 128);
+    uint8x16x4_t t3 = vld1q_u8_x4(lut + 192);
+    const uint8x16_t step = vdupq_n_u8(64);
+    for (; i + 16 <= n; i += 16) {
+        // out of range indices return 0 from tbl, so only the table holding the index contributes
+        uint8x16_t idx = vld1q_u8(in + i);
+        uint8x16_t r = vqtbl4q_u8(t0, idx);
+        idx = vsubq_u8(idx, step);
+        r = vorrq_u8(r, vqtbl4q_u8(t1, idx));
+        idx = vsubq_u8(idx, step);
+        r = vorrq_u8(r, vqtbl4q_u8(t2, idx));
+        idx = vsubq_u8(idx, step);
+        r = vorrq_u8(r, vqtbl4q_u8(t3, idx));
+        vst1q_u8(out + i, r);
+    }
+#endif
+    for (; i + 8 <= n; i += 8) {
+        out[i + 0] = lut[in[i + 0]];
+        out[i + 1] = lut[in[i + 1]];
+        out[i + 2] = lut[in[i + 2]];
+        out[i + 3] = lut[in[i + 3]];
+        out[i + 4] = lut[in[i + 4]];
+        out[i + 5] = lut[in[i + 5]];
+        out[i + 6] = lut[in[i + 6]];
+        out[i + 7] = lut[in[i + 7]];
+    }
+    for (; i < n; i++) {
+        out[i] = lut[in[i]];
+    }
+}
+
+// mapping() from the python: t = ceil(255 * cumsum(h) + 0.5)
+static void glcae_mapping(const f64* h, u8* t) {
+    f64 cum_sum = 0.0;
+    for (int v = 0; v < 256; v++) {
+        cum_sum += h[v];
+        f64 m = ceil(255.0 * cum_sum + 0.5);
+        t[v] = m > 255.0 ? 255 : (u8)m;
+    }
+}
+
+// f() from the python: the widest span of occupied input levels merged into one output level.
+// t is monotonic so merged levels are contiguous runs, which makes this linear instead of quadratic
+static s32 glcae_merge_span(const f64* h_tilde, const u8* t) {
+    s32 d = 0;
+    s32 run_first = -1;
+    for (int v = 0; v < 256; v++) {
+        if (v > 0 && t[v] != t[v - 1]) run_first = -1;
+        if (h_tilde[v] <= 0.0) continue;
+        if (run_first < 0) run_first = v;
+        if (v - run_first > d) d = v - run_first;
+    }
+    return d;
+}
+
+// Global histogram mapping: blend the histogram with a uniform one, picking the blend that merges
+// the fewest levels. The python uses brent on this piecewise constant function; a log spaced scan is
+// more robust and costs nothing at 256 bins
+static void glcae_global_lut(const u64* hist, s64 total, u8* t) {
+    f64 h_i[256], h_tilde[256];
+    for (int v = 0; v < 256; v++) h_i[v] = (f64)hist[v] / (f64)total;
+
+    s32 best_d = INT32_MAX;
+    f64 best_lam = 0.0;
+    for (int step = -1; step <= 60; step++) {
+        f64 lam = step < 0 ? 0.0 : pow(10.0, -3.0 + step * 0.1);
+        for (int v = 0; v < 256; v++) h_tilde[v] = h_i[v] / (1.0 + lam) + lam / (1.0 + lam) / 256.0;
+        glcae_mapping(h_tilde, t);
+        s32 d = glcae_merge_span(h_tilde, t);
+        if (d < best_d) {
+            best_d = d;
+            best_lam = lam;
+        }
+    }
+
+    for (int v = 0; v < 256; v++) h_tilde[v] = h_i[v] / (1.0 + best_lam) + best_lam / (1.0 + best_lam) / 256.0;
+    glcae_mapping(h_tilde, t);
+}
+
+// huePreservation() for a single grayscale channel
+static inline f32 glcae_hue(f32 g_i, f32 i, f32 x_hat) {
+    if (g_i <= i) {
+        return g_i / (i + 1e-8f) * x_hat;
+    }
+    return (255.0f - g_i) / (255.0f - i + 1e-8f) * (x_hat - i) + g_i;
+}
+
+// 3D CLAHE. Each tile's histogram is gathered over the tile grown by overlap voxels, clipped and
+// equalized into a LUT; voxels then trilinearly blend the LUTs of the 8 nearest tile centers
+static void clahe_3d_u8(const u8* in, u8* out, const s32 dims[3], const ContrastParams* p) {
+    s32 ntiles[3];
+    for (int a = 0; a < 3; a++) ntiles[a] = (dims[a] + p->tile - 1) / p->tile;
+    s32 num_tiles = ntiles[0] * ntiles[1] * ntiles[2];
+    u8* luts = malloc((s64)num_tiles * 256);
+
+    for (s32 tz = 0; tz < ntiles[0]; tz++) {
+        for (s32 ty = 0; ty < ntiles[1]; ty++) {
+            for (s32 tx = 0; tx < ntiles[2]; tx++) {
+                s32 lo[3] = {tz * p->tile - p->overlap, ty * p->tile - p->overlap, tx * p->tile - p->overlap};
+                s32 hi[3] = {(tz + 1) * p->tile + p->overlap, (ty + 1) * p->tile + p->overlap, (tx + 1) * p->tile + p->overlap};
+                for (int a = 0; a < 3; a++) {
+                    if (lo[a] < 0) lo[a] = 0;
+                    if (hi[a] > dims[a]) hi[a] = dims[a];
+                }
+
+                u32 hist[256] = {0};
+                for (s32 z = lo[0]; z < hi[0]; z++) {
+                    for (s32 y = lo[1]; y < hi[1]; y++) {
+                        const u8* row = &in[((s64)z * dims[1] + y) * dims[2]];
+                        for (s32 x = lo[2]; x < hi[2]; x++) hist[row[x]]++;
+                    }
+                }
+                u32 count = (u32)((hi[0] - lo[0]) * (hi[1] - lo[1]) * (hi[2] - lo[2]));
+
+                // clip and spread the excess evenly, remainder one count per bin from the bottom
+                u32 limit = (u32)(p->clip_limit * (f32)count / 256.0f);
+                if (limit < 1) limit = 1;
+                u32 excess = 0;
+                for (int v = 0; v < 256; v++) {
+                    if (hist[v] > limit) {
+                        excess += hist[v] - limit;
+                        hist[v] = limit;
+                    }
+                }
+                u32 spread = excess / 256;
+                u32 remainder = excess % 256;
+                for (int v = 0; v < 256; v++) hist[v] += spread + ((u32)v < remainder);
+
+                u8* lut = &luts[(((s64)tz * ntiles[1] + ty) * ntiles[2] + tx) * 256];
+                u32 cdf = 0;
+                for (int v = 0; v < 256; v++) {
+                    cdf += hist[v];
+                    lut[v] = (u8)((255ull * cdf + count / 2) / count);
+                }
+            }
+        }
+    }
+
+    // per axis pair of tiles and blend weight, computed once per coordinate
+    s32* k0[3];
+    f32* w1[3];
+    for (int a = 0; a < 3; a++) {
+        k0[a] = malloc(dims[a] * sizeof(s32));
+        w1[a] = malloc(dims[a] * sizeof(f32));
+        for (s32 c = 0; c < dims[a]; c++) {
+            f32 t = ((f32)c + 0.5f) / (f32)p->tile - 0.5f;
+            s32 k = (s32)floorf(t);
+            f32 w = t - (f32)k;
+            if (k < 0) { k = 0; w = 0.0f; }
+            if (k >= ntiles[a] - 1) { k = ntiles[a] - 1; w = 0.0f; }
+            k0[a][c] = k;
+            w1[a][c] = w;
+        }
+    }
+
+    #define tile_lut(z, y, x) (&luts[(((s64)(z) * ntiles[1] + (y)) * ntiles[2] + (x)) * 256])
+    for (s32 z = 0; z < dims[0]; z++) {
+        s32 z0 = k0[0][z], z1 = z0 + (z0 + 1 < ntiles[0]);
+        f32 wz = w1[0][z];
+        for (s32 y = 0; y < dims[1]; y++) {
+            s32 y0 = k0[1][y], y1 = y0 + (y0 + 1 < ntiles[1]);
+            f32 wy = w1[1][y];
+            for (s32 x = 0; x < dims[2]; x++) {
+                s32 x0 = k0[2][x], x1 = x0 + (x0 + 1 < ntiles[2]);
+                f32 wx = w1[2][x];
+                s64 i = ((s64)z * dims[1] + y) * dims[2] + x;
+                u8 v = in[i];
+
+                f32 c00 = tile_lut(z0, y0, x0)[v] * (1.0f - wx) + tile_lut(z0, y0, x1)[v] * wx;
+                f32 c01 = tile_lut(z0, y1, x0)[v] * (1.0f - wx) + tile_lut(z0, y1, x1)[v] * wx;
+                f32 c10 = tile_lut(z1, y0, x0)[v] * (1.0f - wx) + tile_lut(z1, y0, x1)[v] * wx;
+                f32 c11 = tile_lut(z1, y1, x0)[v] * (1.0f - wx) + tile_lut(z1, y1, x1)[v] * wx;
+                f32 c0 = c00 * (1.0f - wy) + c01 * wy;
+                f32 c1 = c10 * (1.0f - wy) + c11 * wy;
+                out[i] = (u8)(c0 * (1.0f - wz) + c1 * wz + 0.5f);
+            }
+        }
+    }
+    #undef tile_lut
+
+    for (int a = 0; a < 3; a++) {
+        free(k0[a]);
+        free(w1[a]);
+    }
+    free(luts);
+}
+
+// fusion() from the python: weight = min(normalized |laplacian|, well-exposedness)
+static void glcae_fusion_weights(const u8* v, f32* w, const s32 dims[3]) {
+    s64 total_size = (s64)dims[0] * dims[1] * dims[2];
+    s64 sy = dims[2], sz = (s64)dims[1] * dims[2];
+
+    u8 vmin = 255, vmax = 0;
+    for (s64 i = 0; i < total_size; i++) {
+        if (v[i] < vmin) vmin = v[i];
+        if (v[i] > vmax) vmax = v[i];
+    }
+
+    f32 lap_max = 0.0f;
+    for (s32 z = 0; z < dims[0]; z++) {
+        for (s32 y = 0; y < dims[1]; y++) {
+            for (s32 x = 0; x < dims[2]; x++) {
+                s64 i = z * sz + y * sy + x;
+                // replicate the border like cv2 does
+                s32 c = v[i];
+                s32 lap = (z > 0 ? v[i - sz] : c) + (z < dims[0] - 1 ? v[i + sz] : c) +
+                          (y > 0 ? v[i - sy] : c) + (y < dims[1] - 1 ? v[i + sy] : c) +
+                          (x > 0 ? v[i - 1] : c) + (x < dims[2] - 1 ? v[i + 1] : c) - 6 * c;
+                f32 a = (f32)(lap < 0 ? -lap : lap);
+                if (a > 255.0f) a = 255.0f;  // convertScaleAbs saturates
+                w[i] = a;
+                if (a > lap_max) lap_max = a;
+            }
+        }
+    }
+
+    f32 range = (f32)(vmax - vmin) + 1e-8f;
+    for (s64 i = 0; i < total_size; i++) {
+        f32 c_d = w[i] / (lap_max + 1e-8f) + 0.00001f;
+        f32 s = ((f32)v[i] - (f32)vmin) / range - 0.5f;
+        f32 b_d = expf(-(s * s) / (2.0f * 0.2f * 0.2f));
+        w[i] = c_d < b_d ? c_d : b_d;
+    }
+}
+
+// Global + local contrast enhancement of a u8 chunk, in place
+void vs_contrast_enhance_u8(tchunk* c, const ContrastParams* p) {
+    assert(c->dtype == VS_U8);
+    s64 total_size = tchunk_len(c);
+    const u8* x = c->d8;
+
+    // rescale to the full range, everything below is a function of the input level so it's all LUTs
+    u8 x_min = 255, x_max = 0;
+    for (s64 n = 0; n < total_size; n++) {
+        if (x[n] < x_min) x_min = x[n];
+        if (x[n] > x_max) x_max = x[n];
+    }
+    f32 x_hat_lut[256];
+    u8 i_lut[256];
+    for (int v = 0; v < 256; v++) {
+        f32 x_hat = 255.0f * ((f32)v - (f32)x_min) / ((f32)x_max - (f32)x_min + 1e-8f);
+        x_hat_lut[v] = x_hat;
+        i_lut[v] = x_hat < 0.0f ? 0 : x_hat > 255.0f ? 255 : (u8)x_hat;
+    }
+
+    u8* i = malloc(total_size);
+    lut_apply_u8(i_lut, x, i, total_size);
+
+    // global: histogram mapping of i, then hue preservation
+    u64 hist[256] = {0};
+    for (s64 n = 0; n < total_size; n++) hist[i[n]]++;
+    u8 t[256];
+    glcae_global_lut(hist, total_size, t);
+
+    u8 g_i_lut[256];
+    f32 g_lut[256];
+    for (int v = 0; v < 256; v++) {
+        g_i_lut[v] = t[i_lut[v]];
+        g_lut[v] = glcae_hue((f32)g_i_lut[v], (f32)i_lut[v], x_hat_lut[v]);
+    }
+    u8* g_i = malloc(total_size);
+    lut_apply_u8(g_i_lut, x, g_i, total_size);
+
+    // local: 3D CLAHE of i
+    u8* l_i = malloc(total_size);
+    clahe_3d_u8(i, l_i, c->dims, p);
+
+    f32* w_g = malloc(total_size * sizeof(f32));
+    f32* w_l = malloc(total_size * sizeof(f32));
+    glcae_fusion_weights(g_i, w_g, c->dims);
+    glcae_fusion_weights(l_i, w_l, c->dims);
+
+    // fuse, then rescale the result back to the full u8 range like rescale_array
+    f32* y = w_g;
+    f32 y_min = FLT_MAX, y_max = -FLT_MAX;
+    for (s64 n = 0; n < total_size; n++) {
+        u8 v = x[n];
+        f32 g = g_lut[v];
+        f32 l = glcae_hue((f32)l_i[n], (f32)i[n], x_hat_lut[v]);
+        f32 sum = w_g[n] + w_l[n] + 1e-8f;
+        f32 val = (w_g[n] * g + w_l[n] * l) / sum;
+        val = val < 0.0f ? 0.0f : val > 255.0f ? 255.0f : val;
+        y[n] = val;
+        if (val < y_min) y_min = val;
+        if (val > y_max) y_max = val;
+    }
+
+    f32 scale = y_max > y_min ? 255.0f / (y_max - y_min) : 0.0f;
+    for (s64 n = 0; n < total_size; n++) {
+        c->d8[n] = (u8)((y[n] - y_min) * scale + 0.5f);
+    }
+
+    free(i);
+    free(g_i);
+    free(l_i);
+    free(w_g);
+    free(w_l);
+}
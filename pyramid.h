@@ -0,0 +1,505 @@
+#pragma once
+
+#include <blosc2.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "volcano.h"
+#include "chunk.h"
+#include "labels.h"
+#include "traversal.h"
+
+// Multiscale pyramids of the run's outputs, built as chunks complete instead of in a second pass.
+// Level l is 2^l times coarser than level 0 and chunked the same, so each chunk at level l has the
+// 2x2x2 chunks of level l-1 below it, and each of those becomes one octant of it after pooling.
+// Every chunk the traversal visits is handed in exactly once, with data or as background. A parent
+// is finished by whichever thread delivers its last child, which writes it and pools it into its
+// own parent the same way. How many children each parent waits for is counted from the traversal
+// up front; chunks the traversal never visits are background and nobody waits on them.
+// Labels pool to the most common label among the 8 voxels, background only when all 8 are, so thin
+// sheets survive the coarse levels. Every level keeps level 0's labels, label_source on /0 resolves
+// them. Intensities pool to the mean.
+// The group follows OME-Zarr: .zgroup and a "multiscales" .zattrs at the root, the levels as the zarr
+// v2 arrays 0, 1, 2, ...
+
+#define PYRAMID_MAX_LEVELS 8
+
+typedef enum PyramidKind {
+  PYRAMID_LABELS,   // u64 label volumes, mode pooling
+  PYRAMID_MEAN,     // intensities in the pyramid's dtype, mean pooling
+} PyramidKind;
+
+typedef struct PyramidNode {
+  u64 key;            // 0 for an empty slot
+  s32 expected;       // children the traversal will deliver
+  s32 done;
+  void* octants[8];   // pooled children, nullptr for background
+} PyramidNode;
+
+typedef struct PyramidLevel {
+  s32 shape[3];
+  char root[1100];
+  LabelVolume* labels;   // PYRAMID_LABELS
+  s64 chunks_written;
+  s64 stored_bytes;
+} PyramidLevel;
+
+typedef struct Pyramid {
+  char root[1024];
+  PyramidKind kind;
+  vs_dtype dtype;
+  int elem_size;
+  int num_levels;
+  s32 chunks[3];
+  char cname[16];
+  int clevel;
+  PyramidLevel levels[PYRAMID_MAX_LEVELS];
+
+  // every parent at levels 1.., built once by pyramid_create and never resized, so lookups don't
+  // lock. done and octants are only touched under lock
+  PyramidNode* nodes;
+  s64 nodes_cap;   // power of two
+  pthread_mutex_t lock;
+
+  s64 pending_bytes;       // octants waiting on their siblings
+  s64 max_pending_bytes;
+  s64 encode_ns;
+} Pyramid;
+
+// Per worker state, reused for every chunk. pyramid nullptr makes every call a no-op
+typedef struct PyramidBuffer {
+  Pyramid* pyramid;
+  u8* chunk;               // a whole chunk, assembled from octants
+  LabelEncoder labels;
+  blosc2_context* cctx;
+  u8* compressed;
+  s64 compressed_cap;
+} PyramidBuffer;
+
+static void pyramid_buffer_free(PyramidBuffer* b) {
+  free(b->chunk);
+  label_encoder_free(&b->labels);
+  if (b->cctx) blosc2_free_ctx(b->cctx);
+  free(b->compressed);
+  *b = (PyramidBuffer){};
+}
+
+static inline u64 pyramid_key(int level, s32 cz, s32 cy, s32 cx) {
+  return (u64)level << 60 | (u64)cz << 40 | (u64)cy << 20 | (u64)cx;
+}
+
+static PyramidNode* pyramid_node(Pyramid* p, u64 key, bool insert) {
+  s64 mask = p->nodes_cap - 1;
+  for (s64 i = (s64)((key * 0x9e3779b97f4a7c15ull) >> 24) & mask;; i = (i + 1) & mask) {
+    PyramidNode* node = &p->nodes[i];
+    if (node->key == key) return node;
+    if (node->key == 0) {
+      if (!insert) return nullptr;
+      node->key = key;
+      return node;
+    }
+  }
+}
+
+static const char* pyramid_zarr_dtype(vs_dtype dtype) {
+  switch (dtype) {
+    case VS_U8: return "|u1";
+    case VS_U16: return "<u2";
+    case VS_F32: return "<f4";
+  }
+  return "|u1";
+}
+
+static bool pyramid_write_metadata(const Pyramid* p, const char* name) {
+  char path[1100];
+  snprintf(path, sizeof(path), "%s/.zgroup", p->root);
+  FILE* fp = fopen(path, "w");
+  if (!fp) return false;
+  fprintf(fp, "{\n  \"zarr_format\": 2\n}\n");
+  bool ok = fclose(fp) == 0;
+
+  snprintf(path, sizeof(path), "%s/.zattrs", p->root);
+  fp = fopen(path, "w");
+  if (!fp) return false;
+  fprintf(fp,
+          "{\n"
+          "  \"multiscales\": [{\n"
+          "    \"version\": \"0.4\",\n"
+          "    \"name\": \"%s\",\n"
+          "    \"type\": \"%s\",\n"
+          "    \"axes\": [{\"name\": \"z\", \"type\": \"space\"}, {\"name\": \"y\", \"type\": \"space\"}, {\"name\": \"x\", \"type\": \"space\"}],\n"
+          "    \"datasets\": [\n",
+          name, p->kind == PYRAMID_LABELS ? "mode" : "mean");
+  for (int l = 0; l < p->num_levels; l++) {
+    // a pooled voxel sits at the center of the 2^l level 0 voxels it covers
+    f64 scale = (f64)(1 << l);
+    f64 shift = (scale - 1.0) / 2.0;
+    fprintf(fp,
+            "      {\"path\": \"%d\", \"coordinateTransformations\": [{\"type\": \"scale\", \"scale\": [%.1f, %.1f, %.1f]}, "
+            "{\"type\": \"translation\", \"translation\": [%.1f, %.1f, %.1f]}]}%s\n",
+            l, scale, scale, scale, shift, shift, shift, l + 1 < p->num_levels ? "," : "");
+  }
+  fprintf(fp, "    ]\n  }]\n}\n");
+  return ok & (fclose(fp) == 0);
+}
+
+static bool pyramid_write_zarray(const Pyramid* p, const PyramidLevel* level) {
+  mkdir(level->root, 0755);
+  char path[1200];
+  snprintf(path, sizeof(path), "%s/.zarray", level->root);
+  FILE* fp = fopen(path, "w");
+  if (!fp) return false;
+  fprintf(fp,
+          "{\n"
+          "  \"zarr_format\": 2,\n"
+          "  \"shape\": [%d, %d, %d],\n"
+          "  \"chunks\": [%d, %d, %d],\n"
+          "  \"dtype\": \"%s\",\n"
+          "  \"fill_value\": 0,\n"
+          "  \"order\": \"C\",\n"
+          "  \"dimension_separator\": \"/\",\n"
+          "  \"filters\": null,\n"
+          "  \"compressor\": {\"id\": \"blosc\", \"cname\": \"%s\", \"clevel\": %d, \"shuffle\": 1, \"blocksize\": 0}\n"
+          "}\n",
+          level->shape[0], level->shape[1], level->shape[2], p->chunks[0], p->chunks[1], p->chunks[2],
+          pyramid_zarr_dtype(p->dtype), p->cname, p->clevel);
+  return fclose(fp) == 0;
+}
+
+// Create root as an empty pyramid of num_levels levels over a level 0 of the given zyx shape, for the
+// chunks of traversal. dtype is ignored for labels, label_bits for intensities
+static Pyramid* pyramid_create(const char* root, PyramidKind kind, vs_dtype dtype, const s32 shape[3], const s32 chunks[3],
+                               int num_levels, const Traversal* traversal, int label_bits, const char* cname, int clevel) {
+  if (num_levels < 1 || num_levels > PYRAMID_MAX_LEVELS) {
+    printf("a pyramid has 1 to %d levels, not %d\n", PYRAMID_MAX_LEVELS, num_levels);
+    return nullptr;
+  }
+  for (int d = 0; d < 3; d++) {
+    if (num_levels > 1 && chunks[d] % 2) {
+      printf("pyramid chunks have to be even to pool 2x2x2\n");
+      return nullptr;
+    }
+  }
+  mkdir(root, 0755);
+  Pyramid* p = calloc(1, sizeof(Pyramid));
+  snprintf(p->root, sizeof(p->root), "%s", root);
+  p->kind = kind;
+  p->dtype = kind == PYRAMID_LABELS ? VS_U8 : dtype;
+  p->elem_size = kind == PYRAMID_LABELS ? (int)sizeof(u64) : vs_dtype_size(dtype);
+  p->num_levels = num_levels;
+  memcpy(p->chunks, chunks, sizeof(p->chunks));
+  snprintf(p->cname, sizeof(p->cname), "%s", cname);
+  p->clevel = clevel;
+  pthread_mutex_init(&p->lock, nullptr);
+
+  const char* name = strrchr(root, '/');
+  bool ok = pyramid_write_metadata(p, name ? name + 1 : root);
+  for (int l = 0; ok && l < num_levels; l++) {
+    PyramidLevel* level = &p->levels[l];
+    for (int d = 0; d < 3; d++) level->shape[d] = (shape[d] + (1 << l) - 1) >> l;
+    snprintf(level->root, sizeof(level->root), "%s/%d", root, l);
+    if (kind == PYRAMID_LABELS) {
+      level->labels = label_volume_create(level->root, level->shape, chunks, label_bits, cname, clevel);
+      ok = level->labels != nullptr;
+    } else {
+      ok = pyramid_write_zarray(p, level);
+    }
+  }
+
+  // count every parent's children, level by level. A parent at level l has a child at l-1 when any
+  // traversal chunk is below it
+  s64 cap = 16;
+  while (cap < 2 * traversal->count * (num_levels - 1)) cap *= 2;
+  p->nodes_cap = cap;
+  p->nodes = calloc(cap, sizeof(PyramidNode));
+  ok = ok && p->nodes;
+  if (ok && num_levels > 1) {
+    for (s64 i = 0; i < traversal->count; i++) {
+      const ChunkCoord* c = &traversal->chunks[i];
+      pyramid_node(p, pyramid_key(1, c->z >> 1, c->y >> 1, c->x >> 1), true)->expected++;
+    }
+    for (int l = 2; l < num_levels; l++) {
+      // parents inserted along the way are at level l and skipped
+      for (s64 i = 0; i < cap; i++) {
+        u64 key = p->nodes[i].key;
+        if (key == 0 || (int)(key >> 60) != l - 1) continue;
+        s32 cz = (s32)(key >> 40 & 0xfffff), cy = (s32)(key >> 20 & 0xfffff), cx = (s32)(key & 0xfffff);
+        pyramid_node(p, pyramid_key(l, cz >> 1, cy >> 1, cx >> 1), true)->expected++;
+      }
+    }
+  }
+  if (!ok) {
+    printf("could not create the pyramid %s\n", root);
+    for (int l = 0; l < num_levels; l++) label_volume_free(p->levels[l].labels);
+    free(p->nodes);
+    free(p);
+    return nullptr;
+  }
+  return p;
+}
+
+// Most common nonzero label of 8, the smaller one on ties
+static inline u64 pyramid_mode8(const u64 v[8]) {
+  if (v[0] == v[1] && v[0] == v[2] && v[0] == v[3] && v[0] == v[4] && v[0] == v[5] && v[0] == v[6] && v[0] == v[7]) {
+    return v[0];
+  }
+  u64 best = 0;
+  int best_count = 0;
+  for (int i = 0; i < 8; i++) {
+    if (v[i] == 0) continue;
+    int count = 0;
+    for (int j = 0; j < 8; j++) count += v[j] == v[i];
+    if (count > best_count || (count == best_count && v[i] < best)) {
+      best = v[i];
+      best_count = count;
+    }
+  }
+  return best;
+}
+
+#define PYRAMID_POOL_MEAN(T, ACC, ROUND)                                                                       \
+  do {                                                                                                         \
+    const T* in = data;                                                                                        \
+    T* out = octant;                                                                                           \
+    for (s32 z = 0; z < h[0]; z++) {                                                                           \
+      for (s32 y = 0; y < h[1]; y++) {                                                                         \
+        const T* r[4] = {in + ((s64)(2 * z) * d[1] + 2 * y) * d[2], in + ((s64)(2 * z) * d[1] + 2 * y + 1) * d[2], \
+                         in + ((s64)(2 * z + 1) * d[1] + 2 * y) * d[2],                                        \
+                         in + ((s64)(2 * z + 1) * d[1] + 2 * y + 1) * d[2]};                                   \
+        for (s32 x = 0; x < h[2]; x++) {                                                                       \
+          ACC sum = 0;                                                                                         \
+          for (int k = 0; k < 4; k++) sum += (ACC)r[k][2 * x] + (ACC)r[k][2 * x + 1];                          \
+          *out++ = (T)((sum + ROUND) / 8);                                                                     \
+        }                                                                                                      \
+      }                                                                                                        \
+    }                                                                                                          \
+  } while (0)
+
+// 2x2x2 pool a whole chunk into a new octant
+static void* pyramid_pool(const Pyramid* p, const void* data) {
+  const s32* d = p->chunks;
+  const s32 h[3] = {d[0] / 2, d[1] / 2, d[2] / 2};
+  void* octant = malloc((s64)h[0] * h[1] * h[2] * p->elem_size);
+  if (p->kind == PYRAMID_LABELS) {
+    const u64* in = data;
+    u64* out = octant;
+    for (s32 z = 0; z < h[0]; z++) {
+      for (s32 y = 0; y < h[1]; y++) {
+        for (s32 x = 0; x < h[2]; x++) {
+          u64 v[8];
+          for (int k = 0; k < 8; k++) {
+            v[k] = in[((s64)(2 * z + (k >> 2)) * d[1] + 2 * y + (k >> 1 & 1)) * d[2] + 2 * x + (k & 1)];
+          }
+          *out++ = pyramid_mode8(v);
+        }
+      }
+    }
+    return octant;
+  }
+  switch (p->dtype) {
+    case VS_U8: PYRAMID_POOL_MEAN(u8, u32, 4); break;
+    case VS_U16: PYRAMID_POOL_MEAN(u16, u32, 4); break;
+    case VS_F32: PYRAMID_POOL_MEAN(f32, f32, 0.0f); break;
+  }
+  return octant;
+}
+
+#undef PYRAMID_POOL_MEAN
+
+// A finished parent's octants as one chunk in b->chunk, nullptr when every child was background.
+// Frees the octants
+static const void* pyramid_assemble(PyramidBuffer* b, PyramidNode* node) {
+  Pyramid* p = b->pyramid;
+  bool any = false;
+  for (int o = 0; o < 8; o++) any |= node->octants[o] != nullptr;
+  if (!any) return nullptr;
+
+  const s32* d = p->chunks;
+  const s32 h[3] = {d[0] / 2, d[1] / 2, d[2] / 2};
+  s64 row = (s64)h[2] * p->elem_size;
+  if (!b->chunk) b->chunk = malloc((s64)d[0] * d[1] * d[2] * p->elem_size);
+  for (int o = 0; o < 8; o++) {
+    const s32 oz = (o >> 2) * h[0], oy = (o >> 1 & 1) * h[1], ox = (o & 1) * h[2];
+    const u8* src = node->octants[o];
+    for (s32 z = 0; z < h[0]; z++) {
+      for (s32 y = 0; y < h[1]; y++) {
+        u8* dst = b->chunk + (((s64)(oz + z) * d[1] + oy + y) * d[2] + ox) * p->elem_size;
+        if (src) {
+          memcpy(dst, src + ((s64)z * h[1] + y) * row, row);
+        } else {
+          memset(dst, 0, row);
+        }
+      }
+    }
+    if (src) __atomic_fetch_sub(&p->pending_bytes, row * h[0] * h[1], __ATOMIC_RELAXED);
+    free(node->octants[o]);
+    node->octants[o] = nullptr;
+  }
+  return b->chunk;
+}
+
+static bool pyramid_write_chunk(PyramidBuffer* b, int l, const s32 c[3], const void* data) {
+  Pyramid* p = b->pyramid;
+  PyramidLevel* level = &p->levels[l];
+  s64 t0 = io_now_ns();
+  // label volumes count their own bytes
+  s64 stored = 0;
+  if (p->kind == PYRAMID_LABELS) {
+    if (!label_volume_write_labels(level->labels, &b->labels, c[0], c[1], c[2], data)) return false;
+  } else {
+    s64 raw = (s64)p->chunks[0] * p->chunks[1] * p->chunks[2] * p->elem_size;
+    if (raw > INT32_MAX - BLOSC2_MAX_OVERHEAD) return false;
+    if (b->compressed_cap < raw + BLOSC2_MAX_OVERHEAD) {
+      free(b->compressed);
+      b->compressed_cap = raw + BLOSC2_MAX_OVERHEAD;
+      b->compressed = malloc(b->compressed_cap);
+    }
+    if (!b->cctx) {
+      blosc2_cparams cparams = BLOSC2_CPARAMS_DEFAULTS;
+      cparams.compcode = label_blosc_compcode(p->cname);
+      cparams.clevel = p->clevel;
+      cparams.typesize = p->elem_size;
+      cparams.nthreads = 1;
+      cparams.filters[BLOSC2_MAX_FILTERS - 1] = BLOSC_SHUFFLE;
+      b->cctx = blosc2_create_cctx(cparams);
+    }
+    int size = blosc2_compress_ctx(b->cctx, data, (s32)raw, b->compressed, (s32)b->compressed_cap);
+    if (size <= 0) {
+      printf("compressing pyramid chunk %d %d %d of level %d failed: %d\n", c[0], c[1], c[2], l, size);
+      return false;
+    }
+    char path[1300];
+    snprintf(path, sizeof(path), "%s/%d", level->root, c[0]);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/%d/%d", level->root, c[0], c[1]);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/%d/%d/%d", level->root, c[0], c[1], c[2]);
+    FILE* fp = fopen(path, "wb");
+    bool ok = fp && fwrite(b->compressed, 1, size, fp) == (size_t)size;
+    if (fp) ok &= fclose(fp) == 0;
+    if (!ok) {
+      printf("could not write %s\n", path);
+      return false;
+    }
+    stored = size;
+  }
+  __atomic_fetch_add(&level->chunks_written, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&level->stored_bytes, stored, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&p->encode_ns, io_now_ns() - t0, __ATOMIC_RELAXED);
+  return true;
+}
+
+// Write a chunk at level l, nullptr for background, then carry it up for as long as it's the last
+// child its parent was waiting on
+static bool pyramid_deliver(PyramidBuffer* b, int l, s32 cz, s32 cy, s32 cx, const void* data) {
+  Pyramid* p = b->pyramid;
+  s32 c[3] = {cz, cy, cx};
+  bool ok = true;
+  for (; l < p->num_levels; l++) {
+    if (data) ok &= pyramid_write_chunk(b, l, c, data);
+    if (l + 1 == p->num_levels) break;
+
+    PyramidNode* parent = pyramid_node(p, pyramid_key(l + 1, c[0] >> 1, c[1] >> 1, c[2] >> 1), false);
+    if (!parent) {
+      printf("pyramid chunk %d %d %d of level %d isn't in the traversal\n", c[0], c[1], c[2], l);
+      return false;
+    }
+    void* octant = data ? pyramid_pool(p, data) : nullptr;
+    if (octant) {
+      s64 bytes = (s64)(p->chunks[0] / 2) * (p->chunks[1] / 2) * (p->chunks[2] / 2) * p->elem_size;
+      s64 pending = __atomic_add_fetch(&p->pending_bytes, bytes, __ATOMIC_RELAXED);
+      s64 max = __atomic_load_n(&p->max_pending_bytes, __ATOMIC_RELAXED);
+      while (pending > max && !__atomic_compare_exchange_n(&p->max_pending_bytes, &max, pending, true,
+                                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      }
+    }
+    int o = (c[0] & 1) << 2 | (c[1] & 1) << 1 | (c[2] & 1);
+    pthread_mutex_lock(&p->lock);
+    bool last = parent->done < parent->expected && ++parent->done == parent->expected;
+    if (parent->octants[o]) {
+      // delivered twice, keep the first
+      free(octant);
+      octant = nullptr;
+    } else {
+      parent->octants[o] = octant;
+    }
+    pthread_mutex_unlock(&p->lock);
+    if (!last) break;
+
+    // every sibling is in, this thread finishes the parent
+    data = pyramid_assemble(b, parent);
+    for (int d = 0; d < 3; d++) c[d] >>= 1;
+  }
+  return ok;
+}
+
+// Hand in a level 0 chunk of the pyramid's element type, nullptr for a chunk the traversal visited
+// but that came out empty. Every traversal chunk has to be handed in once or its parents are only
+// written by pyramid_close
+static bool pyramid_add(PyramidBuffer* b, s32 cz, s32 cy, s32 cx, const void* data) {
+  if (!b->pyramid) return true;
+  return pyramid_deliver(b, 0, cz, cy, cx, data);
+}
+
+static bool pyramid_add_tchunk(PyramidBuffer* b, s32 cz, s32 cy, s32 cx, const tchunk* chunk) {
+  if (!b->pyramid) return true;
+  const Pyramid* p = b->pyramid;
+  if (chunk && (chunk->dtype != p->dtype || memcmp(chunk->dims, p->chunks, sizeof(p->chunks)) != 0)) {
+    printf("chunk %d %d %d doesn't match the pyramid %s, left empty\n", cz, cy, cx, p->root);
+    chunk = nullptr;
+  }
+  return pyramid_add(b, cz, cy, cx, chunk ? chunk->data : nullptr);
+}
+
+// snic's labels for a chunk, superpixel rows and UINT32_MAX for background
+static bool pyramid_add_labels(PyramidBuffer* b, s32 cz, s32 cy, s32 cx, const u32* labels) {
+  if (!b->pyramid) return true;
+  const Pyramid* p = b->pyramid;
+  if (!labels) return pyramid_add(b, cz, cy, cx, nullptr);
+  if (!b->chunk) b->chunk = malloc((s64)p->chunks[0] * p->chunks[1] * p->chunks[2] * p->elem_size);
+  label_chunk_globalize(p->levels[0].labels, cz, cy, cx, labels, (u64*)b->chunk);
+  return pyramid_add(b, cz, cy, cx, b->chunk);
+}
+
+static void pyramid_print_stats(const Pyramid* p) {
+  f64 mb = 1.0 / (1024.0 * 1024.0);
+  s64 chunks = 0;
+  printf("pyramid %s:", p->root);
+  for (int l = 0; l < p->num_levels; l++) {
+    const PyramidLevel* level = &p->levels[l];
+    chunks += level->chunks_written;
+    s64 stored = level->labels ? level->labels->stored_bytes : level->stored_bytes;
+    printf(" %d: %lld chunks %.1f MB%s", l, level->chunks_written, (f64)stored * mb,
+           l + 1 < p->num_levels ? "," : "\n");
+  }
+  printf("pyramid %s: %.1f ms encode per chunk, at most %.1f MB of octants waiting on their siblings\n", p->root,
+         chunks ? (f64)p->encode_ns * 1e-6 / (f64)chunks : 0.0, (f64)p->max_pending_bytes * mb);
+}
+
+// Finish the parents still waiting on children that were never handed in, e.g. after a worker
+// failed, with those children as background. Then print the stats and free everything
+static void pyramid_close(Pyramid* p) {
+  if (!p) return;
+  PyramidBuffer b = {.pyramid = p};
+  s64 incomplete = 0;
+  for (int l = 1; l < p->num_levels; l++) {
+    for (s64 i = 0; i < p->nodes_cap; i++) {
+      PyramidNode* node = &p->nodes[i];
+      if (node->key == 0 || (int)(node->key >> 60) != l || node->done == node->expected) continue;
+      incomplete++;
+      node->done = node->expected;
+      const void* data = pyramid_assemble(&b, node);
+      u64 key = node->key;
+      pyramid_deliver(&b, l, (s32)(key >> 40 & 0xfffff), (s32)(key >> 20 & 0xfffff), (s32)(key & 0xfffff), data);
+    }
+  }
+  if (incomplete) printf("pyramid %s: %lld parents were missing children\n", p->root, incomplete);
+  pyramid_buffer_free(&b);
+
+  pyramid_print_stats(p);
+  if (p->kind == PYRAMID_LABELS) label_volume_print_stats(p->levels[0].labels);
+  for (int l = 0; l < p->num_levels; l++) label_volume_free(p->levels[l].labels);
+  pthread_mutex_destroy(&p->lock);
+  free(p->nodes);
+  free(p);
+}
@@ -7,9 +7,13 @@
 #include <stdint.h>
 #include <time.h>
 
+#include "chunk.h"
+#include "brick.h"
+
 constexpr f32 compactness = 512.0f;
 constexpr int d_seed = 2;
 constexpr int dimension = 128;
+static_assert(dimension == BRICK_CHUNK_DIM);
 
 typedef struct HeapNode {
   f32 d;
@@ -78,85 +82,218 @@ typedef struct Superpixel {
 
 #define snic_superpixel_count() ((dimension/2)*(dimension/2)*(dimension/2))
 
-static int snic(f32 *img, u32 *labels, Superpixel* superpixels) {
-  constexpr int lz = dimension;
-  constexpr int ly = dimension;
-  constexpr int lx = dimension;
-  constexpr int lylx = ly * lx;
-  constexpr int img_size = lylx * lz;
-
-  // Initialize all labels to UINT32_MAX (uninitialized)
-  for (int i = 0; i < img_size; i++) {
-    labels[i] = UINT32_MAX;
-  }
-
-  constexpr f32 invwt = (compactness*compactness*snic_superpixel_count())/(f32)(img_size);
-
-  #define idx(z, y, x) ((z)*lylx + (x)*ly + (y))
-  #define sqr(x) ((x)*(x))
-
-  int neigh_overflow = 0;
-  Heap pq = heap_alloc(img_size);
-  u32 numk = 0;
-
-  for (u8 z = 0; z < lz; z += d_seed) {
-    for (u8 y = 0; y < ly; y += d_seed) {
-      for (u8 x = 0; x < lx; x += d_seed) {
-        heap_push(&pq, (HeapNode){.d = 0.0f, .k = numk, .x = x, .y = y, .z = z});
-        numk++;
-      }
-    }
-  }
-
-  while (pq.len > 0) {
-    HeapNode n = heap_pop(&pq);
-    int i = idx(n.z, n.y, n.x);
-    if (labels[i] != UINT32_MAX) continue;
-
-    u32 k = n.k;
-    labels[i] = k;
-    int c = img[i];
-    superpixels[k].c += c;
-    superpixels[k].x += n.x;
-    superpixels[k].y += n.y;
-    superpixels[k].z += n.z;
-    superpixels[k].n += 1;
-
-    #define do_neigh(ndz, ndy, ndx, ioffset) { \
-      int xx = n.x + ndx; int yy = n.y + ndy; int zz = n.z + ndz; \
-      if (0 <= xx && xx < lx && 0 <= yy && yy < ly && 0 <= zz && zz < lz) { \
-        int ii = i + ioffset; \
-        if (labels[ii] == UINT32_MAX) { \
-          f32 ksize = (f32)superpixels[k].n; \
-          f32 dc = sqr(255.0f*(superpixels[k].c - (img[ii]*ksize))); \
-          f32 dx = superpixels[k].x - xx*ksize; \
-          f32 dy = superpixels[k].y - yy*ksize; \
-          f32 dz = superpixels[k].z - zz*ksize; \
-          f32 dpos = sqr(dx) + sqr(dy) + sqr(dz); \
-          f32 d = (dc + dpos*invwt) / (ksize*ksize); \
-          heap_push(&pq, (HeapNode){.d = d, .k = k, .x = (u16)xx, .y = (u16)yy, .z = (u16)zz}); \
-        } \
-      } \
-    }
+// same zyx layout as chunk->data, x is the stride 1 axis. The kernels below define lylx and lx
+#define idx(z, y, x) ((z)*lylx + (y)*lx + (x))
+#define sqr(x) ((x)*(x))
+
+static const int snic_offsets[6][3] = {{0, 0, 1}, {0, 0, -1}, {0, 1, 0}, {0, -1, 0}, {1, 0, 0}, {-1, 0, 0}};
+
+// The SNIC kernels, instantiated per voxel type T so the inner loops read img directly. A growing
+// superpixel is summed in integers: positions are < dimension, so u32 sums can't overflow within a
+// chunk, and intensities go to ACC, wide enough for T (f32 voxels are truncated to int when summed,
+// as snic always did). The distances are taken from the exact sums and match what the f32 sums gave
+// for integral voxels. Superpixel gets the means at the end
+#define snic_kernels(T, ACC, name) \
+typedef struct SnicSums_##name {                                                                                      \
+  ACC c;                                                                                                              \
+  u32 z, y, x, n;                                                                                                     \
+} SnicSums_##name;                                                                                                    \
+                                                                                                                      \
+static inline void snic_add_##name(SnicSums_##name* s, T v, HeapNode n) {                                             \
+  s->c += (ACC)(int)v;                                                                                                \
+  s->z += n.z;                                                                                                        \
+  s->y += n.y;                                                                                                        \
+  s->x += n.x;                                                                                                        \
+  s->n += 1;                                                                                                          \
+}                                                                                                                     \
+                                                                                                                      \
+static inline f32 snic_cost_##name(const SnicSums_##name* s, T v, int zz, int yy, int xx) {                           \
+  constexpr f32 invwt = (compactness*compactness*snic_superpixel_count())/(f32)(dimension*dimension*dimension);       \
+  f32 ksize = (f32)s->n;                                                                                              \
+  f32 dc = sqr(255.0f*(f32)((f64)s->c - (f64)v*s->n));                                                                \
+  f32 dx = (f32)((s64)s->x - (s64)xx*s->n);                                                                           \
+  f32 dy = (f32)((s64)s->y - (s64)yy*s->n);                                                                           \
+  f32 dz = (f32)((s64)s->z - (s64)zz*s->n);                                                                           \
+  f32 dpos = sqr(dx) + sqr(dy) + sqr(dz);                                                                             \
+  return (dc + dpos*invwt) / (ksize*ksize);                                                                           \
+}                                                                                                                     \
+                                                                                                                      \
+static void snic_finish_##name(const SnicSums_##name* sums, Superpixel* superpixels) {                                \
+  for (u32 k = 0; k < snic_superpixel_count(); k++) {                                                                 \
+    if (sums[k].n == 0) continue;                                                                                     \
+    f32 ksize = (f32)sums[k].n;                                                                                       \
+    superpixels[k] = (Superpixel){.z = (f32)sums[k].z / ksize, .y = (f32)sums[k].y / ksize,                           \
+                                  .x = (f32)sums[k].x / ksize, .c = (f32)sums[k].c / ksize, .n = sums[k].n};          \
+  }                                                                                                                   \
+}                                                                                                                     \
+                                                                                                                      \
+static int snic_dense_##name(const T *img, u32 *labels, Superpixel* superpixels) {                                    \
+  constexpr int lz = dimension;                                                                                       \
+  constexpr int ly = dimension;                                                                                       \
+  constexpr int lx = dimension;                                                                                       \
+  constexpr int lylx = ly * lx;                                                                                       \
+  constexpr int img_size = lylx * lz;                                                                                 \
+                                                                                                                      \
+  for (int i = 0; i < img_size; i++) {                                                                                \
+    labels[i] = UINT32_MAX;                                                                                           \
+  }                                                                                                                   \
+  SnicSums_##name* sums = calloc(snic_superpixel_count(), sizeof(SnicSums_##name));                                   \
+  Heap pq = heap_alloc(img_size);                                                                                     \
+  u32 numk = 0;                                                                                                       \
+                                                                                                                      \
+  for (int z = 0; z < lz; z += d_seed) {                                                                              \
+    for (int y = 0; y < ly; y += d_seed) {                                                                            \
+      for (int x = 0; x < lx; x += d_seed) {                                                                          \
+        heap_push(&pq, (HeapNode){.d = 0.0f, .k = numk, .x = (u8)x, .y = (u8)y, .z = (u8)z});                         \
+        numk++;                                                                                                       \
+      }                                                                                                               \
+    }                                                                                                                 \
+  }                                                                                                                   \
+                                                                                                                      \
+  while (pq.len > 0) {                                                                                                \
+    HeapNode n = heap_pop(&pq);                                                                                       \
+    int i = idx(n.z, n.y, n.x);                                                                                       \
+    if (labels[i] != UINT32_MAX) continue;                                                                            \
+                                                                                                                      \
+    u32 k = n.k;                                                                                                      \
+    labels[i] = k;                                                                                                    \
+    snic_add_##name(&sums[k], img[i], n);                                                                             \
+                                                                                                                      \
+    for (int o = 0; o < 6; o++) {                                                                                     \
+      int zz = n.z + snic_offsets[o][0], yy = n.y + snic_offsets[o][1], xx = n.x + snic_offsets[o][2];                \
+      if (zz < 0 || zz >= lz || yy < 0 || yy >= ly || xx < 0 || xx >= lx) continue;                                   \
+      int ii = idx(zz, yy, xx);                                                                                       \
+      if (labels[ii] != UINT32_MAX) continue;                                                                         \
+      heap_push(&pq, (HeapNode){.d = snic_cost_##name(&sums[k], img[ii], zz, yy, xx), .k = k,                         \
+                                .x = (u8)xx, .y = (u8)yy, .z = (u8)zz});                                              \
+    }                                                                                                                 \
+  }                                                                                                                   \
+                                                                                                                      \
+  snic_finish_##name(sums, superpixels);                                                                              \
+  free(sums);                                                                                                         \
+  heap_free(&pq);                                                                                                     \
+  return 0;                                                                                                           \
+}                                                                                                                     \
+                                                                                                                      \
+static void snic_bricks_grow_##name(const T *img, const BrickSet* bricks, u32 *labels, SnicSums_##name* sums,         \
+                                    Heap* pq) {                                                                       \
+  constexpr int lz = dimension;                                                                                       \
+  constexpr int ly = dimension;                                                                                       \
+  constexpr int lx = dimension;                                                                                       \
+  constexpr int lylx = ly * lx;                                                                                       \
+                                                                                                                      \
+  while (pq->len > 0) {                                                                                               \
+    HeapNode n = heap_pop(pq);                                                                                        \
+    int i = idx(n.z, n.y, n.x);                                                                                       \
+    if (labels[i] != UINT32_MAX) continue;                                                                            \
+                                                                                                                      \
+    u32 k = n.k;                                                                                                      \
+    labels[i] = k;                                                                                                    \
+    snic_add_##name(&sums[k], img[i], n);                                                                             \
+                                                                                                                      \
+    for (int o = 0; o < 6; o++) {                                                                                     \
+      int zz = n.z + snic_offsets[o][0], yy = n.y + snic_offsets[o][1], xx = n.x + snic_offsets[o][2];                \
+      if (zz < 0 || zz >= lz || yy < 0 || yy >= ly || xx < 0 || xx >= lx) continue;                                   \
+      if (!brick_voxel_occupied(bricks, zz, yy, xx)) continue;                                                        \
+      int ii = idx(zz, yy, xx);                                                                                       \
+      T v = img[ii];                                                                                                  \
+      if (labels[ii] != UINT32_MAX || v == 0) continue;                                                               \
+      heap_push(pq, (HeapNode){.d = snic_cost_##name(&sums[k], v, zz, yy, xx), .k = k,                                \
+                               .x = (u8)xx, .y = (u8)yy, .z = (u8)zz});                                               \
+    }                                                                                                                 \
+  }                                                                                                                   \
+}                                                                                                                     \
+                                                                                                                      \
+static int snic_bricks_##name(const T *img, const BrickSet* bricks, u32 *labels, Superpixel* superpixels) {           \
+  constexpr int ly = dimension;                                                                                       \
+  constexpr int lx = dimension;                                                                                       \
+  constexpr int lylx = ly * lx;                                                                                       \
+  constexpr int img_size = lylx * dimension;                                                                          \
+  constexpr int seeds_per_axis = dimension / d_seed;                                                                  \
+                                                                                                                      \
+  memset(labels, 0xff, img_size * sizeof(u32));                                                                       \
+  SnicSums_##name* sums = calloc(snic_superpixel_count(), sizeof(SnicSums_##name));                                   \
+  /* every seed is a distinct foreground voxel, and every foreground voxel is labeled once and */                     \
+  /* pushes at most 6 neighbors, so the heap never holds more than 7 nodes per voxel. heap_alloc */                   \
+  /* reserves 2 * size + 1 nodes and heap_push doesn't grow, so size is half that bound */                            \
+  Heap pq = heap_alloc((int)((bricks->num_voxels * 7 + 1) / 2));                                                      \
+                                                                                                                      \
+  for (int b = 0; b < bricks->num_bricks; b++) {                                                                      \
+    int z0 = brick_z0(bricks, b), y0 = brick_y0(bricks, b), x0 = brick_x0(bricks, b);                                 \
+    for (int z = z0; z < z0 + BRICK_DIM; z += d_seed) {                                                               \
+      for (int y = y0; y < y0 + BRICK_DIM; y += d_seed) {                                                             \
+        for (int x = x0; x < x0 + BRICK_DIM; x += d_seed) {                                                           \
+          int s = -1;                                                                                                 \
+          for (int c = 0; c < d_seed * d_seed * d_seed && s < 0; c++) {                                               \
+            if (img[idx(z + c / (d_seed * d_seed), y + c / d_seed % d_seed, x + c % d_seed)] != 0) s = c;             \
+          }                                                                                                           \
+          if (s < 0) continue;                                                                                        \
+          u32 k = ((z / d_seed) * seeds_per_axis + (y / d_seed)) * seeds_per_axis + (x / d_seed);                     \
+          heap_push(&pq, (HeapNode){.d = 0.0f, .k = k, .x = (u8)(x + s % d_seed), .y = (u8)(y + s / d_seed % d_seed), \
+                                    .z = (u8)(z + s / (d_seed * d_seed))});                                           \
+        }                                                                                                             \
+      }                                                                                                               \
+    }                                                                                                                 \
+  }                                                                                                                   \
+  snic_bricks_grow_##name(img, bricks, labels, sums, &pq);                                                            \
+                                                                                                                      \
+  int unlabeled = 0;                                                                                                  \
+  u32 free_k = 0;                                                                                                     \
+  brick_foreach_voxel(bricks, z, y, x) {                                                                              \
+    int i = idx(z, y, x);                                                                                             \
+    if (labels[i] != UINT32_MAX || img[i] == 0) continue;                                                             \
+    while (free_k < snic_superpixel_count() && sums[free_k].n != 0) free_k++;                                         \
+    if (free_k == snic_superpixel_count()) {                                                                          \
+      unlabeled++;                                                                                                    \
+      continue;                                                                                                       \
+    }                                                                                                                 \
+    heap_push(&pq, (HeapNode){.d = 0.0f, .k = free_k, .x = (u8)x, .y = (u8)y, .z = (u8)z});                           \
+    snic_bricks_grow_##name(img, bricks, labels, sums, &pq);                                                          \
+  }                                                                                                                   \
+                                                                                                                      \
+  snic_finish_##name(sums, superpixels);                                                                              \
+  free(sums);                                                                                                         \
+  heap_free(&pq);                                                                                                     \
+  return unlabeled;                                                                                                   \
+}
 
-    do_neigh( 0,  1,  0,    1);
-    do_neigh( 0, -1,  0,   -1);
-    do_neigh( 0,  0,  1,    ly);
-    do_neigh( 0,  0, -1,   -ly);
-    do_neigh( 1,  0,  0,  lylx);
-    do_neigh(-1,  0,  0, -lylx);
+snic_kernels(u8, u32, u8)
+snic_kernels(u16, u64, u16)
+snic_kernels(f32, s64, f32)
+#undef snic_kernels
+
+// img may be u8, u16 or f32
+static int snic_typed(const void *img, vs_dtype dtype, u32 *labels, Superpixel* superpixels) {
+  switch (dtype) {
+    case VS_U8: return snic_dense_u8(img, labels, superpixels);
+    case VS_U16: return snic_dense_u16(img, labels, superpixels);
+    case VS_F32: return snic_dense_f32(img, labels, superpixels);
   }
+  return 0;
+}
 
-  for (u32 k = 0; k < snic_superpixel_count(); k++) {
-    f32 ksize = (f32)superpixels[k].n;
-    superpixels[k].c /= ksize;
-    superpixels[k].x /= ksize;
-    superpixels[k].y /= ksize;
-    superpixels[k].z /= ksize;
+// SNIC restricted to the foreground of a cleaned chunk. Regions only grow through nonzero voxels of
+// occupied bricks, so zero voxels keep the UINT32_MAX label and the work is proportional to the
+// papyrus voxels. This is not snic_typed() with the background masked off:
+//   - each d_seed^3 seed cell holding foreground gets one seed, id k as in snic_typed(). It sits on the
+//     cell's grid voxel, where snic_typed() puts it, when that voxel is foreground, else on the cell's first
+//     foreground voxel
+//   - foreground no seed reached, e.g. a component sharing all its cells with another one, is seeded
+//     again afterwards, one seed per component, using the ids of superpixels that ended up empty.
+//     Every foreground voxel is labeled unless those run out; the return value counts the ones left
+//   - c is the mean over foreground voxels only, which are all >= iso after segment_and_clean, where
+//     snic_typed() also averages in the background its regions cross. So filter_superpixels_bricks(..., iso)
+//     keeps every superpixel with a voxel, and a chunk gets more superpixels than from snic_typed() and
+//     filter_superpixels()
+// Unused ids are left as they were in superpixels, which should be zeroed, with n == 0
+static int snic_bricks(const void *img, vs_dtype dtype, const BrickSet* bricks, u32 *labels, Superpixel* superpixels) {
+  static_assert(BRICK_DIM % d_seed == 0);
+  switch (dtype) {
+    case VS_U8: return snic_bricks_u8(img, bricks, labels, superpixels);
+    case VS_U16: return snic_bricks_u16(img, bricks, labels, superpixels);
+    case VS_F32: return snic_bricks_f32(img, bricks, labels, superpixels);
   }
-
-  heap_free(&pq);
-  return neigh_overflow;
+  return 0;
 }
 
 typedef struct SuperpixelConnection {
@@ -180,8 +317,69 @@ static void free_superpixel_connections(SuperpixelConnections* connections, u32
     free(connections);
 }
 
-static SuperpixelConnections* calculate_superpixel_connections(
-    const f32* img,
+// Second pass of calculate_superpixel_connections_bricks, per voxel type so the reads are direct
+#define superpixel_connections_kernel(T, name) \
+static void superpixel_connections_pass_##name(const T* img, const BrickSet* bricks, const u32* labels,           \
+                                              SuperpixelConnections* all_connections) {                           \
+    constexpr int lz = dimension;                                                                                 \
+    constexpr int ly = dimension;                                                                                 \
+    constexpr int lx = dimension;                                                                                 \
+    constexpr int lylx = ly * lx;                                                                                 \
+                                                                                                                  \
+    brick_foreach_voxel(bricks, z, y, x) {                                                                        \
+        u32 current_label = labels[idx(z,y,x)];                                                                   \
+        if (current_label == UINT32_MAX) continue;                                                                \
+        float current_val = (float)img[idx(z,y,x)];                                                               \
+                                                                                                                  \
+        for (int dz = -1; dz <= 1; dz++) {                                                                        \
+            for (int dy = -1; dy <= 1; dy++) {                                                                    \
+                for (int dx = -1; dx <= 1; dx++) {                                                                \
+                    if (dz == 0 && dy == 0 && dx == 0) continue;                                                  \
+                                                                                                                  \
+                    int xx = x + dx;                                                                              \
+                    int yy = y + dy;                                                                              \
+                    int zz = z + dz;                                                                              \
+                                                                                                                  \
+                    if (xx < 0 || xx >= lx || yy < 0 || yy >= ly || zz < 0 || zz >= lz)                           \
+                        continue;                                                                                 \
+                                                                                                                  \
+                    u32 neighbor_label = labels[idx(zz,yy,xx)];                                                   \
+                    if (neighbor_label == UINT32_MAX || neighbor_label == current_label)                          \
+                        continue;                                                                                 \
+                                                                                                                  \
+                    float neighbor_val = (float)img[idx(zz,yy,xx)];                                               \
+                    float value_similarity = 1.0f - fabsf(current_val - neighbor_val) / 255.0f;                   \
+                                                                                                                  \
+                    int conn_idx = -1;                                                                            \
+                    for (int i = 0; i < all_connections[current_label].num_connections; i++) {                    \
+                        if (all_connections[current_label].connections[i].neighbor_label == neighbor_label) {     \
+                            conn_idx = i;                                                                         \
+                            break;                                                                                \
+                        }                                                                                         \
+                    }                                                                                             \
+                                                                                                                  \
+                    if (conn_idx == -1) {                                                                         \
+                        conn_idx = all_connections[current_label].num_connections++;                              \
+                        all_connections[current_label].connections[conn_idx].neighbor_label = neighbor_label;     \
+                    }                                                                                             \
+                                                                                                                  \
+                    all_connections[current_label].connections[conn_idx].connection_strength += value_similarity; \
+                }                                                                                                 \
+            }                                                                                                     \
+        }                                                                                                         \
+    }                                                                                                             \
+}
+
+superpixel_connections_kernel(u8, u8)
+superpixel_connections_kernel(u16, u16)
+superpixel_connections_kernel(f32, f32)
+#undef superpixel_connections_kernel
+
+// bricks limits the scan to the occupied bricks of a cleaned chunk, NULL scans the whole chunk
+static SuperpixelConnections* calculate_superpixel_connections_bricks(
+    const void* img,
+    vs_dtype dtype,
+    const BrickSet* bricks,
     const u32* labels,
     int num_superpixels
 ) {
@@ -194,42 +392,38 @@ static SuperpixelConnections* calculate_superpixel_connections(
     if (!all_connections) return NULL;
 
     // First pass: count unique neighbors
-    for (int z = 0; z < lz; z++) {
-        for (int y = 0; y < ly; y++) {
-            for (int x = 0; x < lx; x++) {
-                u32 current_label = labels[idx(z,y,x)];
-                if (current_label == UINT32_MAX) continue;
-
-                for (int dz = -1; dz <= 1; dz++) {
-                    for (int dy = -1; dy <= 1; dy++) {
-                        for (int dx = -1; dx <= 1; dx++) {
-                            if (dz == 0 && dy == 0 && dx == 0) continue;
-
-                            int xx = x + dx;
-                            int yy = y + dy;
-                            int zz = z + dz;
-
-                            if (xx < 0 || xx >= lx || yy < 0 || yy >= ly || zz < 0 || zz >= lz)
-                                continue;
-
-                            u32 neighbor_label = labels[idx(zz,yy,xx)];
-                            if (neighbor_label == UINT32_MAX || neighbor_label == current_label)
-                                continue;
-
-                            bool found = false;
-                            if (all_connections[current_label].connections) {
-                                for (int i = 0; i < all_connections[current_label].num_connections; i++) {
-                                    if (all_connections[current_label].connections[i].neighbor_label == neighbor_label) {
-                                        found = true;
-                                        break;
-                                    }
-                                }
-                            }
-                            if (!found) {
-                                all_connections[current_label].num_connections++;
+    brick_foreach_voxel(bricks, z, y, x) {
+        u32 current_label = labels[idx(z,y,x)];
+        if (current_label == UINT32_MAX) continue;
+
+        for (int dz = -1; dz <= 1; dz++) {
+            for (int dy = -1; dy <= 1; dy++) {
+                for (int dx = -1; dx <= 1; dx++) {
+                    if (dz == 0 && dy == 0 && dx == 0) continue;
+
+                    int xx = x + dx;
+                    int yy = y + dy;
+                    int zz = z + dz;
+
+                    if (xx < 0 || xx >= lx || yy < 0 || yy >= ly || zz < 0 || zz >= lz)
+                        continue;
+
+                    u32 neighbor_label = labels[idx(zz,yy,xx)];
+                    if (neighbor_label == UINT32_MAX || neighbor_label == current_label)
+                        continue;
+
+                    bool found = false;
+                    if (all_connections[current_label].connections) {
+                        for (int i = 0; i < all_connections[current_label].num_connections; i++) {
+                            if (all_connections[current_label].connections[i].neighbor_label == neighbor_label) {
+                                found = true;
+                                break;
                             }
                         }
                     }
+                    if (!found) {
+                        all_connections[current_label].num_connections++;
+                    }
                 }
             }
         }
@@ -245,51 +439,10 @@ static SuperpixelConnections* calculate_superpixel_connections(
     }
 
     // Second pass: calculate connections
-    for (int z = 0; z < lz; z++) {
-        for (int y = 0; y < ly; y++) {
-            for (int x = 0; x < lx; x++) {
-                u32 current_label = labels[idx(z,y,x)];
-                if (current_label == UINT32_MAX) continue;
-                float current_val = img[idx(z,y,x)];
-
-                for (int dz = -1; dz <= 1; dz++) {
-                    for (int dy = -1; dy <= 1; dy++) {
-                        for (int dx = -1; dx <= 1; dx++) {
-                            if (dz == 0 && dy == 0 && dx == 0) continue;
-
-                            int xx = x + dx;
-                            int yy = y + dy;
-                            int zz = z + dz;
-
-                            if (xx < 0 || xx >= lx || yy < 0 || yy >= ly || zz < 0 || zz >= lz)
-                                continue;
-
-                            u32 neighbor_label = labels[idx(zz,yy,xx)];
-                            if (neighbor_label == UINT32_MAX || neighbor_label == current_label)
-                                continue;
-
-                            float neighbor_val = img[idx(zz,yy,xx)];
-                            float value_similarity = 1.0f - fabsf(current_val - neighbor_val) / 255.0f;
-
-                            int conn_idx = -1;
-                            for (int i = 0; i < all_connections[current_label].num_connections; i++) {
-                                if (all_connections[current_label].connections[i].neighbor_label == neighbor_label) {
-                                    conn_idx = i;
-                                    break;
-                                }
-                            }
-
-                            if (conn_idx == -1) {
-                                conn_idx = all_connections[current_label].num_connections++;
-                                all_connections[current_label].connections[conn_idx].neighbor_label = neighbor_label;
-                            }
-
-                            all_connections[current_label].connections[conn_idx].connection_strength += value_similarity;
-                        }
-                    }
-                }
-            }
-        }
+    switch (dtype) {
+        case VS_U8: superpixel_connections_pass_u8(img, bricks, labels, all_connections); break;
+        case VS_U16: superpixel_connections_pass_u16(img, bricks, labels, all_connections); break;
+        case VS_F32: superpixel_connections_pass_f32(img, bricks, labels, all_connections); break;
     }
 
     return all_connections;
@@ -327,5 +480,38 @@ static int filter_superpixels(u32* labels, Superpixel* superpixels, int min_size
     return new_count;
 }
 
+// filter_superpixels for a brick set, only relabels voxels in occupied bricks.
+// Voxels outside them were never labeled by snic_bricks
+static int filter_superpixels_bricks(u32* labels, Superpixel* superpixels, const BrickSet* bricks, int min_size, f32 min_val) {
+    constexpr int ly = dimension;
+    constexpr int lx = dimension;
+    constexpr int lylx = ly * lx;
+
+    int new_count = 0;
+    u32* label_map = calloc(snic_superpixel_count(), sizeof(u32));
+
+    for (u32 k = 0; k < snic_superpixel_count(); k++) {
+        if (superpixels[k].n >= min_size && superpixels[k].c >= min_val) {
+            label_map[k] = new_count;
+            if (new_count != k) {
+                superpixels[new_count] = superpixels[k];
+            }
+            new_count++;
+        } else {
+            label_map[k] = UINT32_MAX;
+        }
+    }
+
+    brick_foreach_voxel(bricks, z, y, x) {
+        int i = idx(z, y, x);
+        if (labels[i] != UINT32_MAX) {
+            labels[i] = label_map[labels[i]];
+        }
+    }
+
+    free(label_map);
+    return new_count;
+}
+
 #undef sqr
 #undef idx
\ No newline at end of file
@@ -0,0 +1,544 @@
+#pragma once
+
+#include <float.h>
+#include <sys/stat.h>
+
+#include "volcano.h"
+#include "output.h"
+#include "pack.h"
+
+// Scroll-wide spatial index over a run's superpixels and chords, built from its pack file. Queries by
+// box or sphere read only the parts of the index under the query, never the pack.
+//
+//   SpatialHeader | per chunk: SpatialSuperpixel[] SpatialChord[] | SpatialChunk[] | u32 directory[]
+//
+// The directory is a dense grid over the occupied chunk range holding each chunk's SpatialChunk index.
+// A chunk's superpixels are sorted by the morton key of their voxel in the chunk, so a box inside a
+// chunk is a few key ranges found by binary search (BIGMIN skips the runs of keys that leave the box).
+// Chords are per chunk and few, they're kept with their ChordStats bbox and tested one by one.
+// Coordinates in records are local to the chunk like in the tables, queries and SpatialChunk.origin
+// are global zyx voxels. Superpixel and chord ids are rows of the chunk's tables, so a chord's points
+// are pack_find(chunk, VCB_CHORDS) row id.
+
+#define SPATIAL_MAGIC "VOLCSPX"
+#define SPATIAL_VERSION 1
+#define SPATIAL_KEY_BITS 10     // per axis, chunks up to 1024 voxels a side
+#define SPATIAL_NO_CHUNK UINT32_MAX
+#define SPATIAL_DATA_OFFSET (2 * VCB_ALIGN)
+
+typedef struct SpatialHeader {
+  char magic[8];
+  u32 version;
+  u32 reserved;
+  s32 chunk_dims[3];
+  s32 grid_lo[3];       // directory covers chunks grid_lo .. grid_lo + grid_size - 1
+  s32 grid_size[3];
+  u32 pad;
+  u64 num_chunks;
+  u64 num_superpixels;
+  u64 num_chords;
+  u64 chunks_offset;
+  u64 directory_offset;
+  u64 total_bytes;
+} SpatialHeader;
+
+typedef struct SpatialChunk {
+  s32 chunk[3];
+  s32 origin[3];
+  u32 num_superpixels;
+  u32 num_chords;
+  u64 superpixels_offset;
+  u64 chords_offset;
+  f32 bounds[3][2];     // local min/max over superpixels and chord bboxes
+  u8 pad[8];
+} SpatialChunk;
+
+typedef struct SpatialSuperpixel {
+  u32 key;
+  u32 id;
+  f32 z, y, x, c;
+  u32 n;
+  u32 reserved;
+} SpatialSuperpixel;
+
+typedef struct SpatialChord {
+  f32 bbox[3][2];
+  u32 id;
+  u32 num_points;
+} SpatialChord;
+
+static_assert(sizeof(SpatialHeader) <= SPATIAL_DATA_OFFSET, "the header fits in front of the first chunk");
+static_assert(sizeof(SpatialChunk) == 80, "SpatialChunk is part of the file format");
+static_assert(sizeof(SpatialSuperpixel) == 32, "SpatialSuperpixel is part of the file format");
+static_assert(sizeof(SpatialChord) == 32, "SpatialChord is part of the file format");
+
+// morton keys, bit 3i + 2 is z's bit i, 3i + 1 y's, 3i x's
+
+static inline u32 morton_spread(u32 v) {
+  v &= 0x3ff;
+  v = (v | (v << 16)) & 0x030000ff;
+  v = (v | (v << 8)) & 0x0300f00f;
+  v = (v | (v << 4)) & 0x030c30c3;
+  v = (v | (v << 2)) & 0x09249249;
+  return v;
+}
+
+static inline u32 morton_key(u32 z, u32 y, u32 x) {
+  return (morton_spread(z) << 2) | (morton_spread(y) << 1) | morton_spread(x);
+}
+
+static inline bool morton_in_box(u32 key, u32 lo, u32 hi) {
+  for (u32 axis = 0; axis < 3; axis++) {
+    u32 mask = 0x09249249u << axis;
+    if ((key & mask) < (lo & mask) || (key & mask) > (hi & mask)) return false;
+  }
+  return true;
+}
+
+// Smallest key > key inside the box with corners lo and hi (Tropf and Herzog's BIGMIN). key is
+// between lo and hi but outside the box
+static u32 morton_bigmin(u32 key, u32 lo, u32 hi) {
+  u32 bigmin = hi;
+  for (int bit = 3 * SPATIAL_KEY_BITS - 1; bit >= 0; bit--) {
+    u32 b = 1u << bit;
+    u32 axis_below = (0x09249249u << (bit % 3)) & (b - 1);
+    u32 k = (key & b) != 0, l = (lo & b) != 0, h = (hi & b) != 0;
+    if (!k && !l && h) {
+      // the answer is either in the upper half of the box along this axis, or below with a smaller hi
+      bigmin = (lo & ~axis_below) | b;
+      hi = (hi & ~b) | axis_below;
+    } else if (!k && l && h) {
+      return lo;
+    } else if (k && !l && !h) {
+      return bigmin;
+    } else if (k && !l && h) {
+      lo = (lo & ~axis_below) | b;
+    }
+  }
+  return bigmin;
+}
+
+static inline u32 spatial_quantize(f32 v, s32 dim) {
+  s32 q = (s32)floorf(v);
+  return q < 0 ? 0 : q >= dim ? (u32)dim - 1 : (u32)q;
+}
+
+static int spatial_superpixel_cmp(const void* a, const void* b) {
+  const SpatialSuperpixel* l = a;
+  const SpatialSuperpixel* r = b;
+  if (l->key != r->key) return l->key < r->key ? -1 : 1;
+  return l->id < r->id ? -1 : l->id > r->id;
+}
+
+static bool spatial_write_at(FILE* fp, const void* data, s64 size, s64* offset) {
+  static const u8 zeros[VCB_ALIGN] = {};
+  s64 pad = vcb_align(*offset) - *offset;
+  if (pad && fwrite(zeros, 1, pad, fp) != (size_t)pad) return false;
+  *offset += pad;
+  if (size && fwrite(data, 1, size, fp) != (size_t)size) return false;
+  *offset += size;
+  return true;
+}
+
+// Index every chunk of a pack that has superpixels and chord stats tables. Written to a temp name
+// and renamed, like the tables
+static bool spatial_index_build(const PackReader* pack, const char* path) {
+  char tmp[1100];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  FILE* fp = fopen(tmp, "wb");
+  if (!fp) return false;
+
+  SpatialHeader header = {.magic = SPATIAL_MAGIC, .version = SPATIAL_VERSION};
+  s64 offset = SPATIAL_DATA_OFFSET;
+  static const u8 zeros[SPATIAL_DATA_OFFSET] = {};
+  bool ok = fwrite(zeros, 1, SPATIAL_DATA_OFFSET, fp) == SPATIAL_DATA_OFFSET;
+
+  s64 chunks_cap = 1024;
+  SpatialChunk* chunks = malloc(chunks_cap * sizeof(SpatialChunk));
+  SpatialSuperpixel* superpixels = nullptr;
+  SpatialChord* chords = nullptr;
+  s64 superpixels_cap = 0, chords_cap = 0;
+  s32 grid_hi[3] = {};
+  s64 skipped = 0;
+
+  // the pack index is sorted by chunk then kind, superpixels come right before chords and stats
+  for (s64 i = 0; ok && i < pack->count; i++) {
+    const PackEntry* e = &pack->index[i];
+    if (e->kind != VCB_SUPERPIXELS) continue;
+    VcbTable sp_table = {}, stats_table = {};
+    VcbSuperpixelView sp;
+    const f32* bbox = nullptr;
+    const s32* points = nullptr;
+    if (!pack_find(pack, e->chunk[0], e->chunk[1], e->chunk[2], VCB_SUPERPIXELS, &sp_table) ||
+        !pack_find(pack, e->chunk[0], e->chunk[1], e->chunk[2], VCB_CHORD_STATS, &stats_table) ||
+        !vcb_superpixel_view(&sp_table, &sp) ||
+        !(bbox = vcb_column_rows(&stats_table, "bbox", VCB_F32, 6, stats_table.header->rows)) ||
+        !(points = vcb_column_rows(&stats_table, "num_superpixels", VCB_S32, 1, stats_table.header->rows))) {
+      skipped++;
+      vcb_close(&sp_table);
+      vcb_close(&stats_table);
+      continue;
+    }
+    const VcbHeader* h = sp_table.header;
+    if (header.num_chunks == 0) {
+      memcpy(header.chunk_dims, h->dims, sizeof(header.chunk_dims));
+      memcpy(header.grid_lo, e->chunk, sizeof(header.grid_lo));
+      memcpy(grid_hi, e->chunk, sizeof(grid_hi));
+      for (int d = 0; d < 3; d++) {
+        if (h->dims[d] <= 0 || h->dims[d] > 1 << SPATIAL_KEY_BITS) ok = false;
+      }
+      if (!ok) printf("chunks of %d %d %d voxels are too big to index\n", h->dims[0], h->dims[1], h->dims[2]);
+    } else if (memcmp(header.chunk_dims, h->dims, sizeof(header.chunk_dims)) != 0) {
+      printf("chunk %d %d %d has different dims, skipping it\n", e->chunk[0], e->chunk[1], e->chunk[2]);
+      skipped++;
+      vcb_close(&sp_table);
+      vcb_close(&stats_table);
+      continue;
+    }
+
+    u64 num_sp = sp.count;
+    u64 num_chords = stats_table.header->rows;
+    if ((s64)num_sp > superpixels_cap) {
+      superpixels_cap = num_sp;
+      superpixels = realloc(superpixels, superpixels_cap * sizeof(SpatialSuperpixel));
+    }
+    if ((s64)num_chords > chords_cap) {
+      chords_cap = num_chords;
+      chords = realloc(chords, chords_cap * sizeof(SpatialChord));
+    }
+    SpatialChunk chunk = {
+      .chunk = {e->chunk[0], e->chunk[1], e->chunk[2]},
+      .origin = {h->origin[0], h->origin[1], h->origin[2]},
+      .num_superpixels = (u32)num_sp,
+      .num_chords = (u32)num_chords,
+      .bounds = {{FLT_MAX, -FLT_MAX}, {FLT_MAX, -FLT_MAX}, {FLT_MAX, -FLT_MAX}},
+    };
+    for (u64 j = 0; j < num_sp; j++) {
+      const f32 p[3] = {sp.z[j], sp.y[j], sp.x[j]};
+      for (int d = 0; d < 3; d++) {
+        chunk.bounds[d][0] = fminf(chunk.bounds[d][0], p[d]);
+        chunk.bounds[d][1] = fmaxf(chunk.bounds[d][1], p[d]);
+      }
+      superpixels[j] = (SpatialSuperpixel){
+        .key = morton_key(spatial_quantize(p[0], h->dims[0]), spatial_quantize(p[1], h->dims[1]),
+                          spatial_quantize(p[2], h->dims[2])),
+        .id = (u32)j, .z = p[0], .y = p[1], .x = p[2], .c = sp.c[j], .n = sp.n[j]};
+    }
+    qsort(superpixels, num_sp, sizeof(SpatialSuperpixel), spatial_superpixel_cmp);
+    for (u64 j = 0; j < num_chords; j++) {
+      SpatialChord* c = &chords[j];
+      memcpy(c->bbox, bbox + j * 6, sizeof(c->bbox));
+      c->id = (u32)j;
+      c->num_points = (u32)points[j];
+      for (int d = 0; d < 3; d++) {
+        chunk.bounds[d][0] = fminf(chunk.bounds[d][0], c->bbox[d][0]);
+        chunk.bounds[d][1] = fmaxf(chunk.bounds[d][1], c->bbox[d][1]);
+      }
+    }
+    vcb_close(&sp_table);
+    vcb_close(&stats_table);
+
+    ok = ok && spatial_write_at(fp, nullptr, 0, &offset);
+    chunk.superpixels_offset = offset;
+    ok = ok && spatial_write_at(fp, superpixels, num_sp * sizeof(SpatialSuperpixel), &offset);
+    chunk.chords_offset = offset;
+    ok = ok && spatial_write_at(fp, chords, num_chords * sizeof(SpatialChord), &offset);
+
+    if ((s64)header.num_chunks == chunks_cap) {
+      chunks_cap *= 2;
+      chunks = realloc(chunks, chunks_cap * sizeof(SpatialChunk));
+    }
+    chunks[header.num_chunks++] = chunk;
+    header.num_superpixels += num_sp;
+    header.num_chords += num_chords;
+    for (int d = 0; d < 3; d++) {
+      if (e->chunk[d] < header.grid_lo[d]) header.grid_lo[d] = e->chunk[d];
+      if (e->chunk[d] > grid_hi[d]) grid_hi[d] = e->chunk[d];
+    }
+  }
+
+  u32* directory = nullptr;
+  s64 cells = 0;
+  if (ok) {
+    if (header.num_chunks) {
+      cells = 1;
+      for (int d = 0; d < 3; d++) {
+        header.grid_size[d] = grid_hi[d] - header.grid_lo[d] + 1;
+        cells *= header.grid_size[d];
+      }
+    }
+    directory = malloc((cells ? cells : 1) * sizeof(u32));
+    for (s64 i = 0; i < cells; i++) directory[i] = SPATIAL_NO_CHUNK;
+    for (u64 i = 0; i < header.num_chunks; i++) {
+      const s32* c = chunks[i].chunk;
+      s64 cell = ((s64)(c[0] - header.grid_lo[0]) * header.grid_size[1] + (c[1] - header.grid_lo[1])) *
+                 header.grid_size[2] + (c[2] - header.grid_lo[2]);
+      directory[cell] = (u32)i;
+    }
+    ok = spatial_write_at(fp, nullptr, 0, &offset);
+    header.chunks_offset = offset;
+    ok = ok && spatial_write_at(fp, chunks, header.num_chunks * sizeof(SpatialChunk), &offset);
+    ok = ok && spatial_write_at(fp, nullptr, 0, &offset);
+    header.directory_offset = offset;
+    ok = ok && spatial_write_at(fp, directory, cells * sizeof(u32), &offset);
+    header.total_bytes = offset;
+    ok = ok && fseek(fp, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, fp) == 1;
+  }
+  ok &= fclose(fp) == 0;
+  if (!ok || rename(tmp, path) != 0) {
+    unlink(tmp);
+    ok = false;
+  }
+  if (ok) {
+    printf("indexed %llu chunks, %llu superpixels, %llu chords in %s (%.1f MB)",
+           header.num_chunks, header.num_superpixels, header.num_chords, path, (f64)offset / (1024.0 * 1024.0));
+    printf(skipped ? ", skipped %lld incomplete chunks\n" : "\n", skipped);
+  }
+  free(directory);
+  free(chords);
+  free(superpixels);
+  free(chunks);
+  return ok;
+}
+
+typedef struct SpatialIndex {
+  const SpatialHeader* header;
+  const SpatialChunk* chunks;
+  const u32* directory;
+  u8* base;
+  s64 size;
+} SpatialIndex;
+
+static SpatialIndex* spatial_index_open(const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return nullptr;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < SPATIAL_DATA_OFFSET) {
+    close(fd);
+    return nullptr;
+  }
+  void* base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) return nullptr;
+  const SpatialHeader* h = base;
+  s64 cells = (s64)h->grid_size[0] * h->grid_size[1] * h->grid_size[2];
+  if (memcmp(h->magic, SPATIAL_MAGIC, sizeof(h->magic)) != 0 || h->version != SPATIAL_VERSION ||
+      h->total_bytes != (u64)st.st_size || h->chunks_offset + h->num_chunks * sizeof(SpatialChunk) > h->total_bytes ||
+      h->directory_offset + cells * sizeof(u32) > h->total_bytes) {
+    printf("%s is not a version %d spatial index\n", path, SPATIAL_VERSION);
+    munmap(base, st.st_size);
+    return nullptr;
+  }
+  SpatialIndex* index = calloc(1, sizeof(SpatialIndex));
+  index->base = base;
+  index->size = st.st_size;
+  index->header = h;
+  index->chunks = (const SpatialChunk*)(index->base + h->chunks_offset);
+  index->directory = (const u32*)(index->base + h->directory_offset);
+  return index;
+}
+
+static void spatial_index_close(SpatialIndex* index) {
+  if (!index) return;
+  munmap(index->base, index->size);
+  free(index);
+}
+
+// The chunk at grid position cz cy cx, nullptr if it has no outputs
+static const SpatialChunk* spatial_chunk(const SpatialIndex* index, s32 cz, s32 cy, s32 cx) {
+  const SpatialHeader* h = index->header;
+  s32 c[3] = {cz - h->grid_lo[0], cy - h->grid_lo[1], cx - h->grid_lo[2]};
+  for (int d = 0; d < 3; d++) {
+    if (c[d] < 0 || c[d] >= h->grid_size[d]) return nullptr;
+  }
+  u32 i = index->directory[((s64)c[0] * h->grid_size[1] + c[1]) * h->grid_size[2] + c[2]];
+  return i == SPATIAL_NO_CHUNK ? nullptr : &index->chunks[i];
+}
+
+static inline const SpatialSuperpixel* spatial_chunk_superpixels(const SpatialIndex* index, const SpatialChunk* c) {
+  return (const SpatialSuperpixel*)(index->base + c->superpixels_offset);
+}
+
+static inline const SpatialChord* spatial_chunk_chords(const SpatialIndex* index, const SpatialChunk* c) {
+  return (const SpatialChord*)(index->base + c->chords_offset);
+}
+
+// Query results. Coordinates are local to the chunk at origin, same as the tables
+typedef struct SpatialSuperpixelHit {
+  s32 chunk[3];
+  u32 id;
+  s32 origin[3];
+  Superpixel sp;
+} SpatialSuperpixelHit;
+
+typedef struct SpatialChordHit {
+  s32 chunk[3];
+  u32 id;
+  s32 origin[3];
+  u32 num_points;
+  f32 bbox[3][2];
+} SpatialChordHit;
+
+typedef struct SpatialHits {
+  SpatialSuperpixelHit* superpixels;
+  s64 num_superpixels;
+  s64 superpixels_cap;
+  SpatialChordHit* chords;
+  s64 num_chords;
+  s64 chords_cap;
+} SpatialHits;
+
+static void spatial_hits_clear(SpatialHits* hits) {
+  hits->num_superpixels = 0;
+  hits->num_chords = 0;
+}
+
+static void spatial_hits_free(SpatialHits* hits) {
+  free(hits->superpixels);
+  free(hits->chords);
+  *hits = (SpatialHits){};
+}
+
+static void spatial_push_superpixel(SpatialHits* hits, const SpatialChunk* c, const SpatialSuperpixel* s) {
+  if (hits->num_superpixels == hits->superpixels_cap) {
+    hits->superpixels_cap = hits->superpixels_cap ? hits->superpixels_cap * 2 : 1024;
+    hits->superpixels = realloc(hits->superpixels, hits->superpixels_cap * sizeof(SpatialSuperpixelHit));
+  }
+  hits->superpixels[hits->num_superpixels++] = (SpatialSuperpixelHit){
+    .chunk = {c->chunk[0], c->chunk[1], c->chunk[2]}, .id = s->id,
+    .origin = {c->origin[0], c->origin[1], c->origin[2]},
+    .sp = {.z = s->z, .y = s->y, .x = s->x, .c = s->c, .n = s->n}};
+}
+
+static void spatial_push_chord(SpatialHits* hits, const SpatialChunk* c, const SpatialChord* chord) {
+  if (hits->num_chords == hits->chords_cap) {
+    hits->chords_cap = hits->chords_cap ? hits->chords_cap * 2 : 256;
+    hits->chords = realloc(hits->chords, hits->chords_cap * sizeof(SpatialChordHit));
+  }
+  SpatialChordHit* hit = &hits->chords[hits->num_chords++];
+  *hit = (SpatialChordHit){
+    .chunk = {c->chunk[0], c->chunk[1], c->chunk[2]}, .id = chord->id,
+    .origin = {c->origin[0], c->origin[1], c->origin[2]}, .num_points = chord->num_points};
+  memcpy(hit->bbox, chord->bbox, sizeof(hit->bbox));
+}
+
+// A query box, inclusive, and optionally a sphere inside it
+typedef struct SpatialQuery {
+  f32 lo[3], hi[3];
+  f32 center[3];
+  f32 radius2;    // < 0 for a plain box
+} SpatialQuery;
+
+static inline bool spatial_point_hit(const SpatialQuery* q, const f32 p[3]) {
+  for (int d = 0; d < 3; d++) {
+    if (p[d] < q->lo[d] || p[d] > q->hi[d]) return false;
+  }
+  if (q->radius2 < 0) return true;
+  f32 dz = p[0] - q->center[0], dy = p[1] - q->center[1], dx = p[2] - q->center[2];
+  return dz * dz + dy * dy + dx * dx <= q->radius2;
+}
+
+static inline bool spatial_box_hit(const SpatialQuery* q, const f32 box[3][2]) {
+  f32 dist2 = 0.0f;
+  for (int d = 0; d < 3; d++) {
+    if (box[d][1] < q->lo[d] || box[d][0] > q->hi[d]) return false;
+    f32 nearest = fminf(fmaxf(q->center[d], box[d][0]), box[d][1]);
+    dist2 += (nearest - q->center[d]) * (nearest - q->center[d]);
+  }
+  return q->radius2 < 0 || dist2 <= q->radius2;
+}
+
+static inline const SpatialSuperpixel* spatial_lower_bound(const SpatialSuperpixel* first, const SpatialSuperpixel* last, u32 key) {
+  while (first < last) {
+    const SpatialSuperpixel* mid = first + (last - first) / 2;
+    if (mid->key < key) first = mid + 1;
+    else last = mid;
+  }
+  return first;
+}
+
+// q in the chunk's local coordinates
+static void spatial_query_chunk(const SpatialIndex* index, const SpatialChunk* c, const SpatialQuery* q,
+                                bool want_superpixels, bool want_chords, SpatialHits* hits) {
+  if (!spatial_box_hit(q, c->bounds)) return;
+
+  if (want_superpixels && c->num_superpixels) {
+    const SpatialSuperpixel* sp = spatial_chunk_superpixels(index, c);
+    const SpatialSuperpixel* end = sp + c->num_superpixels;
+    bool inside = q->radius2 < 0;
+    for (int d = 0; d < 3 && inside; d++) inside = q->lo[d] <= c->bounds[d][0] && c->bounds[d][1] <= q->hi[d];
+    if (inside) {
+      for (; sp < end; sp++) spatial_push_superpixel(hits, c, sp);
+    } else {
+      const s32* dims = index->header->chunk_dims;
+      u32 lo = morton_key(spatial_quantize(q->lo[0], dims[0]), spatial_quantize(q->lo[1], dims[1]),
+                          spatial_quantize(q->lo[2], dims[2]));
+      u32 hi = morton_key(spatial_quantize(q->hi[0], dims[0]), spatial_quantize(q->hi[1], dims[1]),
+                          spatial_quantize(q->hi[2], dims[2]));
+      for (sp = spatial_lower_bound(sp, end, lo); sp < end && sp->key <= hi;) {
+        if (!morton_in_box(sp->key, lo, hi)) {
+          u32 next = morton_bigmin(sp->key, lo, hi);
+          sp = next > sp->key ? spatial_lower_bound(sp, end, next) : sp + 1;
+          continue;
+        }
+        // keys are floored voxels, the box edges cut through them
+        if (spatial_point_hit(q, (const f32[3]){sp->z, sp->y, sp->x})) spatial_push_superpixel(hits, c, sp);
+        sp++;
+      }
+    }
+  }
+
+  if (want_chords) {
+    const SpatialChord* chords = spatial_chunk_chords(index, c);
+    for (u32 i = 0; i < c->num_chords; i++) {
+      if (spatial_box_hit(q, chords[i].bbox)) spatial_push_chord(hits, c, &chords[i]);
+    }
+  }
+}
+
+static void spatial_query(const SpatialIndex* index, const SpatialQuery* q, bool want_superpixels, bool want_chords,
+                          SpatialHits* hits) {
+  const SpatialHeader* h = index->header;
+  if (h->num_chunks == 0) return;
+  s32 lo[3], hi[3];
+  for (int d = 0; d < 3; d++) {
+    lo[d] = (s32)floorf(q->lo[d] / h->chunk_dims[d]);
+    hi[d] = (s32)floorf(q->hi[d] / h->chunk_dims[d]);
+    if (lo[d] < h->grid_lo[d]) lo[d] = h->grid_lo[d];
+    if (hi[d] > h->grid_lo[d] + h->grid_size[d] - 1) hi[d] = h->grid_lo[d] + h->grid_size[d] - 1;
+  }
+  for (s32 cz = lo[0]; cz <= hi[0]; cz++) {
+    for (s32 cy = lo[1]; cy <= hi[1]; cy++) {
+      for (s32 cx = lo[2]; cx <= hi[2]; cx++) {
+        const SpatialChunk* c = spatial_chunk(index, cz, cy, cx);
+        if (!c) continue;
+        SpatialQuery local = *q;
+        for (int d = 0; d < 3; d++) {
+          local.lo[d] -= (f32)c->origin[d];
+          local.hi[d] -= (f32)c->origin[d];
+          local.center[d] -= (f32)c->origin[d];
+        }
+        spatial_query_chunk(index, c, &local, want_superpixels, want_chords, hits);
+      }
+    }
+  }
+}
+
+// Superpixels with their center in the box, and chords whose bbox overlaps it. lo and hi are global
+// zyx voxel coordinates, inclusive. Hits are appended
+static void spatial_query_box(const SpatialIndex* index, const f32 lo[3], const f32 hi[3],
+                              bool want_superpixels, bool want_chords, SpatialHits* hits) {
+  SpatialQuery q = {.lo = {lo[0], lo[1], lo[2]}, .hi = {hi[0], hi[1], hi[2]}, .radius2 = -1.0f};
+  spatial_query(index, &q, want_superpixels, want_chords, hits);
+}
+
+// Superpixels within radius of center, and chords whose bbox comes within radius of it
+static void spatial_query_radius(const SpatialIndex* index, const f32 center[3], f32 radius,
+                                 bool want_superpixels, bool want_chords, SpatialHits* hits) {
+  SpatialQuery q = {.center = {center[0], center[1], center[2]}, .radius2 = radius * radius};
+  for (int d = 0; d < 3; d++) {
+    q.lo[d] = center[d] - radius;
+    q.hi[d] = center[d] + radius;
+  }
+  spatial_query(index, &q, want_superpixels, want_chords, hits);
+}
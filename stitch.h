@@ -0,0 +1,581 @@
+#pragma once
+
+#include <float.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "volcano.h"
+#include "snic.h"
+#include "chord.h"
+#include "output.h"
+#include "traversal.h"
+
+// Stitches the per chunk chords into scroll length ones while the run goes. grow_chords stops at the
+// chunk's faces, so a sheet crossing a face leaves one chord ending just inside it and another starting
+// just inside the neighbor. When a chunk is done, each chord end near a face is matched against the
+// ends the chunk across that face left there, by distance and by the two pointing at each other.
+// Matched chords are joined with union-find. Ends whose neighbor isn't done yet wait in a hash of
+// faces; a face is dropped once both of its chunks are done, and whatever ends are still in it then
+// are final. A stitched chord whose pieces have no ends waiting anywhere is finished: it's written out
+// as a VCB_STITCHED_CHORDS row and its pieces are freed. Memory follows the faces with exactly one
+// side done and the chords reaching them, not the scroll.
+// Not thread safe on its own, stitch_add_chunk locks.
+
+#define STITCH_NONE UINT32_MAX
+
+typedef struct StitchParams {
+  f32 reach;       // how close to a face a chord end has to be to wait on it, in voxels
+  f32 max_gap;     // between matched ends
+  f32 min_align;   // -dot of the two ends' outward directions
+} StitchParams;
+
+typedef struct StitchEnd {
+  u32 chord;       // StitchChord handle
+  u8 end;          // 0 for the chord's first point, 1 for its last
+  f32 pos[3];      // global zyx
+  f32 dir[3];      // unit, pointing out of the chord
+} StitchEnd;
+
+typedef struct StitchFace {
+  u64 key;
+  struct StitchFace* next;
+  StitchEnd* ends;     // matched ones get chord STITCH_NONE
+  s32 count;
+  s32 cap;
+  // the ends bucketed by max_gap cells over the face's two in-plane axes, built at the first match.
+  // Ends only arrive before the second chunk is done and only get matched after, so it stays valid
+  s32* cell_start;     // cells[0] * cells[1] + 1, into cell_ends
+  s32* cell_ends;      // end indices, cell by cell
+  s32 cell_lo[2];
+  s32 cells[2];
+} StitchFace;
+
+typedef struct StitchChord {
+  u32 parent;          // union-find, the free list while unused
+  u32 next_member;     // circular list of the pieces of a stitched chord
+  u32 open;            // at the root, ends of its pieces still waiting on a face
+  u32 link[2];         // chord joined at each end, STITCH_NONE at a free end
+  u8 link_end[2];      // and which of its ends
+  u8 touched;          // on the touched list of the current stitch_add_chunk
+  u8 emitting;
+  s32 chunk[3];
+  u32 row;             // in the chunk's VCB_CHORDS table
+  s32 num_points;
+  f32* points;         // num_points * 3, global zyx
+} StitchChord;
+
+typedef struct Stitcher {
+  StitchParams params;
+  s32 grid[3];
+  s32 dims[3];
+  VcbParams vcb_params;
+  u8* state;           // per chunk: 1 will be processed, 2 done
+
+  StitchChord* chords;
+  u32 num_chords;
+  u32 cap;
+  u32 free_list;
+  u32 live;
+
+  StitchFace** faces;  // chained hash on the face key
+  s64 faces_cap;       // power of two
+  s64 num_faces;
+
+  u32* touched;
+  s64 num_touched;
+  s64 touched_cap;
+
+  pthread_mutex_t lock;
+
+  s64 chords_added;
+  s64 joins;
+  s64 stitched;        // rows written
+  s64 max_live;
+  s64 max_faces;
+} Stitcher;
+
+// Over the chunks of traversal, the only ones whose faces anything waits on
+static Stitcher* stitcher_new(const s32 grid[3], const s32 dims[3], const Traversal* traversal, StitchParams params,
+                              VcbParams vcb_params) {
+  Stitcher* s = calloc(1, sizeof(Stitcher));
+  s->params = params;
+  memcpy(s->grid, grid, sizeof(s->grid));
+  memcpy(s->dims, dims, sizeof(s->dims));
+  s->vcb_params = vcb_params;
+  s->state = calloc((s64)grid[0] * grid[1] * grid[2], 1);
+  for (s64 i = 0; i < traversal->count; i++) {
+    const ChunkCoord* c = &traversal->chunks[i];
+    s->state[((s64)c->z * grid[1] + c->y) * grid[2] + c->x] = 1;
+  }
+  s->free_list = STITCH_NONE;
+  s->faces_cap = 1024;
+  s->faces = calloc(s->faces_cap, sizeof(StitchFace*));
+  pthread_mutex_init(&s->lock, nullptr);
+  return s;
+}
+
+static u8* stitch_state(Stitcher* s, s32 cz, s32 cy, s32 cx) {
+  if (cz < 0 || cy < 0 || cx < 0 || cz >= s->grid[0] || cy >= s->grid[1] || cx >= s->grid[2]) return nullptr;
+  return &s->state[((s64)cz * s->grid[1] + cy) * s->grid[2] + cx];
+}
+
+static u32 stitch_find(Stitcher* s, u32 c) {
+  while (s->chords[c].parent != c) {
+    s->chords[c].parent = s->chords[s->chords[c].parent].parent;
+    c = s->chords[c].parent;
+  }
+  return c;
+}
+
+static void stitch_touch(Stitcher* s, u32 c) {
+  if (s->chords[c].touched) return;
+  s->chords[c].touched = 1;
+  if (s->num_touched == s->touched_cap) {
+    s->touched_cap = s->touched_cap ? s->touched_cap * 2 : 1024;
+    s->touched = realloc(s->touched, s->touched_cap * sizeof(u32));
+  }
+  s->touched[s->num_touched++] = c;
+}
+
+static u32 stitch_chord_new(Stitcher* s) {
+  u32 c;
+  if (s->free_list != STITCH_NONE) {
+    c = s->free_list;
+    s->free_list = s->chords[c].parent;
+  } else {
+    if (s->num_chords == s->cap) {
+      s->cap = s->cap ? s->cap * 2 : 4096;
+      s->chords = realloc(s->chords, s->cap * sizeof(StitchChord));
+    }
+    c = s->num_chords++;
+  }
+  s->chords[c] = (StitchChord){.parent = c, .next_member = c, .link = {STITCH_NONE, STITCH_NONE}};
+  s->live++;
+  if (s->live > s->max_live) s->max_live = s->live;
+  return c;
+}
+
+static void stitch_chord_free(Stitcher* s, u32 c) {
+  free(s->chords[c].points);
+  s->chords[c].points = nullptr;
+  s->chords[c].parent = s->free_list;
+  s->free_list = c;
+  s->live--;
+}
+
+// The face between chunk c and its neighbor along +axis
+static inline u64 stitch_face_key(int axis, s32 cz, s32 cy, s32 cx) {
+  return (u64)axis << 62 | (u64)cz << 40 | (u64)cy << 20 | (u64)cx;
+}
+
+static StitchFace** stitch_face_slot(Stitcher* s, u64 key) {
+  StitchFace** slot = &s->faces[(key * 0x9e3779b97f4a7c15ull) >> 20 & (s->faces_cap - 1)];
+  while (*slot && (*slot)->key != key) slot = &(*slot)->next;
+  return slot;
+}
+
+static StitchFace* stitch_face_get(Stitcher* s, u64 key) {
+  StitchFace** slot = stitch_face_slot(s, key);
+  if (*slot) return *slot;
+  if (s->num_faces >= s->faces_cap) {
+    s64 old_cap = s->faces_cap;
+    StitchFace** old = s->faces;
+    s->faces_cap *= 2;
+    s->faces = calloc(s->faces_cap, sizeof(StitchFace*));
+    for (s64 i = 0; i < old_cap; i++) {
+      for (StitchFace* f = old[i]; f;) {
+        StitchFace* next = f->next;
+        StitchFace** to = &s->faces[(f->key * 0x9e3779b97f4a7c15ull) >> 20 & (s->faces_cap - 1)];
+        f->next = *to;
+        *to = f;
+        f = next;
+      }
+    }
+    free(old);
+    slot = stitch_face_slot(s, key);
+  }
+  StitchFace* f = calloc(1, sizeof(StitchFace));
+  f->key = key;
+  *slot = f;
+  s->num_faces++;
+  if (s->num_faces > s->max_faces) s->max_faces = s->num_faces;
+  return f;
+}
+
+static void stitch_face_free(StitchFace* f) {
+  free(f->ends);
+  free(f->cell_start);
+  free(f->cell_ends);
+  free(f);
+}
+
+// Drop a face both chunks are done with, its remaining ends are final
+static void stitch_face_retire(Stitcher* s, u64 key) {
+  StitchFace** slot = stitch_face_slot(s, key);
+  StitchFace* f = *slot;
+  if (!f) return;
+  for (s32 i = 0; i < f->count; i++) {
+    if (f->ends[i].chord == STITCH_NONE) continue;
+    u32 root = stitch_find(s, f->ends[i].chord);
+    s->chords[root].open--;
+    stitch_touch(s, root);
+  }
+  *slot = f->next;
+  stitch_face_free(f);
+  s->num_faces--;
+}
+
+// Cells are at least a voxel so a tiny max_gap can't blow up their number
+static inline f32 stitch_cell_size(const Stitcher* s) { return s->params.max_gap > 1.0f ? s->params.max_gap : 1.0f; }
+
+static inline s32 stitch_cell(const Stitcher* s, f32 v) { return (s32)floorf(v / stitch_cell_size(s)); }
+
+// Counting sort of the face's ends into cells
+static void stitch_face_index(const Stitcher* s, StitchFace* f) {
+  int axis = (int)(f->key >> 62), a0 = (axis + 1) % 3, a1 = (axis + 2) % 3;
+  s32 lo[2] = {INT32_MAX, INT32_MAX}, hi[2] = {INT32_MIN, INT32_MIN};
+  for (s32 i = 0; i < f->count; i++) {
+    s32 c[2] = {stitch_cell(s, f->ends[i].pos[a0]), stitch_cell(s, f->ends[i].pos[a1])};
+    for (int d = 0; d < 2; d++) {
+      lo[d] = c[d] < lo[d] ? c[d] : lo[d];
+      hi[d] = c[d] > hi[d] ? c[d] : hi[d];
+    }
+  }
+  for (int d = 0; d < 2; d++) {
+    f->cell_lo[d] = f->count ? lo[d] : 0;
+    f->cells[d] = f->count ? hi[d] - lo[d] + 1 : 1;
+  }
+  s64 num_cells = (s64)f->cells[0] * f->cells[1];
+  f->cell_start = calloc(num_cells + 1, sizeof(s32));
+  f->cell_ends = malloc((f->count ? f->count : 1) * sizeof(s32));
+  s32* cell_of = malloc((f->count ? f->count : 1) * sizeof(s32));
+  for (s32 i = 0; i < f->count; i++) {
+    s32 u = stitch_cell(s, f->ends[i].pos[a0]) - f->cell_lo[0], v = stitch_cell(s, f->ends[i].pos[a1]) - f->cell_lo[1];
+    cell_of[i] = u * f->cells[1] + v;
+    f->cell_start[cell_of[i] + 1]++;
+  }
+  for (s64 c = 0; c < num_cells; c++) f->cell_start[c + 1] += f->cell_start[c];
+  s32* fill = malloc((num_cells + 1) * sizeof(s32));
+  memcpy(fill, f->cell_start, (num_cells + 1) * sizeof(s32));
+  for (s32 i = 0; i < f->count; i++) f->cell_ends[fill[cell_of[i]]++] = i;
+  free(fill);
+  free(cell_of);
+}
+
+// Position and outward direction of one end of a chord's points
+static void stitch_end_geometry(const f32* points, s32 n, int end, f32 pos[3], f32 dir[3]) {
+  s32 k = n - 1 < 3 ? n - 1 : 3;
+  s32 at = end ? n - 1 : 0;
+  s32 in = end ? n - 1 - k : k;
+  f32 len = 0.0f;
+  for (int d = 0; d < 3; d++) {
+    pos[d] = points[at * 3 + d];
+    dir[d] = points[at * 3 + d] - points[in * 3 + d];
+    len += dir[d] * dir[d];
+  }
+  len = sqrtf(len);
+  for (int d = 0; d < 3; d++) dir[d] = len > 0.0f ? dir[d] / len : 0.0f;
+}
+
+// Score of joining e to o, FLT_MAX if they're too far apart, badly aligned or already joined. Not INFINITY,
+// -Ofast assumes finite math and may drop the comparisons against it
+static f32 stitch_score(Stitcher* s, const StitchEnd* e, u32 root, const StitchEnd* o) {
+  f32 gap[3], dist = 0.0f, align = 0.0f, ahead = 0.0f;
+  for (int d = 0; d < 3; d++) {
+    gap[d] = o->pos[d] - e->pos[d];
+    dist += gap[d] * gap[d];
+    align -= e->dir[d] * o->dir[d];
+    ahead += gap[d] * e->dir[d];
+  }
+  dist = sqrtf(dist);
+  if (dist > s->params.max_gap || align < s->params.min_align) return FLT_MAX;
+  // the other end has to be in front of this one, not beside or behind it
+  if (dist > 1.0f && ahead < 0.0f) return FLT_MAX;
+  // joining would close a loop
+  if (stitch_find(s, o->chord) == root) return FLT_MAX;
+  return dist / s->params.max_gap + (1.0f - align);
+}
+
+// Best waiting end for e in f, -1 if none is close and aligned enough. Anything within max_gap is in
+// e's cell or the 8 around it, so only those are scored
+static s32 stitch_match(Stitcher* s, StitchFace* f, const StitchEnd* e) {
+  if (!f->cell_start) stitch_face_index(s, f);
+  int axis = (int)(f->key >> 62), a0 = (axis + 1) % 3, a1 = (axis + 2) % 3;
+  s32 u = stitch_cell(s, e->pos[a0]) - f->cell_lo[0], v = stitch_cell(s, e->pos[a1]) - f->cell_lo[1];
+  s32 best = -1;
+  f32 best_score = FLT_MAX;
+  u32 root = stitch_find(s, e->chord);
+  for (s32 cu = u - 1; cu <= u + 1; cu++) {
+    if (cu < 0 || cu >= f->cells[0]) continue;
+    for (s32 cv = v - 1; cv <= v + 1; cv++) {
+      if (cv < 0 || cv >= f->cells[1]) continue;
+      s32 cell = cu * f->cells[1] + cv;
+      for (s32 k = f->cell_start[cell]; k < f->cell_start[cell + 1]; k++) {
+        s32 i = f->cell_ends[k];
+        if (f->ends[i].chord == STITCH_NONE) continue;
+        f32 score = stitch_score(s, e, root, &f->ends[i]);
+        // lowest index on ties, so the result doesn't depend on the order cells are visited in
+        if (score < best_score || (score == best_score && score < FLT_MAX && i < best)) {
+          best_score = score;
+          best = i;
+        }
+      }
+    }
+  }
+  return best;
+}
+
+static void stitch_union(Stitcher* s, u32 a, u32 b) {
+  u32 ra = stitch_find(s, a), rb = stitch_find(s, b);
+  if (ra == rb) return;
+  s->chords[rb].parent = ra;
+  s->chords[ra].open += s->chords[rb].open;
+  // splice the two circular member lists
+  u32 t = s->chords[ra].next_member;
+  s->chords[ra].next_member = s->chords[rb].next_member;
+  s->chords[rb].next_member = t;
+}
+
+// Write the stitched chord rooted at root into the arrays, following the links from a free end
+static void stitch_walk(const Stitcher* s, u32 root, f32* points, s64* num_points, s32 (*pieces)[5], s64* num_pieces) {
+  u32 start = root;
+  int start_end = 0;
+  for (u32 c = root;;) {
+    const StitchChord* ch = &s->chords[c];
+    if (ch->link[0] == STITCH_NONE || ch->link[1] == STITCH_NONE) {
+      start = c;
+      start_end = ch->link[0] == STITCH_NONE ? 0 : 1;
+      break;
+    }
+    c = ch->next_member;
+    if (c == root) break;
+  }
+  u32 c = start;
+  int entry = start_end;
+  do {
+    const StitchChord* ch = &s->chords[c];
+    s32* piece = pieces[(*num_pieces)++];
+    piece[0] = ch->chunk[0];
+    piece[1] = ch->chunk[1];
+    piece[2] = ch->chunk[2];
+    piece[3] = (s32)ch->row;
+    piece[4] = entry;   // 1 when walked last point first
+    for (s32 i = 0; i < ch->num_points; i++) {
+      s32 p = entry ? ch->num_points - 1 - i : i;
+      memcpy(points + 3 * (*num_points)++, ch->points + 3 * p, 3 * sizeof(f32));
+    }
+    int exit = 1 - entry;
+    u32 next = ch->link[exit];
+    entry = ch->link_end[exit];
+    c = next;
+  } while (c != STITCH_NONE && c != start);
+}
+
+// Emit every finished stitched chord among the touched ones, or every one left when everything is
+// true, into out as a VCB_STITCHED_CHORDS table and free their pieces. Returns the rows
+static s64 stitch_emit(Stitcher* s, const s32 origin[3], bool everything, VcbBuilder* out) {
+  s64 n = everything ? s->num_chords : s->num_touched;
+  u32* roots = malloc(n * sizeof(u32) + 1);
+  s64 num_roots = 0, total_points = 0, total_pieces = 0;
+  for (s64 i = 0; i < n; i++) {
+    u32 c = everything ? (u32)i : s->touched[i];
+    s->chords[c].touched = 0;
+    // free handles have no points
+    if (!s->chords[c].points) continue;
+    u32 root = stitch_find(s, c);
+    StitchChord* r = &s->chords[root];
+    if (r->emitting || (!everything && r->open != 0)) continue;
+    r->emitting = 1;
+    roots[num_roots++] = root;
+    u32 m = root;
+    do {
+      total_points += s->chords[m].num_points;
+      total_pieces++;
+      m = s->chords[m].next_member;
+    } while (m != root);
+  }
+  s->num_touched = 0;
+  if (num_roots == 0) {
+    free(roots);
+    return 0;
+  }
+
+  vcb_begin(out, VCB_STITCHED_CHORDS, origin, s->dims, s->vcb_params, num_roots);
+  u64* offsets = vcb_add_column(out, "offsets", VCB_U64, 1, num_roots + 1);
+  offsets[0] = 0;
+  s64 k = 0;
+  for (s64 i = 0; i < num_roots; i++) {
+    u32 m = roots[i];
+    do {
+      k += s->chords[m].num_points;
+      m = s->chords[m].next_member;
+    } while (m != roots[i]);
+    offsets[i + 1] = k;
+  }
+  f32* points = vcb_add_column(out, "points", VCB_F32, 3, total_points * 3);
+  s32(*pieces)[5] = malloc(total_pieces * sizeof(*pieces) + 1);
+  u64* piece_offsets = malloc((num_roots + 1) * sizeof(u64));
+  s64 np = 0, nc = 0;
+  piece_offsets[0] = 0;
+  for (s64 i = 0; i < num_roots; i++) {
+    stitch_walk(s, roots[i], points, &np, pieces, &nc);
+    piece_offsets[i + 1] = nc;
+  }
+  memcpy(vcb_add_column(out, "piece_offsets", VCB_U64, 1, num_roots + 1), piece_offsets, (num_roots + 1) * sizeof(u64));
+  memcpy(vcb_add_column(out, "pieces", VCB_S32, 5, total_pieces * 5), pieces, total_pieces * sizeof(*pieces));
+  free(pieces);
+  free(piece_offsets);
+
+  for (s64 i = 0; i < num_roots; i++) {
+    u32 m = roots[i];
+    do {
+      u32 next = s->chords[m].next_member;
+      stitch_chord_free(s, m);
+      m = next;
+    } while (m != roots[i]);
+  }
+  s->stitched += num_roots;
+  free(roots);
+  return num_roots;
+}
+
+// A chunk is done: stitch its chords (chunk local superpixel positions, as grow_chords made them)
+// to its done neighbors and emit what that finished into out. Returns the rows emitted, 0 leaves out
+// alone. Thread safe
+static s64 stitch_add_chunk(Stitcher* s, s32 cz, s32 cy, s32 cx, const Superpixel* superpixels, const Chord* chords,
+                            int num_chords, VcbBuilder* out) {
+  const s32 chunk[3] = {cz, cy, cx};
+  const s32 origin[3] = {cz * s->dims[0], cy * s->dims[1], cx * s->dims[2]};
+  pthread_mutex_lock(&s->lock);
+  u8* state = stitch_state(s, cz, cy, cx);
+  if (!state || *state & 2) {
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+  }
+  *state |= 2;
+
+  // which neighbors are done (their faces' waiting ends get matched, then retired) and which will
+  // be (our ends wait for them)
+  u8 neighbor[6];
+  u64 keys[6];
+  for (int face = 0; face < 6; face++) {
+    int axis = face / 2, side = face % 2;
+    s32 n[3] = {cz, cy, cx};
+    n[axis] += side ? 1 : -1;
+    u8* ns = stitch_state(s, n[0], n[1], n[2]);
+    neighbor[face] = ns ? *ns : 0;
+    const s32* lower = side ? chunk : n;
+    keys[face] = stitch_face_key(axis, lower[0], lower[1], lower[2]);
+  }
+
+  for (int i = 0; i < num_chords; i++) {
+    const Chord* chord = &chords[i];
+    if (chord->point_count < 1) continue;
+    u32 c = stitch_chord_new(s);
+    StitchChord* ch = &s->chords[c];
+    memcpy(ch->chunk, chunk, sizeof(ch->chunk));
+    ch->row = (u32)i;
+    ch->num_points = chord->point_count;
+    ch->points = malloc((s64)chord->point_count * 3 * sizeof(f32));
+    for (s32 j = 0; j < chord->point_count; j++) {
+      const Superpixel* sp = &superpixels[chord->points[j]];
+      ch->points[3 * j + 0] = origin[0] + sp->z;
+      ch->points[3 * j + 1] = origin[1] + sp->y;
+      ch->points[3 * j + 2] = origin[2] + sp->x;
+    }
+    s->chords_added++;
+    stitch_touch(s, c);
+
+    for (int end = 0; end < 2; end++) {
+      if (end == 1 && chord->point_count == 1) break;
+      StitchEnd e = {.chord = c, .end = (u8)end};
+      stitch_end_geometry(s->chords[c].points, chord->point_count, end, e.pos, e.dir);
+      // the nearest face the end points out of, if it's within reach
+      int face = -1;
+      f32 nearest = s->params.reach;
+      for (int axis = 0; axis < 3; axis++) {
+        f32 local = e.pos[axis] - (f32)origin[axis];
+        f32 to_low = local, to_high = (f32)s->dims[axis] - 1.0f - local;
+        if (to_low < nearest && e.dir[axis] <= 0.0f) {
+          nearest = to_low;
+          face = 2 * axis;
+        }
+        if (to_high < nearest && e.dir[axis] >= 0.0f) {
+          nearest = to_high;
+          face = 2 * axis + 1;
+        }
+      }
+      if (face < 0 || !(neighbor[face] & 1)) continue;
+
+      StitchFace* f = stitch_face_get(s, keys[face]);
+      if (neighbor[face] & 2) {
+        s32 m = stitch_match(s, f, &e);
+        if (m < 0) continue;
+        StitchEnd o = f->ends[m];
+        f->ends[m].chord = STITCH_NONE;
+        s->chords[c].link[end] = o.chord;
+        s->chords[c].link_end[end] = o.end;
+        s->chords[o.chord].link[o.end] = c;
+        s->chords[o.chord].link_end[o.end] = (u8)end;
+        s->chords[stitch_find(s, o.chord)].open--;
+        stitch_union(s, c, o.chord);
+        stitch_touch(s, o.chord);
+        s->joins++;
+      } else {
+        if (f->count == f->cap) {
+          f->cap = f->cap ? f->cap * 2 : 16;
+          f->ends = realloc(f->ends, f->cap * sizeof(StitchEnd));
+        }
+        f->ends[f->count++] = e;
+        // can't happen with the states above, but a stale index would hide the new end
+        if (f->cell_start) {
+          free(f->cell_start);
+          free(f->cell_ends);
+          f->cell_start = f->cell_ends = nullptr;
+        }
+        s->chords[stitch_find(s, c)].open++;
+      }
+    }
+  }
+  for (int face = 0; face < 6; face++) {
+    if (neighbor[face] & 2) stitch_face_retire(s, keys[face]);
+  }
+
+  s64 rows = stitch_emit(s, origin, false, out);
+  pthread_mutex_unlock(&s->lock);
+  return rows;
+}
+
+// Everything still waiting, e.g. on chunks the run never got to, into out. Returns the rows
+static s64 stitch_finish(Stitcher* s, VcbBuilder* out) {
+  pthread_mutex_lock(&s->lock);
+  const s32 origin[3] = {-1, -1, -1};
+  s64 rows = stitch_emit(s, origin, true, out);
+  pthread_mutex_unlock(&s->lock);
+  return rows;
+}
+
+static void stitcher_print_stats(const Stitcher* s) {
+  printf("stitcher: %lld chords, %lld joins, %lld stitched chords, at most %lld chords and %lld faces held\n",
+         s->chords_added, s->joins, s->stitched, s->max_live, s->max_faces);
+}
+
+static void stitcher_free(Stitcher* s) {
+  if (!s) return;
+  for (s64 i = 0; i < s->faces_cap; i++) {
+    for (StitchFace* f = s->faces[i]; f;) {
+      StitchFace* next = f->next;
+      stitch_face_free(f);
+      f = next;
+    }
+  }
+  for (u32 c = 0; c < s->num_chords; c++) {
+    if (s->chords[c].points) free(s->chords[c].points);
+  }
+  free(s->faces);
+  free(s->chords);
+  free(s->touched);
+  free(s->state);
+  pthread_mutex_destroy(&s->lock);
+  free(s);
+}
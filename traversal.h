@@ -0,0 +1,185 @@
+#pragma once
+
+#include "volcano.h"
+
+// Orders for walking the chunk grid. Space filling curves keep consecutive chunks spatially close,
+// which is what the decoded chunk cache and the OS page cache want; raster order jumps a whole row
+// (or slab) between neighbors
+typedef enum TraversalCurve {
+  CURVE_RASTER,
+  CURVE_MORTON,
+  CURVE_HILBERT,
+} TraversalCurve;
+
+typedef struct ChunkCoord {
+  s32 z, y, x;
+} ChunkCoord;
+
+typedef struct Traversal {
+  ChunkCoord* chunks;
+  s64 count;
+} Traversal;
+
+// Which chunks are worth visiting, e.g. zarr_chunk_source_exists on the fiber volume
+typedef bool (*chunk_occupied_fn)(void* ctx, s32 cz, s32 cy, s32 cx);
+
+// spread the low 21 bits of v to every third bit
+static inline u64 morton_spread(u64 v) {
+  v &= 0x1fffff;
+  v = (v | v << 32) & 0x1f00000000ffffull;
+  v = (v | v << 16) & 0x1f0000ff0000ffull;
+  v = (v | v << 8) & 0x100f00f00f00f00full;
+  v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+  v = (v | v << 2) & 0x1249249249249249ull;
+  return v;
+}
+
+static inline u64 morton3(u32 z, u32 y, u32 x) {
+  return morton_spread(z) << 2 | morton_spread(y) << 1 | morton_spread(x);
+}
+
+// Hilbert index of a point on a 2^bits grid, Skilling's "Programming the Hilbert curve" (AIP 2004):
+// convert the axes to the transposed Hilbert index in place, then interleave its bits
+static inline u64 hilbert3(u32 z, u32 y, u32 x, int bits) {
+  u32 p[3] = {z, y, x};
+  u32 m = 1u << (bits - 1);
+
+  // inverse undo
+  for (u32 q = m; q > 1; q >>= 1) {
+    u32 mask = q - 1;
+    for (int i = 0; i < 3; i++) {
+      if (p[i] & q) {
+        p[0] ^= mask;
+      } else {
+        u32 t = (p[0] ^ p[i]) & mask;
+        p[0] ^= t;
+        p[i] ^= t;
+      }
+    }
+  }
+
+  // gray encode
+  for (int i = 1; i < 3; i++) p[i] ^= p[i - 1];
+  u32 t = 0;
+  for (u32 q = m; q > 1; q >>= 1) {
+    if (p[2] & q) t ^= q - 1;
+  }
+  for (int i = 0; i < 3; i++) p[i] ^= t;
+
+  u64 h = 0;
+  for (int b = bits - 1; b >= 0; b--) {
+    for (int i = 0; i < 3; i++) h = h << 1 | ((p[i] >> b) & 1);
+  }
+  return h;
+}
+
+typedef struct TraversalKey {
+  u64 key;
+  ChunkCoord coord;
+} TraversalKey;
+
+static int traversal_key_cmp(const void* a, const void* b) {
+  u64 ka = ((const TraversalKey*)a)->key;
+  u64 kb = ((const TraversalKey*)b)->key;
+  return ka < kb ? -1 : ka > kb;
+}
+
+// All occupied chunks of a grid of grid[0] x grid[1] x grid[2] chunks, in curve order.
+// occupied may be nullptr to visit every chunk
+static Traversal* traversal_build(const s32 grid[3], TraversalCurve curve, chunk_occupied_fn occupied, void* ctx) {
+  s32 maxdim = grid[0] > grid[1] ? grid[0] : grid[1];
+  maxdim = maxdim > grid[2] ? maxdim : grid[2];
+  int bits = 1;
+  while ((1 << bits) < maxdim) bits++;
+
+  s64 total = (s64)grid[0] * grid[1] * grid[2];
+  TraversalKey* keys = malloc(total * sizeof(TraversalKey));
+  s64 count = 0;
+
+  for (s32 z = 0; z < grid[0]; z++) {
+    for (s32 y = 0; y < grid[1]; y++) {
+      for (s32 x = 0; x < grid[2]; x++) {
+        if (occupied && !occupied(ctx, z, y, x)) continue;
+        u64 key;
+        switch (curve) {
+          case CURVE_MORTON: key = morton3(z, y, x); break;
+          case CURVE_HILBERT: key = hilbert3(z, y, x, bits); break;
+          default: key = (u64)count; break;
+        }
+        keys[count++] = (TraversalKey){.key = key, .coord = {z, y, x}};
+      }
+    }
+  }
+
+  if (curve != CURVE_RASTER) {
+    qsort(keys, count, sizeof(TraversalKey), traversal_key_cmp);
+  }
+
+  Traversal* ret = malloc(sizeof(Traversal));
+  ret->count = count;
+  ret->chunks = malloc((count > 0 ? count : 1) * sizeof(ChunkCoord));
+  for (s64 i = 0; i < count; i++) ret->chunks[i] = keys[i].coord;
+  free(keys);
+  return ret;
+}
+
+static void traversal_free(Traversal* t) {
+  if (!t) return;
+  free(t->chunks);
+  free(t);
+}
+
+// Contiguous curve segment [start, end) for one of num_workers workers, so each worker keeps the
+// locality of the curve instead of getting every num_workers'th chunk
+static void traversal_segment(const Traversal* t, int worker, int num_workers, s64* start, s64* end) {
+  *start = t->count * worker / num_workers;
+  *end = t->count * (worker + 1) / num_workers;
+}
+
+static int chunk_coord_cmp(const void* a, const void* b) {
+  const ChunkCoord* ca = a;
+  const ChunkCoord* cb = b;
+  if (ca->z != cb->z) return ca->z < cb->z ? -1 : 1;
+  if (ca->y != cb->y) return ca->y < cb->y ? -1 : 1;
+  if (ca->x != cb->x) return ca->x < cb->x ? -1 : 1;
+  return 0;
+}
+
+// I/O locality of an order: the mean number of distinct chunk files touched per window of `window`
+// consecutive chunks, counting the 26 neighbors of each when halo is true. Lower is better, the
+// minimum is reached when a window reads each file once
+static f64 traversal_locality(const Traversal* t, s64 window, bool halo) {
+  if (t->count == 0 || window <= 0) return 0.0;
+
+  s32 reach = halo ? 1 : 0;
+  s64 per_chunk = halo ? 27 : 1;
+  ChunkCoord* touched = malloc(window * per_chunk * sizeof(ChunkCoord));
+
+  s64 windows = 0;
+  s64 distinct_total = 0;
+  for (s64 start = 0; start < t->count; start += window) {
+    s64 end = start + window < t->count ? start + window : t->count;
+    s64 n = 0;
+    for (s64 i = start; i < end; i++) {
+      ChunkCoord c = t->chunks[i];
+      for (s32 dz = -reach; dz <= reach; dz++) {
+        for (s32 dy = -reach; dy <= reach; dy++) {
+          for (s32 dx = -reach; dx <= reach; dx++) {
+            touched[n++] = (ChunkCoord){c.z + dz, c.y + dy, c.x + dx};
+          }
+        }
+      }
+    }
+
+    qsort(touched, n, sizeof(ChunkCoord), chunk_coord_cmp);
+    s64 distinct = n > 0;
+    for (s64 i = 1; i < n; i++) {
+      distinct += chunk_coord_cmp(&touched[i - 1], &touched[i]) != 0;
+    }
+    distinct_total += distinct;
+    windows++;
+  }
+
+  free(touched);
+  return (f64)distinct_total / (f64)windows;
+}
@@ -10,48 +10,41 @@
 
 #define ZLIB_CHUNK_SIZE 16384
 
-// Helper function to compress a string using zlib
+// Helper function to compress a string using zlib. One deflate call into a buffer sized by
+// deflateBound, then shrunk to fit. The default level is much faster than Z_BEST_COMPRESSION for
+// nearly the same size
 static int compress_string(const char* input, size_t input_len, char** output, size_t* output_len) {
     z_stream strm;
-    char out[ZLIB_CHUNK_SIZE];
-    char* compressed = NULL;
-    size_t total_size = 0;
-
     strm.zalloc = Z_NULL;
     strm.zfree = Z_NULL;
     strm.opaque = Z_NULL;
 
-    if (deflateInit2(&strm, Z_BEST_COMPRESSION, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+
+    size_t bound = deflateBound(&strm, input_len);
+    char* compressed = malloc(bound);
+    if (!compressed) {
+        deflateEnd(&strm);
         return -1;
     }
 
     strm.avail_in = input_len;
     strm.next_in = (unsigned char*)input;
+    strm.avail_out = bound;
+    strm.next_out = (unsigned char*)compressed;
 
-    do {
-        strm.avail_out = ZLIB_CHUNK_SIZE;
-        strm.next_out = (unsigned char*)out;
-
-        if (deflate(&strm, Z_FINISH) == Z_STREAM_ERROR) {
-            deflateEnd(&strm);
-            free(compressed);
-            return -1;
-        }
-
-        size_t have = ZLIB_CHUNK_SIZE - strm.avail_out;
-        char* new_compressed = realloc(compressed, total_size + have);
-        if (!new_compressed) {
-            deflateEnd(&strm);
-            free(compressed);
-            return -1;
-        }
-        compressed = new_compressed;
-        memcpy(compressed + total_size, out, have);
-        total_size += have;
-    } while (strm.avail_out == 0);
+    if (deflate(&strm, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&strm);
+        free(compressed);
+        return -1;
+    }
 
+    size_t total_size = strm.total_out;
     deflateEnd(&strm);
-    *output = compressed;
+    char* exact = realloc(compressed, total_size ? total_size : 1);
+    *output = exact ? exact : compressed;
     *output_len = total_size;
     return 0;
 }
@@ -194,11 +187,12 @@ static Superpixel* compressed_csv_to_superpixels(char* path, int* num_superpixel
     while (line < end && *line != '\n') line++;
     line++; // Skip the newline
 
-    // Count lines
+    // Count lines, and a last one without a trailing newline
     char* counting_line = line;
     while (counting_line < end) {
         if (*counting_line++ == '\n') num_lines++;
     }
+    if (line < end && end[-1] != '\n') num_lines++;
 
     // Allocate array
     Superpixel* superpixels = calloc(num_lines, sizeof(Superpixel));
@@ -213,6 +207,20 @@ static Superpixel* compressed_csv_to_superpixels(char* path, int* num_superpixel
         float z, y, x, c;
         unsigned int n;
 
+        // terminate the line, sscanf takes strlen of its input and the rest of the file is huge.
+        // The last line may have no newline to overwrite, it's copied out instead
+        char* eol = memchr(line, '\n', end - line);
+        char tail[128];
+        if (eol) {
+            *eol = '\0';
+        } else {
+            size_t len = (size_t)(end - line) < sizeof(tail) - 1 ? (size_t)(end - line) : sizeof(tail) - 1;
+            memcpy(tail, line, len);
+            tail[len] = '\0';
+            line = tail;
+            eol = end - 1;
+        }
+
         if (sscanf(line, "%f,%f,%f,%f,%u", &z, &y, &x, &c, &n) == 5) {
             superpixels[i].z = z;
             superpixels[i].y = y;
@@ -222,9 +230,7 @@ static Superpixel* compressed_csv_to_superpixels(char* path, int* num_superpixel
             i++;
         }
 
-        // Move to next line
-        while (line < end && *line != '\n') line++;
-        line++; // Skip the newline
+        line = eol + 1;
     }
 
     free(csv_data);
@@ -457,7 +463,7 @@ static Chord* csv_to_chords_with_data(const char* path, int* num_chords_out) {
 
         if (sscanf(line, "%d,%u,%f,%f,%f,%f,%u",
                    &chord_id, &superpixel_id,
-                   &sp_z, &sp_y, &sp_x, &intensity, &pixel_count) != 8) {
+                   &sp_z, &sp_y, &sp_x, &intensity, &pixel_count) != 7 || chord_id < 0) {
             continue;
         }
 
@@ -468,6 +474,7 @@ static Chord* csv_to_chords_with_data(const char* path, int* num_chords_out) {
             // Expand chords array if needed
             if (chord_id >= max_chords) {
                 int new_max = max_chords * 2;
+                while (chord_id >= new_max) new_max *= 2;
                 Chord* new_chords = realloc(chords, new_max * sizeof(Chord));
                 if (!new_chords) {
                     for (int i = 0; i < num_chords; i++) {
@@ -479,20 +486,43 @@ static Chord* csv_to_chords_with_data(const char* path, int* num_chords_out) {
                     return NULL;
                 }
                 chords = new_chords;
+                // chord ids that never show up stay empty
+                memset(chords + max_chords, 0, (new_max - max_chords) * sizeof(Chord));
                 max_chords = new_max;
             }
 
             current_chord = &chords[chord_id];
-            point_capacity = 128; // Initial point capacity
-            current_chord->points = malloc(point_capacity * sizeof(uint32_t));
-            current_chord->recent_dirs = malloc(MAX_RECENT_DIRS * NUM_DIMENSIONS * sizeof(float));
-            current_chord->point_count = 0;
-            current_chord->num_recent_dirs = 0;
+            if (!current_chord->points) {
+                point_capacity = 128; // Initial point capacity
+                current_chord->points = malloc(point_capacity * sizeof(uint32_t));
+                current_chord->recent_dirs = malloc(MAX_RECENT_DIRS * NUM_DIMENSIONS * sizeof(float));
+                current_chord->point_count = 0;
+                current_chord->num_recent_dirs = 0;
+            } else {
+                point_capacity = current_chord->point_count;
+            }
 
             if (chord_id >= num_chords) {
                 num_chords = chord_id + 1;
             }
         }
+
+        // Append the point, growing the chord as needed
+        if (current_chord->point_count == point_capacity) {
+            point_capacity = point_capacity ? point_capacity * 2 : 128;
+            uint32_t* new_points = realloc(current_chord->points, point_capacity * sizeof(uint32_t));
+            if (!new_points) {
+                for (int i = 0; i < num_chords; i++) {
+                    free(chords[i].points);
+                    free(chords[i].recent_dirs);
+                }
+                free(chords);
+                fclose(fp);
+                return NULL;
+            }
+            current_chord->points = new_points;
+        }
+        current_chord->points[current_chord->point_count++] = superpixel_id;
     }
 
     fclose(fp);
@@ -12,10 +12,27 @@
 #define VESUVIUS_IMPL
 #include "vesuvius-c.h"
 
+#include "chunk.h"
+#include "zarr.h"
+#include "zarr3.h"
+#include "http.h"
+#include "cache.h"
+#include "diskcache.h"
+#include "traversal.h"
+#include "coarse.h"
+#include "frontier.h"
+#include "stitch.h"
+#include "graph.h"
+#include "components.h"
+#include "association.h"
 #include "preprocess.h"
 #include "snic.h"
 #include "chord.h"
 #include "util.h"
+#include "output.h"
+#include "pack.h"
+#include "labels.h"
+#include "pyramid.h"
 #include "flood.h"
 
 #define SINGLE_THREADED
@@ -23,14 +40,97 @@
 
 #define ROOTPATH "/Volumes/vesuvius"
 #define OUTPUTPATH_1A ROOTPATH "/output_1a"
-#define SCROLL_1A_VOLUME_PATH ROOTPATH "/dl.ash2txt.org/data/full-scrolls/Scroll1/PHercParis4.volpkg/volumes_zarr_standardized/54keV_7.91um_Scroll1A.zarr/0"
+// every table the run writes, examples/vcb_export turns it back into per chunk csv files
+#define OUTPUT_PACK_1A OUTPUTPATH_1A "/snic_chord.pack"
+// snic's labels and the cleaned scroll for every processed chunk, as multiscale zarr groups with
+// level 0 in /0, see labels.h and pyramid.h
+#define OUTPUT_LABELS_1A OUTPUTPATH_1A "/labels.zarr"
+#define OUTPUT_CLEANED_1A OUTPUTPATH_1A "/cleaned.zarr"
+// the scroll-wide superpixel graph built from the pack after the run, see graph.h
+#define OUTPUT_GRAPH_1A OUTPUTPATH_1A "/graph"
+// the fiber mask's connected components per chunk, joined across the scroll after the run into global
+// ids, see components.h. The union-find table is scratch
+#define OUTPUT_FIBER_LOCAL_1A OUTPUTPATH_1A "/fiber_local.zarr"
+#define OUTPUT_FIBER_1A OUTPUTPATH_1A "/fiber.zarr"
+#define OUTPUT_FIBER_TABLE_1A OUTPUTPATH_1A "/fiber_components.uf"
+// the multiscale zarr, level 0 is the full resolution volume we process
+#define SCROLL_1A_VOLUME_ROOT ROOTPATH "/dl.ash2txt.org/data/full-scrolls/Scroll1/PHercParis4.volpkg/volumes_zarr_standardized/54keV_7.91um_Scroll1A.zarr"
+#define SCROLL_1A_VOLUME_PATH SCROLL_1A_VOLUME_ROOT "/0"
 #define SCROLL_1A_FIBER_PATH ROOTPATH "/scroll1a_fibers/s1-surface-erode.zarr"
+// sharded zarr v3 copies of the two arrays above, made with examples/zarr_convert. Both are zyx
+#define SCROLL_1A_VOLUME_V3_PATH ROOTPATH "/scroll1a_v3/volume.zarr"
+#define SCROLL_1A_FIBER_V3_PATH ROOTPATH "/scroll1a_v3/fibers.zarr"
+// where the local volume mirror comes from, see use_http_volume
+#define SCROLL_1A_VOLUME_URL "https://dl.ash2txt.org/full-scrolls/Scroll1/PHercParis4.volpkg/volumes_zarr_standardized/54keV_7.91um_Scroll1A.zarr/0"
+#define DECODED_CACHE_PATH ROOTPATH "/decoded_cache"
+// "cz cy cx" chunk per line, where use_frontier starts from
+#define FRONTIER_SEEDS_PATH OUTPUTPATH_1A "/seeds.txt"
 
 constexpr int zmax = 14376;
 constexpr int ymax = 7888;
 constexpr int xmax = 8096;
 constexpr f32 iso = 32.0f;
+// run the native GLCAE contrast stage on each chunk as it's read, instead of preprocessing the scroll in python.
+// off by default since iso was tuned on the unenhanced standardized volume
+constexpr bool enhance_contrast = false;
 constexpr int dims[3] = {dimension,dimension,dimension};
+// voxels of neighboring chunks around each chunk for denoise, flood fill and fiber dilation, so they see
+// across chunk faces. SNIC and chord growth still run on the 128^3 chunk itself
+constexpr int halo = 8;
+// fiber masks are dilated by a euclidean ball of this radius. The old vs_dilate(fiberchunk, 7) took a 7^3 cube,
+// so 3 keeps its reach along the axes, but the ball leaves out the cube's corners (3 to 3*sqrt(3) voxels away
+// diagonally) and slightly fewer voxels count as fiber. No ball reproduces the cube exactly. Must stay <= halo
+constexpr f32 fiber_dilation_radius = 3.0f;
+// decoded chunk cache shared by all workers, per volume
+constexpr s64 cache_bytes = 2ll * 1024 * 1024 * 1024;
+// read the sharded v3 arrays instead of the per chunk v2 files
+constexpr bool use_sharded_zarr = false;
+// fetch volume chunks from SCROLL_1A_VOLUME_URL as they're needed instead of expecting a full mirror.
+// Downloads are written into SCROLL_1A_VOLUME_PATH, so the mirror fills in as we go. v2 layout only
+constexpr bool use_http_volume = false;
+constexpr int http_threads = 2;
+constexpr int http_parallel = 16;
+// how chunk files are read, and how many chunks ahead of the current one each worker asks for
+constexpr IoBackendKind io_backend = IO_PREAD;
+constexpr int io_queue_depth = 32;
+constexpr int prefetch_chunks = 16;
+// keep decoded chunks on local disk between runs, mmap'ed instead of decoded again. Point
+// DECODED_CACHE_PATH at an SSD, there's no win over decoding from a spinning disk
+constexpr bool use_decoded_cache = false;
+constexpr s64 decoded_cache_bytes = 256ll * 1024 * 1024 * 1024;
+// before the run, read a coarse level of the volume and only visit level 0 chunks with fiber where it
+// could hold a sheet at least coarse_sheet voxels thick at iso, within coarse_margin of its voxels.
+// The mask is only used if it marks every chunk with papyrus in a coarse_check^3 sample of level 0.
+// -1 to visit every chunk with fiber
+constexpr int coarse_level = 3;
+constexpr f32 coarse_sheet = 2.0f;
+constexpr int coarse_margin = 1;
+constexpr int coarse_check = 4;
+// follow the papyrus out from the seeds in FRONTIER_SEEDS_PATH instead of sweeping every chunk: a
+// chunk's face neighbors are only visited when it has foreground or chords on that face. Without a
+// seeds file every chunk with fiber is a seed, which visits what the sweep does but hands chunks out
+// as workers free up
+constexpr bool use_frontier = false;
+// join chords across chunk faces as chunks complete, written to the pack as VCB_STITCHED_CHORDS
+constexpr bool stitch_chords = true;
+constexpr StitchParams stitch_params = {.reach = 8.0f, .max_gap = 12.0f, .min_align = 0.5f};
+// pack each chunk's superpixel graph and face labels, and join them into OUTPUT_GRAPH_1A at the end
+constexpr bool write_graph = true;
+// label the fiber mask's connected components across the whole scroll instead of per chunk
+constexpr bool fiber_components = true;
+// how the output tables are compressed, on their own threads so the workers don't wait on it.
+// CODEC_NONE keeps them readable in place from the mapped pack
+constexpr OutputCodec output_codec = CODEC_ZSTD;
+constexpr int output_codec_level = 3;
+constexpr int output_compress_threads = 2;
+// keep the label volume instead of throwing the labels away after each chunk
+constexpr bool write_labels = true;
+constexpr int labels_clevel = 5;
+// keep the volume snic ran on, after denoise and segment_and_clean
+constexpr bool write_cleaned = true;
+constexpr int cleaned_clevel = 5;
+// levels of the label and cleaned pyramids, 128^3 chunks at 2^level times coarser each
+constexpr int pyramid_levels = 5;
 constexpr u32 max_superpixels = snic_superpixel_count();
 constexpr f32 bounds[NUM_DIMENSIONS][2] = {
   {0, (f32)dims[0]},
@@ -41,161 +141,265 @@ constexpr f32 bounds[NUM_DIMENSIONS][2] = {
 
 typedef struct WorkerArgs {
   int worker_num;
-  int z_start, z_end;
-  char* volume_path;
-  char* fiber_path;
+  const Traversal* traversal;
+  s64 start, end;
+  Frontier* frontier;   // pop chunks from here instead of walking start to end
+  Stitcher* stitcher;
+  ChunkCache* volume_cache;
+  ChunkCache* fiber_cache;
+  int processed;
+  VcbBuilder output;   // reused for every table the worker writes
+  PackBuffer pack;
+  PyramidBuffer labels;
+  PyramidBuffer cleaned;
+  FiberComponents* fiber_components;
+  LabelEncoder fiber_encoder;
 } WorkerArgs;
 
 void* worker_thread(void* arg) {
   WorkerArgs* args = arg;
 
-  char path[1024] = {'\0'};
-  snprintf(path,1023,"%s/.zarray",args->volume_path);
-  const auto volume_metadata = vs_zarr_parse_zarray(path);
-
-  snprintf(path,1023,"%s/.zarray",args->fiber_path);
-  const auto fiber_metadata = vs_zarr_parse_zarray(path);
-
-  printf("worker %d start z %d end z %d\n",args->worker_num,args->z_start,args->z_end);
-
-  for (int z = args->z_start; z < args->z_end; z += dims[0]) {
-    for (int y = 0; y < ymax; y += dims[1]) {
-      for (int x = 0; x <  xmax; x += dims[2]) {
-        chunk* scrollchunk = nullptr;
-        chunk* fiberchunk = nullptr;
-        u32* labels = nullptr;
-        Superpixel* superpixels = nullptr;
-        SuperpixelConnections* connections = nullptr;
-        Chord* chords = nullptr;
-        ChordStats* stats = nullptr;
-        chunk* labeled_fiber = nullptr;
-
-        char chunkpath[1024] = {'\0'};
-        char csvpath[1024] = {'\0'};
-        int num_chords = -1;
-        int neigh_overflow = -1;
-        int num_superpixels = -1;
-
-        snprintf(chunkpath,1023,"%s/%d/%d/%d",SCROLL_1A_VOLUME_PATH,z/128,y/128,x/128);
-        scrollchunk = vs_zarr_read_chunk(chunkpath,volume_metadata);
-        if (scrollchunk == nullptr) {
-          goto cleanup;
-        }
+  if (args->frontier) {
+    printf("worker %d following the frontier\n",args->worker_num);
+  } else {
+    printf("worker %d start %lld end %lld of %lld chunks\n",args->worker_num,args->start,args->end,args->traversal->count);
+  }
 
-        snprintf(chunkpath,1023,"%s/%d.%d.%d",SCROLL_1A_FIBER_PATH,z/128,x/128,y/128);
-        fiberchunk = vs_zarr_read_chunk(chunkpath,fiber_metadata);
-        if (fiberchunk == nullptr) {
-          goto cleanup;
-        }
+  constexpr s32 halo_offset[3] = {halo, halo, halo};
+
+  // a contiguous segment of the space filling curve, consecutive chunks are spatial neighbors so
+  // most of each halo is already in the cache
+  for (s64 i = args->start;; i++) {
+    ChunkCoord chunk;
+    if (args->frontier) {
+      // the chunks it hands out were prefetched when they were queued
+      if (!frontier_pop(args->frontier, &chunk)) break;
+    } else if (i >= args->end) {
+      break;
+    } else {
+      chunk = args->traversal->chunks[i];
+    }
 
-        if (vs_chunk_max(fiberchunk) < 0.5f) {
-          goto cleanup;
-        }
+    // every prefetch_chunks chunks, queue up reads for this batch and the next so the disk works
+    // while we compute. Only the chunks themselves, their halos are mostly chunks we've just visited
+    if (!args->frontier && (i - args->start) % prefetch_chunks == 0) {
+      s32 upcoming[2 * prefetch_chunks][3];
+      int n = 0;
+      for (s64 j = i; j < args->end && n < 2 * prefetch_chunks; j++, n++) {
+        upcoming[n][0] = args->traversal->chunks[j].z;
+        upcoming[n][1] = args->traversal->chunks[j].y;
+        upcoming[n][2] = args->traversal->chunks[j].x;
+      }
+      chunk_cache_prefetch(args->fiber_cache, (const s32 (*)[3])upcoming, n);
+      chunk_cache_prefetch(args->volume_cache, (const s32 (*)[3])upcoming, n);
+    }
 
-        chunk* c = vs_avgpool_denoise(scrollchunk,3);
-        vs_chunk_free(scrollchunk);
-        scrollchunk = c;
-        c = nullptr;
-
-        float* cleaned_volume = segment_and_clean_f32(scrollchunk->data, dims[0], dims[1], dims[2], iso, iso + 96.0f);
-
-        memcpy(scrollchunk->data, cleaned_volume, dims[0] * dims[1] * dims[2] * sizeof(float));
-        free(cleaned_volume);
-        cleaned_volume = nullptr;
-
-        auto fiberchunk_transposed = vs_transpose(fiberchunk,"zxy","zyx");
-        vs_chunk_free(fiberchunk);
-        fiberchunk = fiberchunk_transposed;
-        fiberchunk_transposed = nullptr;
-
-        // the fiber data we are using has been eroded, so lets dilate it a bit. How much is an open question...
-        auto dilated = vs_dilate(fiberchunk, 7);
-        vs_chunk_free(fiberchunk);
-        fiberchunk = dilated;
-        dilated = nullptr;
-
-        labels = malloc(dims[0]*dims[1]*dims[2]*sizeof(u32));
-        superpixels = calloc(max_superpixels, sizeof(Superpixel));
-        memset(labels, 0, dims[0]*dims[1]*dims[2]*sizeof(u32));
-
-        neigh_overflow = snic(scrollchunk->data, labels, superpixels);
-
-        num_superpixels = filter_superpixels(labels,superpixels,1,iso);
-
-        snprintf(csvpath,1023,"%s/superpixels.%d.%d.%d.csv",OUTPUTPATH_1A,z/128,y/128,x/128);
-        superpixels_to_csv(csvpath,superpixels,num_superpixels);
-
-        connections = calculate_superpixel_connections(scrollchunk->data,labels,num_superpixels);
-
-        // 0 for z-axis, 1 for y-axis, 2 for x-axis
-        chords = grow_chords(superpixels, connections, num_superpixels, bounds, 0, 4096, &num_chords);
-
-        snprintf(csvpath, 1023, "%s/chords.%d.%d.%d.csv", OUTPUTPATH_1A, z/128, y/128, x/128);
-        chords_to_csv(csvpath, chords, num_chords);
-        stats = analyze_chords(chords, num_chords,superpixels,connections);
-        snprintf(csvpath, 1023, "%s/chords.stats.%d.%d.%d.csv", OUTPUTPATH_1A, z/128, y/128, x/128);
-        write_chord_stats_csv(csvpath,stats,num_chords);
-
-        snprintf(csvpath, 1023, "%s/chords.only.%d.%d.%d.csv", OUTPUTPATH_1A, z/128, y/128, x/128);
-        chords_with_data_to_csv(csvpath,chords,num_chords,superpixels);
-
-        // after getting the chords, it's time to map them to fiber data
-        // the fiber data is a binary mask of a few voxels wide demonstrating the recto side of the papyrus
-        // we first want to split it into individual connected sections
-        labeled_fiber = vs_chunk_label_components(fiberchunk);
-        printf("got %f unique sections of fiber\n",vs_chunk_max(labeled_fiber));
-        // the sections are either part of the same papyrus sheet or not, and the disconnect can occur in any z y x axis
-        // generally due to the fiber just being too hard to trace for the input ML fiber model coming from @bruniss
-
-        // we want to check the superpixels in a chord and see if they fall in a fiber. we need to handle
-        // 1) all of the superpixels in a chord falling in a single fiber
-        // 2) some of the superpixels falling in one fiber and not in any other
-        //    - in this case, we extend the fiber to include those bits
-        // 3) some of the superpixels falling in one fiber, and some in a different fiber
-        //    - this means that we've _either_
-        //    1) continued a fiber through an area that the fiber data couldnt cover, or
-        //    2) two fibers touch and the chord spans incorrectly across both. i.e. sheets are touching
-        //    we'll assume it's 1 and hope/pray that 2 doesnt happen often
-
-        for (int i = 0; i < num_chords; i++) {
-          Chord mychord = chords[i];
-          int num_unique = 0;
-          int unique_labels[32] = {0};
-          for (int j = 0; j < mychord.point_count; j++) {
-            Superpixel sp = superpixels[mychord.points[j]];
-            int label = vs_chunk_get(fiberchunk,sp.z,sp.y,sp.x);
-            assert(label < 32);
-            if (label == 0) {
-              continue;
-            }
-            if (unique_labels[label] == 0) {
-              num_unique++;
-              unique_labels[label] = 1;
-            }
-
-          }
-        }
+    const int z = chunk.z * dims[0];
+    const int y = chunk.y * dims[1];
+    const int x = chunk.x * dims[2];
+    tchunk* scrollchunk = nullptr;
+    tchunk* fiberchunk = nullptr;
+    u32* labels = nullptr;
+    Superpixel* superpixels = nullptr;
+    SuperpixelConnections* connections = nullptr;
+    Chord* chords = nullptr;
+    ChordStats* stats = nullptr;
+    tchunk* labeled_fiber = nullptr;
+    BrickSet* bricks = nullptr;
+
+    int num_chords = -1;
+    int num_superpixels = -1;
+    u8 faces = 0;   // where the frontier goes on from here
+
+    // skip chunks without fiber before touching the scroll volume
+    ChunkCacheEntry* fiber_entry = chunk_cache_acquire(args->fiber_cache, z/128, y/128, x/128);
+    bool has_fiber = fiber_entry->chunk != nullptr && tchunk_max(fiber_entry->chunk) >= 0.5f;
+    vs_dtype fiber_dtype = fiber_entry->chunk ? fiber_entry->chunk->dtype : VS_U8;
+    chunk_cache_release(args->fiber_cache, fiber_entry);
+    if (!has_fiber) {
+      goto cleanup;
+    }
+
+    ChunkCacheEntry* scroll_entry = chunk_cache_acquire(args->volume_cache, z/128, y/128, x/128);
+    bool has_scroll = scroll_entry->chunk != nullptr;
+    vs_dtype scroll_dtype = scroll_entry->chunk ? scroll_entry->chunk->dtype : VS_U8;
+    chunk_cache_release(args->volume_cache, scroll_entry);
+    if (!has_scroll) {
+      goto cleanup;
+    }
+
+    // chunks keep the zarr dtype (u8 for scroll 1a), every kernel below works on it natively.
+    // the fiber chunks are stored z.x.y, the cache decodes them straight into zyx
+    scrollchunk = chunk_cache_read_halo(args->volume_cache, z/128, y/128, x/128, halo, dims, scroll_dtype);
+    fiberchunk = chunk_cache_read_halo(args->fiber_cache, z/128, y/128, x/128, halo, dims, fiber_dtype);
+
+    if (enhance_contrast && scrollchunk->dtype == VS_U8) {
+      vs_contrast_enhance_u8(scrollchunk, &default_contrast_params);
+    }
+
+    tchunk* c = vs_tchunk_denoise(scrollchunk,3);
+    tchunk_free(scrollchunk);
+    scrollchunk = c;
+    c = nullptr;
+
+    segment_and_clean_tchunk(scrollchunk, iso, iso + 96.0f);
+
+    c = tchunk_crop(scrollchunk, halo_offset, dims);
+    tchunk_free(scrollchunk);
+    scrollchunk = c;
+    c = nullptr;
+    pyramid_add_tchunk(&args->cleaned, z/128, y/128, x/128, scrollchunk);
+
+    // most of the cleaned chunk is zero now, everything downstream only walks the occupied bricks
+    bricks = brickset_build(scrollchunk);
+
+    // the fiber data we are using has been eroded, so lets dilate it a bit. How much is an open question...
+    // distance transform based so the radius can be tuned without changing the cost
+    auto dilated = vs_dilate_edt_tchunk(fiberchunk, fiber_dilation_radius);
+    tchunk_free(fiberchunk);
+    fiberchunk = tchunk_crop(dilated, halo_offset, dims);
+    tchunk_free(dilated);
+    dilated = nullptr;
+
+    labels = malloc(dims[0]*dims[1]*dims[2]*sizeof(u32));
+    superpixels = calloc(max_superpixels, sizeof(Superpixel));
+    memset(labels, 0, dims[0]*dims[1]*dims[2]*sizeof(u32));
+
+    int unlabeled = snic_bricks(scrollchunk->data, scrollchunk->dtype, bricks, labels, superpixels);
+    if (unlabeled > 0) {
+      printf("%d foreground voxels of %d %d %d left without a superpixel\n", unlabeled, z, y, x);
+    }
 
-        vs_chunk_free(labeled_fiber);
-        free(stats);
-        free_chords(chords,num_chords);
-        free_superpixel_connections(connections, num_superpixels);
-        free(labels);
-        free(superpixels);
+    num_superpixels = filter_superpixels_bricks(labels,superpixels,bricks,1,iso);
 
-        printf("worker %d processed %d %d %d\n",args->worker_num,z,y,x);
-        cleanup:
+    pyramid_add_labels(&args->labels, z/128, y/128, x/128, labels);
 
-        vs_chunk_free(fiberchunk);
-        vs_chunk_free(scrollchunk);
+    const s32 origin[3] = {z, y, x};
+    const VcbParams params = {.iso = iso, .halo = halo, .d_seed = d_seed, .compactness = compactness};
+
+    vcb_superpixels(&args->output, origin, dims, params, superpixels, num_superpixels);
+    pack_append(&args->pack, z/128, y/128, x/128, &args->output);
+
+    connections = calculate_superpixel_connections_bricks(scrollchunk->data,scrollchunk->dtype,bricks,labels,num_superpixels);
+    if (write_graph) {
+      vcb_superpixel_edges(&args->output, origin, dims, params, connections, num_superpixels);
+      pack_append(&args->pack, z/128, y/128, x/128, &args->output);
+      vcb_face_labels(&args->output, origin, dims, params, labels);
+      pack_append(&args->pack, z/128, y/128, x/128, &args->output);
+    }
+
+    // 0 for z-axis, 1 for y-axis, 2 for x-axis
+    chords = grow_chords(superpixels, connections, num_superpixels, bounds, 0, 4096, &num_chords);
+    stats = analyze_chords(chords, num_chords,superpixels,connections);
+    if (args->frontier) {
+      faces = frontier_faces_from_chunk(scrollchunk) | frontier_faces_from_chords(stats, num_chords, dims, (f32)d_seed);
+    }
+
+    vcb_chords(&args->output, origin, dims, params, chords, num_chords);
+    pack_append(&args->pack, z/128, y/128, x/128, &args->output);
+    vcb_chord_stats(&args->output, origin, dims, params, stats, num_chords);
+    pack_append(&args->pack, z/128, y/128, x/128, &args->output);
+    if (args->stitcher && stitch_add_chunk(args->stitcher, z/128, y/128, x/128, superpixels, chords, num_chords, &args->output)) {
+      pack_append(&args->pack, z/128, y/128, x/128, &args->output);
+    }
+
+    // after getting the chords, it's time to map them to fiber data
+    // the fiber data is a binary mask of a few voxels wide demonstrating the recto side of the papyrus
+    // we first want to split it into individual connected sections
+    labeled_fiber = vs_tchunk_label_components(fiberchunk);
+    // NULL when the chunk has more sections than its u16 labels hold. It then gets no fiber tables,
+    // like a chunk that was skipped
+    if (!labeled_fiber) {
+      printf("could not label the fiber of %d %d %d\n", z, y, x);
+    } else {
+      if (args->fiber_components) {
+        if (!fiber_components_add_chunk(args->fiber_components, &args->fiber_encoder, z/128, y/128, x/128, labeled_fiber,
+                                        &args->output)) {
+          printf("could not write the fiber labels of %d %d %d\n", z, y, x);
+        }
+        pack_append(&args->pack, z/128, y/128, x/128, &args->output);
       }
+      const u32 num_fiber_sections = (u32)tchunk_max(labeled_fiber);
+      printf("got %u unique sections of fiber\n",num_fiber_sections);
+      // the sections are either part of the same papyrus sheet or not, and the disconnect can occur in any z y x axis
+      // generally due to the fiber just being too hard to trace for the input ML fiber model coming from @bruniss
+
+      // we want to check the superpixels in a chord and see if they fall in a fiber. we need to handle
+      // 1) all of the superpixels in a chord falling in a single fiber
+      // 2) some of the superpixels falling in one fiber and not in any other
+      //    - in this case, we extend the fiber to include those bits
+      // 3) some of the superpixels falling in one fiber, and some in a different fiber
+      //    - this means that we've _either_
+      //    1) continued a fiber through an area that the fiber data couldnt cover, or
+      //    2) two fibers touch and the chord spans incorrectly across both. i.e. sheets are touching
+      //    we'll assume it's 1 and hope/pray that 2 doesnt happen often
+
+      // so each chord gets a histogram of the fibers its points fall in and one of those three classes,
+      // and each fiber the chords touching it. both go to the pack for the fiber extension to work from
+      ChordFibers chord_fibers;
+      chord_fibers_build(&chord_fibers, superpixels, chords, num_chords, labeled_fiber, num_fiber_sections);
+      vcb_chord_fibers(&args->output, origin, dims, params, &chord_fibers);
+      pack_append(&args->pack, z/128, y/128, x/128, &args->output);
+      vcb_fiber_chords(&args->output, origin, dims, params, &chord_fibers);
+      pack_append(&args->pack, z/128, y/128, x/128, &args->output);
+      printf("%d chords: %lld in no fiber, %lld in a single fiber, %lld extending a fiber, %lld bridging fibers\n",
+             num_chords, chord_fibers.class_counts[CHORD_NO_FIBER], chord_fibers.class_counts[CHORD_SINGLE_FIBER],
+             chord_fibers.class_counts[CHORD_EXTENDS_FIBER], chord_fibers.class_counts[CHORD_BRIDGES_FIBERS]);
+      chord_fibers_free(&chord_fibers);
     }
+
+    tchunk_free(labeled_fiber);
+    free(stats);
+    free_chords(chords,num_chords);
+    free_superpixel_connections(connections, num_superpixels);
+    free(labels);
+    free(superpixels);
+
+    args->processed++;
+    printf("worker %d processed %d %d %d\n",args->worker_num,z,y,x);
+    cleanup:
+    // skipped chunks are still children the pyramids' parents wait on
+    if (num_superpixels < 0) {
+      pyramid_add(&args->cleaned, z/128, y/128, x/128, nullptr);
+      pyramid_add(&args->labels, z/128, y/128, x/128, nullptr);
+    }
+    // and are done as far as the stitcher is concerned, which may finish chords waiting on them
+    if (num_chords < 0 && args->stitcher &&
+        stitch_add_chunk(args->stitcher, z/128, y/128, x/128, nullptr, nullptr, 0, &args->output)) {
+      pack_append(&args->pack, z/128, y/128, x/128, &args->output);
+    }
+    if (args->frontier) {
+      s32 queued[6][3];
+      int n = frontier_finish(args->frontier, chunk, faces, queued);
+      chunk_cache_prefetch(args->fiber_cache, (const s32 (*)[3])queued, n);
+      chunk_cache_prefetch(args->volume_cache, (const s32 (*)[3])queued, n);
+    }
+    free(bricks);
+    tchunk_free(fiberchunk);
+    tchunk_free(scrollchunk);
   }
   printf("worker %d done\n",args->worker_num);
+  vcb_builder_free(&args->output);
+  pack_buffer_free(&args->pack);
+  pyramid_buffer_free(&args->labels);
+  pyramid_buffer_free(&args->cleaned);
+  label_encoder_free(&args->fiber_encoder);
+  zarr_thread_reader_release();
   return NULL;
 }
 
-
+// Setup failed before any chunk was processed: the pack is dropped, so the previous run's is kept,
+// and the inputs are closed
+static int scroll_1a_setup_failed(PackWriter* pack, IoBackend* io, ZarrShardedArray* volume_v3, ZarrShardedArray* fiber_v3,
+                                  HttpZarrStore* volume_http) {
+  pack_abort(pack);
+  zarr3_close(volume_v3);
+  zarr3_close(fiber_v3);
+  http_store_free(volume_http);
+  zarr_set_io_backend(nullptr);
+  io_backend_free(io);
+  return 1;
+}
 
 int scroll_1a_snic_chord() {
 #ifdef SINGLE_THREADED
@@ -204,18 +408,177 @@ int scroll_1a_snic_chord() {
   constexpr int num_threads = 8;
 #endif
 
-  constexpr int chunk_per_thread = zmax / num_threads;
+  PackWriter* pack = pack_writer_new(OUTPUT_PACK_1A, (CodecParams){output_codec, output_codec_level}, output_compress_threads);
+  if (!pack) return 1;
+
+  IoBackend* io = io_backend_new(io_backend, io_queue_depth);
+  zarr_set_io_backend(io);
+  struct timespec run_start, run_end;
+  clock_gettime(CLOCK_MONOTONIC, &run_start);
+
+  chunk_loader_fn volume_load, fiber_load;
+  chunk_prefetch_fn volume_prefetch, fiber_prefetch;
+  chunk_exists_fn volume_exists, fiber_exists;
+  void* volume_ctx;
+  void* fiber_ctx;
+  ZarrShardedArray* volume_v3 = nullptr;
+  ZarrShardedArray* fiber_v3 = nullptr;
+  HttpZarrStore* volume_http = nullptr;
+  static HttpZarrSource volume_http_source;
+
+  char path[1024] = {'\0'};
+  bool opened = true;
+  static ZarrChunkSource volume_source = {.root = SCROLL_1A_VOLUME_PATH, .storage_order = "zyx", .separator = '/'};
+  static ZarrChunkSource fiber_source = {.root = SCROLL_1A_FIBER_PATH, .storage_order = "zxy", .separator = '.'};
+  if (use_sharded_zarr) {
+    volume_v3 = zarr3_open(SCROLL_1A_VOLUME_V3_PATH);
+    fiber_v3 = zarr3_open(SCROLL_1A_FIBER_V3_PATH);
+    opened = volume_v3 && fiber_v3;
+    volume_load = fiber_load = zarr3_chunk_load;
+    volume_prefetch = fiber_prefetch = zarr3_chunk_prefetch;
+    volume_exists = fiber_exists = zarr3_chunk_exists;
+    volume_ctx = volume_v3;
+    fiber_ctx = fiber_v3;
+  } else {
+    snprintf(path,1023,"%s/.zarray",SCROLL_1A_VOLUME_PATH);
+    volume_source.metadata = vs_zarr_parse_zarray(path);
+    snprintf(path,1023,"%s/.zarray",SCROLL_1A_FIBER_PATH);
+    fiber_source.metadata = vs_zarr_parse_zarray(path);
+    volume_load = fiber_load = zarr_chunk_source_load;
+    volume_prefetch = fiber_prefetch = zarr_chunk_source_prefetch;
+    volume_exists = fiber_exists = zarr_chunk_source_exists;
+    volume_ctx = &volume_source;
+    fiber_ctx = &fiber_source;
+  }
+  if (use_http_volume && !use_sharded_zarr) {
+    volume_http = http_store_new(SCROLL_1A_VOLUME_URL, SCROLL_1A_VOLUME_PATH, http_threads, http_parallel);
+    opened = http_zarr_source_open(&volume_http_source, volume_http, "zyx", '/');
+    volume_load = http_zarr_source_load;
+    volume_prefetch = http_zarr_source_prefetch;
+    volume_exists = http_zarr_source_exists;
+    volume_ctx = &volume_http_source;
+  }
+  if (!opened) return scroll_1a_setup_failed(pack, io, volume_v3, fiber_v3, volume_http);
+
+  // only chunks with fiber data, and papyrus at the coarse level, are worth visiting. Walk them along
+  // a hilbert curve
+  constexpr s32 grid[3] = {(zmax + dims[0] - 1) / dims[0], (ymax + dims[1] - 1) / dims[1], (xmax + dims[2] - 1) / dims[2]};
+  CoarseMask* coarse = nullptr;
+  if (coarse_level > 0) {
+    coarse = coarse_mask_build(SCROLL_1A_VOLUME_ROOT, coarse_level, grid, dims, iso, coarse_sheet, coarse_margin,
+                               num_threads);
+  }
+  if (coarse && coarse_mask_verify(coarse, volume_load, volume_ctx, iso + 96.0f, coarse_check) > 0) {
+    printf("the coarse pass drops chunks with papyrus, not pruning\n");
+    coarse_mask_free(coarse);
+    coarse = nullptr;
+  }
+  Traversal* traversal;
+  if (coarse) {
+    coarse_mask_set_inner(coarse, fiber_exists, fiber_ctx);
+    traversal = traversal_build(grid, CURVE_HILBERT, coarse_mask_occupied, coarse);
+    coarse_mask_print_stats(coarse);
+    coarse_mask_free(coarse);
+  } else {
+    traversal = traversal_build(grid, CURVE_HILBERT, fiber_exists, fiber_ctx);
+  }
+  printf("%lld occupied chunks, %.1f chunk files touched per 64 chunks with halo\n",
+         traversal->count, traversal_locality(traversal, 64, true));
+
+  // the frontier only goes where the traversal would, so the pyramids below can count on it
+  Frontier* frontier = nullptr;
+  if (use_frontier) {
+    frontier = frontier_new(grid, traversal);
+    s64 seeds = frontier_seed_file(frontier, FRONTIER_SEEDS_PATH);
+    if (seeds < 0) {
+      for (s64 i = 0; i < traversal->count; i++) {
+        frontier_seed(frontier, traversal->chunks[i].z, traversal->chunks[i].y, traversal->chunks[i].x);
+      }
+    } else if (seeds == 0) {
+      printf("no seeds in %s are chunks with fiber\n", FRONTIER_SEEDS_PATH);
+    }
+  }
+
+  Stitcher* stitcher = nullptr;
+  if (stitch_chords) {
+    const VcbParams params = {.iso = iso, .halo = halo, .d_seed = d_seed, .compactness = compactness};
+    stitcher = stitcher_new(grid, dims, traversal, stitch_params, params);
+  }
+
+  // the pyramids finish a parent once all of its traversal chunks are in
+  constexpr s32 shape[3] = {zmax, ymax, xmax};
+  Pyramid* labels = nullptr;
+  Pyramid* cleaned = nullptr;
+  bool created = true;
+  if (write_labels) {
+    labels = pyramid_create(OUTPUT_LABELS_1A, PYRAMID_LABELS, VS_U8, shape, dims, pyramid_levels, traversal,
+                            label_bits_for(max_superpixels), "zstd", labels_clevel);
+    created = labels != nullptr;
+  }
+  if (created && write_cleaned) {
+    // u8 for scroll 1a, unless the metadata says otherwise
+    vs_dtype volume_dtype = VS_U8;
+    if (volume_v3) {
+      volume_dtype = volume_v3->dtype;
+    } else {
+      vs_dtype_from_zarr(volume_source.metadata.dtype, &volume_dtype);
+    }
+    cleaned = pyramid_create(OUTPUT_CLEANED_1A, PYRAMID_MEAN, volume_dtype, shape, dims, pyramid_levels, traversal, 0,
+                             "zstd", cleaned_clevel);
+    created = cleaned != nullptr;
+  }
+
+  FiberComponents* components = nullptr;
+  if (created && fiber_components) {
+    components = fiber_components_new(OUTPUT_FIBER_LOCAL_1A, shape, dims, "zstd", labels_clevel);
+    created = components != nullptr;
+  }
+  if (!created) {
+    pyramid_close(labels);
+    pyramid_close(cleaned);
+    stitcher_free(stitcher);
+    frontier_free(frontier);
+    traversal_free(traversal);
+    return scroll_1a_setup_failed(pack, io, volume_v3, fiber_v3, volume_http);
+  }
+
+  DiskCache* volume_disk = nullptr;
+  DiskCache* fiber_disk = nullptr;
+  if (use_decoded_cache) {
+    mkdir(DECODED_CACHE_PATH, 0755);
+    volume_disk = disk_cache_new(DECODED_CACHE_PATH "/volume", decoded_cache_bytes, volume_load, volume_exists, volume_ctx);
+    fiber_disk = disk_cache_new(DECODED_CACHE_PATH "/fiber", decoded_cache_bytes / 8, fiber_load, fiber_exists, fiber_ctx);
+  }
+
+  ChunkCache* volume_cache = volume_disk ? chunk_cache_new(cache_bytes, disk_cache_load, volume_disk)
+                                         : chunk_cache_new(cache_bytes, volume_load, volume_ctx);
+  ChunkCache* fiber_cache = fiber_disk ? chunk_cache_new(cache_bytes / 4, disk_cache_load, fiber_disk)
+                                       : chunk_cache_new(cache_bytes / 4, fiber_load, fiber_ctx);
+  // with the decoded cache in front, most chunks never touch the zarr files
+  if (!use_decoded_cache) {
+    chunk_cache_set_prefetch(volume_cache, volume_prefetch, volume_ctx);
+    chunk_cache_set_prefetch(fiber_cache, fiber_prefetch, fiber_ctx);
+  }
 
   pthread_t threads[num_threads];
   WorkerArgs args[num_threads];
 
   for (int i = 0; i < num_threads; i++) {
+    s64 start, end;
+    traversal_segment(traversal, i, num_threads, &start, &end);
     args[i] = (WorkerArgs){
       .worker_num = i,
-      .z_start = i * chunk_per_thread,
-      .z_end = (i == num_threads-1) ? zmax : (i+1) * chunk_per_thread,
-      .volume_path = SCROLL_1A_VOLUME_PATH,
-      .fiber_path = SCROLL_1A_FIBER_PATH
+      .traversal = traversal,
+      .start = start,
+      .end = end,
+      .frontier = frontier,
+      .stitcher = stitcher,
+      .volume_cache = volume_cache,
+      .fiber_cache = fiber_cache,
+      .pack = {.writer = pack},
+      .labels = {.pyramid = labels},
+      .cleaned = {.pyramid = cleaned},
+      .fiber_components = components,
     };
 #ifdef SINGLE_THREADED
     worker_thread(&args[i]);
@@ -230,6 +593,72 @@ int scroll_1a_snic_chord() {
   }
 #endif
 
+  int processed = 0;
+  for (int i = 0; i < num_threads; i++) {
+    processed += args[i].processed;
+  }
+  if (frontier) {
+    frontier_print_stats(frontier);
+    // the chunks it never reached are background in the pyramids
+    PyramidBuffer labels_rest = {.pyramid = labels}, cleaned_rest = {.pyramid = cleaned};
+    for (s64 i = 0; i < traversal->count; i++) {
+      const ChunkCoord c = traversal->chunks[i];
+      if (frontier_visited(frontier, c.z, c.y, c.x)) continue;
+      pyramid_add(&labels_rest, c.z, c.y, c.x, nullptr);
+      pyramid_add(&cleaned_rest, c.z, c.y, c.x, nullptr);
+    }
+    pyramid_buffer_free(&labels_rest);
+    pyramid_buffer_free(&cleaned_rest);
+    frontier_free(frontier);
+  }
+  if (stitcher) {
+    PackBuffer rest = {.writer = pack};
+    VcbBuilder table = {};
+    if (stitch_finish(stitcher, &table)) pack_append(&rest, -1, -1, -1, &table);
+    vcb_builder_free(&table);
+    pack_buffer_free(&rest);
+    stitcher_print_stats(stitcher);
+    stitcher_free(stitcher);
+  }
+  chunk_cache_print_stats(volume_cache, "volume", processed);
+  chunk_cache_print_stats(fiber_cache, "fiber", processed);
+  bool packed = pack_close(pack);
+  // both join per chunk tables across the scroll, from the finished pack. If it couldn't be finished
+  // OUTPUT_PACK_1A is still the previous run's, which doesn't go with this run's outputs
+  if (!packed && (write_graph || components)) {
+    printf("not building the graph or fiber components without this run's pack\n");
+  } else if (write_graph || components) {
+    PackReader* reader = pack_open(OUTPUT_PACK_1A);
+    if (reader && write_graph) {
+      graph_build(reader, OUTPUT_GRAPH_1A, grid, (u32)label_bits_for(max_superpixels), num_threads);
+    }
+    if (reader && components) {
+      fiber_components_resolve(components, reader, OUTPUT_FIBER_1A, OUTPUT_FIBER_TABLE_1A, num_threads);
+    }
+    pack_reader_close(reader);
+  }
+  fiber_components_free(components);
+  pyramid_close(labels);
+  pyramid_close(cleaned);
+  clock_gettime(CLOCK_MONOTONIC, &run_end);
+  io_print_stats(io, (f64)(run_end.tv_sec - run_start.tv_sec) + (f64)(run_end.tv_nsec - run_start.tv_nsec) * 1e-9);
+  chunk_cache_free(volume_cache);
+  chunk_cache_free(fiber_cache);
+  if (volume_disk) disk_cache_print_stats(volume_disk, "volume");
+  if (fiber_disk) disk_cache_print_stats(fiber_disk, "fiber");
+  disk_cache_free(volume_disk);
+  disk_cache_free(fiber_disk);
+  zarr3_close(volume_v3);
+  zarr3_close(fiber_v3);
+  if (volume_http) {
+    http_store_print_stats(volume_http);
+    http_store_free(volume_http);
+  }
+  // every worker has released its reader
+  zarr_set_io_backend(nullptr);
+  io_backend_free(io);
+  traversal_free(traversal);
+
   return 0;
 }
 
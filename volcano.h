@@ -27,4 +27,5 @@ typedef signed long long s64;
 typedef __uint128_t u128;
 typedef __int128_t s128;
 typedef float f32;
+typedef double f64;
 typedef __fp16 f16;
\ No newline at end of file
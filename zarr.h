@@ -0,0 +1,173 @@
+#pragma once
+
+#include <blosc2.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "volcano.h"
+#include "chunk.h"
+#include "io.h"
+
+// Map a zarr v2 dtype string onto the native voxel type we keep it in
+static inline bool vs_dtype_from_zarr(const char* dtype, vs_dtype* out) {
+  if (strcmp(dtype, "|u1") == 0) { *out = VS_U8; return true; }
+  if (strcmp(dtype, "<u2") == 0) { *out = VS_U16; return true; }
+  if (strcmp(dtype, "<f4") == 0) { *out = VS_F32; return true; }
+  return false;
+}
+
+// Per thread decode state. blosc2_decompress goes through blosc's global context, which takes a lock
+// around every call, so 8 workers decoding at once mostly wait on each other. A reader owns its own
+// decompression context plus the compressed and scratch buffers, which are grown once and reused,
+// so reading into a caller owned chunk doesn't allocate. Files are read through the reader's IoContext
+typedef struct ZarrReader {
+  blosc2_context* dctx;
+  IoContext* io;
+  u8* compressed;
+  s64 compressed_cap;
+  u8* scratch;
+  s64 scratch_cap;
+} ZarrReader;
+
+// I/O backend for readers created from now on, pread unless zarr_set_io_backend says otherwise
+static IoBackend zarr_default_io_backend = {.kind = IO_PREAD, .queue_depth = 32};
+static IoBackend* zarr_io_backend = &zarr_default_io_backend;
+
+static void zarr_set_io_backend(IoBackend* backend) {
+  zarr_io_backend = backend ? backend : &zarr_default_io_backend;
+}
+
+static ZarrReader* zarr_reader_new() {
+  ZarrReader* ret = calloc(1, sizeof(ZarrReader));
+  ret->io = io_context_new(zarr_io_backend);
+  blosc2_dparams dparams = BLOSC2_DPARAMS_DEFAULTS;
+  // the parallelism is across chunks, one decode thread per reader
+  dparams.nthreads = 1;
+  ret->dctx = blosc2_create_dctx(dparams);
+  return ret;
+}
+
+static void zarr_reader_free(ZarrReader* reader) {
+  if (!reader) return;
+  blosc2_free_ctx(reader->dctx);
+  io_context_free(reader->io);
+  free(reader->compressed);
+  free(reader->scratch);
+  free(reader);
+}
+
+static u8* zarr_reader_reserve(u8** buf, s64* cap, s64 size) {
+  if (*cap < size) {
+    free(*buf);
+    *buf = malloc(size);
+    *cap = size;
+  }
+  return *buf;
+}
+
+static pthread_key_t zarr_reader_key;
+static pthread_once_t zarr_reader_once = PTHREAD_ONCE_INIT;
+
+static void zarr_reader_key_destroy(void* reader) { zarr_reader_free(reader); }
+static void zarr_reader_key_init() { pthread_key_create(&zarr_reader_key, zarr_reader_key_destroy); }
+
+// The calling thread's reader, created on first use and freed when the thread exits
+static ZarrReader* zarr_thread_reader() {
+  pthread_once(&zarr_reader_once, zarr_reader_key_init);
+  ZarrReader* reader = pthread_getspecific(zarr_reader_key);
+  if (!reader) {
+    reader = zarr_reader_new();
+    pthread_setspecific(zarr_reader_key, reader);
+  }
+  return reader;
+}
+
+// Free the calling thread's reader now rather than at thread exit, e.g. before the I/O backend it uses goes away
+static void zarr_thread_reader_release() {
+  pthread_once(&zarr_reader_once, zarr_reader_key_init);
+  zarr_reader_free(pthread_getspecific(zarr_reader_key));
+  pthread_setspecific(zarr_reader_key, nullptr);
+}
+
+// zyx dims of a chunk stored in storage_order
+static void zarr_chunk_dims(zarr_metadata metadata, const char* storage_order, s32 dims[3]) {
+  for (int i = 0; i < 3; i++) {
+    int axis = storage_order[i] == 'z' ? 0 : storage_order[i] == 'y' ? 1 : 2;
+    dims[axis] = metadata.chunks[i];
+  }
+}
+
+// Decode a zarr v2 chunk into dst, which the caller allocated with the chunk's zyx dims and stored dtype.
+// Chunks already in zyx order are decompressed straight into dst, others go through the reader's
+// scratch buffer and are permuted on the copy out
+static bool zarr_reader_read_into(ZarrReader* reader, const char* path, zarr_metadata metadata,
+                                  const char* storage_order, tchunk* dst) {
+  vs_dtype dtype;
+  if (!vs_dtype_from_zarr(metadata.dtype, &dtype) || dtype != dst->dtype) {
+    printf("can't read dtype %s into a %d chunk\n", metadata.dtype, dst->dtype);
+    return false;
+  }
+  s32 dims[3];
+  zarr_chunk_dims(metadata, storage_order, dims);
+  if (memcmp(dims, dst->dims, sizeof(dims)) != 0) {
+    printf("chunk shape of %s doesn't match the destination\n", path);
+    return false;
+  }
+
+  s64 compressed_size;
+  const u8* compressed = io_read_file(reader->io, path, &compressed_size);
+  if (!compressed) return false;
+
+  bool permuted = strcmp(storage_order, "zyx") != 0;
+  s32 raw_size = (s32)(tchunk_len(dst) * vs_dtype_size(dtype));
+  u8* raw = permuted ? zarr_reader_reserve(&reader->scratch, &reader->scratch_cap, raw_size) : dst->data;
+
+  // a short chunk would leave whatever the buffer held before in the rest of it
+  int decompressed = blosc2_decompress_ctx(reader->dctx, compressed, (s32)compressed_size, raw, raw_size);
+  if (decompressed != raw_size) {
+    printf("blosc2 decompression of %s failed: %d of %d bytes\n", path, decompressed, raw_size);
+    return false;
+  }
+
+  if (permuted) {
+    s64 src_strides[3];
+    vs_storage_strides(storage_order, dims, src_strides);
+    #define permute_loop(T, out) \
+      for (s32 z = 0, i = 0; z < dims[0]; z++) { \
+        for (s32 y = 0; y < dims[1]; y++) { \
+          for (s32 x = 0; x < dims[2]; x++, i++) { \
+            out[i] = ((const T*)raw)[z * src_strides[0] + y * src_strides[1] + x * src_strides[2]]; \
+          } \
+        } \
+      }
+    switch (dtype) {
+      case VS_U8: permute_loop(u8, dst->d8); break;
+      case VS_U16: permute_loop(u16, dst->d16); break;
+      case VS_F32: permute_loop(f32, dst->d32); break;
+    }
+    #undef permute_loop
+  }
+  return true;
+}
+
+// Read a zarr v2 chunk keeping its stored dtype, through the calling thread's reader
+tchunk* vs_zarr_read_tchunk_as(char* path, zarr_metadata metadata, const char* storage_order) {
+  vs_dtype dtype;
+  if (!vs_dtype_from_zarr(metadata.dtype, &dtype)) {
+    printf("unsupported dtype %s\n", metadata.dtype);
+    return nullptr;
+  }
+  s32 dims[3];
+  zarr_chunk_dims(metadata, storage_order, dims);
+
+  tchunk* ret = tchunk_new(dtype, dims);
+  if (!zarr_reader_read_into(zarr_thread_reader(), path, metadata, storage_order, ret)) {
+    tchunk_free(ret);
+    return nullptr;
+  }
+  return ret;
+}
+
+tchunk* vs_zarr_read_tchunk(char* path, zarr_metadata metadata) {
+  return vs_zarr_read_tchunk_as(path, metadata, "zyx");
+}
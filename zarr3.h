@@ -0,0 +1,280 @@
+#pragma once
+
+#include <errno.h>
+#include <json-c/json.h>
+#include <pthread.h>
+
+#include "volcano.h"
+#include "chunk.h"
+#include "zarr.h"
+
+// Reader for zarr v3 arrays using the sharding_indexed codec: each shard file holds a block of inner chunks
+// plus an index of (offset, nbytes) pairs, so the whole scroll is a few hundred files instead of hundreds
+// of thousands. Shard files stay open and their index is read once, after that an inner chunk is a
+// single pread with no path lookup.
+// Only the layout we write is handled: 3d, C order, bytes + optional blosc inner codecs, and an index
+// at either end with an optional crc32c (which isn't checked)
+//
+// The v3 "blosc" codec is the blosc1 chunk format. blosc2 reads those, but what blosc2_compress_ctx
+// writes has blosc2's extended header, which blosc1 readers reject. So our own arrays name their inner
+// codec ZARR3_BLOSC2_CODEC instead of claiming to be "blosc", and both are decoded with blosc2
+
+#define ZARR3_EMPTY_CHUNK UINT64_MAX
+#define ZARR3_BLOSC2_CODEC "volcano.blosc2"
+
+typedef struct ZarrShard {
+  bool loaded;
+  int fd;         // -1 for shards that don't exist or can't be read
+  bool unreadable; // the shard is there but couldn't be opened or its index read
+  u64* index;     // (offset, nbytes) per inner chunk in C order
+} ZarrShard;
+
+typedef struct ZarrShardedArray {
+  char root[1024];
+  vs_dtype dtype;
+  s32 shape[3];
+  s32 shard_shape[3];
+  s32 chunk_shape[3];
+  s32 chunks_per_shard[3];
+  s32 shard_grid[3];
+  bool blosc;
+  bool index_at_end;
+  s64 index_bytes;
+  // default encoding is "c/z/y/x", v2 encoding is "z.y.x"
+  char key_prefix[4];
+  char separator;
+
+  pthread_mutex_t lock;
+  ZarrShard* shards;
+} ZarrShardedArray;
+
+static bool zarr3_dtype(const char* data_type, vs_dtype* out) {
+  if (strcmp(data_type, "uint8") == 0) { *out = VS_U8; return true; }
+  if (strcmp(data_type, "uint16") == 0) { *out = VS_U16; return true; }
+  if (strcmp(data_type, "float32") == 0) { *out = VS_F32; return true; }
+  return false;
+}
+
+static bool zarr3_get_shape(json_object* obj, const char* key, s32 out[3]) {
+  json_object* arr;
+  if (!json_object_object_get_ex(obj, key, &arr) || json_object_array_length(arr) != 3) return false;
+  for (int i = 0; i < 3; i++) out[i] = json_object_get_int(json_object_array_get_idx(arr, i));
+  return true;
+}
+
+static const char* zarr3_get_string(json_object* obj, const char* key) {
+  json_object* val;
+  return json_object_object_get_ex(obj, key, &val) ? json_object_get_string(val) : nullptr;
+}
+
+// Parse <root>/zarr.json, nullptr if it isn't a sharded array we can read
+static ZarrShardedArray* zarr3_open(const char* root) {
+  char path[1100];
+  snprintf(path, sizeof(path), "%s/zarr.json", root);
+  json_object* meta = json_object_from_file(path);
+  if (!meta) {
+    printf("could not read %s\n", path);
+    return nullptr;
+  }
+
+  ZarrShardedArray* arr = calloc(1, sizeof(ZarrShardedArray));
+  snprintf(arr->root, sizeof(arr->root), "%s", root);
+  arr->index_at_end = true;
+  arr->separator = '/';
+  snprintf(arr->key_prefix, sizeof(arr->key_prefix), "c%c", arr->separator);
+
+  bool ok = true;
+  const char* data_type = zarr3_get_string(meta, "data_type");
+  ok &= data_type && zarr3_dtype(data_type, &arr->dtype);
+  ok &= zarr3_get_shape(meta, "shape", arr->shape);
+
+  json_object *grid, *grid_config, *codecs;
+  ok &= json_object_object_get_ex(meta, "chunk_grid", &grid) &&
+        json_object_object_get_ex(grid, "configuration", &grid_config) &&
+        zarr3_get_shape(grid_config, "chunk_shape", arr->shard_shape);
+
+  json_object* key_encoding;
+  if (ok && json_object_object_get_ex(meta, "chunk_key_encoding", &key_encoding)) {
+    const char* name = zarr3_get_string(key_encoding, "name");
+    json_object* key_config;
+    const char* sep = json_object_object_get_ex(key_encoding, "configuration", &key_config)
+                    ? zarr3_get_string(key_config, "separator") : nullptr;
+    if (name && strcmp(name, "v2") == 0) {
+      arr->separator = sep ? sep[0] : '.';
+      arr->key_prefix[0] = '\0';
+    } else {
+      arr->separator = sep ? sep[0] : '/';
+      snprintf(arr->key_prefix, sizeof(arr->key_prefix), "c%c", arr->separator);
+    }
+  }
+
+  json_object* sharding = nullptr;
+  ok &= json_object_object_get_ex(meta, "codecs", &codecs) && json_object_array_length(codecs) == 1;
+  if (ok) {
+    json_object* codec = json_object_array_get_idx(codecs, 0);
+    const char* name = zarr3_get_string(codec, "name");
+    ok &= name && strcmp(name, "sharding_indexed") == 0 &&
+          json_object_object_get_ex(codec, "configuration", &sharding);
+  }
+
+  json_object *inner_codecs, *index_codecs;
+  if (ok) {
+    ok &= zarr3_get_shape(sharding, "chunk_shape", arr->chunk_shape);
+    const char* location = zarr3_get_string(sharding, "index_location");
+    if (location) arr->index_at_end = strcmp(location, "start") != 0;
+
+    ok &= json_object_object_get_ex(sharding, "codecs", &inner_codecs);
+    for (size_t i = 0; ok && i < json_object_array_length(inner_codecs); i++) {
+      const char* name = zarr3_get_string(json_object_array_get_idx(inner_codecs, i), "name");
+      if (name && (strcmp(name, "blosc") == 0 || strcmp(name, ZARR3_BLOSC2_CODEC) == 0)) arr->blosc = true;
+      else if (!name || strcmp(name, "bytes") != 0) ok = false;
+    }
+  }
+
+  if (ok) {
+    for (int i = 0; i < 3; i++) {
+      ok &= arr->chunk_shape[i] > 0 && arr->shard_shape[i] % arr->chunk_shape[i] == 0;
+      arr->chunks_per_shard[i] = ok ? arr->shard_shape[i] / arr->chunk_shape[i] : 0;
+      arr->shard_grid[i] = ok ? (arr->shape[i] + arr->shard_shape[i] - 1) / arr->shard_shape[i] : 0;
+    }
+    arr->index_bytes = (s64)arr->chunks_per_shard[0] * arr->chunks_per_shard[1] * arr->chunks_per_shard[2] * 16;
+    if (json_object_object_get_ex(sharding, "index_codecs", &index_codecs)) {
+      for (size_t i = 0; i < json_object_array_length(index_codecs); i++) {
+        const char* name = zarr3_get_string(json_object_array_get_idx(index_codecs, i), "name");
+        if (name && strcmp(name, "crc32c") == 0) arr->index_bytes += 4;
+      }
+    }
+  }
+  json_object_put(meta);
+
+  if (!ok) {
+    printf("%s is not a sharded zarr v3 array we can read\n", root);
+    free(arr);
+    return nullptr;
+  }
+
+  pthread_mutex_init(&arr->lock, nullptr);
+  arr->shards = calloc((s64)arr->shard_grid[0] * arr->shard_grid[1] * arr->shard_grid[2], sizeof(ZarrShard));
+  return arr;
+}
+
+static void zarr3_close(ZarrShardedArray* arr) {
+  if (!arr) return;
+  s64 num_shards = (s64)arr->shard_grid[0] * arr->shard_grid[1] * arr->shard_grid[2];
+  for (s64 i = 0; i < num_shards; i++) {
+    if (arr->shards[i].fd >= 0 && arr->shards[i].loaded) close(arr->shards[i].fd);
+    free(arr->shards[i].index);
+  }
+  free(arr->shards);
+  pthread_mutex_destroy(&arr->lock);
+  free(arr);
+}
+
+static void zarr3_shard_path(const ZarrShardedArray* arr, s32 sz, s32 sy, s32 sx, char* path, size_t len) {
+  snprintf(path, len, "%s/%s%d%c%d%c%d", arr->root, arr->key_prefix, sz, arr->separator, sy, arr->separator, sx);
+}
+
+// The shard holding inner chunk (cz, cy, cx) with its index loaded, nullptr if out of bounds
+static ZarrShard* zarr3_shard(ZarrShardedArray* arr, s32 cz, s32 cy, s32 cx, s64* inner) {
+  s32 s[3] = {cz / arr->chunks_per_shard[0], cy / arr->chunks_per_shard[1], cx / arr->chunks_per_shard[2]};
+  if (cz < 0 || cy < 0 || cx < 0 || s[0] >= arr->shard_grid[0] || s[1] >= arr->shard_grid[1] || s[2] >= arr->shard_grid[2]) {
+    return nullptr;
+  }
+  s32 i[3] = {cz % arr->chunks_per_shard[0], cy % arr->chunks_per_shard[1], cx % arr->chunks_per_shard[2]};
+  *inner = ((s64)i[0] * arr->chunks_per_shard[1] + i[1]) * arr->chunks_per_shard[2] + i[2];
+
+  ZarrShard* shard = &arr->shards[((s64)s[0] * arr->shard_grid[1] + s[1]) * arr->shard_grid[2] + s[2]];
+  if (__atomic_load_n(&shard->loaded, __ATOMIC_ACQUIRE)) return shard;
+
+  // the index is small, read it under the lock so every shard is opened once
+  pthread_mutex_lock(&arr->lock);
+  if (!shard->loaded) {
+    char path[1200];
+    zarr3_shard_path(arr, s[0], s[1], s[2], path, sizeof(path));
+    shard->fd = open(path, O_RDONLY);
+    shard->unreadable = shard->fd < 0 && errno != ENOENT;
+    if (shard->fd >= 0) {
+      struct stat st;
+      s64 offset = 0;
+      if (fstat(shard->fd, &st) == 0 && st.st_size >= arr->index_bytes) {
+        offset = arr->index_at_end ? st.st_size - arr->index_bytes : 0;
+        shard->index = malloc(arr->index_bytes);
+      }
+      if (!shard->index || pread(shard->fd, shard->index, arr->index_bytes, offset) != arr->index_bytes) {
+        printf("could not read the shard index of %s\n", path);
+        free(shard->index);
+        shard->index = nullptr;
+        close(shard->fd);
+        shard->fd = -1;
+        shard->unreadable = true;
+      }
+    }
+    __atomic_store_n(&shard->loaded, true, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&arr->lock);
+  return shard;
+}
+
+// Inner chunks are zarr chunks in their own right, zarr only writes the ones that aren't all fill value.
+// A chunk_exists_fn, so the chunks of a shard that can't be read count as present
+static bool zarr3_chunk_exists(void* ctx, s32 cz, s32 cy, s32 cx) {
+  s64 inner;
+  ZarrShard* shard = zarr3_shard(ctx, cz, cy, cx, &inner);
+  return shard && (shard->unreadable || (shard->fd >= 0 && shard->index[inner * 2] != ZARR3_EMPTY_CHUNK));
+}
+
+// Decode inner chunk (cz, cy, cx) into dst, which has the array's dtype and chunk shape.
+// Returns false for missing chunks without touching dst
+static bool zarr3_read_chunk_into(ZarrShardedArray* arr, ZarrReader* reader, s32 cz, s32 cy, s32 cx, tchunk* dst) {
+  s64 inner;
+  ZarrShard* shard = zarr3_shard(arr, cz, cy, cx, &inner);
+  if (!shard || shard->fd < 0 || shard->index[inner * 2] == ZARR3_EMPTY_CHUNK) return false;
+  if (dst->dtype != arr->dtype || memcmp(dst->dims, arr->chunk_shape, sizeof(dst->dims)) != 0) {
+    printf("destination doesn't match the chunks of %s\n", arr->root);
+    return false;
+  }
+
+  u64 offset = shard->index[inner * 2];
+  u64 nbytes = shard->index[inner * 2 + 1];
+  s64 raw_size = tchunk_len(dst) * vs_dtype_size(dst->dtype);
+  u8* buf = arr->blosc ? zarr_reader_reserve(&reader->compressed, &reader->compressed_cap, nbytes) : dst->data;
+  if (!arr->blosc && (s64)nbytes != raw_size) return false;
+  if (!io_pread(reader->io, shard->fd, buf, nbytes, offset)) {
+    printf("short read of chunk %d %d %d from %s\n", cz, cy, cx, arr->root);
+    return false;
+  }
+  if (arr->blosc) {
+    int decompressed = blosc2_decompress_ctx(reader->dctx, buf, (s32)nbytes, dst->data, (s32)raw_size);
+    if (decompressed != raw_size) {
+      printf("blosc2 decompression of chunk %d %d %d from %s failed: %d of %lld bytes\n",
+             cz, cy, cx, arr->root, decompressed, raw_size);
+      return false;
+    }
+  }
+  return true;
+}
+
+// chunk_loader_fn over a sharded array, ctx is the ZarrShardedArray
+static tchunk* zarr3_chunk_load(void* ctx, s32 cz, s32 cy, s32 cx) {
+  ZarrShardedArray* arr = ctx;
+  if (!zarr3_chunk_exists(arr, cz, cy, cx)) return nullptr;
+  tchunk* ret = tchunk_new(arr->dtype, arr->chunk_shape);
+  if (!zarr3_read_chunk_into(arr, zarr_thread_reader(), cz, cy, cx, ret)) {
+    tchunk_free(ret);
+    return nullptr;
+  }
+  return ret;
+}
+
+// Inner chunks are byte ranges of shard files that are already open, the kernel's readahead of just those
+// ranges is all the batching they need
+static void zarr3_chunk_prefetch(void* ctx, const s32 (*coords)[3], int n) {
+  ZarrShardedArray* arr = ctx;
+  for (int i = 0; i < n; i++) {
+    s64 inner;
+    ZarrShard* shard = zarr3_shard(arr, coords[i][0], coords[i][1], coords[i][2], &inner);
+    if (!shard || shard->fd < 0 || shard->index[inner * 2] == ZARR3_EMPTY_CHUNK) continue;
+    io_advise_willneed(shard->fd, (s64)shard->index[inner * 2], (s64)shard->index[inner * 2 + 1]);
+  }
+  __atomic_fetch_add(&zarr_io_backend->prefetch_issued, n, __ATOMIC_RELAXED);
+}